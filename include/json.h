@@ -9,6 +9,7 @@
 #include "strings.h"
 #include "numbers.h"
 #include <stdbool.h>
+#include <stdio.h>
 
 typedef enum
 {
@@ -33,6 +34,11 @@ typedef enum
     json_expected_colon_separator,
     json_expected_name,
     json_expected_element,
+    json_stopped_by_handler,
+    json_cannot_read_file,
+    json_maximum_depth_exceeded,
+    json_incorrect_binary_format,
+    json_value_does_not_match_binding,
 } json_error_type_t;
 
 typedef struct json_element_t json_element_t;
@@ -123,29 +129,428 @@ typedef struct
     char _buff[sizeof(wchar_t) * (json_error_text_max_length + 1)];
 } json_error_t;
 
+typedef struct json_arena_t json_arena_t;
+
+typedef struct
+{
+    json_element_t * const root;
+} json_document_t;
+
+typedef struct
+{
+    json_element_t * const root;
+} json_frozen_t;
+
+json_arena_t * create_json_arena(size_t chunk_size);
+void * alloc_from_json_arena(json_arena_t *arena, size_t size);
+
+/*
+    Releases everything allocated from the arena at once but keeps the memory,
+    which is taken again by the following allocations
+*/
+void reset_json_arena(json_arena_t *arena);
+void destroy_json_arena(json_arena_t *arena);
+
 json_element_t * parse_json(wide_string_t *text);
 json_element_t * parse_json_ext(wide_string_t *text, json_error_t *err);
 
+/*
+    Elements parsed into an arena are released all at once by destroy_json_arena(),
+    destroy_json_element() must not be called for them
+*/
+json_element_t * parse_json_arena(wide_string_t *text, json_error_t *err, json_arena_t *arena);
+
+json_element_t * parse_json_utf8(const char *data, size_t length, json_error_t *err);
+
+/*
+    Objects parsed with the same key table share one instance of each distinct key,
+    so the table must outlive all of them. The table is not thread-safe
+*/
+typedef struct json_key_table_t json_key_table_t;
+
+json_key_table_t * create_json_key_table();
+size_t get_json_key_table_size(const json_key_table_t *table);
+void destroy_json_key_table(json_key_table_t *table);
+
+/*
+    Any field may be NULL or false, passing NULL instead of the options is the same
+    as parsing with parse_json_ext() or parse_json_utf8(). With 'raw_numbers' numbers
+    keep their literals and are converted by the first get_value_from_json_number() call,
+    until then 'num_value' of the element points to NaN.
+    With 'lazy' and an arena, the text is validated but only the top container is built,
+    nested containers are parsed when they are first reached through the getters;
+    the text must outlive the elements and they must not be read by several threads.
+    Text nested deeper than 'max_depth' containers is rejected, 0 means no limit.
+    If there are 'stats', the parsers building elements from the text on the calling
+    thread add their counters to them, nothing is counted otherwise. 'consumed' counts
+    characters of wide text and bytes of UTF-8 text, 'elements' are counted by type
+    and 'allocations' are the blocks taken for elements from the heap or the arena
+*/
+typedef struct
+{
+    size_t consumed;
+    size_t elements[json_boolean + 1];
+    size_t max_depth;
+    size_t keys;
+    size_t strings;
+    size_t escapes;
+    size_t allocations;
+    size_t allocated_bytes;
+    double seconds;
+} json_parse_stats_t;
+
+typedef struct
+{
+    json_arena_t *arena;
+    json_key_table_t *keys;
+    bool raw_numbers;
+    bool lazy;
+    size_t max_depth;
+    json_parse_stats_t *stats;
+} json_options_t;
+
+json_element_t * parse_json_with_options(wide_string_t *text, json_error_t *err, const json_options_t *options);
+json_element_t * parse_json_utf8_with_options(const char *data, size_t length, json_error_t *err,
+    const json_options_t *options);
+
+/*
+    A context keeps an arena, a key table and the scratch memory of the parser
+    between calls. Elements parsed with it live until reset_json_context(), which
+    keeps all the memory for the next documents, so once it has warmed up, parsing
+    documents of similar size and keys allocates nothing. The context uses the key
+    table of the options if there is one and a table of its own otherwise. The own
+    table is cleared by the reset too, so distinct keys do not pile up; keys that
+    must outlive resets go to the table of the options, which is never cleared.
+    The arena and the 'lazy' flag of the options are not used. A context is not
+    thread-safe
+*/
+typedef struct json_context_t json_context_t;
+
+json_context_t * create_json_context(const json_options_t *options);
+json_element_t * parse_json_with_context(json_context_t *ctx, wide_string_t *text, json_error_t *err);
+json_element_t * parse_json_utf8_with_context(json_context_t *ctx, const char *data, size_t length,
+    json_error_t *err);
+void reset_json_context(json_context_t *ctx);
+void destroy_json_context(json_context_t *ctx);
+
+/*
+    Event callbacks, any of them may be NULL; a callback returning false stops
+    the parser with the 'json_stopped_by_handler' error. Strings passed
+    to callbacks are valid only during the call. If 'on_number_literal' is set,
+    numbers are not converted and it is called instead of 'on_number' with
+    the text of the literal, including the sign
+*/
+typedef struct
+{
+    bool (*on_object_begin)(void *context);
+    bool (*on_object_end)(void *context);
+    bool (*on_array_begin)(void *context);
+    bool (*on_array_end)(void *context);
+    bool (*on_key)(void *context, const wide_string_t *key);
+    bool (*on_string)(void *context, const wide_string_t *value);
+    bool (*on_number)(void *context, const number_t *value);
+    bool (*on_boolean)(void *context, bool value);
+    bool (*on_null)(void *context);
+    bool (*on_number_literal)(void *context, const char *text, size_t length);
+} json_handler_t;
+
+bool parse_json_with_handler(wide_string_t *text, const json_handler_t *handler, void *context, json_error_t *err);
+bool parse_json_utf8_with_handler(const char *data, size_t length, const json_handler_t *handler,
+    void *context, json_error_t *err);
+
+/*
+    Checks the text against the same grammar and reports the same errors as the parser,
+    but allocates nothing unless the text is nested deeper than 256 containers;
+    numbers are only checked for the format, as in the raw mode
+*/
+bool validate_json(wide_string_t *text, json_error_t *err);
+bool validate_json_utf8(const char *data, size_t length, json_error_t *err);
+
+/*
+    The incremental parser takes UTF-8 text in chunks of any size, a token may be
+    split between chunks. json_parser_finish() reports the end of the input
+*/
+typedef struct json_parser_t json_parser_t;
+
+json_parser_t * create_json_parser(const json_handler_t *handler, void *context);
+json_parser_t * create_json_dom_parser(json_arena_t *arena);
+json_parser_t * create_json_dom_parser_with_options(const json_options_t *options);
+bool json_parser_feed(json_parser_t *parser, const char *chunk, size_t length);
+bool json_parser_finish(json_parser_t *parser);
+const json_error_t * get_json_parser_error(const json_parser_t *parser);
+json_element_t * take_root_from_json_parser(json_parser_t *parser);
+void reset_json_parser(json_parser_t *parser);
+void destroy_json_parser(json_parser_t *parser);
+
+json_document_t * parse_json_document(wide_string_t *text, json_error_t *err);
+
+/*
+    The UTF-8 file is mapped into memory and parsed in place. Strings and keys are
+    copied out of the mapping, which is released as soon as the file is parsed;
+    with 'raw_numbers' or 'lazy' it lives as long as the document, since raw numbers
+    refer to their literals and lazy containers are parsed from the mapped text.
+    A file that cannot be opened or mapped gives json_cannot_read_file. The arena
+    of the options is not used, each document has its own one
+*/
+json_document_t * parse_json_file(const char *path, const json_options_t *options, json_error_t *err);
+
+/*
+    A top-level array is split by a vectorized structural index and its items
+    are parsed on 'threads_count' threads (by the number of processors if it is 0).
+    Any other root, as well as any error, is handled by the sequential parser.
+    The options mean what they mean for the sequential parser: the keys are put
+    into the key table after the threads finish, the statistics of the threads
+    are summed, and a lazy document is always parsed by the sequential parser
+*/
+json_document_t * parse_json_utf8_parallel(const char *data, size_t length, const json_options_t *options,
+    size_t threads_count, json_error_t *err);
+void destroy_json_document(json_document_t *doc);
+
+/*
+    Freezing takes the tree (a heap one or a whole document) and does all
+    the deferred work of lazy containers and raw numbers at once. After that
+    the tree must not be changed, and any number of threads may read it: lookups,
+    paths and items by index do not allocate, and no read writes to the tree.
+    The reference counter is atomic, so a new version can be published while
+    readers release the old one; the last release destroys the tree and returns
+    true. A reader must take its reference from someone who already holds one
+*/
+json_frozen_t * freeze_json_element(json_element_t *root);
+json_frozen_t * freeze_json_document(json_document_t *doc);
+json_frozen_t * retain_json_frozen(json_frozen_t *frozen);
+bool release_json_frozen(json_frozen_t *frozen);
+
+/*
+    Newline-delimited JSON: each non-blank line is one record. Records are parsed
+    in parallel (by the number of processors if 'threads_count' is 0), each thread
+    into its own arena, so the key table and the arena of the options are not used.
+    Failed records have no root, the row of their error is the line in the input
+*/
+typedef struct
+{
+    json_element_t *root;
+    json_error_t error;
+    size_t line;
+} json_record_t;
+
+typedef struct json_batch_t json_batch_t;
+
+json_batch_t * parse_json_lines(const char *data, size_t length, const json_options_t *options,
+    size_t threads_count);
+size_t get_json_batch_size(const json_batch_t *batch);
+const json_record_t * get_record_from_json_batch(const json_batch_t *batch, size_t index);
+void destroy_json_batch(json_batch_t *batch);
+
+/*
+    The callback gets records in the input order while the rest of the input is
+    being parsed: the threads take chunks of lines a little ahead of the callback,
+    so the memory does not grow with the input. A root is released soon after
+    the callback returns and must not be kept; a callback returning false stops it
+*/
+typedef bool (*json_record_callback_t)(void *context, size_t index, const json_record_t *record);
+
+bool parse_json_lines_with_callback(const char *data, size_t length, const json_options_t *options,
+    size_t threads_count, json_record_callback_t callback, void *context);
+
+/*
+    The tape is a read-only form of a document kept in one block: a sequence
+    of tagged 64-bit entries where containers can be skipped at once, followed
+    by the characters of all strings. Values are referred to by their position
+    on the tape, strings returned by get_json_tape_string() point into the tape
+*/
+typedef struct json_tape_t json_tape_t;
+
+typedef struct
+{
+    const json_tape_t *tape;
+    size_t index;
+} json_tape_value_t;
+
+json_tape_t * parse_json_to_tape(wide_string_t *text, json_error_t *err);
+json_tape_t * parse_json_utf8_to_tape(const char *data, size_t length, json_error_t *err);
+void destroy_json_tape(json_tape_t *tape);
+
+/*
+    A snapshot is a tape written to a file as it is, so a mapped snapshot is read
+    in place: it takes constant time to open and its pages are shared by all
+    processes mapping the same file. Only a file written by a machine with
+    the same byte order and wchar_t is accepted. Only the header is checked
+    when the file is mapped, the offsets on the tape are checked when they are
+    followed: a damaged file may give wrong values but is never read outside
+*/
+bool write_json_tape_to_file(const json_tape_t *tape, const char *path);
+json_tape_t * map_json_tape_file(const char *path, json_error_t *err);
+
+json_tape_value_t get_json_tape_root(const json_tape_t *tape);
+json_element_type_t get_json_tape_value_type(json_tape_value_t value);
+size_t get_json_tape_value_count(json_tape_value_t value);
+bool get_pair_from_json_tape_object(json_tape_value_t object, const wchar_t *key, json_tape_value_t *value);
+bool get_element_from_json_tape_array(json_tape_value_t array, size_t index, json_tape_value_t *item);
+bool get_json_tape_string(json_tape_value_t value, wide_string_t *str);
+real_t get_json_tape_number(json_tape_value_t value);
+bool get_json_tape_boolean(json_tape_value_t value);
+
+/*
+    The binary form of an element is several times faster to decode than the text:
+    numbers are stored natively, strings and containers are prefixed by their sizes
+    and each distinct key is written once, raw numbers are stored by their literals.
+    The encoded data is released by free(). The error of decoding has the offset
+    of the byte plus one as its column. With 'raw_numbers' the numbers stored by
+    their literals are decoded as raw numbers again, the 'lazy' flag is not used
+*/
+void * encode_json_element(const json_element_base_t *iface, size_t *size);
+json_element_t * decode_json_element(const void *data, size_t size, const json_options_t *options,
+    json_error_t *err);
+bool decode_json_element_with_handler(const void *data, size_t size, const json_handler_t *handler,
+    void *context, json_error_t *err);
+
 void destroy_json_element(const json_element_base_t *iface);
 
 json_null_t * create_json_null();
 json_null_t * create_json_null_at_end_of_array(json_array_t *iface);
 
+/*
+    Containers created with a capacity take that many items without growing.
+    The pairs of an object are indexed in the order their keys first came, by
+    the parser or the constructors, not in the sorted order of keys: a repeated
+    key keeps its place and takes the last value, a removed pair shifts the ones
+    after it. The writer and the binary form follow the same order.
+    The strings passed to the "taking" constructors must be released by free(),
+    as the ones made by duplicate_wide_string(), and belong to the element
+    afterwards; a container in an arena copies them and releases them at once
+*/
 json_object_t * create_json_object();
+json_object_t * create_json_object_with_capacity(size_t capacity);
 json_pair_t * get_pair_from_json_object(const json_object_data_t *iface, const wchar_t *key);
+json_pair_t * get_pair_by_index_from_json_object(const json_object_data_t *iface, size_t index);
 
 json_array_t * create_json_array();
+json_array_t * create_json_array_with_capacity(size_t capacity);
+void reserve_json_array_capacity(json_array_t *iface, size_t capacity);
 json_element_t * get_element_from_json_array(const json_array_data_t *iface, size_t index);
 
 json_string_t * create_json_string(const wchar_t *value);
 json_string_t * create_json_string_owned_by_object(json_object_t *iface, const wchar_t *key, const wchar_t *value);
 json_string_t * create_json_string_at_end_of_array(json_array_t *iface, const wchar_t *value);
+json_string_t * create_json_string_taking(wide_string_t *value);
+json_string_t * create_json_string_taking_owned_by_object(json_object_t *iface, wide_string_t *key,
+    wide_string_t *value);
+json_string_t * create_json_string_taking_at_end_of_array(json_array_t *iface, wide_string_t *value);
+void append_json_strings_to_array(json_array_t *iface, const wchar_t * const *values, size_t count);
 
 json_number_t * create_json_number(real_t value);
 json_number_t * create_json_number_at_end_of_array(json_array_t *iface, real_t value);
+void append_json_numbers_to_array(json_array_t *iface, const real_t *values, size_t count);
+const real_t * get_value_from_json_number(const json_number_t *iface);
+const char * get_literal_from_json_number(const json_number_t *iface, size_t *length);
 
 json_boolean_t * create_json_boolean(bool value);
 json_boolean_t * create_json_boolean_at_end_of_array(json_array_t *iface, bool value);
 
+/*
+    A path is a JSON pointer (RFC 6901) like "/meta/trace/id" compiled once, with
+    hashed keys and parsed indices, and then resolved without allocations; keys
+    interned into the table of the document are matched by pointers. A set resolves
+    the shared prefixes of its paths once, 'results' gets an element or NULL
+    for each pointer. A malformed pointer is not compiled, NULL is returned
+*/
+typedef struct json_path_t json_path_t;
+typedef struct json_path_set_t json_path_set_t;
+
+json_path_t * compile_json_path(const wchar_t *pointer, json_key_table_t *keys);
+const json_element_t * find_json_element_by_path(const json_element_t *root, const json_path_t *path);
+void destroy_json_path(json_path_t *path);
+
+json_path_set_t * compile_json_path_set(const wchar_t * const *pointers, size_t count, json_key_table_t *keys);
+size_t get_json_path_set_size(const json_path_set_t *set);
+void find_json_elements_by_path_set(const json_element_t *root, const json_path_set_t *set,
+    const json_element_t **results);
+void destroy_json_path_set(json_path_set_t *set);
+
+/*
+    JSON Patch (RFC 6902) and JSON Merge Patch (RFC 7386). The diff compares
+    objects by keys and arrays item by item, so an item inserted in the middle
+    of an array shows up as replacements. Patches change the tree in place,
+    new elements go to the memory of the container that gets them and the root
+    is replaced if the path is empty. The target of a move is found after its
+    source is removed. A failed operation leaves the tree as it was and stops
+    the patch, the operations applied before it are not rolled back
+*/
+bool are_json_elements_equal(const json_element_t *first, const json_element_t *second);
+json_array_t * diff_json_elements(const json_element_t *a, const json_element_t *b);
+bool apply_json_patch(json_element_t **root, const json_element_t *patch);
+void apply_json_merge_patch(json_element_t **root, const json_element_t *patch);
+
+/*
+    Selective parsing builds only the values the paths of the set point to, into
+    the arena of the returned document, which has no root. Everything else is checked
+    as validate_json() checks it, without building anything, so malformed text is
+    rejected wherever it is. 'results' gets an element or NULL for each pointer of the set.
+    The arena and the 'lazy' flag of the options are not used
+*/
+json_document_t * parse_json_selected(wide_string_t *text, const json_path_set_t *set,
+    const json_options_t *options, const json_element_t **results, json_error_t *err);
+json_document_t * parse_json_utf8_selected(const char *data, size_t length, const json_path_set_t *set,
+    const json_options_t *options, const json_element_t **results, json_error_t *err);
+
+/*
+    The simple format separates items by ", " and keys by ": " on one line,
+    the compact one has no spaces at all and the pretty one indents nested
+    items by four spaces
+*/
+typedef enum
+{
+    json_format_simple,
+    json_format_compact,
+    json_format_pretty
+} json_format_t;
+
 wide_string_t * json_element_to_simple_string(const json_element_base_t *iface);
-wide_string_t * json_error_to_string(const json_error_t *err);
\ No newline at end of file
+wide_string_t * json_element_to_string(const json_element_base_t *iface, json_format_t format);
+
+/*
+    The streaming serializer encodes the output as UTF-8 and passes it to the callback
+    in blocks of a few kilobytes, so the memory it takes does not depend on the size
+    of the output. A callback returning false stops the serializer, which then returns false
+*/
+typedef bool (*json_write_callback_t)(void *context, const char *data, size_t size);
+
+bool write_json_element(const json_element_base_t *iface, json_format_t format,
+    json_write_callback_t callback, void *context);
+bool write_json_element_to_file(const json_element_base_t *iface, json_format_t format, FILE *file);
+bool write_json_element_to_descriptor(const json_element_base_t *iface, json_format_t format, int fd);
+wide_string_t * json_error_to_string(const json_error_t *err);
+
+/*
+    A binding describes a C struct, so that JSON objects are decoded straight
+    into it with no elements in between and the struct is written back the same way.
+    Fields hold 'bool', 'real_t', 'wide_string_t*' (released by free()) or a nested
+    struct of the given binding; an array field is a 'json_bound_array_t' of items
+    of 'item_type'. Unknown keys and null values are skipped, a value of another type
+    fails the decoding. The struct is zeroed first and released on failure
+*/
+typedef struct json_binding_t json_binding_t;
+
+typedef struct
+{
+    const wchar_t *name;
+    size_t offset;
+    json_element_type_t type;
+    json_element_type_t item_type;
+    const json_binding_t *binding;
+} json_field_t;
+
+typedef struct
+{
+    void *items;
+    size_t count;
+} json_bound_array_t;
+
+json_binding_t * create_json_binding(const json_field_t *fields, size_t count, size_t size);
+void destroy_json_binding(json_binding_t *binding);
+bool decode_json_struct(const json_binding_t *binding, const char *data, size_t length, void *value,
+    json_error_t *err);
+void release_json_struct(const json_binding_t *binding, void *value);
+wide_string_t * json_struct_to_string(const json_binding_t *binding, const void *value, json_format_t format);
+bool write_json_struct(const json_binding_t *binding, const void *value, json_format_t format,
+    json_write_callback_t callback, void *context);
\ No newline at end of file
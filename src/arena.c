@@ -0,0 +1,144 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    The implementation of the bump allocator used by JSON documents
+*/
+
+#include "json.h"
+#include "allocator.h"
+#include <stdint.h>
+
+#define default_chunk_size (64 * 1024)
+#define arena_alignment 16
+
+typedef struct chunk_t chunk_t;
+
+struct chunk_t
+{
+    chunk_t *next;
+    size_t size;
+    size_t used;
+};
+
+/*
+    Chunks released by a reset are kept as spare ones and are taken again
+    before any new chunk is allocated
+*/
+struct json_arena_t
+{
+    chunk_t *first;
+    chunk_t *spare;
+    size_t chunk_size;
+};
+
+static __inline size_t align_size(size_t size)
+{
+    return (size + arena_alignment - 1) & ~((size_t)arena_alignment - 1);
+}
+
+static __inline uint8_t * get_chunk_data(chunk_t *chunk)
+{
+    return (uint8_t*)chunk + align_size(sizeof(chunk_t));
+}
+
+static chunk_t * create_chunk(size_t size)
+{
+    chunk_t *chunk = nnalloc(align_size(sizeof(chunk_t)) + size);
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+/*
+    The smallest spare chunk that fits is taken, so large chunks are left
+    for large blocks
+*/
+static chunk_t * acquire_chunk(json_arena_t *arena, size_t size)
+{
+    chunk_t **best = NULL;
+    for (chunk_t **link = &arena->spare; *link; link = &(*link)->next)
+    {
+        if ((*link)->size >= size && (!best || (*link)->size < (*best)->size))
+        {
+            best = link;
+            if ((*link)->size == size)
+                break;
+        }
+    }
+    if (!best)
+        return create_chunk(size);
+    chunk_t *chunk = *best;
+    *best = chunk->next;
+    chunk->next = NULL;
+    chunk->used = 0;
+    return chunk;
+}
+
+json_arena_t * create_json_arena(size_t chunk_size)
+{
+    json_arena_t *arena = nnalloc(sizeof(json_arena_t));
+    arena->chunk_size = align_size(chunk_size ? chunk_size : default_chunk_size);
+    arena->spare = NULL;
+    arena->first = create_chunk(arena->chunk_size);
+    return arena;
+}
+
+void * alloc_from_json_arena(json_arena_t *arena, size_t size)
+{
+    size = align_size(size ? size : 1);
+    chunk_t *chunk = arena->first;
+    if (chunk->size - chunk->used >= size)
+    {
+        void *ptr = get_chunk_data(chunk) + chunk->used;
+        chunk->used += size;
+        return ptr;
+    }
+    if (size > arena->chunk_size / 4)
+    {
+        // large blocks get a chunk of their own, placed behind the current one
+        // so that the free space of the current chunk is not wasted
+        chunk_t *large = acquire_chunk(arena, size);
+        large->used = size;
+        large->next = chunk->next;
+        chunk->next = large;
+        return get_chunk_data(large);
+    }
+    chunk = acquire_chunk(arena, arena->chunk_size);
+    chunk->next = arena->first;
+    arena->first = chunk;
+    chunk->used = size;
+    return get_chunk_data(chunk);
+}
+
+void reset_json_arena(json_arena_t *arena)
+{
+    chunk_t *chunk = arena->first;
+    while (chunk)
+    {
+        chunk_t *next = chunk->next;
+        chunk->next = arena->spare;
+        arena->spare = chunk;
+        chunk = next;
+    }
+    arena->first = acquire_chunk(arena, arena->chunk_size);
+}
+
+static void free_chunks(chunk_t *chunk)
+{
+    while(chunk)
+    {
+        chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+void destroy_json_arena(json_arena_t *arena)
+{
+    if (!arena)
+        return;
+    free_chunks(arena->first);
+    free_chunks(arena->spare);
+    free(arena);
+}
@@ -0,0 +1,681 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    The compact binary form of JSON elements
+*/
+
+#include <math.h>
+#include <string.h>
+#include "element.h"
+#include "parser.h"
+#include "binary.h"
+#include "number.h"
+#include "allocator.h"
+
+/*
+    The data starts with a signature and a version, then the root value follows.
+    A value is a tag byte and its payload: integers are zigzag varints, other numbers
+    are 8 bytes of a little-endian double, strings are the varint length of UTF-8
+    text (where a surrogate may stand on its own) and the text, containers are the varint count of items and the items.
+    A number that keeps its literal is the varint length of the literal and its text,
+    the data of version 1 has no such numbers and is read as well.
+    A key is a varint 'n': an even one is followed by n / 2 bytes of a new key,
+    an odd one refers to the (n / 2)th new key of the data
+*/
+#define binary_signature_0 'J'
+#define binary_signature_1 'B'
+#define binary_version 2
+#define binary_oldest_version 1
+#define binary_header_size 3
+
+#define max_exact_integer 9007199254740992.0
+
+typedef enum
+{
+    tag_null,
+    tag_false,
+    tag_true,
+    tag_integer,
+    tag_double,
+    tag_string,
+    tag_array,
+    tag_object,
+    tag_literal
+} binary_tag_t;
+
+// --- encoder ----------------------------------------------------------------
+
+typedef struct
+{
+    const wide_string_t *key;
+    size_t hash;
+    size_t id;
+} known_key_t;
+
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    known_key_t *keys;
+    size_t keys_count;
+    size_t keys_mask;
+} encoder_t;
+
+static void reserve_bytes(encoder_t *encoder, size_t count)
+{
+    if (encoder->size + count <= encoder->capacity)
+        return;
+    size_t capacity = encoder->capacity * 2;
+    while (capacity < encoder->size + count)
+        capacity *= 2;
+    uint8_t *data = nnalloc(capacity);
+    memcpy(data, encoder->data, encoder->size);
+    free(encoder->data);
+    encoder->data = data;
+    encoder->capacity = capacity;
+}
+
+static __inline void put_byte(encoder_t *encoder, uint8_t value)
+{
+    reserve_bytes(encoder, 1);
+    encoder->data[encoder->size++] = value;
+}
+
+static void put_varint(encoder_t *encoder, uint64_t value)
+{
+    reserve_bytes(encoder, 10);
+    while (value >= 0x80)
+    {
+        encoder->data[encoder->size++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    encoder->data[encoder->size++] = (uint8_t)value;
+}
+
+/*
+    Strings are stored unit by unit so that they read back the same. A surrogate
+    that is not a part of a pair of a 16-bit wchar_t, including the ones the parser
+    makes from escaped pairs where wchar_t has 32 bits, is written as a three-byte
+    sequence of its own. Units above U+10FFFF cannot come from the parser and
+    are replaced by U+FFFD
+*/
+static __inline unsigned int get_code_point(const wchar_t *chars, size_t length, size_t *index)
+{
+    unsigned int cp = (unsigned int)chars[(*index)++];
+#if WCHAR_MAX <= 0xFFFF
+    if (cp >= 0xD800 && cp <= 0xDBFF && *index < length
+        && (unsigned int)chars[*index] >= 0xDC00 && (unsigned int)chars[*index] <= 0xDFFF)
+        return 0x10000 + ((cp - 0xD800) << 10) + ((unsigned int)chars[(*index)++] - 0xDC00);
+#else
+    (void)length;
+#endif
+    return cp > 0x10FFFF ? 0xFFFD : cp;
+}
+
+static size_t get_utf8_size(const wide_string_t *str)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < str->length; )
+    {
+        unsigned int cp = get_code_point(str->data, str->length, &i);
+        size += cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+    }
+    return size;
+}
+
+static void put_utf8_chars(encoder_t *encoder, const wide_string_t *str, size_t size)
+{
+    reserve_bytes(encoder, size);
+    uint8_t *b = encoder->data + encoder->size;
+    for (size_t i = 0; i < str->length; )
+    {
+        unsigned int cp = get_code_point(str->data, str->length, &i);
+        if (cp < 0x80)
+            *b++ = (uint8_t)cp;
+        else if (cp < 0x800)
+        {
+            *b++ = (uint8_t)(0xC0 | (cp >> 6));
+            *b++ = (uint8_t)(0x80 | (cp & 0x3F));
+        }
+        else if (cp < 0x10000)
+        {
+            *b++ = (uint8_t)(0xE0 | (cp >> 12));
+            *b++ = (uint8_t)(0x80 | ((cp >> 6) & 0x3F));
+            *b++ = (uint8_t)(0x80 | (cp & 0x3F));
+        }
+        else
+        {
+            *b++ = (uint8_t)(0xF0 | (cp >> 18));
+            *b++ = (uint8_t)(0x80 | ((cp >> 12) & 0x3F));
+            *b++ = (uint8_t)(0x80 | ((cp >> 6) & 0x3F));
+            *b++ = (uint8_t)(0x80 | (cp & 0x3F));
+        }
+    }
+    encoder->size += size;
+}
+
+static void put_string(encoder_t *encoder, const wide_string_t *str)
+{
+    size_t size = get_utf8_size(str);
+    put_varint(encoder, size);
+    put_utf8_chars(encoder, str, size);
+}
+
+static void grow_known_keys(encoder_t *encoder)
+{
+    size_t size = (encoder->keys_mask + 1) * 2;
+    known_key_t *keys = nnalloc(size * sizeof(known_key_t));
+    memset(keys, 0, size * sizeof(known_key_t));
+    for (size_t i = 0; i <= encoder->keys_mask; i++)
+    {
+        if (encoder->keys[i].key)
+        {
+            size_t slot = encoder->keys[i].hash & (size - 1);
+            while (keys[slot].key)
+                slot = (slot + 1) & (size - 1);
+            keys[slot] = encoder->keys[i];
+        }
+    }
+    free(encoder->keys);
+    encoder->keys = keys;
+    encoder->keys_mask = size - 1;
+}
+
+/*
+    Pairs keep the hashes of their keys, so repeated keys are found without
+    hashing them again and are written as references to the first occurrence
+*/
+static void put_key(encoder_t *encoder, const private_pair_t *pair)
+{
+    const wide_string_t *key = pair->key;
+    size_t slot = pair->hash & encoder->keys_mask;
+    while (encoder->keys[slot].key)
+    {
+        const known_key_t *known = &encoder->keys[slot];
+        if (known->hash == pair->hash && (known->key == key || (known->key->length == key->length
+            && memcmp(known->key->data, key->data, key->length * sizeof(wchar_t)) == 0)))
+        {
+            put_varint(encoder, ((uint64_t)known->id << 1) | 1);
+            return;
+        }
+        slot = (slot + 1) & encoder->keys_mask;
+    }
+    encoder->keys[slot].key = key;
+    encoder->keys[slot].hash = pair->hash;
+    encoder->keys[slot].id = encoder->keys_count;
+    if (++encoder->keys_count * 2 > encoder->keys_mask + 1)
+        grow_known_keys(encoder);
+    size_t size = get_utf8_size(key);
+    put_varint(encoder, (uint64_t)size << 1);
+    put_utf8_chars(encoder, key, size);
+}
+
+static void put_number(encoder_t *encoder, const element_t *elem)
+{
+    const private_number_data_t *num = (const private_number_data_t*)elem->data.num_value;
+    if (num->literal)
+    {
+        put_byte(encoder, tag_literal);
+        put_varint(encoder, num->length);
+        reserve_bytes(encoder, num->length);
+        memcpy(encoder->data + encoder->size, num->literal, num->length);
+        encoder->size += num->length;
+        return;
+    }
+    double value = (double)*get_value_from_json_number((const json_number_t*)elem);
+    if (value == floor(value) && fabs(value) <= max_exact_integer && !(value == 0 && signbit(value)))
+    {
+        int64_t integer = (int64_t)value;
+        put_byte(encoder, tag_integer);
+        put_varint(encoder, ((uint64_t)integer << 1) ^ (uint64_t)(integer >> 63));
+        return;
+    }
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    put_byte(encoder, tag_double);
+    reserve_bytes(encoder, 8);
+    for (int i = 0; i < 8; i++)
+        encoder->data[encoder->size++] = (uint8_t)(bits >> (i * 8));
+}
+
+static void put_element(encoder_t *encoder, element_t *elem)
+{
+    switch (elem->type)
+    {
+        case json_null:
+            put_byte(encoder, tag_null);
+            break;
+        case json_boolean:
+            put_byte(encoder, elem->data.bool_value ? tag_true : tag_false);
+            break;
+        case json_number:
+            put_number(encoder, elem);
+            break;
+        case json_string:
+            put_byte(encoder, tag_string);
+            put_string(encoder, elem->data.string_value);
+            break;
+        case json_array:
+        {
+            expand_element(elem);
+            const private_array_data_t *array = elem->data.array;
+            put_byte(encoder, tag_array);
+            put_varint(encoder, array->count);
+            for (size_t i = 0; i < array->count; i++)
+                put_element(encoder, array->items[i]);
+            break;
+        }
+        case json_object:
+        {
+            expand_element(elem);
+            const private_object_data_t *object = elem->data.object;
+            put_byte(encoder, tag_object);
+            put_varint(encoder, object->count);
+            for (size_t i = 0; i < object->count; i++)
+            {
+                put_key(encoder, &object->pairs[i]);
+                put_element(encoder, object->pairs[i].value);
+            }
+            break;
+        }
+    }
+}
+
+void * encode_json_element(const json_element_base_t *iface, size_t *size)
+{
+    encoder_t encoder;
+    encoder.capacity = 256;
+    encoder.data = nnalloc(encoder.capacity);
+    encoder.size = 0;
+    encoder.keys_mask = 63;
+    encoder.keys = nnalloc((encoder.keys_mask + 1) * sizeof(known_key_t));
+    memset(encoder.keys, 0, (encoder.keys_mask + 1) * sizeof(known_key_t));
+    encoder.keys_count = 0;
+    put_byte(&encoder, binary_signature_0);
+    put_byte(&encoder, binary_signature_1);
+    put_byte(&encoder, binary_version);
+    put_element(&encoder, (element_t*)iface);
+    free(encoder.keys);
+    *size = encoder.size;
+    return encoder.data;
+}
+// --- decoder ----------------------------------------------------------------
+
+static bool set_reader_error(binary_reader_t *reader, json_error_type_t type)
+{
+    reader->failed = true;
+    if (reader->err)
+    {
+        reader->err->type = type;
+        reader->err->where.row = 1;
+        reader->err->where.column = (int)reader->index + 1;
+    }
+    return false;
+}
+
+static bool get_varint(binary_reader_t *reader, uint64_t *value)
+{
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (reader->index >= reader->size)
+            return false;
+        uint8_t b = reader->data[reader->index++];
+        result |= (uint64_t)(b & 0x7F) << shift;
+        if (b < 0x80)
+        {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void reserve_chars(binary_reader_t *reader, size_t count)
+{
+    if (reader->chars_count + count <= reader->chars_capacity)
+        return;
+    size_t capacity = reader->chars_capacity * 2;
+    while (capacity < reader->chars_count + count)
+        capacity *= 2;
+    wchar_t *chars = nnalloc(capacity * sizeof(wchar_t));
+    memcpy(chars, reader->chars, reader->chars_count * sizeof(wchar_t));
+    free(reader->chars);
+    reader->chars = chars;
+    reader->chars_capacity = capacity;
+}
+
+/*
+    Appends the UTF-8 text of the given size to the character buffer,
+    a text has no more characters than bytes
+*/
+static bool get_utf8_chars(binary_reader_t *reader, size_t size)
+{
+    if (size > reader->size - reader->index)
+        return false;
+    reserve_chars(reader, size);
+    wchar_t *dst = reader->chars + reader->chars_count;
+    source_t src;
+    src.wide = NULL;
+    src.bytes = reader->data + reader->index;
+    src.length = size;
+    src.index = 0;
+    src.kernels = NULL;
+    src.escapes = 0;
+    while (src.index < size)
+    {
+        uint8_t b = src.bytes[src.index];
+        if (b < 0x80)
+        {
+            *dst++ = (wchar_t)b;
+            src.index++;
+            continue;
+        }
+        // a surrogate written on its own is kept as it is
+        if (b == 0xED && size - src.index >= 3 && (src.bytes[src.index + 1] & 0xE0) == 0xA0
+            && (src.bytes[src.index + 2] & 0xC0) == 0x80)
+        {
+            *dst++ = (wchar_t)(0xD000 | ((src.bytes[src.index + 1] & 0x3Fu) << 6)
+                | (src.bytes[src.index + 2] & 0x3Fu));
+            src.index += 3;
+            continue;
+        }
+        unsigned int cp = decode_utf8_sequence(&src);
+#if WCHAR_MAX <= 0xFFFF
+        if (cp >= 0x10000)
+        {
+            cp -= 0x10000;
+            *dst++ = (wchar_t)(0xD800 + (cp >> 10));
+            *dst++ = (wchar_t)(0xDC00 + (cp & 0x3FF));
+            continue;
+        }
+#endif
+        *dst++ = (wchar_t)cp;
+    }
+    reader->chars_count = dst - reader->chars;
+    reader->index += size;
+    return true;
+}
+
+/*
+    The characters of keys stay in the buffer to be referred to later,
+    the ones of string values are dropped by the next item
+*/
+static bool get_key(binary_reader_t *reader, binary_item_t *item)
+{
+    uint64_t n;
+    if (!get_varint(reader, &n))
+        return false;
+    item->type = binary_item_key;
+    if (n & 1)
+    {
+        if ((n >> 1) >= reader->keys_count)
+            return false;
+        const binary_key_span_t *span = &reader->keys[n >> 1];
+        item->string.data = reader->chars + span->offset;
+        item->string.length = span->length;
+        item->key_id = (size_t)(n >> 1);
+        item->is_new_key = false;
+        return true;
+    }
+    size_t offset = reader->chars_count;
+    if (!get_utf8_chars(reader, (size_t)(n >> 1)))
+        return false;
+    if (reader->keys_count == reader->keys_capacity)
+    {
+        binary_key_span_t *keys = nnalloc(reader->keys_capacity * 2 * sizeof(binary_key_span_t));
+        memcpy(keys, reader->keys, reader->keys_count * sizeof(binary_key_span_t));
+        free(reader->keys);
+        reader->keys = keys;
+        reader->keys_capacity *= 2;
+    }
+    binary_key_span_t *span = &reader->keys[reader->keys_count];
+    span->offset = offset;
+    span->length = reader->chars_count - offset;
+    reader->values_offset = reader->chars_count;
+    item->string.data = reader->chars + offset;
+    item->string.length = span->length;
+    item->key_id = reader->keys_count++;
+    item->is_new_key = true;
+    return true;
+}
+
+static void push_reader_frame(binary_reader_t *reader, size_t count, bool is_object)
+{
+    if (reader->frames_count == reader->frames_capacity)
+    {
+        binary_frame_t *frames = nnalloc(reader->frames_capacity * 2 * sizeof(binary_frame_t));
+        memcpy(frames, reader->frames, reader->frames_count * sizeof(binary_frame_t));
+        free(reader->frames);
+        reader->frames = frames;
+        reader->frames_capacity *= 2;
+    }
+    reader->frames[reader->frames_count].remaining = count;
+    reader->frames[reader->frames_count].is_object = is_object;
+    reader->frames_count++;
+}
+
+static bool get_value(binary_reader_t *reader, binary_item_t *item)
+{
+    if (reader->index >= reader->size)
+        return false;
+    uint8_t tag = reader->data[reader->index++];
+    switch (tag)
+    {
+        case tag_null:
+            item->type = binary_item_null;
+            return true;
+        case tag_false:
+        case tag_true:
+            item->type = binary_item_boolean;
+            item->bool_value = tag == tag_true;
+            return true;
+        case tag_integer:
+        {
+            uint64_t n;
+            if (!get_varint(reader, &n))
+                return false;
+            item->type = binary_item_integer;
+            item->integer = (int64_t)(n >> 1) ^ -(int64_t)(n & 1);
+            return true;
+        }
+        case tag_double:
+        {
+            if (reader->size - reader->index < 8)
+                return false;
+            uint64_t bits = 0;
+            for (int i = 0; i < 8; i++)
+                bits |= (uint64_t)reader->data[reader->index++] << (i * 8);
+            item->type = binary_item_double;
+            memcpy(&item->real, &bits, sizeof(bits));
+            return true;
+        }
+        case tag_string:
+        {
+            uint64_t size;
+            if (!get_varint(reader, &size) || !get_utf8_chars(reader, (size_t)size))
+                return false;
+            item->type = binary_item_string;
+            item->string.data = reader->chars + reader->values_offset;
+            item->string.length = reader->chars_count - reader->values_offset;
+            return true;
+        }
+        case tag_literal:
+        {
+            uint64_t length;
+            if (!get_varint(reader, &length) || length > reader->size - reader->index)
+                return false;
+            const char *text = (const char*)reader->data + reader->index;
+            if (!is_json_number_literal(text, (size_t)length))
+                return false;
+            item->type = binary_item_literal;
+            item->literal = text;
+            item->literal_length = (size_t)length;
+            reader->index += (size_t)length;
+            return true;
+        }
+        case tag_array:
+        case tag_object:
+        {
+            uint64_t count;
+            // each item takes at least one byte, so a larger count is malformed
+            if (!get_varint(reader, &count) || count > reader->size - reader->index)
+                return false;
+            item->type = tag == tag_object ? binary_item_object : binary_item_array;
+            item->count = (size_t)count;
+            push_reader_frame(reader, item->count, tag == tag_object);
+            return true;
+        }
+    }
+    reader->index--;
+    return false;
+}
+
+bool init_binary_reader(binary_reader_t *reader, const void *data, size_t size, json_error_t *err)
+{
+    init_json_error(err);
+    reader->data = data;
+    reader->size = size;
+    reader->index = 0;
+    reader->err = err;
+    reader->expect_key = true;
+    reader->done = false;
+    reader->failed = false;
+    reader->chars_capacity = 256;
+    reader->chars = nnalloc(reader->chars_capacity * sizeof(wchar_t));
+    reader->chars_count = 0;
+    reader->values_offset = 0;
+    reader->keys_capacity = 64;
+    reader->keys = nnalloc(reader->keys_capacity * sizeof(binary_key_span_t));
+    reader->keys_count = 0;
+    reader->frames_capacity = 16;
+    reader->frames = nnalloc(reader->frames_capacity * sizeof(binary_frame_t));
+    reader->frames_count = 0;
+    const uint8_t *b = data;
+    if (size < binary_header_size || b[0] != binary_signature_0 || b[1] != binary_signature_1
+            || b[2] < binary_oldest_version || b[2] > binary_version)
+        return set_reader_error(reader, json_incorrect_binary_format);
+    reader->index = binary_header_size;
+    return true;
+}
+
+/*
+    Nesting is tracked by the frames of the reader, so it takes no native stack
+*/
+bool read_binary_item(binary_reader_t *reader, binary_item_t *item)
+{
+    if (reader->done)
+    {
+        if (reader->index != reader->size)
+            set_reader_error(reader, json_incorrect_binary_format);
+        return false;
+    }
+    reader->chars_count = reader->values_offset;
+    if (reader->frames_count > 0)
+    {
+        binary_frame_t *frame = &reader->frames[reader->frames_count - 1];
+        if (frame->remaining == 0)
+        {
+            item->type = binary_item_end;
+            item->closes_object = frame->is_object;
+            reader->done = --reader->frames_count == 0;
+            return true;
+        }
+        if (frame->is_object && reader->expect_key)
+        {
+            reader->expect_key = false;
+            if (!get_key(reader, item))
+                return set_reader_error(reader, json_incorrect_binary_format);
+            return true;
+        }
+        frame->remaining--;
+        reader->expect_key = true;
+    }
+    if (!get_value(reader, item))
+        return set_reader_error(reader, json_incorrect_binary_format);
+    if (reader->frames_count == 0)
+        reader->done = true;
+    else if (item->type == binary_item_object || item->type == binary_item_array)
+        reader->expect_key = true;
+    return true;
+}
+
+void release_binary_reader(binary_reader_t *reader)
+{
+    free(reader->chars);
+    free(reader->keys);
+    free(reader->frames);
+}
+
+static bool emit_binary_number(const binary_item_t *item, const json_handler_t *handler, void *context)
+{
+    if (item->type == binary_item_literal)
+    {
+        if (handler->on_number_literal)
+            return handler->on_number_literal(context, item->literal, item->literal_length);
+        if (!handler->on_number)
+            return true;
+        number_t num;
+        bool neg = item->literal[0] == '-';
+        if (!decode_json_number(item->literal + neg, item->literal_length - neg, neg, &num))
+            return false;
+        return handler->on_number(context, &num);
+    }
+    if (handler->on_number_literal)
+    {
+        char buff[32];
+        int length = item->type == binary_item_integer ? snprintf(buff, sizeof(buff), "%lld", (long long)item->integer)
+            : snprintf(buff, sizeof(buff), "%.17g", item->real);
+        return handler->on_number_literal(context, buff, (size_t)length);
+    }
+    if (!handler->on_number)
+        return true;
+    number_t num;
+    init_number_by_real(&num, item->type == binary_item_integer ? (real_t)item->integer : (real_t)item->real);
+    return handler->on_number(context, &num);
+}
+
+static bool emit_binary_item(const binary_item_t *item, const json_handler_t *handler, void *context)
+{
+    switch (item->type)
+    {
+        case binary_item_null:
+            return !handler->on_null || handler->on_null(context);
+        case binary_item_boolean:
+            return !handler->on_boolean || handler->on_boolean(context, item->bool_value);
+        case binary_item_integer:
+        case binary_item_double:
+        case binary_item_literal:
+            return emit_binary_number(item, handler, context);
+        case binary_item_string:
+            return !handler->on_string || handler->on_string(context, &item->string);
+        case binary_item_key:
+            return !handler->on_key || handler->on_key(context, &item->string);
+        case binary_item_array:
+            return !handler->on_array_begin || handler->on_array_begin(context);
+        case binary_item_object:
+            return !handler->on_object_begin || handler->on_object_begin(context);
+        case binary_item_end:
+            if (item->closes_object)
+                return !handler->on_object_end || handler->on_object_end(context);
+            return !handler->on_array_end || handler->on_array_end(context);
+    }
+    return true;
+}
+
+bool decode_json_element_with_handler(const void *data, size_t size, const json_handler_t *handler,
+    void *context, json_error_t *err)
+{
+    binary_reader_t reader;
+    bool result = init_binary_reader(&reader, data, size, err);
+    binary_item_t item;
+    while (result && read_binary_item(&reader, &item))
+    {
+        if (!emit_binary_item(&item, handler, context))
+            result = set_reader_error(&reader, json_stopped_by_handler);
+    }
+    result = result && !reader.failed;
+    release_binary_reader(&reader);
+    return result;
+}
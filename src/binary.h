@@ -0,0 +1,87 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    The reader of the compact binary form of JSON elements
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "json.h"
+
+typedef enum
+{
+    binary_item_null,
+    binary_item_boolean,
+    binary_item_integer,
+    binary_item_double,
+    binary_item_literal,
+    binary_item_string,
+    binary_item_key,
+    binary_item_array,
+    binary_item_object,
+    binary_item_end
+} binary_item_type_t;
+
+/*
+    The characters of strings and keys are valid until the next item is read.
+    Keys are numbered in the order they first appear in the data.
+    A literal refers to the data and is checked to be a JSON number
+*/
+typedef struct
+{
+    binary_item_type_t type;
+    bool bool_value;
+    int64_t integer;
+    double real;
+    const char *literal;
+    size_t literal_length;
+    wide_string_t string;
+    size_t count;
+    size_t key_id;
+    bool is_new_key;
+    bool closes_object;
+} binary_item_t;
+
+typedef struct
+{
+    size_t offset;
+    size_t length;
+} binary_key_span_t;
+
+typedef struct
+{
+    size_t remaining;
+    bool is_object;
+} binary_frame_t;
+
+typedef struct
+{
+    const uint8_t *data;
+    size_t size;
+    size_t index;
+    json_error_t *err;
+    bool expect_key;
+    bool done;
+    bool failed;
+    wchar_t *chars;
+    size_t chars_count;
+    size_t chars_capacity;
+    size_t values_offset;
+    binary_key_span_t *keys;
+    size_t keys_count;
+    size_t keys_capacity;
+    binary_frame_t *frames;
+    size_t frames_count;
+    size_t frames_capacity;
+} binary_reader_t;
+
+/*
+    Containers are reported by their items count and closed by the 'end' item,
+    the pairs of objects are reported as a key followed by a value.
+    After the root value read_binary_item() returns false, the reader is marked
+    as failed unless the data has been read up to the end
+*/
+bool init_binary_reader(binary_reader_t *reader, const void *data, size_t size, json_error_t *err);
+bool read_binary_item(binary_reader_t *reader, binary_item_t *item);
+void release_binary_reader(binary_reader_t *reader);
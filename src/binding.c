@@ -0,0 +1,407 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    Decoding JSON objects straight into C structs described by bindings
+*/
+
+#include <string.h>
+#include "binding.h"
+#include "allocator.h"
+
+// --- compiling --------------------------------------------------------------
+
+static __inline size_t hash_field_name(const wchar_t *data, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (uint64_t)data[i]) * 1099511628211ULL;
+    return (size_t)(hash ^ (hash >> 32));
+}
+
+static bool fill_binding_index(json_binding_t *binding, size_t size, bool allow_collisions)
+{
+    memset(binding->index, 0, size * sizeof(uint32_t));
+    binding->index_mask = size - 1;
+    for (size_t i = 0; i < binding->count; i++)
+    {
+        size_t slot = binding->fields[i].hash & binding->index_mask;
+        if (binding->index[slot] && !allow_collisions)
+            return false;
+        while (binding->index[slot])
+            slot = (slot + 1) & binding->index_mask;
+        binding->index[slot] = (uint32_t)(i + 1);
+    }
+    return true;
+}
+
+static bool is_field_supported(const json_field_t *field)
+{
+    switch (field->type)
+    {
+        case json_boolean:
+        case json_number:
+        case json_string:
+            return true;
+        case json_object:
+            return field->binding != NULL;
+        case json_array:
+            return field->item_type == json_boolean || field->item_type == json_number
+                || field->item_type == json_string || (field->item_type == json_object && field->binding);
+        default:
+            return false;
+    }
+}
+
+json_binding_t * create_json_binding(const json_field_t *fields, size_t count, size_t size)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!is_field_supported(&fields[i]))
+            return NULL;
+    }
+    json_binding_t *binding = nnalloc(sizeof(json_binding_t) + count * sizeof(bound_field_t));
+    binding->fields = (bound_field_t*)(binding + 1);
+    binding->count = count;
+    binding->size = size;
+    for (size_t i = 0; i < count; i++)
+    {
+        bound_field_t *bound = &binding->fields[i];
+        bound->field = fields[i];
+        bound->name_length = wcslen(fields[i].name);
+        bound->hash = hash_field_name(fields[i].name, bound->name_length);
+    }
+    // the index grows until the fields do not collide, up to a limit
+    size_t min_size = 4;
+    while (min_size < count * 2)
+        min_size *= 2;
+    binding->index = nnalloc(min_size * 16 * sizeof(uint32_t));
+    size_t index_size = min_size;
+    while (index_size < min_size * 16 && !fill_binding_index(binding, index_size, false))
+        index_size *= 2;
+    if (index_size == min_size * 16)
+        fill_binding_index(binding, index_size, true);
+    return binding;
+}
+
+void destroy_json_binding(json_binding_t *binding)
+{
+    if (binding)
+    {
+        free(binding->index);
+        free(binding);
+    }
+}
+
+static const json_field_t * find_bound_field(const json_binding_t *binding, const wchar_t *name, size_t length)
+{
+    size_t hash = hash_field_name(name, length);
+    size_t slot = hash & binding->index_mask;
+    while (binding->index[slot])
+    {
+        const bound_field_t *bound = &binding->fields[binding->index[slot] - 1];
+        if (bound->hash == hash && bound->name_length == length
+            && memcmp(bound->field.name, name, length * sizeof(wchar_t)) == 0)
+            return &bound->field;
+        slot = (slot + 1) & binding->index_mask;
+    }
+    return NULL;
+}
+
+// --- releasing --------------------------------------------------------------
+
+static void release_bound_value(json_element_type_t type, const json_binding_t *binding, uint8_t *value)
+{
+    if (type == json_string)
+        free(*(wide_string_t**)value);
+    else if (type == json_object)
+        release_json_struct(binding, value);
+}
+
+void release_json_struct(const json_binding_t *binding, void *value)
+{
+    uint8_t *base = value;
+    for (size_t i = 0; i < binding->count; i++)
+    {
+        const json_field_t *field = &binding->fields[i].field;
+        uint8_t *slot = base + field->offset;
+        if (field->type == json_array)
+        {
+            json_bound_array_t *array = (json_bound_array_t*)slot;
+            size_t size = get_bound_value_size(field->item_type, field->binding);
+            for (size_t k = 0; k < array->count; k++)
+                release_bound_value(field->item_type, field->binding, (uint8_t*)array->items + k * size);
+            free(array->items);
+            array->items = NULL;
+            array->count = 0;
+        }
+        else
+        {
+            release_bound_value(field->type, field->binding, slot);
+            if (field->type == json_string)
+                *(wide_string_t**)slot = NULL;
+        }
+    }
+}
+
+// --- decoding ---------------------------------------------------------------
+
+/*
+    A frame is an object being filled, with the field of its current key,
+    or an array of a field, with its own capacity
+*/
+typedef struct
+{
+    bool is_array;
+    const json_binding_t *binding;
+    uint8_t *base;
+    const json_field_t *field;
+    size_t capacity;
+} binding_frame_t;
+
+typedef struct
+{
+    const json_binding_t *binding;
+    uint8_t *root;
+    binding_frame_t *frames;
+    size_t frames_count;
+    size_t frames_capacity;
+    size_t skipped_depth;
+    bool started;
+    bool mismatch;
+} binding_decoder_t;
+
+/*
+    Returns where the value of the given type goes, or NULL if it is skipped;
+    a value of a type the binding does not expect stops the decoder
+*/
+static uint8_t * get_value_slot(binding_decoder_t *decoder, json_element_type_t type,
+    const json_binding_t **binding)
+{
+    if (!decoder->frames_count)
+    {
+        decoder->mismatch = true;
+        return NULL;
+    }
+    binding_frame_t *frame = &decoder->frames[decoder->frames_count - 1];
+    const json_field_t *field = frame->field;
+    if (!frame->is_array)
+    {
+        frame->field = NULL;
+        if (!field || type == json_null)
+            return NULL;
+        if (field->type != type)
+        {
+            decoder->mismatch = true;
+            return NULL;
+        }
+        *binding = field->binding;
+        return frame->base + field->offset;
+    }
+    if (type != json_null && field->item_type != type)
+    {
+        decoder->mismatch = true;
+        return NULL;
+    }
+    json_bound_array_t *array = (json_bound_array_t*)frame->base;
+    size_t size = get_bound_value_size(field->item_type, field->binding);
+    if (array->count == frame->capacity)
+    {
+        size_t capacity = frame->capacity ? frame->capacity * 2 : 4;
+        void *items = nnalloc(capacity * size);
+        if (array->count)
+            memcpy(items, array->items, array->count * size);
+        free(array->items);
+        array->items = items;
+        frame->capacity = capacity;
+    }
+    uint8_t *slot = (uint8_t*)array->items + array->count++ * size;
+    memset(slot, 0, size);
+    *binding = field->binding;
+    return type == json_null ? NULL : slot;
+}
+
+static void push_binding_frame(binding_decoder_t *decoder, bool is_array, const json_binding_t *binding,
+    uint8_t *base, const json_field_t *field)
+{
+    if (decoder->frames_count == decoder->frames_capacity)
+    {
+        size_t capacity = decoder->frames_capacity ? decoder->frames_capacity * 2 : 8;
+        binding_frame_t *frames = nnalloc(capacity * sizeof(binding_frame_t));
+        if (decoder->frames_count)
+            memcpy(frames, decoder->frames, decoder->frames_count * sizeof(binding_frame_t));
+        free(decoder->frames);
+        decoder->frames = frames;
+        decoder->frames_capacity = capacity;
+    }
+    binding_frame_t *frame = &decoder->frames[decoder->frames_count++];
+    frame->is_array = is_array;
+    frame->binding = binding;
+    frame->base = base;
+    frame->field = field;
+    frame->capacity = 0;
+}
+
+static bool on_bound_container_begin(binding_decoder_t *decoder, json_element_type_t type)
+{
+    if (decoder->skipped_depth)
+    {
+        decoder->skipped_depth++;
+        return true;
+    }
+    if (!decoder->started)
+    {
+        decoder->started = true;
+        decoder->mismatch = type != json_object;
+        if (decoder->mismatch)
+            return false;
+        push_binding_frame(decoder, false, decoder->binding, decoder->root, NULL);
+        return true;
+    }
+    binding_frame_t *frame = decoder->frames_count ? &decoder->frames[decoder->frames_count - 1] : NULL;
+    const json_field_t *field = frame ? frame->field : NULL;
+    const json_binding_t *binding = NULL;
+    uint8_t *slot = get_value_slot(decoder, type, &binding);
+    if (!slot)
+    {
+        decoder->skipped_depth = 1;
+        return !decoder->mismatch;
+    }
+    if (type == json_object)
+        push_binding_frame(decoder, false, binding, slot, NULL);
+    else
+    {
+        // a repeated key replaces the items of the array
+        json_bound_array_t *array = (json_bound_array_t*)slot;
+        size_t size = get_bound_value_size(field->item_type, field->binding);
+        for (size_t k = 0; k < array->count; k++)
+            release_bound_value(field->item_type, field->binding, (uint8_t*)array->items + k * size);
+        free(array->items);
+        array->items = NULL;
+        array->count = 0;
+        push_binding_frame(decoder, true, NULL, slot, field);
+    }
+    return true;
+}
+
+static bool on_bound_container_end(binding_decoder_t *decoder)
+{
+    if (decoder->skipped_depth)
+        decoder->skipped_depth--;
+    else
+        decoder->frames_count--;
+    return true;
+}
+
+static bool on_bound_object_begin(void *context)
+{
+    return on_bound_container_begin((binding_decoder_t*)context, json_object);
+}
+
+static bool on_bound_array_begin(void *context)
+{
+    return on_bound_container_begin((binding_decoder_t*)context, json_array);
+}
+
+static bool on_bound_end(void *context)
+{
+    return on_bound_container_end((binding_decoder_t*)context);
+}
+
+static bool on_bound_key(void *context, const wide_string_t *key)
+{
+    binding_decoder_t *decoder = context;
+    if (!decoder->skipped_depth)
+    {
+        binding_frame_t *frame = &decoder->frames[decoder->frames_count - 1];
+        frame->field = find_bound_field(frame->binding, key->data, key->length);
+    }
+    return true;
+}
+
+static bool on_bound_string(void *context, const wide_string_t *value)
+{
+    binding_decoder_t *decoder = context;
+    if (decoder->skipped_depth)
+        return true;
+    const json_binding_t *binding;
+    wide_string_t **slot = (wide_string_t**)get_value_slot(decoder, json_string, &binding);
+    if (slot)
+    {
+        free(*slot);
+        *slot = duplicate_wide_string(*value);
+    }
+    return !decoder->mismatch;
+}
+
+static bool on_bound_number(void *context, const number_t *value)
+{
+    binding_decoder_t *decoder = context;
+    if (decoder->skipped_depth)
+        return true;
+    const json_binding_t *binding;
+    real_t *slot = (real_t*)get_value_slot(decoder, json_number, &binding);
+    if (slot)
+        *slot = *(const real_t*)value;
+    return !decoder->mismatch;
+}
+
+static bool on_bound_boolean(void *context, bool value)
+{
+    binding_decoder_t *decoder = context;
+    if (decoder->skipped_depth)
+        return true;
+    const json_binding_t *binding;
+    bool *slot = (bool*)get_value_slot(decoder, json_boolean, &binding);
+    if (slot)
+        *slot = value;
+    return !decoder->mismatch;
+}
+
+static bool on_bound_null(void *context)
+{
+    binding_decoder_t *decoder = context;
+    if (decoder->skipped_depth)
+        return true;
+    const json_binding_t *binding;
+    get_value_slot(decoder, json_null, &binding);
+    return !decoder->mismatch;
+}
+
+static const json_handler_t binding_handler =
+{
+    on_bound_object_begin,
+    on_bound_end,
+    on_bound_array_begin,
+    on_bound_end,
+    on_bound_key,
+    on_bound_string,
+    on_bound_number,
+    on_bound_boolean,
+    on_bound_null,
+    NULL
+};
+
+bool decode_json_struct(const json_binding_t *binding, const char *data, size_t length, void *value,
+    json_error_t *err)
+{
+    binding_decoder_t decoder;
+    decoder.binding = binding;
+    decoder.root = value;
+    decoder.frames = NULL;
+    decoder.frames_count = 0;
+    decoder.frames_capacity = 0;
+    decoder.skipped_depth = 0;
+    decoder.started = false;
+    decoder.mismatch = false;
+    memset(value, 0, binding->size);
+    json_error_t own_err;
+    if (!err)
+        err = &own_err;
+    bool result = parse_json_utf8_with_handler(data, length, &binding_handler, &decoder, err);
+    if (!result && decoder.mismatch)
+        err->type = json_value_does_not_match_binding;
+    free(decoder.frames);
+    if (!result)
+        release_json_struct(binding, value);
+    return result;
+}
@@ -0,0 +1,48 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    The compiled form of struct bindings shared by the decoder and the serializer
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "json.h"
+
+typedef struct
+{
+    json_field_t field;
+    size_t name_length;
+    size_t hash;
+} bound_field_t;
+
+/*
+    Fields are found by the hash of the key in an open addressing index;
+    the index is made large enough for the fields not to collide if possible,
+    so the lookup is mostly one probe and one comparison
+*/
+struct json_binding_t
+{
+    bound_field_t *fields;
+    size_t count;
+    size_t size;
+    uint32_t *index;
+    size_t index_mask;
+};
+
+static __inline size_t get_bound_value_size(json_element_type_t type, const json_binding_t *binding)
+{
+    switch (type)
+    {
+        case json_boolean:
+            return sizeof(bool);
+        case json_number:
+            return sizeof(real_t);
+        case json_string:
+            return sizeof(wide_string_t*);
+        case json_object:
+            return binding->size;
+        default:
+            return 0;
+    }
+}
@@ -0,0 +1,86 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    The private layout of JSON elements shared by the DOM and the serializer
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "json.h"
+
+typedef struct element_t element_t;
+typedef struct lazy_source_t lazy_source_t;
+
+typedef struct
+{
+    wide_string_t *key;
+    element_t *value;
+    size_t hash;
+} private_pair_t;
+
+/*
+    Pairs are kept in the insertion order; objects having more than a few pairs
+    also get an open addressing index that maps key hashes to pair numbers
+*/
+typedef struct
+{
+    size_t count;
+    size_t capacity;
+    private_pair_t *pairs;
+    uint32_t *index;
+    size_t index_mask;
+    json_arena_t *arena;
+    json_key_table_t *keys;
+    const lazy_source_t *lazy;
+    size_t lazy_begin;
+} private_object_data_t;
+
+typedef struct
+{
+    size_t count;
+    size_t capacity;
+    element_t **items;
+    json_arena_t *arena;
+    const lazy_source_t *lazy;
+    size_t lazy_begin;
+} private_array_data_t;
+
+struct element_t
+{
+    json_element_type_t type;
+    const json_element_t *parent;
+    union
+    {
+        private_object_data_t *object;
+        private_array_data_t *array;
+        wide_string_t *string_value;
+        number_t *num_value;
+        bool bool_value;
+    } data;
+};
+
+/*
+    A number parsed in the raw mode keeps its literal, which is converted
+    on the first access and written back unchanged by the serializer
+*/
+typedef struct
+{
+    number_t value;
+    const char *literal;
+    size_t length;
+    bool converted;
+} private_number_data_t;
+
+/*
+    A container of a lazy document that has not been reached yet keeps
+    the position of its text and has no items until it is expanded
+*/
+void expand_lazy_container(element_t *elem);
+
+static __inline void expand_element(element_t *elem)
+{
+    if ((elem->type == json_object && elem->data.object->lazy)
+        || (elem->type == json_array && elem->data.array->lazy))
+        expand_lazy_container(elem);
+}
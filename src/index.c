@@ -0,0 +1,170 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    The structural index: the first stage of the parallel parser
+*/
+
+#include <string.h>
+#include "index.h"
+#include "allocator.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+    #define INDEX_SSE2
+    #include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
+
+/*
+    The text is processed in blocks of 64 bytes, each class of characters
+    of a block is represented by a 64-bit mask
+*/
+typedef struct
+{
+    uint64_t quotes;
+    uint64_t backslashes;
+    uint64_t operators;
+} block_masks_t;
+
+static __inline unsigned int count_trailing_zeros(uint64_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return (unsigned int)index;
+#else
+    return (unsigned int)__builtin_ctzll(mask);
+#endif
+}
+
+#ifdef INDEX_SSE2
+
+static __inline uint64_t get_lane_mask(__m128i v, char c)
+{
+    return (uint64_t)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+
+static void classify_block(const uint8_t *block, block_masks_t *masks)
+{
+    masks->quotes = 0;
+    masks->backslashes = 0;
+    masks->operators = 0;
+    for (int k = 0; k < 4; k++)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(block + k * 16));
+        uint64_t operators = get_lane_mask(v, '[') | get_lane_mask(v, ']') | get_lane_mask(v, '{')
+            | get_lane_mask(v, '}') | get_lane_mask(v, ',') | get_lane_mask(v, ':');
+        masks->quotes |= get_lane_mask(v, '"') << (k * 16);
+        masks->backslashes |= get_lane_mask(v, '\\') << (k * 16);
+        masks->operators |= operators << (k * 16);
+    }
+}
+
+#else
+
+static void classify_block(const uint8_t *block, block_masks_t *masks)
+{
+    masks->quotes = 0;
+    masks->backslashes = 0;
+    masks->operators = 0;
+    for (int i = 0; i < 64; i++)
+    {
+        uint8_t c = block[i];
+        uint64_t bit = (uint64_t)1 << i;
+        if (c == '"')
+            masks->quotes |= bit;
+        else if (c == '\\')
+            masks->backslashes |= bit;
+        else if (c == '[' || c == ']' || c == '{' || c == '}' || c == ',' || c == ':')
+            masks->operators |= bit;
+    }
+}
+
+#endif
+
+static __inline uint64_t prefix_xor(uint64_t mask)
+{
+    mask ^= mask << 1;
+    mask ^= mask << 2;
+    mask ^= mask << 4;
+    mask ^= mask << 8;
+    mask ^= mask << 16;
+    mask ^= mask << 32;
+    return mask;
+}
+
+/*
+    Marks characters that follow an odd number of backslashes; 'carry' tells
+    whether the previous block ended with such a backslash
+*/
+static __inline uint64_t find_escaped_chars(uint64_t backslashes, uint64_t *carry)
+{
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    backslashes &= ~*carry;
+    uint64_t follows_escape = (backslashes << 1) | *carry;
+    uint64_t odd_starts = backslashes & ~even_bits & ~follows_escape;
+    uint64_t even_sequences = odd_starts + backslashes;
+    *carry = even_sequences < backslashes ? 1 : 0;
+    uint64_t invert_mask = even_sequences << 1;
+    return (even_bits ^ invert_mask) & follows_escape;
+}
+
+bool build_structural_index(const uint8_t *data, size_t length, structural_index_t *index)
+{
+    index->positions = NULL;
+    index->count = 0;
+    if (length > UINT32_MAX)
+        return false;
+    size_t capacity = length / 8 + 64;
+    uint32_t *positions = nnalloc(capacity * sizeof(uint32_t));
+    size_t count = 0;
+    uint64_t escape_carry = 0;
+    uint64_t in_string_carry = 0;
+    uint8_t tail[64];
+    for (size_t offset = 0; offset < length; offset += 64)
+    {
+        const uint8_t *block = data + offset;
+        if (length - offset < 64)
+        {
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, block, length - offset);
+            block = tail;
+        }
+        block_masks_t masks;
+        classify_block(block, &masks);
+        uint64_t quotes = masks.quotes & ~find_escaped_chars(masks.backslashes, &escape_carry);
+        uint64_t in_string = prefix_xor(quotes) ^ in_string_carry;
+        in_string_carry = (uint64_t)((int64_t)in_string >> 63);
+        uint64_t structurals = (masks.operators & ~in_string) | quotes;
+        if (count + 64 > capacity)
+        {
+            uint32_t *bigger = nnalloc(capacity * 2 * sizeof(uint32_t));
+            memcpy(bigger, positions, count * sizeof(uint32_t));
+            free(positions);
+            positions = bigger;
+            capacity *= 2;
+        }
+        while (structurals)
+        {
+            positions[count++] = (uint32_t)(offset + count_trailing_zeros(structurals));
+            structurals &= structurals - 1;
+        }
+    }
+    if (in_string_carry)
+    {
+        free(positions);
+        return false;
+    }
+    index->positions = positions;
+    index->count = count;
+    return true;
+}
+
+void release_structural_index(structural_index_t *index)
+{
+    free(index->positions);
+    index->positions = NULL;
+    index->count = 0;
+}
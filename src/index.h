@@ -0,0 +1,27 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    The structural index: the first stage of the parallel parser
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Positions of the quotation marks that open and close strings, and of
+    the brackets, commas and colons outside strings, in ascending order
+*/
+typedef struct
+{
+    uint32_t *positions;
+    size_t count;
+} structural_index_t;
+
+/*
+    Fails for text longer than 4 GB and for text that ends inside a string
+*/
+bool build_structural_index(const uint8_t *data, size_t length, structural_index_t *index);
+void release_structural_index(structural_index_t *index);
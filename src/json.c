@@ -5,34 +5,194 @@
 */
 
 #include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <wchar.h>
 #include "json.h"
 #include "allocator.h"
-#include "tree_map.h"
-#include "vector.h"
+#include "parser.h"
+#include "number.h"
+#include "element.h"
+#include "mapping.h"
+#include "index.h"
+#include "threads.h"
+#include "binary.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 typedef struct
 {
-    tree_map_t base;
-} private_object_data_t;
+    json_element_t *root;
+    json_arena_t *arena;
+    file_mapping_t mapping;
+    json_arena_t **worker_arenas;
+    size_t worker_arenas_count;
+} private_document_t;
+
+// --- memory -----------------------------------------------------------------
+
+#ifdef _MSC_VER
+#define thread_local_variable __declspec(thread)
+#else
+#define thread_local_variable _Thread_local
+#endif
+
+/*
+    Set while a parse with statistics runs on the thread, so that building
+    elements without them costs one check per allocation
+*/
+static thread_local_variable json_parse_stats_t *allocation_stats = NULL;
+
+static __inline void * alloc_memory(json_arena_t *arena, size_t size)
+{
+    if (allocation_stats)
+    {
+        allocation_stats->allocations++;
+        allocation_stats->allocated_bytes += size;
+    }
+    return arena ? alloc_from_json_arena(arena, size) : nnalloc(size);
+}
+
+static __inline void free_memory(json_arena_t *arena, void *ptr)
+{
+    if (!arena)
+        free(ptr);
+}
+
+static void * grow_memory(json_arena_t *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    void *new_ptr = alloc_memory(arena, new_size);
+    if (old_size)
+        memcpy(new_ptr, ptr, old_size);
+    free_memory(arena, ptr);
+    return new_ptr;
+}
+
+static wide_string_t * create_wide_string_in_memory(json_arena_t *arena, const wchar_t *data, size_t length)
+{
+    wide_string_t *str = alloc_memory(arena, sizeof(wide_string_t) + (length + 1) * sizeof(wchar_t));
+    str->data = (wchar_t*)(str + 1);
+    str->length = length;
+    if (length)
+        memcpy(str->data, data, length * sizeof(wchar_t));
+    str->data[length] = L'\0';
+    return str;
+}
+
+// --- key table --------------------------------------------------------------
 
 typedef struct
 {
-    vector_t base;
-} private_array_data_t;
+    wide_string_t key;
+    size_t hash;
+} key_table_entry_t;
+
+struct json_key_table_t
+{
+    json_arena_t *arena;
+    key_table_entry_t **slots;
+    size_t count;
+    size_t mask;
+};
+
+static __inline size_t hash_wide_chars(const wchar_t *data, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (uint64_t)data[i]) * 1099511628211ULL;
+    return (size_t)(hash ^ (hash >> 32));
+}
+
+json_key_table_t * create_json_key_table()
+{
+    json_key_table_t *table = nnalloc(sizeof(json_key_table_t));
+    table->arena = create_json_arena(0);
+    table->count = 0;
+    table->mask = 255;
+    table->slots = nnalloc((table->mask + 1) * sizeof(key_table_entry_t*));
+    memset(table->slots, 0, (table->mask + 1) * sizeof(key_table_entry_t*));
+    return table;
+}
+
+void destroy_json_key_table(json_key_table_t *table)
+{
+    if (table)
+    {
+        destroy_json_arena(table->arena);
+        free(table->slots);
+        free(table);
+    }
+}
+
+/*
+    Forgets all the keys but keeps the memory of the table, which is taken
+    again by the keys of the following documents
+*/
+static void clear_json_key_table(json_key_table_t *table)
+{
+    reset_json_arena(table->arena);
+    memset(table->slots, 0, (table->mask + 1) * sizeof(key_table_entry_t*));
+    table->count = 0;
+}
+
+static void grow_json_key_table(json_key_table_t *table)
+{
+    size_t size = (table->mask + 1) * 2;
+    key_table_entry_t **slots = nnalloc(size * sizeof(key_table_entry_t*));
+    memset(slots, 0, size * sizeof(key_table_entry_t*));
+    for (size_t i = 0; i <= table->mask; i++)
+    {
+        key_table_entry_t *entry = table->slots[i];
+        if (entry)
+        {
+            size_t slot = entry->hash & (size - 1);
+            while (slots[slot])
+                slot = (slot + 1) & (size - 1);
+            slots[slot] = entry;
+        }
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->mask = size - 1;
+}
 
-typedef struct 
+static wide_string_t * intern_key(json_key_table_t *table, const wchar_t *data, size_t length, size_t hash)
 {
-    json_element_type_t type;
-    const json_element_t *parent;
-    union 
+    size_t slot = hash & table->mask;
+    key_table_entry_t *entry;
+    while ((entry = table->slots[slot]) != NULL)
     {
-        private_object_data_t *object;
-        private_array_data_t *array;
-        wide_string_t *string_value;
-        number_t *num_value;
-        bool bool_value;;
-    } data;
-} element_t;
+        if (entry->hash == hash && entry->key.length == length
+                && memcmp(entry->key.data, data, length * sizeof(wchar_t)) == 0)
+            return &entry->key;
+        slot = (slot + 1) & table->mask;
+    }
+    entry = alloc_from_json_arena(table->arena, sizeof(key_table_entry_t) + (length + 1) * sizeof(wchar_t));
+    entry->key.data = (wchar_t*)(entry + 1);
+    entry->key.length = length;
+    if (length)
+        memcpy(entry->key.data, data, length * sizeof(wchar_t));
+    entry->key.data[length] = L'\0';
+    entry->hash = hash;
+    table->slots[slot] = entry;
+    if (++table->count * 2 > table->mask + 1)
+        grow_json_key_table(table);
+    return &entry->key;
+}
+
+static __inline size_t get_interned_key_hash(const wide_string_t *key)
+{
+    return ((const key_table_entry_t*)key)->hash;
+}
+
+size_t get_json_key_table_size(const json_key_table_t *table)
+{
+    return table->count;
+}
 
 // --- destructor -------------------------------------------------------------
 
@@ -64,21 +224,35 @@ static void json_null_destructor(element_t *elem)
 static void json_object_destructor(element_t *elem)
 {
     assert(elem->type == json_object);
-    destroy_tree_map_and_content(&elem->data.object->base, free, (void*)destroy_json_element);
+    private_object_data_t *object = elem->data.object;
+    assert(object->arena == NULL);
+    for (size_t i = 0; i < object->count; i++)
+    {
+        if (!object->keys)
+            free(object->pairs[i].key);
+        destructors[object->pairs[i].value->type](object->pairs[i].value);
+    }
+    free(object->pairs);
+    free(object->index);
     free(elem);
 }
 
 static void json_array_destructor(element_t *elem)
 {
     assert(elem->type == json_array);
-    destroy_vector_and_content(&elem->data.array->base, (void*)destroy_json_element);
+    private_array_data_t *array = elem->data.array;
+    assert(array->arena == NULL);
+    for (size_t i = 0; i < array->count; i++)
+        destructors[array->items[i]->type](array->items[i]);
+    free(array->items);
     free(elem);
 }
 
 static void json_string_destructor(element_t *elem)
 {
     assert(elem->type == json_string);
-    free(elem->data.string_value);
+    if (elem->data.string_value != (wide_string_t*)(elem + 1))
+        free(elem->data.string_value);
     free(elem);
 }
 
@@ -103,17 +277,19 @@ void destroy_json_element(const json_element_base_t *iface)
 
 // --- null constructors ------------------------------------------------------
 
-static __inline element_t * instantiate_json_null()
+static __inline element_t * instantiate_json_null(json_arena_t *arena)
 {
-    element_t *elem = nnalloc(sizeof(element_t));
+    element_t *elem = alloc_memory(arena, sizeof(element_t));
     elem->type = json_null;
     elem->data.object = NULL;
     return elem;
 }
 
+static void add_element_to_array(element_t *this, element_t *elem);
+
 json_null_t * create_json_null()
 {
-    element_t *elem = instantiate_json_null();
+    element_t *elem = instantiate_json_null(NULL);
     elem->parent = NULL;
     return (json_null_t*)elem;
 }
@@ -121,76 +297,356 @@ json_null_t * create_json_null()
 json_null_t * create_json_null_at_end_of_array(json_array_t *iface)
 {
     element_t *this = (element_t*)iface;
-    element_t *elem = instantiate_json_null();
-    elem->parent = (json_element_t*)iface;
-    add_item_to_vector(&this->data.array->base, elem);
+    element_t *elem = instantiate_json_null(this->data.array->arena);
+    add_element_to_array(this, elem);
     return (json_null_t*)elem;
 }
 
 // --- object constructors ----------------------------------------------------
 
-static __inline element_t * instantiate_json_object()
+static __inline element_t * instantiate_json_object(json_arena_t *arena, size_t capacity)
 {
-    element_t *elem = nnalloc(sizeof(element_t));
+    element_t *elem = alloc_memory(arena, sizeof(element_t) + sizeof(private_object_data_t));
+    private_object_data_t *object = (private_object_data_t*)(elem + 1);
     elem->type = json_object;
-    elem->data.object = (private_object_data_t*)create_tree_map((void*)compare_wide_strings);
+    elem->data.object = object;
+    object->count = 0;
+    object->capacity = capacity;
+    object->pairs = capacity ? alloc_memory(arena, capacity * sizeof(private_pair_t)) : NULL;
+    object->index = NULL;
+    object->index_mask = 0;
+    object->arena = arena;
+    object->keys = NULL;
+    object->lazy = NULL;
+    object->lazy_begin = 0;
     return elem;
 }
 
 json_object_t * create_json_object()
 {
-    element_t *elem = instantiate_json_object();
+    element_t *elem = instantiate_json_object(NULL, 0);
     elem->parent = NULL;
     return (json_object_t*)elem;
 }
 
 // --- object methods ---------------------------------------------------------
 
+#define object_index_threshold 8
+#define pair_not_found ((size_t)-1)
+
+static __inline bool is_same_key(const private_pair_t *pair, size_t hash, const wchar_t *data, size_t length)
+{
+    // interned keys are the same instance, so the characters are compared only for foreign keys
+    return pair->hash == hash && (pair->key->data == data || (pair->key->length == length
+        && memcmp(pair->key->data, data, length * sizeof(wchar_t)) == 0));
+}
+
+static __inline void add_pair_to_object_index(private_object_data_t *object, size_t number)
+{
+    size_t slot = object->pairs[number].hash & object->index_mask;
+    while (object->index[slot])
+        slot = (slot + 1) & object->index_mask;
+    object->index[slot] = (uint32_t)(number + 1);
+}
+
+static void rebuild_object_index(private_object_data_t *object, size_t expected_count)
+{
+    size_t size = 16;
+    while (size < expected_count * 2)
+        size *= 2;
+    free_memory(object->arena, object->index);
+    object->index = alloc_memory(object->arena, size * sizeof(uint32_t));
+    memset(object->index, 0, size * sizeof(uint32_t));
+    object->index_mask = size - 1;
+    for (size_t i = 0; i < object->count; i++)
+        add_pair_to_object_index(object, i);
+}
+
+static size_t find_pair_in_object(const private_object_data_t *object, size_t hash, const wchar_t *data, size_t length)
+{
+    if (!object->index)
+    {
+        for (size_t i = 0; i < object->count; i++)
+        {
+            if (is_same_key(&object->pairs[i], hash, data, length))
+                return i;
+        }
+        return pair_not_found;
+    }
+    size_t slot = hash & object->index_mask;
+    while (object->index[slot])
+    {
+        size_t number = object->index[slot] - 1;
+        if (is_same_key(&object->pairs[number], hash, data, length))
+            return number;
+        slot = (slot + 1) & object->index_mask;
+    }
+    return pair_not_found;
+}
+
+static void append_pair_to_object(private_object_data_t *object, wide_string_t *key, size_t hash, element_t *value)
+{
+    if (object->count == object->capacity)
+    {
+        size_t capacity = object->capacity ? object->capacity * 2 : 4;
+        object->pairs = grow_memory(object->arena, object->pairs,
+            object->count * sizeof(private_pair_t), capacity * sizeof(private_pair_t));
+        object->capacity = capacity;
+    }
+    size_t number = object->count++;
+    object->pairs[number].key = key;
+    object->pairs[number].value = value;
+    object->pairs[number].hash = hash;
+    if (object->index)
+    {
+        if (object->count * 2 > object->index_mask + 1)
+            rebuild_object_index(object, object->count);
+        else
+            add_pair_to_object_index(object, number);
+    }
+    else if (object->count > object_index_threshold)
+        rebuild_object_index(object, object->count);
+}
+
+/*
+    The slot of the pair is cleared by shifting back the entries of its probe
+    sequence, and the numbers of the following pairs are decreased in place
+*/
+static void remove_pair_from_object(private_object_data_t *object, size_t number)
+{
+    if (object->index)
+    {
+        size_t mask = object->index_mask;
+        size_t slot = object->pairs[number].hash & mask;
+        while (object->index[slot] != number + 1)
+            slot = (slot + 1) & mask;
+        size_t next = slot;
+        while (true)
+        {
+            next = (next + 1) & mask;
+            if (!object->index[next])
+                break;
+            size_t home = object->pairs[object->index[next] - 1].hash & mask;
+            // the entry stays if its home lies cyclically between the free slot and its position
+            if (((next - home) & mask) >= ((next - slot) & mask))
+            {
+                object->index[slot] = object->index[next];
+                slot = next;
+            }
+        }
+        object->index[slot] = 0;
+        for (size_t i = 0; i <= mask; i++)
+        {
+            if (object->index[i] > number + 1)
+                object->index[i]--;
+        }
+    }
+    memmove(&object->pairs[number], &object->pairs[number + 1],
+        (object->count - number - 1) * sizeof(private_pair_t));
+    object->count--;
+}
+
+json_object_t * create_json_object_with_capacity(size_t capacity)
+{
+    element_t *elem = instantiate_json_object(NULL, capacity);
+    elem->parent = NULL;
+    // the index is sized for all the pairs at once instead of being rebuilt as they come
+    if (capacity > object_index_threshold)
+        rebuild_object_index(elem->data.object, capacity);
+    return (json_object_t*)elem;
+}
+
+static void add_pair_with_length_to_object(element_t *this, const wchar_t *key, size_t length, element_t *value)
+{
+    private_object_data_t *object = this->data.object;
+    size_t hash = hash_wide_chars(key, length);
+    size_t number = find_pair_in_object(object, hash, key, length);
+    value->parent = (json_element_t*)this;
+    if (number != pair_not_found)
+    {
+        element_t *old_value = object->pairs[number].value;
+        object->pairs[number].value = value;
+        if (!object->arena)
+            destructors[old_value->type](old_value);
+        return;
+    }
+    append_pair_to_object(object, object->keys ? intern_key(object->keys, key, length, hash)
+        : create_wide_string_in_memory(object->arena, key, length), hash, value);
+}
+
+static void add_pair_to_object(element_t *this, const wchar_t *key, element_t *value)
+{
+    add_pair_with_length_to_object(this, key, wcslen(key), value);
+}
+
+/*
+    The key is taken as it is if the object owns its keys on the heap,
+    otherwise it is interned or copied into the arena and released
+*/
+static void add_pair_with_taken_key_to_object(element_t *this, wide_string_t *key, element_t *value)
+{
+    private_object_data_t *object = this->data.object;
+    size_t hash = hash_wide_chars(key->data, key->length);
+    size_t number = find_pair_in_object(object, hash, key->data, key->length);
+    value->parent = (json_element_t*)this;
+    if (number != pair_not_found)
+    {
+        element_t *old_value = object->pairs[number].value;
+        object->pairs[number].value = value;
+        if (!object->arena)
+            destructors[old_value->type](old_value);
+        free(key);
+        return;
+    }
+    wide_string_t *own_key = key;
+    if (object->keys)
+        own_key = intern_key(object->keys, key->data, key->length, hash);
+    else if (object->arena)
+        own_key = create_wide_string_in_memory(object->arena, key->data, key->length);
+    if (own_key != key)
+        free(key);
+    append_pair_to_object(object, own_key, hash, value);
+}
+
 json_pair_t * get_pair_from_json_object(const json_object_data_t *iface, const wchar_t *key)
 {
     private_object_data_t *object = (private_object_data_t*)iface;
-    wide_string_t key_w = _W(key);
-    return (json_pair_t*)get_pair_from_tree_map(&object->base, &key_w);
+    size_t length = wcslen(key);
+    size_t number = find_pair_in_object(object, hash_wide_chars(key, length), key, length);
+    if (number == pair_not_found)
+        return NULL;
+    expand_element(object->pairs[number].value);
+    return (json_pair_t*)&object->pairs[number];
+}
+
+json_pair_t * get_pair_by_index_from_json_object(const json_object_data_t *iface, size_t index)
+{
+    private_object_data_t *object = (private_object_data_t*)iface;
+    if (index >= object->count)
+        return NULL;
+    expand_element(object->pairs[index].value);
+    return (json_pair_t*)&object->pairs[index];
 }
 
 // --- array constructors -----------------------------------------------------
 
-static __inline element_t * instantiate_json_array()
+static __inline element_t * instantiate_json_array(json_arena_t *arena, size_t capacity)
 {
-    element_t *elem = nnalloc(sizeof(element_t));
+    element_t *elem = alloc_memory(arena, sizeof(element_t) + sizeof(private_array_data_t));
+    private_array_data_t *array = (private_array_data_t*)(elem + 1);
     elem->type = json_array;
-    elem->data.array = (private_array_data_t*)create_vector();
+    elem->data.array = array;
+    array->count = 0;
+    array->capacity = capacity;
+    array->items = capacity ? alloc_memory(arena, capacity * sizeof(element_t*)) : NULL;
+    array->arena = arena;
+    array->lazy = NULL;
+    array->lazy_begin = 0;
     return elem;
 }
 
 json_array_t * create_json_array()
 {
-    element_t *elem = instantiate_json_array();
+    element_t *elem = instantiate_json_array(NULL, 0);
+    elem->parent = NULL;
+    return (json_array_t*)elem;
+}
+
+json_array_t * create_json_array_with_capacity(size_t capacity)
+{
+    element_t *elem = instantiate_json_array(NULL, capacity);
     elem->parent = NULL;
     return (json_array_t*)elem;
 }
 
 // --- array methods ----------------------------------------------------------
 
+static void reserve_array_items(private_array_data_t *array, size_t count)
+{
+    if (array->count + count <= array->capacity)
+        return;
+    size_t capacity = array->capacity ? array->capacity * 2 : 4;
+    if (capacity < array->count + count)
+        capacity = array->count + count;
+    array->items = grow_memory(array->arena, array->items,
+        array->count * sizeof(element_t*), capacity * sizeof(element_t*));
+    array->capacity = capacity;
+}
+
+static void add_element_to_array(element_t *this, element_t *elem)
+{
+    private_array_data_t *array = this->data.array;
+    if (array->count == array->capacity)
+        reserve_array_items(array, 1);
+    array->items[array->count++] = elem;
+    elem->parent = (json_element_t*)this;
+}
+
+void reserve_json_array_capacity(json_array_t *iface, size_t capacity)
+{
+    private_array_data_t *array = ((element_t*)iface)->data.array;
+    if (capacity > array->count)
+        reserve_array_items(array, capacity - array->count);
+}
+
 json_element_t * get_element_from_json_array(const json_array_data_t *iface, size_t index)
 {
     private_array_data_t *array = (private_array_data_t*)iface;
-    return (json_element_t*)get_vector_item(&array->base, index);
+    if (index >= array->count)
+        return NULL;
+    expand_element(array->items[index]);
+    return (json_element_t*)array->items[index];
 }
 
 // --- string constructors ----------------------------------------------------
 
-static __inline element_t * instantiate_json_string(const wchar_t *value)
+/*
+    The characters are stored inline, right after the element, so a string
+    costs a single allocation; only a string taken from the caller lives
+    in a block of its own
+*/
+static __inline element_t * instantiate_json_string_with_chars(json_arena_t *arena,
+    const wchar_t *data, size_t length)
+{
+    element_t *elem = alloc_memory(arena, sizeof(element_t) + sizeof(wide_string_t)
+        + (length + 1) * sizeof(wchar_t));
+    wide_string_t *str = (wide_string_t*)(elem + 1);
+    elem->type = json_string;
+    elem->data.string_value = str;
+    str->data = (wchar_t*)(str + 1);
+    str->length = length;
+    if (length)
+        memcpy(str->data, data, length * sizeof(wchar_t));
+    str->data[length] = L'\0';
+    return elem;
+}
+
+static __inline element_t * instantiate_json_string(json_arena_t *arena, const wchar_t *value)
+{
+    return instantiate_json_string_with_chars(arena, value, wcslen(value));
+}
+
+/*
+    Elements on the heap keep the taken string, ones in an arena get a copy
+    and the string is released at once
+*/
+static __inline element_t * instantiate_json_string_taking(json_arena_t *arena, wide_string_t *value)
 {
-    element_t *elem = nnalloc(sizeof(element_t));
+    if (arena)
+    {
+        element_t *elem = instantiate_json_string_with_chars(arena, value->data, value->length);
+        free(value);
+        return elem;
+    }
+    element_t *elem = alloc_memory(NULL, sizeof(element_t));
     elem->type = json_string;
-    elem->data.string_value = duplicate_wide_string(_W(value));
+    elem->data.string_value = value;
     return elem;
 }
 
 json_string_t * create_json_string(const wchar_t *value)
 {
-    element_t *elem = instantiate_json_string(value);
+    element_t *elem = instantiate_json_string(NULL, value);
     elem->parent = NULL;
     return (json_string_t*)elem;
 }
@@ -198,35 +654,85 @@ json_string_t * create_json_string(const wchar_t *value)
 json_string_t * create_json_string_owned_by_object(json_object_t *iface, const wchar_t *key, const wchar_t *value)
 {
     element_t *this = (element_t*)iface;
-    wide_string_t *key_copy = duplicate_wide_string(_W(key));
-    element_t *new_elem = instantiate_json_string(value);
-    new_elem->parent = (json_element_t*)this;
-    json_element_t *old_elem = (json_element_t*)add_pair_to_tree_map(&this->data.object->base, key_copy, new_elem);
-    if (old_elem)
-    {
-        free(key_copy);
-        destroy_json_element(&old_elem->base);
-    }
-    return (json_string_t*)new_elem;
+    element_t *elem = instantiate_json_string(this->data.object->arena, value);
+    add_pair_to_object(this, key, elem);
+    return (json_string_t*)elem;
 }
 
 json_string_t * create_json_string_at_end_of_array(json_array_t *iface, const wchar_t *value)
 {
     element_t *this = (element_t*)iface;
-    element_t *elem = instantiate_json_string(value);
-    elem->parent = (json_element_t*)this;
-    add_item_to_vector(&this->data.array->base, elem);
+    element_t *elem = instantiate_json_string(this->data.array->arena, value);
+    add_element_to_array(this, elem);
+    return (json_string_t*)elem;
+}
+
+json_string_t * create_json_string_taking(wide_string_t *value)
+{
+    element_t *elem = instantiate_json_string_taking(NULL, value);
+    elem->parent = NULL;
+    return (json_string_t*)elem;
+}
+
+json_string_t * create_json_string_taking_owned_by_object(json_object_t *iface, wide_string_t *key,
+    wide_string_t *value)
+{
+    element_t *this = (element_t*)iface;
+    element_t *elem = instantiate_json_string_taking(this->data.object->arena, value);
+    add_pair_with_taken_key_to_object(this, key, elem);
+    return (json_string_t*)elem;
+}
+
+json_string_t * create_json_string_taking_at_end_of_array(json_array_t *iface, wide_string_t *value)
+{
+    element_t *this = (element_t*)iface;
+    element_t *elem = instantiate_json_string_taking(this->data.array->arena, value);
+    add_element_to_array(this, elem);
     return (json_string_t*)elem;
 }
 
+void append_json_strings_to_array(json_array_t *iface, const wchar_t * const *values, size_t count)
+{
+    element_t *this = (element_t*)iface;
+    private_array_data_t *array = this->data.array;
+    reserve_array_items(array, count);
+    for (size_t i = 0; i < count; i++)
+    {
+        element_t *elem = instantiate_json_string(array->arena, values[i]);
+        elem->parent = (json_element_t*)this;
+        array->items[array->count++] = elem;
+    }
+}
+
 // --- number constructors ----------------------------------------------------
 
-static __inline element_t * instantiate_json_number(number_t *value)
+static __inline element_t * instantiate_json_number(json_arena_t *arena, const number_t *value)
+{
+    element_t *elem = alloc_memory(arena, sizeof(element_t) + sizeof(private_number_data_t));
+    private_number_data_t *num = (private_number_data_t*)(elem + 1);
+    elem->type = json_number;
+    elem->data.num_value = &num->value;
+    memcpy(&num->value, value, sizeof(number_t));
+    num->literal = NULL;
+    num->length = 0;
+    num->converted = true;
+    return elem;
+}
+
+static __inline element_t * instantiate_json_raw_number(json_arena_t *arena, const char *text, size_t length)
 {
-    element_t *elem = nnalloc(sizeof(element_t) + sizeof(number_t));
+    element_t *elem = alloc_memory(arena, sizeof(element_t) + sizeof(private_number_data_t) + length + 1);
+    private_number_data_t *num = (private_number_data_t*)(elem + 1);
+    char *literal = (char*)(num + 1);
     elem->type = json_number;
-    elem->data.num_value = (number_t*)(elem + 1);
-    memcpy(elem->data.num_value, value, sizeof(number_t));
+    elem->data.num_value = &num->value;
+    memcpy(literal, text, length);
+    literal[length] = '\0';
+    // the public value reads as NaN until the literal is converted
+    init_number_by_real(&num->value, (real_t)NAN);
+    num->literal = literal;
+    num->length = length;
+    num->converted = false;
     return elem;
 }
 
@@ -234,7 +740,7 @@ json_number_t * create_json_number(real_t value)
 {
     number_t num;
     init_number_by_real(&num, value);
-    element_t *elem = instantiate_json_number(&num);
+    element_t *elem = instantiate_json_number(NULL, &num);
     elem->parent = NULL;
     return (json_number_t*)elem;
 }
@@ -244,17 +750,67 @@ json_number_t * create_json_number_at_end_of_array(json_array_t *iface, real_t v
     element_t *this = (element_t*)iface;
     number_t num;
     init_number_by_real(&num, value);
-    element_t *elem = instantiate_json_number(&num);
-    elem->parent = (json_element_t*)iface;
-    add_item_to_vector(&this->data.array->base, elem);
+    element_t *elem = instantiate_json_number(this->data.array->arena, &num);
+    add_element_to_array(this, elem);
     return (json_number_t*)elem;
 }
 
+void append_json_numbers_to_array(json_array_t *iface, const real_t *values, size_t count)
+{
+    element_t *this = (element_t*)iface;
+    private_array_data_t *array = this->data.array;
+    reserve_array_items(array, count);
+    for (size_t i = 0; i < count; i++)
+    {
+        number_t num;
+        init_number_by_real(&num, values[i]);
+        element_t *elem = instantiate_json_number(array->arena, &num);
+        elem->parent = (json_element_t*)this;
+        array->items[array->count++] = elem;
+    }
+}
+
+static __inline element_t * instantiate_json_borrowed_number(json_arena_t *arena, const char *text, size_t length)
+{
+    element_t *elem = alloc_memory(arena, sizeof(element_t) + sizeof(private_number_data_t));
+    private_number_data_t *num = (private_number_data_t*)(elem + 1);
+    elem->type = json_number;
+    elem->data.num_value = &num->value;
+    init_number_by_real(&num->value, (real_t)NAN);
+    num->literal = text;
+    num->length = length;
+    num->converted = false;
+    return elem;
+}
+
+const real_t * get_value_from_json_number(const json_number_t *iface)
+{
+    element_t *this = (element_t*)iface;
+    private_number_data_t *num = (private_number_data_t*)this->data.num_value;
+    if (!num->converted)
+    {
+        bool neg = num->literal[0] == '-';
+        if (!decode_json_number(num->literal + neg, num->length - neg, neg, &num->value))
+            init_number_by_real(&num->value, 0);
+        num->converted = true;
+    }
+    return (const real_t*)&num->value;
+}
+
+const char * get_literal_from_json_number(const json_number_t *iface, size_t *length)
+{
+    element_t *this = (element_t*)iface;
+    private_number_data_t *num = (private_number_data_t*)this->data.num_value;
+    if (length)
+        *length = num->length;
+    return num->literal;
+}
+
 // --- boolean constructors ---------------------------------------------------
 
-static __inline element_t * instantiate_json_boolean(bool value)
+static __inline element_t * instantiate_json_boolean(json_arena_t *arena, bool value)
 {
-    element_t *elem = nnalloc(sizeof(element_t));
+    element_t *elem = alloc_memory(arena, sizeof(element_t));
     elem->type = json_boolean;
     elem->data.bool_value = value;
     return elem;
@@ -262,7 +818,7 @@ static __inline element_t * instantiate_json_boolean(bool value)
 
 json_boolean_t * create_json_boolean(bool value)
 {
-    element_t *elem = instantiate_json_boolean(value);
+    element_t *elem = instantiate_json_boolean(NULL, value);
     elem->parent = NULL;
     return (json_boolean_t*)elem;
 }
@@ -270,632 +826,2265 @@ json_boolean_t * create_json_boolean(bool value)
 json_boolean_t * create_json_boolean_at_end_of_array(json_array_t *iface, bool value)
 {
     element_t *this = (element_t*)iface;
-    element_t *elem = instantiate_json_boolean(value);
-    elem->parent = (json_element_t*)iface;
-    add_item_to_vector(&this->data.array->base, elem);
+    element_t *elem = instantiate_json_boolean(this->data.array->arena, value);
+    add_element_to_array(this, elem);
     return (json_boolean_t*)elem;
 }
 
-// --- stringify (to simple string) -------------------------------------------
+// --- paths ------------------------------------------------------------------
 
-typedef wide_string_builder_t * (*simple_string_builder_t)(element_t *elem, wide_string_builder_t *builder);
+#define no_array_index ((size_t)-1)
 
-static wide_string_builder_t * json_null_to_simple_string(element_t *elem, wide_string_builder_t *builder);
-static wide_string_builder_t * json_object_to_simple_string(element_t *elem, wide_string_builder_t *builder);
-static wide_string_builder_t * json_array_to_simple_string(element_t *elem, wide_string_builder_t *builder);
-static wide_string_builder_t * json_string_to_simple_string(element_t *elem, wide_string_builder_t *builder);
-static wide_string_builder_t * json_number_to_simple_string(element_t *elem, wide_string_builder_t *builder);
-static wide_string_builder_t * json_boolean_to_simple_string(element_t *elem, wide_string_builder_t *builder);
+typedef struct
+{
+    wide_string_t *key;
+    size_t hash;
+    size_t index;
+} path_step_t;
 
-static simple_string_builder_t simple_string_builders[] =
+struct json_path_t
 {
-    json_null_to_simple_string,
-    json_object_to_simple_string,
-    json_array_to_simple_string,
-    json_string_to_simple_string,
-    json_number_to_simple_string,
-    json_boolean_to_simple_string
+    path_step_t *steps;
+    size_t count;
+    json_key_table_t *keys;
 };
 
-static wide_string_builder_t * json_null_to_simple_string(element_t *elem, wide_string_builder_t *builder)
+/*
+    The paths of a set are merged into a tree by their common prefixes,
+    so each prefix is resolved once; node 0 stands for the root
+*/
+typedef struct
+{
+    path_step_t step;
+    size_t first_child;
+    size_t next_sibling;
+    size_t first_path;
+} path_node_t;
+
+struct json_path_set_t
 {
-    assert(elem->type == json_null);
-    return append_wide_string(builder, __W(L"null"));
-}
+    path_node_t *nodes;
+    size_t nodes_count;
+    size_t nodes_capacity;
+    size_t *next_path;
+    size_t count;
+    json_key_table_t *keys;
+};
 
-static wide_string_builder_t * json_object_to_simple_string(element_t *elem, wide_string_builder_t *builder)
+static size_t parse_array_index(const wchar_t *data, size_t length)
 {
-    assert(elem->type == json_object);
-    builder = append_wide_string(builder, __W(L"{"));
-    map_iterator_t *iter = create_iterator_from_tree_map(&elem->data.object->base);
-    bool flag = false;
-    while(has_next_pair(iter))
+    if (length == 0 || (length > 1 && data[0] == L'0'))
+        return no_array_index;
+    size_t index = 0;
+    for (size_t i = 0; i < length; i++)
     {
-        if (flag)
-            builder = append_wide_string(builder, __W(L", "));
-        flag = true;
-        json_pair_t *pair = (json_pair_t*)next_pair(iter);
-        builder = append_formatted_wide_string(builder, L"\"%W\": ", *pair->key);
-        element_t *value = (element_t*)pair->value;
-        builder = simple_string_builders[value->type](value, builder);
+        if (!is_digit(data[i]) || index > (no_array_index - 9) / 10)
+            return no_array_index;
+        index = index * 10 + (data[i] - L'0');
     }
-    destroy_map_iterator(iter);
-    builder = append_wide_string(builder, __W(L"}"));
-    return builder;
+    return index;
 }
 
-static wide_string_builder_t * json_array_to_simple_string(element_t *elem, wide_string_builder_t *builder)
+static void release_path_steps(path_step_t *steps, size_t count, json_key_table_t *keys)
 {
-    assert(elem->type == json_array);
-    builder = append_wide_string(builder, __W(L"["));
-    vector_index_t i;
-    vector_t *vector = &elem->data.array->base;
-    for (i = 0; i < vector->size; i++)
+    if (!keys)
     {
-        if (i)
-            builder = append_wide_string(builder, __W(L", "));
-        element_t *child = (element_t*)vector->data[i];
-        builder = simple_string_builders[child->type](child, builder);
+        for (size_t i = 0; i < count; i++)
+            free(steps[i].key);
     }
-    builder = append_wide_string(builder, __W(L"]"));
-    return builder;
+    free(steps);
 }
 
-static wide_string_builder_t * json_string_to_simple_string(element_t *elem, wide_string_builder_t *builder)
+/*
+    Splits a JSON pointer (RFC 6901) into steps, "~0" and "~1" in its tokens
+    stand for '~' and '/'. Keys are hashed once here and interned if there is a table
+*/
+static bool compile_path_steps(const wchar_t *pointer, size_t length, json_key_table_t *keys,
+    path_step_t **steps, size_t *count)
 {
-    assert(elem->type == json_string);
-    return append_formatted_wide_string(builder, L"\"%W\"", *elem->data.string_value);
+    *steps = NULL;
+    *count = 0;
+    if (length == 0)
+        return true;
+    if (pointer[0] != L'/')
+        return false;
+    size_t capacity = 0;
+    for (size_t i = 0; i < length; i++)
+        capacity += pointer[i] == L'/' ? 1 : 0;
+    path_step_t *list = nnalloc(capacity * sizeof(path_step_t));
+    wchar_t *token = nnalloc(length * sizeof(wchar_t));
+    size_t number = 0;
+    for (size_t i = 1; number < capacity; i++)
+    {
+        size_t token_length = 0;
+        for (; i < length && pointer[i] != L'/'; i++)
+        {
+            wchar_t c = pointer[i];
+            if (c == L'~')
+            {
+                c = i + 1 < length ? pointer[++i] : L'\0';
+                if (c != L'0' && c != L'1')
+                {
+                    free(token);
+                    release_path_steps(list, number, keys);
+                    return false;
+                }
+                c = c == L'0' ? L'~' : L'/';
+            }
+            token[token_length++] = c;
+        }
+        path_step_t *step = &list[number++];
+        step->hash = hash_wide_chars(token, token_length);
+        step->key = keys ? intern_key(keys, token, token_length, step->hash)
+            : create_wide_string_in_memory(NULL, token, token_length);
+        step->index = parse_array_index(token, token_length);
+    }
+    free(token);
+    *steps = list;
+    *count = number;
+    return true;
 }
 
-static wide_string_builder_t * json_number_to_simple_string(element_t *elem, wide_string_builder_t *builder)
+static const element_t * follow_path_step(const element_t *elem, const path_step_t *step)
 {
-    assert(elem->type == json_number);
-    char buff[64];
-    print_number(buff, elem->data.num_value);
-    return append_formatted_wide_string(builder, L"%s", buff);
+    element_t *child;
+    if (elem->type == json_object)
+    {
+        const private_object_data_t *object = elem->data.object;
+        size_t number = find_pair_in_object(object, step->hash, step->key->data, step->key->length);
+        if (number == pair_not_found)
+            return NULL;
+        child = object->pairs[number].value;
+    }
+    else if (elem->type == json_array)
+    {
+        const private_array_data_t *array = elem->data.array;
+        if (step->index >= array->count)
+            return NULL;
+        child = array->items[step->index];
+    }
+    else
+        return NULL;
+    expand_element(child);
+    return child;
 }
 
-static wide_string_builder_t * json_boolean_to_simple_string(element_t *elem, wide_string_builder_t *builder)
+json_path_t * compile_json_path(const wchar_t *pointer, json_key_table_t *keys)
 {
-    assert(elem->type == json_boolean);
-    return append_wide_string(builder, elem->data.bool_value ? __W(L"true") : __W(L"false"));
+    path_step_t *steps;
+    size_t count;
+    if (!compile_path_steps(pointer, wcslen(pointer), keys, &steps, &count))
+        return NULL;
+    json_path_t *path = nnalloc(sizeof(json_path_t));
+    path->steps = steps;
+    path->count = count;
+    path->keys = keys;
+    return path;
 }
 
-wide_string_t * json_element_to_simple_string(const json_element_base_t *iface)
+const json_element_t * find_json_element_by_path(const json_element_t *root, const json_path_t *path)
 {
-    element_t *this = (element_t*)iface;    
-    return (wide_string_t*)simple_string_builders[this->type](this, NULL);
+    const element_t *elem = (const element_t*)root;
+    for (size_t i = 0; i < path->count && elem; i++)
+        elem = follow_path_step(elem, &path->steps[i]);
+    return (const json_element_t*)elem;
 }
 
-// --- error ------------------------------------------------------------------
-
-const wchar_t *str_error[] =
+void destroy_json_path(json_path_t *path)
 {
-    L"ok",
-    L"unknown symbol",
-    L"incorrect number format",
-    L"incorrect escape character",
-    L"missing closing quotation mark in string",
-    L"missing closing bracket",
-    L"unrecognized entity",
-    L"expected comma as a separator",
-    L"expected colon as a separator",
-    L"expected a name",
-    L"expected an element"
-};
+    if (path)
+    {
+        release_path_steps(path->steps, path->count, path->keys);
+        free(path);
+    }
+}
 
-wide_string_t * json_error_to_string(const json_error_t *err)
+static size_t add_path_node(json_path_set_t *set, size_t parent, path_step_t *step)
 {
-    wide_string_builder_t *buff = append_formatted_wide_string(NULL, L"%d.%d, %w",
-        err->where.row, err->where.column, str_error[err->type]);
-    if (err->text.length)
-        buff = append_formatted_wide_string(buff, L": '%W'", err->text);
-    return (wide_string_t*)buff;
+    size_t previous = 0;
+    for (size_t child = set->nodes[parent].first_child; child; child = set->nodes[child].next_sibling)
+    {
+        const path_step_t *other = &set->nodes[child].step;
+        if (other->hash == step->hash && other->key->length == step->key->length
+            && memcmp(other->key->data, step->key->data, step->key->length * sizeof(wchar_t)) == 0)
+        {
+            if (!set->keys)
+                free(step->key);
+            return child;
+        }
+        previous = child;
+    }
+    if (set->nodes_count == set->nodes_capacity)
+    {
+        set->nodes = grow_memory(NULL, set->nodes, set->nodes_count * sizeof(path_node_t),
+            set->nodes_count * 2 * sizeof(path_node_t));
+        set->nodes_capacity = set->nodes_count * 2;
+    }
+    size_t number = set->nodes_count++;
+    path_node_t *node = &set->nodes[number];
+    node->step = *step;
+    node->first_child = 0;
+    node->next_sibling = 0;
+    node->first_path = 0;
+    if (previous)
+        set->nodes[previous].next_sibling = number;
+    else
+        set->nodes[parent].first_child = number;
+    return number;
 }
 
-// --- parser -----------------------------------------------------------------
-
-static __inline bool is_space(wchar_t c)
+json_path_set_t * compile_json_path_set(const wchar_t * const *pointers, size_t count, json_key_table_t *keys)
 {
-    return c == L' ' || c == L'\t' || c == L'\n' || c == L'\r';
+    json_path_set_t *set = nnalloc(sizeof(json_path_set_t));
+    set->nodes_capacity = 16;
+    set->nodes = nnalloc(set->nodes_capacity * sizeof(path_node_t));
+    set->nodes_count = 1;
+    memset(&set->nodes[0], 0, sizeof(path_node_t));
+    set->next_path = nnalloc((count ? count : 1) * sizeof(size_t));
+    set->count = count;
+    set->keys = keys;
+    for (size_t k = 0; k < count; k++)
+    {
+        path_step_t *steps;
+        size_t steps_count;
+        if (!compile_path_steps(pointers[k], wcslen(pointers[k]), keys, &steps, &steps_count))
+        {
+            set->count = k;
+            destroy_json_path_set(set);
+            return NULL;
+        }
+        size_t number = 0;
+        for (size_t i = 0; i < steps_count; i++)
+            number = add_path_node(set, number, &steps[i]);
+        free(steps);
+        set->next_path[k] = set->nodes[number].first_path;
+        set->nodes[number].first_path = k + 1;
+    }
+    return set;
 }
 
-static __inline bool is_letter(wchar_t c)
+size_t get_json_path_set_size(const json_path_set_t *set)
 {
-    return (c >= L'A' && c <= L'Z') || (c >= L'a' && c <= L'z') || c == '_';
+    return set->count;
 }
 
-static __inline bool is_digit(wchar_t c)
+static void find_json_elements_by_path_node(const json_path_set_t *set, size_t number, const element_t *elem,
+    const json_element_t **results)
 {
-    return c >= L'0' && c <= L'9';
+    const path_node_t *node = &set->nodes[number];
+    for (size_t k = node->first_path; k; k = set->next_path[k - 1])
+        results[k - 1] = (const json_element_t*)elem;
+    for (size_t child = node->first_child; child; child = set->nodes[child].next_sibling)
+    {
+        const element_t *found = elem ? follow_path_step(elem, &set->nodes[child].step) : NULL;
+        find_json_elements_by_path_node(set, child, found, results);
+    }
 }
 
-static __inline bool is_hex_digit(wchar_t c)
+void find_json_elements_by_path_set(const json_element_t *root, const json_path_set_t *set,
+    const json_element_t **results)
 {
-    return (c >= L'0' && c <= L'9') || (c >= L'A' && c <= L'F') || (c >= L'a' && c <= L'f');
+    find_json_elements_by_path_node(set, 0, (const element_t*)root, results);
 }
 
-static __inline int convert_hex_digit(wchar_t c)
+void destroy_json_path_set(json_path_set_t *set)
 {
-    if (c >= L'0' && c <= L'9') return c - L'0';
-    if (c >= L'A' && c <= L'F') return c - L'A' + 10;
-    if (c >= L'a' && c <= L'f') return c - L'a' + 10;
-    return -1;
+    if (set)
+    {
+        if (!set->keys)
+        {
+            for (size_t i = 1; i < set->nodes_count; i++)
+                free(set->nodes[i].step.key);
+        }
+        free(set->nodes);
+        free(set->next_path);
+        free(set);
+    }
 }
 
+// --- patches ----------------------------------------------------------------
+
+/*
+    New elements go to the memory of the container that receives them,
+    objects also share its key table
+*/
 typedef struct
 {
-    wide_string_t *text;
-    size_t index;
-    json_position_t pos;
-} source_t;
+    json_arena_t *arena;
+    json_key_table_t *keys;
+} tree_memory_t;
 
-static __inline void init_source(source_t *src, wide_string_t *text)
+static tree_memory_t get_tree_memory(const element_t *elem)
 {
-    src->text = text;
-    src->index = 0;
-    src->pos.row = 1;
-    src->pos.column = 1;
+    tree_memory_t memory = { NULL, NULL };
+    if (elem && elem->type == json_object)
+    {
+        memory.arena = elem->data.object->arena;
+        memory.keys = elem->data.object->keys;
+    }
+    else if (elem && elem->type == json_array)
+        memory.arena = elem->data.array->arena;
+    return memory;
 }
 
-static __inline wchar_t get_char(source_t *src)
+static void discard_element(json_arena_t *arena, element_t *elem)
 {
-    return src->index < src->text->length ? src->text->data[src->index] : L'\0';
+    if (!arena)
+        destructors[elem->type](elem);
 }
 
-static __inline wchar_t next_char(source_t *src)
+static element_t * clone_element(const tree_memory_t *memory, const element_t *source)
 {
-    if (src->index < src->text->length)
+    expand_element((element_t*)source);
+    switch (source->type)
     {
-        wchar_t c = src->text->data[src->index];
-        if (c == L'\n')
+        case json_object:
         {
-            src->pos.row++;
-            src->pos.column = 1;            
+            const private_object_data_t *source_object = source->data.object;
+            element_t *elem = instantiate_json_object(memory->arena, source_object->count);
+            private_object_data_t *object = elem->data.object;
+            object->keys = memory->keys;
+            for (size_t i = 0; i < source_object->count; i++)
+            {
+                const private_pair_t *pair = &source_object->pairs[i];
+                element_t *value = clone_element(memory, pair->value);
+                value->parent = (json_element_t*)elem;
+                append_pair_to_object(object, memory->keys
+                    ? intern_key(memory->keys, pair->key->data, pair->key->length, pair->hash)
+                    : create_wide_string_in_memory(memory->arena, pair->key->data, pair->key->length),
+                    pair->hash, value);
+            }
+            return elem;
         }
-        else if (c == L'\r')
+        case json_array:
         {
-            src->pos.column = 1;
+            const private_array_data_t *source_array = source->data.array;
+            element_t *elem = instantiate_json_array(memory->arena, source_array->count);
+            private_array_data_t *array = elem->data.array;
+            for (size_t i = 0; i < source_array->count; i++)
+            {
+                element_t *item = clone_element(memory, source_array->items[i]);
+                item->parent = (json_element_t*)elem;
+                array->items[array->count++] = item;
+            }
+            return elem;
         }
-        else
+        case json_string:
+            return instantiate_json_string_with_chars(memory->arena, source->data.string_value->data,
+                source->data.string_value->length);
+        case json_number:
         {
-            src->pos.column++;
+            // a raw number keeps its own copy of the literal, the source may borrow it
+            const private_number_data_t *num = (const private_number_data_t*)source->data.num_value;
+            if (!num->literal)
+                return instantiate_json_number(memory->arena, &num->value);
+            element_t *elem = instantiate_json_raw_number(memory->arena, num->literal, num->length);
+            private_number_data_t *copy = (private_number_data_t*)elem->data.num_value;
+            copy->value = num->value;
+            copy->converted = num->converted;
+            return elem;
         }
-        src->index++;
-        return get_char(src);
+        case json_boolean:
+            return instantiate_json_boolean(memory->arena, source->data.bool_value);
+        default:
+            return instantiate_json_null(memory->arena);
     }
-    return '\0';
 }
 
-static __inline wchar_t get_char_but_not_space(source_t *src)
+bool are_json_elements_equal(const json_element_t *first, const json_element_t *second)
 {
-    wchar_t c = get_char(src);
-    while(is_space(c))
+    const element_t *a = (const element_t*)first;
+    const element_t *b = (const element_t*)second;
+    if (a == b)
+        return true;
+    if (!a || !b || a->type != b->type)
+        return false;
+    expand_element((element_t*)a);
+    expand_element((element_t*)b);
+    switch (a->type)
     {
-        c = next_char(src);
+        case json_object:
+        {
+            const private_object_data_t *x = a->data.object, *y = b->data.object;
+            if (x->count != y->count)
+                return false;
+            for (size_t i = 0; i < x->count; i++)
+            {
+                const private_pair_t *pair = &x->pairs[i];
+                size_t number = find_pair_in_object(y, pair->hash, pair->key->data, pair->key->length);
+                if (number == pair_not_found || !are_json_elements_equal((const json_element_t*)pair->value,
+                        (const json_element_t*)y->pairs[number].value))
+                    return false;
+            }
+            return true;
+        }
+        case json_array:
+        {
+            const private_array_data_t *x = a->data.array, *y = b->data.array;
+            if (x->count != y->count)
+                return false;
+            for (size_t i = 0; i < x->count; i++)
+            {
+                if (!are_json_elements_equal((const json_element_t*)x->items[i],
+                        (const json_element_t*)y->items[i]))
+                    return false;
+            }
+            return true;
+        }
+        case json_string:
+            return a->data.string_value->length == b->data.string_value->length
+                && memcmp(a->data.string_value->data, b->data.string_value->data,
+                    a->data.string_value->length * sizeof(wchar_t)) == 0;
+        case json_number:
+            return *get_value_from_json_number((const json_number_t*)a)
+                == *get_value_from_json_number((const json_number_t*)b);
+        case json_boolean:
+            return a->data.bool_value == b->data.bool_value;
+        default:
+            return true;
     }
-    return c;
 }
 
-static __inline wchar_t next_char_but_not_space(source_t *src)
+/*
+    The pointer of the current position is kept in one buffer, a step
+    appends an escaped token and going back just restores the length
+*/
+typedef struct
+{
+    wchar_t *data;
+    size_t length;
+    size_t capacity;
+} pointer_buffer_t;
+
+static void put_pointer_char(pointer_buffer_t *pointer, wchar_t c)
 {
-    wchar_t c = next_char(src);
-    while(is_space(c))
+    if (pointer->length + 1 >= pointer->capacity)
     {
-        c = next_char(src);
+        size_t capacity = pointer->capacity ? pointer->capacity * 2 : 64;
+        wchar_t *data = nnalloc(capacity * sizeof(wchar_t));
+        if (pointer->length)
+            memcpy(data, pointer->data, pointer->length * sizeof(wchar_t));
+        free(pointer->data);
+        pointer->data = data;
+        pointer->capacity = capacity;
     }
-    return c;
+    pointer->data[pointer->length++] = c;
+    pointer->data[pointer->length] = L'\0';
 }
 
-static wide_string_t * parse_string(source_t *src, json_error_t *err);
-static element_t * parse_element(source_t *src, json_error_t *err);
-
-static element_t * parse_object(source_t *src, json_error_t *err)
+static void put_pointer_key(pointer_buffer_t *pointer, const wide_string_t *key)
 {
-    element_t *obj = instantiate_json_object();
-    size_t count = 0;
-    
-    while(true)
+    put_pointer_char(pointer, L'/');
+    for (size_t i = 0; i < key->length; i++)
     {
-        wchar_t c = get_char_but_not_space(src);
-                    
-        if (c == L'\0')
+        wchar_t c = key->data[i];
+        if (c == L'~' || c == L'/')
         {
-            if (err)
-            {
-                err->type = json_missing_closing_bracket;
-                err->text.data[0] = L'}';
-                err->text.length = 1;
-            }
-            json_object_destructor(obj);
-            return NULL;
+            put_pointer_char(pointer, L'~');
+            c = c == L'~' ? L'0' : L'1';
         }
-        if (c == L'}')
+        put_pointer_char(pointer, c);
+    }
+}
+
+static void put_pointer_index(pointer_buffer_t *pointer, size_t index)
+{
+    wchar_t digits[24];
+    size_t count = 0;
+    do
+    {
+        digits[count++] = (wchar_t)(L'0' + index % 10);
+        index /= 10;
+    } while (index);
+    put_pointer_char(pointer, L'/');
+    while (count)
+        put_pointer_char(pointer, digits[--count]);
+}
+
+static void add_patch_operation(json_array_t *patch, const wchar_t *op, const pointer_buffer_t *pointer,
+    const element_t *value)
+{
+    static const tree_memory_t heap = { NULL, NULL };
+    element_t *operation = instantiate_json_object(NULL, 0);
+    add_element_to_array((element_t*)patch, operation);
+    create_json_string_owned_by_object((json_object_t*)operation, L"op", op);
+    create_json_string_owned_by_object((json_object_t*)operation, L"path",
+        pointer->length ? pointer->data : L"");
+    if (value)
+        add_pair_to_object(operation, L"value", clone_element(&heap, value));
+}
+
+static void diff_elements(json_array_t *patch, pointer_buffer_t *pointer, const element_t *a, const element_t *b)
+{
+    if (a->type != b->type || (a->type != json_object && a->type != json_array))
+    {
+        if (!are_json_elements_equal((const json_element_t*)a, (const json_element_t*)b))
+            add_patch_operation(patch, L"replace", pointer, b);
+        return;
+    }
+    expand_element((element_t*)a);
+    expand_element((element_t*)b);
+    size_t length = pointer->length;
+    if (a->type == json_object)
+    {
+        const private_object_data_t *x = a->data.object, *y = b->data.object;
+        for (size_t i = 0; i < x->count; i++)
         {
-            next_char(src);
-            return obj;
+            const private_pair_t *pair = &x->pairs[i];
+            size_t number = find_pair_in_object(y, pair->hash, pair->key->data, pair->key->length);
+            put_pointer_key(pointer, pair->key);
+            if (number == pair_not_found)
+                add_patch_operation(patch, L"remove", pointer, NULL);
+            else
+                diff_elements(patch, pointer, pair->value, y->pairs[number].value);
+            pointer->length = length;
         }
-        if (count > 0)
+        for (size_t i = 0; i < y->count; i++)
         {
-            if (c != L',')
-            {
-                if (err)
-                    err->type = json_expected_comma_separator;
-                json_object_destructor(obj);
-                return NULL;
-            }
-            c = next_char_but_not_space(src);
-            if (c == 0)
-            {
-                if (err)
-                {
-                    err->type = json_missing_closing_bracket;
-                    err->text.data[0] = L'}';
-                    err->text.length = 1;
-                }
-                json_object_destructor(obj);
-                return NULL;
-            }
-            if (c == L'}')
+            const private_pair_t *pair = &y->pairs[i];
+            if (find_pair_in_object(x, pair->hash, pair->key->data, pair->key->length) == pair_not_found)
             {
-                next_char(src);
-                return obj;
+                put_pointer_key(pointer, pair->key);
+                add_patch_operation(patch, L"add", pointer, pair->value);
+                pointer->length = length;
             }
         }
-        wide_string_t *name = NULL;
-        if (c == L'\"')
-        {
-            next_char(src);
-            name = parse_string(src, err);
-            if (!name)
-                return NULL;
-        }
-        else if (is_letter(c))
-        {
-            wide_string_builder_t *b = NULL;
-            do
-            {
-                b = append_wide_char(b, c);;
-                c = next_char(src);
-            } while(is_letter(c) || is_digit(c));
-            name = (wide_string_t*)b;
-        }
-        else
+    }
+    else
+    {
+        const private_array_data_t *x = a->data.array, *y = b->data.array;
+        size_t common = x->count < y->count ? x->count : y->count;
+        for (size_t i = 0; i < common; i++)
         {
-            if (err)
-                err->type = json_expected_name;
-            json_object_destructor(obj);
-            return NULL;
+            put_pointer_index(pointer, i);
+            diff_elements(patch, pointer, x->items[i], y->items[i]);
+            pointer->length = length;
         }
-        c = get_char_but_not_space(src);
-        if (c != L':')
+        // extra items are removed from the end, so the indexes of the others stay valid
+        for (size_t i = x->count; i > common; i--)
         {
-            if (err)
-                err->type = json_expected_colon_separator;
-            json_object_destructor(obj);
-            return NULL;
+            put_pointer_index(pointer, i - 1);
+            add_patch_operation(patch, L"remove", pointer, NULL);
+            pointer->length = length;
         }
-        c = next_char_but_not_space(src);
-        if (c == 0)
+        for (size_t i = common; i < y->count; i++)
         {
-            if (err)
-                err->type = json_expected_element;
-            json_object_destructor(obj);
-            return NULL;
+            put_pointer_index(pointer, i);
+            add_patch_operation(patch, L"add", pointer, y->items[i]);
+            pointer->length = length;
         }
-        element_t *value = parse_element(src, err);
-        if (!value)
-            return NULL;
-        add_pair_to_tree_map(&obj->data.object->base, name, value);
-        value->parent = (json_element_t*)obj;
-        count++;
     }
+    if (pointer->data)
+        pointer->data[length] = L'\0';
 }
 
-static element_t * parse_array(source_t *src, json_error_t *err)
+json_array_t * diff_json_elements(const json_element_t *a, const json_element_t *b)
 {
-    element_t *elem = instantiate_json_array();
-    size_t count = 0;
-    
-    while(true)
+    json_array_t *patch = create_json_array();
+    pointer_buffer_t pointer = { NULL, 0, 0 };
+    diff_elements(patch, &pointer, (const element_t*)a, (const element_t*)b);
+    free(pointer.data);
+    return patch;
+}
+
+static const element_t * get_patch_member(const element_t *operation, const wchar_t *name)
+{
+    const json_pair_t *pair = get_pair_from_json_object((const json_object_data_t*)operation->data.object, name);
+    return pair ? (const element_t*)pair->value : NULL;
+}
+
+static const wide_string_t * get_patch_string(const element_t *operation, const wchar_t *name)
+{
+    const element_t *value = get_patch_member(operation, name);
+    return value && value->type == json_string ? value->data.string_value : NULL;
+}
+
+/*
+    Follows all the steps but the last one, which names the item within the container
+*/
+static element_t * find_patch_container(element_t *root, const path_step_t *steps, size_t count)
+{
+    const element_t *elem = root;
+    for (size_t i = 0; i + 1 < count && elem; i++)
+        elem = follow_path_step(elem, &steps[i]);
+    return elem && (elem->type == json_object || elem->type == json_array) ? (element_t*)elem : NULL;
+}
+
+static bool is_end_of_array_step(const path_step_t *step)
+{
+    return step->key->length == 1 && step->key->data[0] == L'-';
+}
+
+static element_t * detach_from_container(element_t *container, const path_step_t *step)
+{
+    element_t *elem;
+    if (container->type == json_object)
     {
-        wchar_t c = get_char_but_not_space(src);
-                    
-        if (c == L'\0')
-        {
-            if (err)
-            {
-                err->type = json_missing_closing_bracket;
-                err->text.data[0] = L'}';
-                err->text.length = 1;
-            }
-            json_array_destructor(elem);
+        private_object_data_t *object = container->data.object;
+        size_t number = find_pair_in_object(object, step->hash, step->key->data, step->key->length);
+        if (number == pair_not_found)
             return NULL;
-        }
-        if (c == L']')
-        {
-            next_char(src);
-            return elem;
-        }
-        if (count > 0)
-        {
-            if (c != L',')
-            {
-                if (err)
-                    err->type = json_expected_comma_separator;
-                json_array_destructor(elem);;
-                return NULL;
-            }
-            c = next_char_but_not_space(src);
-            if (c == 0)
-            {
-                if (err)
-                {
-                    err->type = json_missing_closing_bracket;
-                    err->text.data[0] = L']';
-                    err->text.length = 1;
-                }
-                json_array_destructor(elem);;
-                return NULL;
-            }
-            if (c == L']')
-            {
-                next_char(src);
-                return elem;
-            }
-        }
-        element_t *child = parse_element(src, err);
-        if (!child)
+        elem = object->pairs[number].value;
+        if (!object->keys && !object->arena)
+            free(object->pairs[number].key);
+        remove_pair_from_object(object, number);
+    }
+    else
+    {
+        private_array_data_t *array = container->data.array;
+        if (step->index >= array->count)
             return NULL;
-        add_item_to_vector(&elem->data.array->base, child);
-        child->parent = (json_element_t*)elem;
-        count++;
+        elem = array->items[step->index];
+        memmove(&array->items[step->index], &array->items[step->index + 1],
+            (array->count - step->index - 1) * sizeof(element_t*));
+        array->count--;
     }
+    elem->parent = NULL;
+    return elem;
 }
 
-static wide_string_t * parse_string(source_t *src, json_error_t *err)
+static bool insert_into_container(element_t *container, const path_step_t *step, element_t *elem, bool replace)
 {
-    wide_string_builder_t *b = NULL;
-    wchar_t c = get_char(src);
-    while (c != L'\"' && c != L'\0')
+    if (container->type == json_object)
     {
-        if (c == L'\\')
-        {
-            c = next_char(src);
-            switch(c)
-            {
-                case L'"':
-                    b = append_wide_char(b, L'"');
-                    break;
-                case '\\':
-                    b = append_wide_char(b, L'\\');
-                    break;
-                case '/':
-                    b = append_wide_char(b, L'/');
-                    break;
-                case 'b':
-                    b = append_wide_char(b, L'\b');
-                    break;
-                case 'f':
-                    b = append_wide_char(b, L'\f');
-                    break;
-                case 'n':
-                    b = append_wide_char(b, L'\n');
-                    break;
-                case 'r':
-                    b = append_wide_char(b, L'\r');
-                    break;
-                case 't':
-                    b = append_wide_char(b, L'\t');
-                    break;
-                case 'u':
-                {
-                    int k = 0;
-                    wchar_t h[4];
-                    for (size_t i = 0; i < 4; i++)
-                    {
-                        c = next_char(src);
-                        h[i] = c;
-                        if (!is_hex_digit(c))
-                        {
-                            if (err)
-                            {
-                                err->type = json_incorrect_number_format;
-                                memcpy(err->text.data, h, (i + 1) * sizeof(wchar_t));
-                                err->text.length = i + 1;
-                            }
-                            free(b);
-                            return NULL;
-                        }
-                        k = (k << 4) | convert_hex_digit(c);
-                    }
-                    c = (wchar_t)k;
-                    b = append_wide_char(b, c);
-                    break;				
-                }
-                default:
-                    if (err)
-                    {
-                        err->type = json_incorrect_escape_character;
-                        err->text.data[0] = c;
-                        err->text.length = 1;
-                    }
-                    free(b);
-                    return NULL;
-            }
-        }
-        else
-        {
-            b = append_wide_char(b, c);
-        }
-        c = next_char(src);
+        private_object_data_t *object = container->data.object;
+        if (replace && find_pair_in_object(object, step->hash, step->key->data, step->key->length) == pair_not_found)
+            return false;
+        add_pair_with_length_to_object(container, step->key->data, step->key->length, elem);
+        return true;
     }
-    if (c == 0)
+    private_array_data_t *array = container->data.array;
+    size_t index = is_end_of_array_step(step) && !replace ? array->count : step->index;
+    if (replace)
     {
-        if (err)
-            err->type = json_missing_closing_quotation_mark_in_string;
-        free(b);
-        return NULL;
+        if (index >= array->count)
+            return false;
+        discard_element(array->arena, array->items[index]);
+        array->items[index] = elem;
     }
-    next_char(src);
-    return (wide_string_t*)b;
+    else
+    {
+        if (index > array->count)
+            return false;
+        reserve_array_items(array, 1);
+        memmove(&array->items[index + 1], &array->items[index], (array->count - index) * sizeof(element_t*));
+        array->items[index] = elem;
+        array->count++;
+    }
+    elem->parent = (json_element_t*)container;
+    return true;
 }
 
-static element_t * parse_number_element(source_t *src, bool neg, json_error_t *err)
+static bool is_path_prefix(const path_step_t *prefix, size_t prefix_count, const path_step_t *steps, size_t count)
 {
-    string_builder_t *b = NULL;
-    wchar_t c = get_char(src);
-    do
+    if (prefix_count > count)
+        return false;
+    for (size_t i = 0; i < prefix_count; i++)
+    {
+        if (prefix[i].hash != steps[i].hash || prefix[i].key->length != steps[i].key->length
+            || memcmp(prefix[i].key->data, steps[i].key->data, steps[i].key->length * sizeof(wchar_t)) != 0)
+            return false;
+    }
+    return true;
+}
+
+static void replace_root(element_t **root, element_t *elem)
+{
+    tree_memory_t memory = get_tree_memory(*root);
+    discard_element(memory.arena, *root);
+    elem->parent = NULL;
+    *root = elem;
+}
+
+static bool apply_patch_operation(element_t **root, const element_t *operation)
+{
+    if (operation->type != json_object)
+        return false;
+    const wide_string_t *op_string = get_patch_string(operation, L"op");
+    const wide_string_t *path = get_patch_string(operation, L"path");
+    if (!op_string || !path)
+        return false;
+    const wchar_t *op = op_string->data;
+    bool is_add = wcscmp(op, L"add") == 0, is_replace = wcscmp(op, L"replace") == 0,
+        is_move = wcscmp(op, L"move") == 0, is_copy = wcscmp(op, L"copy") == 0;
+    path_step_t *steps;
+    size_t count;
+    if (!compile_path_steps(path->data, path->length, NULL, &steps, &count))
+        return false;
+    bool result = false;
+    element_t *container = count ? find_patch_container(*root, steps, count) : NULL;
+    if (wcscmp(op, L"test") == 0)
     {
-        b = append_char(b, (char)c);
-        c = next_char(src);
-    } while(is_digit(c));
-    if (c == '.')
+        const element_t *value = get_patch_member(operation, L"value");
+        const json_path_t target = { steps, count, NULL };
+        result = value && are_json_elements_equal(find_json_element_by_path((json_element_t*)*root, &target),
+            (const json_element_t*)value);
+    }
+    else if (wcscmp(op, L"remove") == 0)
     {
-        b = append_char(b, (char)c);
-        c = next_char(src);
-        if (is_digit(c))
+        element_t *elem = container ? detach_from_container(container, &steps[count - 1]) : NULL;
+        if (elem)
         {
-            do
-            {
-                b = append_char(b, (char)c);
-                c = next_char(src);
-            } while(is_digit(c));
+            discard_element(get_tree_memory(container).arena, elem);
+            result = true;
         }
-        else
-            goto error;        
     }
-    if (c == L'e' || c == L'E')
+    else if (is_add || is_replace)
     {
-        b = append_char(b, (char)c);
-        c = next_char(src);
-        if (c == '+' || c == '-')
+        const element_t *value = get_patch_member(operation, L"value");
+        if (value && (container || !count))
         {
-            b = append_char(b, (char)c);
-            c = next_char(src);
+            tree_memory_t memory = get_tree_memory(count ? container : *root);
+            element_t *elem = clone_element(&memory, value);
+            if (!count)
+            {
+                replace_root(root, elem);
+                result = true;
+            }
+            else if (!(result = insert_into_container(container, &steps[count - 1], elem, is_replace)))
+                discard_element(memory.arena, elem);
         }
-        if (is_digit(c))
+    }
+    else if (is_move || is_copy)
+    {
+        const wide_string_t *from = get_patch_string(operation, L"from");
+        path_step_t *from_steps;
+        size_t from_count;
+        if (from && compile_path_steps(from->data, from->length, NULL, &from_steps, &from_count))
         {
-            do
+            // an element cannot be moved into one of its own children
+            bool allowed = !is_move || !is_path_prefix(from_steps, from_count, steps, count)
+                || from_count == count;
+            const json_path_t source_path = { from_steps, from_count, NULL };
+            const element_t *source = (const element_t*)find_json_element_by_path((json_element_t*)*root,
+                &source_path);
+            if (allowed && source && (is_move || container || !count))
             {
-                b = append_char(b, (char)c);
-                c = next_char(src);
-            } while(is_digit(c));
+                tree_memory_t memory = get_tree_memory(count ? container : *root);
+                element_t *elem = NULL;
+                element_t *from_container = NULL;
+                if (is_copy)
+                    elem = clone_element(&memory, source);
+                else if (from_count == count && is_path_prefix(from_steps, from_count, steps, count))
+                    result = true;
+                else if (from_count)
+                {
+                    from_container = (element_t*)source->parent;
+                    elem = detach_from_container(from_container, &from_steps[from_count - 1]);
+                    // the target is found in the tree without the moved element, as RFC 6902 has it
+                    container = count ? find_patch_container(*root, steps, count) : NULL;
+                }
+                if (elem && !count)
+                {
+                    replace_root(root, elem);
+                    result = true;
+                }
+                else if (elem && container)
+                    result = insert_into_container(container, &steps[count - 1], elem, false);
+                if (elem && !result)
+                {
+                    // a moved element goes back, at the end of its object if it was in one
+                    if (from_container)
+                        insert_into_container(from_container, &from_steps[from_count - 1], elem, false);
+                    else
+                        discard_element(memory.arena, elem);
+                }
+            }
+            release_path_steps(from_steps, from_count, NULL);
         }
-        else
-            goto error;        
     }
-    number_t result;
-    parse_number(&result, b->data);
-    if (!result.is_number)
-        goto error;
-    free(b);
-    if (neg)
-        negate_number(&result);
-    return instantiate_json_number(&result);
+    release_path_steps(steps, count, NULL);
+    return result;
+}
 
-error:
-    if (err)
+bool apply_json_patch(json_element_t **root, const json_element_t *patch)
+{
+    const element_t *operations = (const element_t*)patch;
+    if (!operations || operations->type != json_array)
+        return false;
+    const private_array_data_t *array = operations->data.array;
+    for (size_t i = 0; i < array->count; i++)
     {
-        b = append_char(b, (char)c);
-        err->type = json_incorrect_number_format;
-        err->text.length = b->length < json_error_text_max_length ? b->length : json_error_text_max_length;
-        for (size_t k = 0; k < err->text.length; k++)
-            err->text.data[k] = b->data[k];
+        if (!apply_patch_operation((element_t**)root, array->items[i]))
+            return false;
     }
-    free(b);
-    return NULL;
+    return true;
 }
 
-static element_t * parse_element(source_t *src, json_error_t *err)
+/*
+    Returns the element that takes the place of the target, which is
+    updated in place if both it and the patch are objects
+*/
+static element_t * merge_patch(const tree_memory_t *memory, element_t *target, const element_t *patch)
 {
-    wchar_t c = get_char_but_not_space(src);
-    
-    if (c == L'{')
+    if (patch->type != json_object)
     {
-        next_char(src);
-        return parse_object(src, err);
+        if (target)
+            discard_element(memory->arena, target);
+        return clone_element(memory, patch);
     }
-    else if (c == L'[')
+    if (!target || target->type != json_object)
     {
-        next_char(src);
-        return parse_array(src, err);
+        if (target)
+            discard_element(memory->arena, target);
+        target = instantiate_json_object(memory->arena, 0);
+        target->data.object->keys = memory->keys;
     }
-    else if (c == L'\"')
+    expand_element(target);
+    expand_element((element_t*)patch);
+    private_object_data_t *object = target->data.object;
+    const private_object_data_t *changes = patch->data.object;
+    for (size_t i = 0; i < changes->count; i++)
     {
-        next_char(src);
-        wide_string_t *text = parse_string(src, err);
-        if (text)
+        const private_pair_t *change = &changes->pairs[i];
+        size_t number = find_pair_in_object(object, change->hash, change->key->data, change->key->length);
+        if (change->value->type == json_null)
         {
-            element_t *elem = nnalloc(sizeof(element_t));
-            elem->type = json_string;
-            elem->data.string_value = text;
-            return elem;
+            if (number != pair_not_found)
+            {
+                path_step_t step = { change->key, change->hash, no_array_index };
+                discard_element(object->arena, detach_from_container(target, &step));
+            }
+            continue;
         }
-        return NULL;
-    }
-    else if (is_letter(c))
-    {
-        wide_string_builder_t *b = create_wide_string_builder(8);
-        do
+        tree_memory_t child_memory = { object->arena, object->keys };
+        if (number != pair_not_found)
         {
-            b = append_wide_char(b, c);
-            c = next_char(src);
-        } while (is_letter(c));
-        wide_string_t *ws = (wide_string_t*)b;
-        
-        if (are_wide_strings_equal(*ws, __W(L"null")))
-            return instantiate_json_null();
-        if (are_wide_strings_equal(*ws, __W(L"true")))
-            return instantiate_json_boolean(true);
-        if (are_wide_strings_equal(*ws, __W(L"false")))
-            return instantiate_json_boolean(false);
-
-        if (err)
+            element_t *value = merge_patch(&child_memory, object->pairs[number].value, change->value);
+            object->pairs[number].value = value;
+            value->parent = (json_element_t*)target;
+        }
+        else
         {
-            err->type = json_unrecognized_entity;
-            err->text.length = ws->length < json_error_text_max_length ? ws->length : json_error_text_max_length;
-            memcpy(err->text.data, ws->data, err->text.length * sizeof(wchar_t));
+            element_t *value = merge_patch(&child_memory, NULL, change->value);
+            value->parent = (json_element_t*)target;
+            append_pair_to_object(object, object->keys
+                ? intern_key(object->keys, change->key->data, change->key->length, change->hash)
+                : create_wide_string_in_memory(object->arena, change->key->data, change->key->length),
+                change->hash, value);
         }
-        return NULL;
-    }
-    else if (is_digit(c))
-    {
-        return parse_number_element(src, false, err);
-    }
-    else if (c == '-')
-    {
-        next_char(src);
-        return parse_number_element(src, true, err);
     }
+    return target;
+}
+
+void apply_json_merge_patch(json_element_t **root, const json_element_t *patch)
+{
+    tree_memory_t memory = get_tree_memory((element_t*)*root);
+    element_t *elem = merge_patch(&memory, (element_t*)*root, (const element_t*)patch);
+    elem->parent = NULL;
+    *root = (json_element_t*)elem;
+}
+
+// --- error ------------------------------------------------------------------
+
+const wchar_t *str_error[] =
+{
+    L"ok",
+    L"unknown symbol",
+    L"incorrect number format",
+    L"incorrect escape character",
+    L"missing closing quotation mark in string",
+    L"missing closing bracket",
+    L"unrecognized entity",
+    L"expected comma as a separator",
+    L"expected colon as a separator",
+    L"expected a name",
+    L"expected an element",
+    L"stopped by handler",
+    L"cannot read file",
+    L"maximum depth exceeded",
+    L"incorrect binary format",
+    L"value does not match the binding"
+};
+
+wide_string_t * json_error_to_string(const json_error_t *err)
+{
+    wide_string_builder_t *buff = append_formatted_wide_string(NULL, L"%d.%d, %w",
+        err->where.row, err->where.column, str_error[err->type]);
+    if (err->text.length)
+        buff = append_formatted_wide_string(buff, L": '%W'", err->text);
+    return (wide_string_t*)buff;
+}
 
-    if (err)
+// --- DOM builder ------------------------------------------------------------
+
+/*
+    The DOM is built as one more consumer of the parser events: children of
+    the open containers are collected on a stack and each container is created
+    with the exact size when it is closed
+*/
+/*
+    The text of a lazy document and the options its containers are expanded with
+*/
+struct lazy_source_t
+{
+    source_t src;
+    json_options_t options;
+    bool borrow_literals;
+};
+
+typedef struct
+{
+    json_arena_t *arena;
+    json_key_table_t *keys;
+    bool borrow_literals;
+    const lazy_source_t *lazy;
+    void **stack;
+    size_t stack_size;
+    size_t stack_capacity;
+    size_t *frames;
+    size_t frames_count;
+    size_t frames_capacity;
+} dom_builder_t;
+
+static void init_dom_builder(dom_builder_t *builder, const json_options_t *options)
+{
+    builder->arena = options ? options->arena : NULL;
+    builder->keys = options ? options->keys : NULL;
+    builder->borrow_literals = false;
+    builder->lazy = NULL;
+    builder->stack_capacity = 64;
+    builder->stack = nnalloc(builder->stack_capacity * sizeof(void*));
+    builder->stack_size = 0;
+    builder->frames_capacity = 16;
+    builder->frames = nnalloc(builder->frames_capacity * sizeof(size_t));
+    builder->frames_count = 0;
+}
+
+static void release_dom_builder(dom_builder_t *builder)
+{
+    free(builder->stack);
+    free(builder->frames);
+}
+
+static __inline void push_to_stack(dom_builder_t *builder, void *item)
+{
+    if (builder->stack_size == builder->stack_capacity)
     {
-        err->type = json_unknown_symbol;
-        err->text.data[0] = c;
-        err->text.length = 1;
+        builder->stack = grow_memory(NULL, builder->stack, builder->stack_size * sizeof(void*),
+            builder->stack_size * 2 * sizeof(void*));
+        builder->stack_capacity = builder->stack_size * 2;
     }
-    return NULL;
+    builder->stack[builder->stack_size++] = item;
 }
 
-json_element_t * parse_json_ext(wide_string_t *text, json_error_t *err)
+static __inline void push_frame(dom_builder_t *builder, bool is_object)
 {
-    source_t src;
-    init_source(&src, text);
-    if (err)
+    if (builder->frames_count == builder->frames_capacity)
     {
-        memset(err, 0, sizeof(json_error_t));
-        err->text.data = (wchar_t*)err->_buff;
+        builder->frames = grow_memory(NULL, builder->frames, builder->frames_count * sizeof(size_t),
+            builder->frames_count * 2 * sizeof(size_t));
+        builder->frames_capacity = builder->frames_count * 2;
     }
-    element_t *root = parse_element(&src, err);
-    if (err && err->type != json_ok)
-        err->where = src.pos;
-    if (root)
-        root->parent = NULL;
-    return (json_element_t*)root;
+    builder->frames[builder->frames_count++] = (builder->stack_size << 1) | (is_object ? 1 : 0);
 }
 
-json_element_t * parse_json(wide_string_t *text)
+static void discard_dom_builder_content(dom_builder_t *builder)
 {
-    return parse_json_ext(text, NULL);
+    while (builder->frames_count > 0)
+    {
+        size_t frame = builder->frames[--builder->frames_count];
+        size_t base = frame >> 1;
+        bool is_object = (frame & 1) != 0;
+        if (!builder->arena)
+        {
+            for (size_t i = base; i < builder->stack_size; i++)
+            {
+                if (is_object && (i - base) % 2 == 0)
+                {
+                    if (!builder->keys)
+                        free(builder->stack[i]);
+                }
+                else
+                {
+                    element_t *elem = builder->stack[i];
+                    destructors[elem->type](elem);
+                }
+            }
+        }
+        builder->stack_size = base;
+    }
+    if (!builder->arena)
+    {
+        for (size_t i = 0; i < builder->stack_size; i++)
+        {
+            element_t *elem = builder->stack[i];
+            destructors[elem->type](elem);
+        }
+    }
+    builder->stack_size = 0;
+}
+
+static element_t * close_object(dom_builder_t *builder, size_t base)
+{
+    size_t count = (builder->stack_size - base) / 2;
+    element_t *obj = instantiate_json_object(builder->arena, count);
+    private_object_data_t *object = obj->data.object;
+    object->keys = builder->keys;
+    void **stack = builder->stack + base;
+    if (count > object_index_threshold)
+        rebuild_object_index(object, count);
+    for (size_t i = 0; i < count; i++)
+    {
+        wide_string_t *key = stack[i * 2];
+        element_t *value = stack[i * 2 + 1];
+        size_t hash = builder->keys ? get_interned_key_hash(key) : hash_wide_chars(key->data, key->length);
+        value->parent = (json_element_t*)obj;
+        size_t number = find_pair_in_object(object, hash, key->data, key->length);
+        if (number == pair_not_found)
+        {
+            append_pair_to_object(object, key, hash, value);
+            continue;
+        }
+        // a repeated key keeps its first position and takes the last value
+        element_t *old_value = object->pairs[number].value;
+        object->pairs[number].value = value;
+        if (!builder->arena)
+        {
+            if (!builder->keys)
+                free(key);
+            destructors[old_value->type](old_value);
+        }
+    }
+    builder->stack_size = base;
+    return obj;
+}
+
+static element_t * close_array(dom_builder_t *builder, size_t base)
+{
+    size_t count = builder->stack_size - base;
+    element_t *elem = instantiate_json_array(builder->arena, count);
+    private_array_data_t *array = elem->data.array;
+    for (size_t i = 0; i < count; i++)
+    {
+        array->items[i] = builder->stack[base + i];
+        array->items[i]->parent = (json_element_t*)elem;
+    }
+    array->count = count;
+    builder->stack_size = base;
+    return elem;
+}
+
+static bool on_dom_object_begin(void *context)
+{
+    push_frame((dom_builder_t*)context, true);
+    return true;
+}
+
+static bool on_dom_object_end(void *context)
+{
+    dom_builder_t *builder = context;
+    size_t base = builder->frames[--builder->frames_count] >> 1;
+    push_to_stack(builder, close_object(builder, base));
+    return true;
+}
+
+static bool on_dom_array_begin(void *context)
+{
+    push_frame((dom_builder_t*)context, false);
+    return true;
+}
+
+static bool on_dom_array_end(void *context)
+{
+    dom_builder_t *builder = context;
+    size_t base = builder->frames[--builder->frames_count] >> 1;
+    push_to_stack(builder, close_array(builder, base));
+    return true;
+}
+
+static bool on_dom_key(void *context, const wide_string_t *key)
+{
+    dom_builder_t *builder = context;
+    if (builder->keys)
+        push_to_stack(builder, intern_key(builder->keys, key->data, key->length,
+            hash_wide_chars(key->data, key->length)));
+    else
+        push_to_stack(builder, create_wide_string_in_memory(builder->arena, key->data, key->length));
+    return true;
+}
+
+static bool on_dom_string(void *context, const wide_string_t *value)
+{
+    dom_builder_t *builder = context;
+    push_to_stack(builder, instantiate_json_string_with_chars(builder->arena, value->data, value->length));
+    return true;
+}
+
+static bool on_dom_number(void *context, const number_t *value)
+{
+    dom_builder_t *builder = context;
+    push_to_stack(builder, instantiate_json_number(builder->arena, value));
+    return true;
+}
+
+static bool on_dom_number_literal(void *context, const char *text, size_t length)
+{
+    dom_builder_t *builder = context;
+    if (builder->borrow_literals)
+        push_to_stack(builder, instantiate_json_borrowed_number(builder->arena, text, length));
+    else
+        push_to_stack(builder, instantiate_json_raw_number(builder->arena, text, length));
+    return true;
+}
+
+static bool on_dom_boolean(void *context, bool value)
+{
+    dom_builder_t *builder = context;
+    push_to_stack(builder, instantiate_json_boolean(builder->arena, value));
+    return true;
+}
+
+static bool on_dom_null(void *context)
+{
+    dom_builder_t *builder = context;
+    push_to_stack(builder, instantiate_json_null(builder->arena));
+    return true;
+}
+
+static bool on_dom_skipped_container(void *context, bool is_object, size_t begin)
+{
+    dom_builder_t *builder = context;
+    element_t *elem;
+    if (is_object)
+    {
+        elem = instantiate_json_object(builder->arena, 0);
+        elem->data.object->keys = builder->keys;
+        elem->data.object->lazy = builder->lazy;
+        elem->data.object->lazy_begin = begin;
+    }
+    else
+    {
+        elem = instantiate_json_array(builder->arena, 0);
+        elem->data.array->lazy = builder->lazy;
+        elem->data.array->lazy_begin = begin;
+    }
+    push_to_stack(builder, elem);
+    return true;
+}
+
+static const json_handler_t dom_handler =
+{
+    on_dom_object_begin,
+    on_dom_object_end,
+    on_dom_array_begin,
+    on_dom_array_end,
+    on_dom_key,
+    on_dom_string,
+    on_dom_number,
+    on_dom_boolean,
+    on_dom_null,
+    NULL
+};
+
+static const json_handler_t raw_number_dom_handler =
+{
+    on_dom_object_begin,
+    on_dom_object_end,
+    on_dom_array_begin,
+    on_dom_array_end,
+    on_dom_key,
+    on_dom_string,
+    NULL,
+    on_dom_boolean,
+    on_dom_null,
+    on_dom_number_literal
+};
+
+static __inline const json_handler_t * get_dom_handler(const json_options_t *options)
+{
+    return options && options->raw_numbers ? &raw_number_dom_handler : &dom_handler;
+}
+
+// --- statistics -------------------------------------------------------------
+
+/*
+    The counting handler is put in front of the DOM handler only when
+    there are statistics to fill, the events are passed on unchanged
+*/
+typedef struct
+{
+    const json_handler_t *handler;
+    void *context;
+    skipped_container_callback_t on_skipped;
+    json_parse_stats_t *stats;
+    size_t depth;
+} counting_context_t;
+
+static __inline void count_container(counting_context_t *counter, json_element_type_t type)
+{
+    counter->stats->elements[type]++;
+    if (++counter->depth > counter->stats->max_depth)
+        counter->stats->max_depth = counter->depth;
+}
+
+static bool on_counted_object_begin(void *context)
+{
+    counting_context_t *counter = context;
+    count_container(counter, json_object);
+    return counter->handler->on_object_begin(counter->context);
+}
+
+static bool on_counted_object_end(void *context)
+{
+    counting_context_t *counter = context;
+    counter->depth--;
+    return counter->handler->on_object_end(counter->context);
+}
+
+static bool on_counted_array_begin(void *context)
+{
+    counting_context_t *counter = context;
+    count_container(counter, json_array);
+    return counter->handler->on_array_begin(counter->context);
+}
+
+static bool on_counted_array_end(void *context)
+{
+    counting_context_t *counter = context;
+    counter->depth--;
+    return counter->handler->on_array_end(counter->context);
+}
+
+static bool on_counted_key(void *context, const wide_string_t *key)
+{
+    counting_context_t *counter = context;
+    counter->stats->keys++;
+    return counter->handler->on_key(counter->context, key);
+}
+
+static bool on_counted_string(void *context, const wide_string_t *value)
+{
+    counting_context_t *counter = context;
+    counter->stats->elements[json_string]++;
+    counter->stats->strings++;
+    return counter->handler->on_string(counter->context, value);
+}
+
+static bool on_counted_number(void *context, const number_t *value)
+{
+    counting_context_t *counter = context;
+    counter->stats->elements[json_number]++;
+    return counter->handler->on_number(counter->context, value);
+}
+
+static bool on_counted_boolean(void *context, bool value)
+{
+    counting_context_t *counter = context;
+    counter->stats->elements[json_boolean]++;
+    return counter->handler->on_boolean(counter->context, value);
+}
+
+static bool on_counted_null(void *context)
+{
+    counting_context_t *counter = context;
+    counter->stats->elements[json_null]++;
+    return counter->handler->on_null(counter->context);
+}
+
+static bool on_counted_number_literal(void *context, const char *text, size_t length)
+{
+    counting_context_t *counter = context;
+    counter->stats->elements[json_number]++;
+    return counter->handler->on_number_literal(counter->context, text, length);
+}
+
+static bool on_counted_skipped_container(void *context, bool is_object, size_t begin)
+{
+    counting_context_t *counter = context;
+    counter->stats->elements[is_object ? json_object : json_array]++;
+    if (counter->depth + 1 > counter->stats->max_depth)
+        counter->stats->max_depth = counter->depth + 1;
+    return counter->on_skipped(counter->context, is_object, begin);
+}
+
+static void init_counting_handler(json_handler_t *handler, const json_handler_t *inner)
+{
+    handler->on_object_begin = on_counted_object_begin;
+    handler->on_object_end = on_counted_object_end;
+    handler->on_array_begin = on_counted_array_begin;
+    handler->on_array_end = on_counted_array_end;
+    handler->on_key = on_counted_key;
+    handler->on_string = on_counted_string;
+    // the parser picks the kind of numbers by the callbacks that are set
+    handler->on_number = inner->on_number ? on_counted_number : NULL;
+    handler->on_boolean = on_counted_boolean;
+    handler->on_null = on_counted_null;
+    handler->on_number_literal = inner->on_number_literal ? on_counted_number_literal : NULL;
+}
+
+#ifdef _WIN32
+
+static double get_monotonic_seconds(void)
+{
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+#else
+
+static double get_monotonic_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+#endif
+
+// --- DOM building -----------------------------------------------------------
+
+/*
+    The builder is empty before and after the run, its stacks are kept;
+    without the buffer the parser has one of its own
+*/
+static json_element_t * run_dom_builder(dom_builder_t *builder, source_t *src, json_error_t *err,
+    const json_options_t *options, parser_buffer_t *buffer)
+{
+    const json_handler_t *handler = get_dom_handler(options);
+    void *context = builder;
+    skipped_container_callback_t on_skipped = on_dom_skipped_container;
+    json_handler_t counting_handler;
+    counting_context_t counter;
+    json_parse_stats_t *outer_stats = allocation_stats;
+    size_t begin = src->index;
+    size_t escapes = src->escapes;
+    double started = 0;
+    if (options && options->stats)
+    {
+        counter.handler = handler;
+        counter.context = context;
+        counter.on_skipped = on_skipped;
+        counter.stats = options->stats;
+        counter.depth = 0;
+        init_counting_handler(&counting_handler, handler);
+        handler = &counting_handler;
+        context = &counter;
+        on_skipped = on_counted_skipped_container;
+        allocation_stats = options->stats;
+        started = get_monotonic_seconds();
+    }
+    element_t *root = NULL;
+    bool parsed;
+    if (options && options->lazy && options->arena)
+    {
+        // the text outlives a lazy document, so UTF-8 literals are never copied
+        lazy_source_t *lazy = alloc_memory(options->arena, sizeof(lazy_source_t));
+        lazy->src = *src;
+        lazy->options = *options;
+        lazy->options.stats = NULL;
+        lazy->borrow_literals = builder->borrow_literals || src->bytes != NULL;
+        builder->borrow_literals = lazy->borrow_literals;
+        builder->lazy = lazy;
+        parsed = run_shallow_json_parser(src, handler, context, options->max_depth,
+            on_skipped, true, err);
+    }
+    else if (buffer)
+        parsed = run_json_parser_with_buffer(src, handler, context, options->max_depth, buffer, err);
+    else
+        parsed = run_json_parser(src, handler, context, options ? options->max_depth : 0, err);
+    if (parsed)
+    {
+        assert(builder->stack_size == 1 && builder->frames_count == 0);
+        root = builder->stack[0];
+        root->parent = NULL;
+        builder->stack_size = 0;
+    }
+    else
+        discard_dom_builder_content(builder);
+    if (options && options->stats)
+    {
+        json_parse_stats_t *stats = options->stats;
+        stats->consumed += src->index - begin;
+        stats->escapes += src->escapes - escapes;
+        stats->seconds += get_monotonic_seconds() - started;
+        allocation_stats = outer_stats;
+    }
+    return (json_element_t*)root;
+}
+
+static json_element_t * build_dom(source_t *src, json_error_t *err, const json_options_t *options,
+    bool borrow_literals)
+{
+    dom_builder_t builder;
+    init_dom_builder(&builder, options);
+    builder.borrow_literals = borrow_literals;
+    json_element_t *root = run_dom_builder(&builder, src, err, options, NULL);
+    release_dom_builder(&builder);
+    return root;
+}
+
+void expand_lazy_container(element_t *elem)
+{
+    bool is_object = elem->type == json_object;
+    const lazy_source_t *lazy = is_object ? elem->data.object->lazy : elem->data.array->lazy;
+    if (!lazy)
+        return;
+    dom_builder_t builder;
+    init_dom_builder(&builder, &lazy->options);
+    builder.borrow_literals = lazy->borrow_literals;
+    builder.lazy = lazy;
+    source_t src = lazy->src;
+    src.index = is_object ? elem->data.object->lazy_begin : elem->data.array->lazy_begin;
+    // the text has been validated by the first pass, so no errors are expected here
+    if (run_shallow_json_parser(&src, get_dom_handler(&lazy->options), &builder, 0,
+        on_dom_skipped_container, false, NULL))
+    {
+        // the new data is copied in place, so pointers to the old one stay valid
+        element_t *expanded = builder.stack[0];
+        if (is_object)
+        {
+            private_object_data_t *object = elem->data.object;
+            *object = *expanded->data.object;
+            for (size_t i = 0; i < object->count; i++)
+                object->pairs[i].value->parent = (json_element_t*)elem;
+        }
+        else
+        {
+            private_array_data_t *array = elem->data.array;
+            *array = *expanded->data.array;
+            for (size_t i = 0; i < array->count; i++)
+                array->items[i]->parent = (json_element_t*)elem;
+        }
+    }
+    release_dom_builder(&builder);
+}
+
+static void reset_dom_builder_context(void *context)
+{
+    discard_dom_builder_content((dom_builder_t*)context);
+}
+
+static void release_dom_builder_context(void *context)
+{
+    dom_builder_t *builder = context;
+    discard_dom_builder_content(builder);
+    release_dom_builder(builder);
+    free(builder);
+}
+
+json_parser_t * create_json_dom_parser_with_options(const json_options_t *options)
+{
+    dom_builder_t *builder = nnalloc(sizeof(dom_builder_t));
+    init_dom_builder(builder, options);
+    return create_json_parser_with_owner(get_dom_handler(options), builder, options ? options->max_depth : 0,
+        reset_dom_builder_context, release_dom_builder_context);
+}
+
+json_parser_t * create_json_dom_parser(json_arena_t *arena)
+{
+    json_options_t options = { arena, NULL, false, false, 0, NULL };
+    return create_json_dom_parser_with_options(&options);
+}
+
+json_element_t * take_root_from_json_parser(json_parser_t *parser)
+{
+    dom_builder_t *builder = get_json_parser_context(parser);
+    if (builder->frames_count != 0 || builder->stack_size != 1)
+        return NULL;
+    element_t *root = builder->stack[0];
+    root->parent = NULL;
+    builder->stack_size = 0;
+    return (json_element_t*)root;
+}
+
+json_element_t * parse_json_with_options(wide_string_t *text, json_error_t *err, const json_options_t *options)
+{
+    source_t src;
+    init_source(&src, text);
+    return build_dom(&src, err, options, false);
+}
+
+json_element_t * parse_json_arena(wide_string_t *text, json_error_t *err, json_arena_t *arena)
+{
+    json_options_t options = { arena, NULL, false, false, 0, NULL };
+    return parse_json_with_options(text, err, &options);
+}
+
+json_element_t * parse_json_ext(wide_string_t *text, json_error_t *err)
+{
+    return parse_json_arena(text, err, NULL);
+}
+
+json_element_t * parse_json(wide_string_t *text)
+{
+    return parse_json_ext(text, NULL);
+}
+
+json_element_t * parse_json_utf8_with_options(const char *data, size_t length, json_error_t *err,
+    const json_options_t *options)
+{
+    source_t src;
+    init_utf8_source(&src, data, length);
+    return build_dom(&src, err, options, false);
+}
+
+json_element_t * parse_json_utf8(const char *data, size_t length, json_error_t *err)
+{
+    return parse_json_utf8_with_options(data, length, err, NULL);
+}
+
+// --- binary decoder ---------------------------------------------------------
+
+/*
+    Containers of the binary form know their sizes, so they are created with
+    the exact capacity when opened and get their items right away. Each distinct
+    key is hashed once; it is also created once if the objects do not own
+    their keys, that is, in an arena or with a key table
+*/
+typedef struct
+{
+    wide_string_t *key;
+    size_t hash;
+} decoded_key_t;
+
+typedef struct
+{
+    json_arena_t *arena;
+    json_key_table_t *keys;
+    bool raw_numbers;
+    decoded_key_t *known_keys;
+    size_t known_keys_capacity;
+    element_t **containers;
+    size_t containers_count;
+    size_t containers_capacity;
+    element_t *root;
+    wide_string_t *key;
+    size_t hash;
+} binary_builder_t;
+
+static void remember_decoded_key(binary_builder_t *builder, const binary_item_t *item)
+{
+    if (item->key_id == builder->known_keys_capacity)
+    {
+        builder->known_keys = grow_memory(NULL, builder->known_keys,
+            builder->known_keys_capacity * sizeof(decoded_key_t),
+            builder->known_keys_capacity * 2 * sizeof(decoded_key_t));
+        builder->known_keys_capacity *= 2;
+    }
+    decoded_key_t *known = &builder->known_keys[item->key_id];
+    known->hash = hash_wide_chars(item->string.data, item->string.length);
+    if (builder->keys)
+        known->key = intern_key(builder->keys, item->string.data, item->string.length, known->hash);
+    else if (builder->arena)
+        known->key = create_wide_string_in_memory(builder->arena, item->string.data, item->string.length);
+    else
+        known->key = NULL;
+}
+
+static void take_decoded_key(binary_builder_t *builder, const binary_item_t *item)
+{
+    if (item->is_new_key)
+        remember_decoded_key(builder, item);
+    const decoded_key_t *known = &builder->known_keys[item->key_id];
+    builder->hash = known->hash;
+    builder->key = known->key ? known->key
+        : create_wide_string_in_memory(NULL, item->string.data, item->string.length);
+}
+
+static void add_decoded_element(binary_builder_t *builder, element_t *elem)
+{
+    if (builder->containers_count == 0)
+    {
+        builder->root = elem;
+        elem->parent = NULL;
+        return;
+    }
+    element_t *this = builder->containers[builder->containers_count - 1];
+    if (this->type == json_array)
+    {
+        add_element_to_array(this, elem);
+        return;
+    }
+    private_object_data_t *object = this->data.object;
+    elem->parent = (json_element_t*)this;
+    size_t number = find_pair_in_object(object, builder->hash, builder->key->data, builder->key->length);
+    if (number == pair_not_found)
+        append_pair_to_object(object, builder->key, builder->hash, elem);
+    else
+    {
+        // the encoder writes no repeated keys, but the data may come from anywhere
+        element_t *old_value = object->pairs[number].value;
+        object->pairs[number].value = elem;
+        if (!builder->arena)
+        {
+            if (!builder->keys)
+                free(builder->key);
+            destructors[old_value->type](old_value);
+        }
+    }
+    builder->key = NULL;
+}
+
+static element_t * create_decoded_element(binary_builder_t *builder, const binary_item_t *item)
+{
+    json_arena_t *arena = builder->arena;
+    number_t num;
+    element_t *elem;
+    switch (item->type)
+    {
+        case binary_item_null:
+            return instantiate_json_null(arena);
+        case binary_item_boolean:
+            return instantiate_json_boolean(arena, item->bool_value);
+        case binary_item_integer:
+            init_number_by_real(&num, (real_t)item->integer);
+            return instantiate_json_number(arena, &num);
+        case binary_item_double:
+            init_number_by_real(&num, (real_t)item->real);
+            return instantiate_json_number(arena, &num);
+        case binary_item_literal:
+        {
+            if (builder->raw_numbers)
+                return instantiate_json_raw_number(arena, item->literal, item->literal_length);
+            bool neg = item->literal[0] == '-';
+            if (!decode_json_number(item->literal + neg, item->literal_length - neg, neg, &num))
+                init_number_by_real(&num, 0);
+            return instantiate_json_number(arena, &num);
+        }
+        case binary_item_string:
+            return instantiate_json_string_with_chars(arena, item->string.data, item->string.length);
+        case binary_item_array:
+            return instantiate_json_array(arena, item->count);
+        case binary_item_object:
+            elem = instantiate_json_object(arena, item->count);
+            elem->data.object->keys = builder->keys;
+            if (item->count > object_index_threshold)
+                rebuild_object_index(elem->data.object, item->count);
+            return elem;
+        default:
+            return NULL;
+    }
+}
+
+json_element_t * decode_json_element(const void *data, size_t size, const json_options_t *options,
+    json_error_t *err)
+{
+    binary_builder_t builder;
+    builder.arena = options ? options->arena : NULL;
+    builder.keys = options ? options->keys : NULL;
+    builder.raw_numbers = options && options->raw_numbers;
+    builder.known_keys_capacity = 64;
+    builder.known_keys = nnalloc(builder.known_keys_capacity * sizeof(decoded_key_t));
+    builder.containers_capacity = 16;
+    builder.containers = nnalloc(builder.containers_capacity * sizeof(element_t*));
+    builder.containers_count = 0;
+    builder.root = NULL;
+    builder.key = NULL;
+    binary_reader_t reader;
+    binary_item_t item;
+    bool ok = init_binary_reader(&reader, data, size, err);
+    while (ok && read_binary_item(&reader, &item))
+    {
+        if (item.type == binary_item_end)
+            builder.containers_count--;
+        else if (item.type == binary_item_key)
+            take_decoded_key(&builder, &item);
+        else
+        {
+            element_t *elem = create_decoded_element(&builder, &item);
+            add_decoded_element(&builder, elem);
+            if (item.type == binary_item_array || item.type == binary_item_object)
+            {
+                if (builder.containers_count == builder.containers_capacity)
+                {
+                    builder.containers = grow_memory(NULL, builder.containers,
+                        builder.containers_count * sizeof(element_t*),
+                        builder.containers_count * 2 * sizeof(element_t*));
+                    builder.containers_capacity *= 2;
+                }
+                builder.containers[builder.containers_count++] = elem;
+            }
+        }
+    }
+    ok = ok && !reader.failed;
+    release_binary_reader(&reader);
+    if (!ok && !builder.arena)
+    {
+        // the items are attached as they come, so the root holds all of them
+        if (builder.key && !builder.keys)
+            free(builder.key);
+        destroy_json_element((json_element_base_t*)builder.root);
+    }
+    free(builder.known_keys);
+    free(builder.containers);
+    return ok ? (json_element_t*)builder.root : NULL;
+}
+
+// --- context ----------------------------------------------------------------
+
+struct json_context_t
+{
+    json_arena_t *arena;
+    json_key_table_t *own_keys;
+    json_options_t options;
+    dom_builder_t builder;
+    parser_buffer_t buffer;
+};
+
+json_context_t * create_json_context(const json_options_t *options)
+{
+    json_context_t *ctx = nnalloc(sizeof(json_context_t));
+    json_options_t defaults = { NULL, NULL, false, false, 0, NULL };
+    ctx->options = options ? *options : defaults;
+    ctx->arena = create_json_arena(0);
+    ctx->options.arena = ctx->arena;
+    ctx->options.lazy = false;
+    ctx->own_keys = ctx->options.keys ? NULL : create_json_key_table();
+    if (ctx->own_keys)
+        ctx->options.keys = ctx->own_keys;
+    init_dom_builder(&ctx->builder, &ctx->options);
+    ctx->buffer.chars = NULL;
+    ctx->buffer.capacity = 0;
+    return ctx;
+}
+
+json_element_t * parse_json_with_context(json_context_t *ctx, wide_string_t *text, json_error_t *err)
+{
+    source_t src;
+    init_source(&src, text);
+    return run_dom_builder(&ctx->builder, &src, err, &ctx->options, &ctx->buffer);
+}
+
+json_element_t * parse_json_utf8_with_context(json_context_t *ctx, const char *data, size_t length,
+    json_error_t *err)
+{
+    source_t src;
+    init_utf8_source(&src, data, length);
+    return run_dom_builder(&ctx->builder, &src, err, &ctx->options, &ctx->buffer);
+}
+
+void reset_json_context(json_context_t *ctx)
+{
+    reset_json_arena(ctx->arena);
+    if (ctx->own_keys)
+        clear_json_key_table(ctx->own_keys);
+}
+
+void destroy_json_context(json_context_t *ctx)
+{
+    if (ctx)
+    {
+        release_dom_builder(&ctx->builder);
+        free(ctx->buffer.chars);
+        destroy_json_key_table(ctx->own_keys);
+        destroy_json_arena(ctx->arena);
+        free(ctx);
+    }
+}
+
+// --- document ---------------------------------------------------------------
+
+json_document_t * parse_json_document(wide_string_t *text, json_error_t *err)
+{
+    json_arena_t *arena = create_json_arena(0);
+    json_element_t *root = parse_json_arena(text, err, arena);
+    if (!root)
+    {
+        destroy_json_arena(arena);
+        return NULL;
+    }
+    private_document_t *doc = alloc_from_json_arena(arena, sizeof(private_document_t));
+    doc->root = root;
+    doc->arena = arena;
+    doc->mapping.data = NULL;
+    doc->worker_arenas_count = 0;
+    return (json_document_t*)doc;
+}
+
+json_document_t * parse_json_file(const char *path, const json_options_t *options, json_error_t *err)
+{
+    file_mapping_t mapping;
+    if (!map_file(path, &mapping))
+    {
+        init_json_error(err);
+        if (err)
+            err->type = json_cannot_read_file;
+        return NULL;
+    }
+    json_arena_t *arena = create_json_arena(0);
+    json_options_t own_options = { arena, NULL, false, false, 0, NULL };
+    if (options)
+    {
+        own_options.keys = options->keys;
+        own_options.raw_numbers = options->raw_numbers;
+        own_options.lazy = options->lazy;
+        own_options.max_depth = options->max_depth;
+        own_options.stats = options->stats;
+    }
+    source_t src;
+    init_utf8_source(&src, mapping.data, mapping.size);
+    json_element_t *root = build_dom(&src, err, &own_options, true);
+    if (!root)
+    {
+        destroy_json_arena(arena);
+        unmap_file(&mapping);
+        return NULL;
+    }
+    private_document_t *doc = alloc_from_json_arena(arena, sizeof(private_document_t));
+    doc->root = root;
+    doc->arena = arena;
+    doc->worker_arenas_count = 0;
+    // strings and keys are copied, only raw literals and lazy containers refer to the text
+    if (own_options.raw_numbers || own_options.lazy)
+        doc->mapping = mapping;
+    else
+    {
+        unmap_file(&mapping);
+        doc->mapping.data = NULL;
+    }
+    return (json_document_t*)doc;
+}
+
+// --- selective parsing ------------------------------------------------------
+
+typedef struct
+{
+    const json_path_set_t *set;
+    const json_element_t **results;
+    const json_options_t *options;
+} selection_t;
+
+static size_t select_path_member(void *context, size_t node, const wide_string_t *key, size_t index)
+{
+    const json_path_set_t *set = ((selection_t*)context)->set;
+    size_t hash = key ? hash_wide_chars(key->data, key->length) : 0;
+    for (size_t child = set->nodes[node].first_child; child; child = set->nodes[child].next_sibling)
+    {
+        const path_step_t *step = &set->nodes[child].step;
+        if (key ? step->hash == hash && step->key->length == key->length
+                && memcmp(step->key->data, key->data, key->length * sizeof(wchar_t)) == 0
+            : step->index == index)
+            return child;
+    }
+    return 0;
+}
+
+static bool is_path_node_taken(void *context, size_t node)
+{
+    return ((selection_t*)context)->set->nodes[node].first_path != 0;
+}
+
+static bool take_path_node_value(void *context, size_t node, source_t *src, json_error_t *err)
+{
+    selection_t *selection = context;
+    element_t *elem = (element_t*)build_dom(src, err, selection->options, false);
+    if (!elem)
+        return false;
+    // the paths going deeper than the taken value are resolved in the built elements
+    find_json_elements_by_path_node(selection->set, node, elem, selection->results);
+    return true;
+}
+
+static const selector_t path_selector =
+{
+    select_path_member,
+    is_path_node_taken,
+    take_path_node_value
+};
+
+static json_document_t * parse_selected_source(source_t *src, const json_path_set_t *set,
+    const json_options_t *options, const json_element_t **results, json_error_t *err)
+{
+    json_arena_t *arena = create_json_arena(0);
+    json_options_t own_options = { arena, NULL, false, false, 0, NULL };
+    if (options)
+    {
+        own_options.keys = options->keys;
+        own_options.raw_numbers = options->raw_numbers;
+        own_options.max_depth = options->max_depth;
+        own_options.stats = options->stats;
+    }
+    for (size_t k = 0; k < set->count; k++)
+        results[k] = NULL;
+    selection_t selection = { set, results, &own_options };
+    if (!run_selective_json_parser(src, &path_selector, &selection, err))
+    {
+        for (size_t k = 0; k < set->count; k++)
+            results[k] = NULL;
+        destroy_json_arena(arena);
+        return NULL;
+    }
+    private_document_t *doc = alloc_from_json_arena(arena, sizeof(private_document_t));
+    doc->root = NULL;
+    doc->arena = arena;
+    doc->mapping.data = NULL;
+    doc->worker_arenas_count = 0;
+    return (json_document_t*)doc;
+}
+
+json_document_t * parse_json_selected(wide_string_t *text, const json_path_set_t *set,
+    const json_options_t *options, const json_element_t **results, json_error_t *err)
+{
+    source_t src;
+    init_source(&src, text);
+    return parse_selected_source(&src, set, options, results, err);
+}
+
+json_document_t * parse_json_utf8_selected(const char *data, size_t length, const json_path_set_t *set,
+    const json_options_t *options, const json_element_t **results, json_error_t *err)
+{
+    source_t src;
+    init_utf8_source(&src, data, length);
+    return parse_selected_source(&src, set, options, results, err);
+}
+
+// --- parallel parsing -------------------------------------------------------
+
+typedef struct
+{
+    size_t begin;
+    size_t end;
+} item_span_t;
+
+typedef struct
+{
+    const char *data;
+    const item_span_t *spans;
+    element_t **items;
+    size_t first;
+    size_t last;
+    json_options_t options;
+    json_parse_stats_t stats;
+    bool failed;
+} array_worker_t;
+
+static void add_item_span(item_span_t **list, size_t *count, size_t *capacity, size_t begin, size_t end)
+{
+    if (*count == *capacity)
+    {
+        *list = grow_memory(NULL, *list, *count * sizeof(item_span_t), *count * 2 * sizeof(item_span_t));
+        *capacity *= 2;
+    }
+    (*list)[*count].begin = begin;
+    (*list)[*count].end = end;
+    (*count)++;
+}
+
+/*
+    Finds the items of the top-level array by the structural index, fails if
+    the root is not an array or the brackets do not match
+*/
+static size_t split_top_level_array(const char *data, size_t length, const structural_index_t *index,
+    item_span_t **spans)
+{
+    *spans = NULL;
+    source_t src;
+    init_utf8_source(&src, data, length);
+    if (index->count == 0 || get_char_but_not_space(&src) != L'[' || index->positions[0] != src.index)
+        return 0;
+    size_t capacity = 1024;
+    item_span_t *list = nnalloc(capacity * sizeof(item_span_t));
+    size_t count = 0;
+    size_t begin = src.index + 1;
+    size_t depth = 0;
+    for (size_t i = 0; i < index->count; i++)
+    {
+        size_t pos = index->positions[i];
+        char c = data[pos];
+        if (c == '[' || c == '{')
+            depth++;
+        else if (c == ']' || c == '}')
+        {
+            if (--depth == 0)
+            {
+                if (c != ']')
+                    break;
+                add_item_span(&list, &count, &capacity, begin, pos);
+                *spans = list;
+                return count;
+            }
+        }
+        else if (c == ',' && depth == 1)
+        {
+            add_item_span(&list, &count, &capacity, begin, pos);
+            begin = pos + 1;
+        }
+    }
+    free(list);
+    return 0;
+}
+
+static void parse_array_items(void *argument)
+{
+    array_worker_t *worker = argument;
+    for (size_t i = worker->first; i < worker->last && !worker->failed; i++)
+    {
+        const item_span_t *span = &worker->spans[i];
+        source_t src;
+        init_utf8_source(&src, worker->data, span->end);
+        src.index = span->begin;
+        element_t *item = (element_t*)build_dom(&src, NULL, &worker->options, false);
+        // the item must take the whole span, otherwise the sequential parser reports the error
+        if (!item || skip_spaces(&src) != L'\0')
+            worker->failed = true;
+        worker->items[i] = item;
+    }
+}
+
+/*
+    The workers intern keys into tables of their own, so the threads do not share
+    a table; after the parse the keys are moved to the table of the options
+*/
+static void move_keys_to_table(element_t *elem, json_key_table_t *keys)
+{
+    if (elem->type == json_object)
+    {
+        private_object_data_t *object = elem->data.object;
+        object->keys = keys;
+        for (size_t i = 0; i < object->count; i++)
+        {
+            private_pair_t *pair = &object->pairs[i];
+            pair->key = intern_key(keys, pair->key->data, pair->key->length, pair->hash);
+            move_keys_to_table(pair->value, keys);
+        }
+    }
+    else if (elem->type == json_array)
+    {
+        private_array_data_t *array = elem->data.array;
+        for (size_t i = 0; i < array->count; i++)
+            move_keys_to_table(array->items[i], keys);
+    }
+}
+
+/*
+    Adds the counters of a worker to the statistics of the whole parse,
+    the depths of the items are one level below the top-level array
+*/
+static void merge_parse_stats(json_parse_stats_t *stats, const json_parse_stats_t *worker)
+{
+    for (int type = 0; type <= json_boolean; type++)
+        stats->elements[type] += worker->elements[type];
+    if (worker->max_depth + 1 > stats->max_depth)
+        stats->max_depth = worker->max_depth + 1;
+    stats->keys += worker->keys;
+    stats->strings += worker->strings;
+    stats->escapes += worker->escapes;
+    stats->allocations += worker->allocations;
+    stats->allocated_bytes += worker->allocated_bytes;
+}
+
+json_document_t * parse_json_utf8_parallel(const char *data, size_t length, const json_options_t *options,
+    size_t threads_count, json_error_t *err)
+{
+    if (threads_count == 0)
+        threads_count = get_processors_count();
+    // with one level allowed any container item is too deep, the sequential parser reports it
+    size_t max_depth = options ? options->max_depth : 0;
+    if (max_depth == 1)
+        threads_count = 1;
+    // a lazy document builds only its top container, there is nothing to share among threads
+    if (options && options->lazy)
+        threads_count = 1;
+    json_parse_stats_t *stats = options ? options->stats : NULL;
+    double started = stats ? get_monotonic_seconds() : 0;
+    structural_index_t index;
+    item_span_t *spans = NULL;
+    size_t count = 0;
+    if (threads_count > 1 && build_structural_index((const uint8_t*)data, length, &index))
+    {
+        count = split_top_level_array(data, length, &index, &spans);
+        release_structural_index(&index);
+    }
+    if (count == 1)
+    {
+        source_t src;
+        init_utf8_source(&src, data, spans[0].end);
+        src.index = spans[0].begin;
+        // "[ ]" has one blank span and no items
+        if (skip_spaces(&src) == L'\0')
+            count = 0;
+    }
+    if (threads_count > count)
+        threads_count = count;
+
+    json_arena_t *arena = create_json_arena(0);
+    json_element_t *root = NULL;
+    json_arena_t **worker_arenas = NULL;
+    if (threads_count > 1)
+    {
+        element_t **items = nnalloc(count * sizeof(element_t*));
+        array_worker_t *workers = nnalloc(threads_count * sizeof(array_worker_t));
+        worker_arenas = alloc_from_json_arena(arena, threads_count * sizeof(json_arena_t*));
+        size_t first = 0;
+        for (size_t k = 0; k < threads_count; k++)
+        {
+            size_t last = first;
+            size_t limit = (size_t)((double)length * (k + 1) / threads_count);
+            while (last < count && (k == threads_count - 1 || spans[last].begin < limit))
+                last++;
+            worker_arenas[k] = create_json_arena(0);
+            workers[k].data = data;
+            workers[k].spans = spans;
+            workers[k].items = items;
+            workers[k].first = first;
+            workers[k].last = last;
+            workers[k].options.arena = worker_arenas[k];
+            workers[k].options.keys = options && options->keys ? create_json_key_table() : NULL;
+            workers[k].options.raw_numbers = options ? options->raw_numbers : false;
+            workers[k].options.lazy = false;
+            // the items are parsed as documents of their own, the array takes one level
+            workers[k].options.max_depth = max_depth ? max_depth - 1 : 0;
+            memset(&workers[k].stats, 0, sizeof(json_parse_stats_t));
+            workers[k].options.stats = stats ? &workers[k].stats : NULL;
+            workers[k].failed = false;
+            first = last;
+        }
+        run_in_parallel(parse_array_items, workers, sizeof(array_worker_t), threads_count);
+        bool failed = false;
+        for (size_t k = 0; k < threads_count; k++)
+            failed = failed || workers[k].failed;
+        if (!failed)
+        {
+            allocation_stats = stats;
+            element_t *array = instantiate_json_array(arena, count);
+            allocation_stats = NULL;
+            for (size_t i = 0; i < count; i++)
+            {
+                array->data.array->items[i] = items[i];
+                items[i]->parent = (json_element_t*)array;
+                if (options && options->keys)
+                    move_keys_to_table(items[i], options->keys);
+            }
+            array->data.array->count = count;
+            array->parent = NULL;
+            root = (json_element_t*)array;
+            init_json_error(err);
+            if (stats)
+            {
+                stats->elements[json_array]++;
+                for (size_t k = 0; k < threads_count; k++)
+                    merge_parse_stats(stats, &workers[k].stats);
+                // the sequential parser stops right after the closing bracket
+                stats->consumed += spans[count - 1].end + 1;
+                stats->seconds += get_monotonic_seconds() - started;
+            }
+        }
+        else
+        {
+            for (size_t k = 0; k < threads_count; k++)
+                destroy_json_arena(worker_arenas[k]);
+            worker_arenas = NULL;
+        }
+        for (size_t k = 0; k < threads_count; k++)
+            destroy_json_key_table(workers[k].options.keys);
+        free(workers);
+        free(items);
+    }
+    free(spans);
+    if (!root)
+    {
+        json_options_t own_options = { arena, NULL, false, false, 0, NULL };
+        if (options)
+        {
+            own_options.keys = options->keys;
+            own_options.raw_numbers = options->raw_numbers;
+            own_options.lazy = options->lazy;
+            own_options.max_depth = options->max_depth;
+            own_options.stats = options->stats;
+        }
+        root = parse_json_utf8_with_options(data, length, err, &own_options);
+    }
+    if (!root)
+    {
+        destroy_json_arena(arena);
+        return NULL;
+    }
+    private_document_t *doc = alloc_from_json_arena(arena, sizeof(private_document_t));
+    doc->root = root;
+    doc->arena = arena;
+    doc->mapping.data = NULL;
+    doc->worker_arenas = worker_arenas;
+    doc->worker_arenas_count = worker_arenas ? threads_count : 0;
+    return (json_document_t*)doc;
+}
+
+void destroy_json_document(json_document_t *iface)
+{
+    private_document_t *doc = (private_document_t*)iface;
+    if (doc)
+    {
+        file_mapping_t mapping = doc->mapping;
+        for (size_t k = 0; k < doc->worker_arenas_count; k++)
+            destroy_json_arena(doc->worker_arenas[k]);
+        destroy_json_arena(doc->arena);
+        unmap_file(&mapping);
+    }
+}
+
+// --- frozen documents -------------------------------------------------------
+
+typedef struct
+{
+    json_element_t *root;
+    json_document_t *doc;
+    volatile long references;
+} private_frozen_t;
+
+/*
+    Does every write that a read could otherwise do later: lazy containers
+    are expanded and raw numbers are converted
+*/
+static void settle_element(element_t *elem)
+{
+    expand_element(elem);
+    if (elem->type == json_object)
+    {
+        private_object_data_t *object = elem->data.object;
+        for (size_t i = 0; i < object->count; i++)
+            settle_element(object->pairs[i].value);
+    }
+    else if (elem->type == json_array)
+    {
+        private_array_data_t *array = elem->data.array;
+        for (size_t i = 0; i < array->count; i++)
+            settle_element(array->items[i]);
+    }
+    else if (elem->type == json_number)
+        get_value_from_json_number((json_number_t*)elem);
+}
+
+static json_frozen_t * create_frozen(json_element_t *root, json_document_t *doc)
+{
+    if (!root)
+        return NULL;
+    settle_element((element_t*)root);
+    private_frozen_t *frozen = nnalloc(sizeof(private_frozen_t));
+    frozen->root = root;
+    frozen->doc = doc;
+    frozen->references = 1;
+    return (json_frozen_t*)frozen;
+}
+
+json_frozen_t * freeze_json_element(json_element_t *root)
+{
+    return create_frozen(root, NULL);
+}
+
+json_frozen_t * freeze_json_document(json_document_t *doc)
+{
+    return doc ? create_frozen(doc->root, doc) : NULL;
+}
+
+json_frozen_t * retain_json_frozen(json_frozen_t *iface)
+{
+    private_frozen_t *frozen = (private_frozen_t*)iface;
+    if (frozen)
+        increment_atomic_counter(&frozen->references);
+    return iface;
+}
+
+bool release_json_frozen(json_frozen_t *iface)
+{
+    private_frozen_t *frozen = (private_frozen_t*)iface;
+    if (!frozen || decrement_atomic_counter(&frozen->references) != 0)
+        return false;
+    if (frozen->doc)
+        destroy_json_document(frozen->doc);
+    else
+        destroy_json_element(&frozen->root->base);
+    free(frozen);
+    return true;
 }
@@ -0,0 +1,386 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    The parallel parser of newline-delimited JSON
+*/
+
+#include <string.h>
+#include "json.h"
+#include "allocator.h"
+#include "threads.h"
+
+typedef struct
+{
+    size_t offset;
+    size_t length;
+    size_t line;
+} record_span_t;
+
+typedef struct
+{
+    const char *data;
+    const record_span_t *spans;
+    json_record_t *records;
+    size_t first;
+    size_t last;
+    json_options_t options;
+} worker_t;
+
+struct json_batch_t
+{
+    size_t count;
+    json_record_t *records;
+    size_t arenas_count;
+    json_arena_t **arenas;
+};
+
+static bool is_blank(const char *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        char c = data[i];
+        if (c != ' ' && c != '\t' && c != '\r')
+            return false;
+    }
+    return true;
+}
+
+static size_t split_lines(const char *data, size_t length, record_span_t **spans)
+{
+    size_t count = 0;
+    size_t capacity = 1024;
+    record_span_t *list = nnalloc(capacity * sizeof(record_span_t));
+    size_t offset = 0;
+    size_t line = 1;
+    while (offset < length)
+    {
+        const char *end = memchr(data + offset, '\n', length - offset);
+        size_t size = end ? (size_t)(end - data) - offset : length - offset;
+        if (!is_blank(data + offset, size))
+        {
+            if (count == capacity)
+            {
+                record_span_t *bigger = nnalloc(capacity * 2 * sizeof(record_span_t));
+                memcpy(bigger, list, count * sizeof(record_span_t));
+                free(list);
+                list = bigger;
+                capacity *= 2;
+            }
+            list[count].offset = offset;
+            list[count].length = size;
+            list[count].line = line;
+            count++;
+        }
+        offset += size + 1;
+        line++;
+    }
+    *spans = list;
+    return count;
+}
+
+static void parse_records(void *argument)
+{
+    worker_t *worker = argument;
+    for (size_t i = worker->first; i < worker->last; i++)
+    {
+        const record_span_t *span = &worker->spans[i];
+        json_record_t *record = &worker->records[i];
+        record->line = span->line;
+        record->root = parse_json_utf8_with_options(worker->data + span->offset, span->length,
+            &record->error, &worker->options);
+        if (!record->root)
+            record->error.where.row = (int)span->line;
+    }
+}
+
+json_batch_t * parse_json_lines(const char *data, size_t length, const json_options_t *options,
+    size_t threads_count)
+{
+    record_span_t *spans;
+    size_t count = split_lines(data, length, &spans);
+    if (threads_count == 0)
+        threads_count = get_processors_count();
+    if (threads_count > count)
+        threads_count = count ? count : 1;
+
+    json_batch_t *batch = nnalloc(sizeof(json_batch_t));
+    batch->count = count;
+    batch->records = nnalloc((count ? count : 1) * sizeof(json_record_t));
+    batch->arenas_count = threads_count;
+    batch->arenas = nnalloc(threads_count * sizeof(json_arena_t*));
+
+    // each worker takes a run of records with about the same number of bytes
+    worker_t *workers = nnalloc(threads_count * sizeof(worker_t));
+    size_t first = 0;
+    for (size_t k = 0; k < threads_count; k++)
+    {
+        size_t last = first;
+        size_t limit = (size_t)((double)length * (k + 1) / threads_count);
+        while (last < count && (k == threads_count - 1 || spans[last].offset < limit))
+            last++;
+        batch->arenas[k] = create_json_arena(0);
+        workers[k].data = data;
+        workers[k].spans = spans;
+        workers[k].records = batch->records;
+        workers[k].first = first;
+        workers[k].last = last;
+        workers[k].options.arena = batch->arenas[k];
+        workers[k].options.keys = NULL;
+        workers[k].options.raw_numbers = options ? options->raw_numbers : false;
+        workers[k].options.lazy = false;
+        workers[k].options.max_depth = options ? options->max_depth : 0;
+        workers[k].options.stats = NULL;
+        first = last;
+    }
+    run_in_parallel(parse_records, workers, sizeof(worker_t), threads_count);
+    free(workers);
+    free(spans);
+    return batch;
+}
+
+size_t get_json_batch_size(const json_batch_t *batch)
+{
+    return batch->count;
+}
+
+const json_record_t * get_record_from_json_batch(const json_batch_t *batch, size_t index)
+{
+    return index < batch->count ? &batch->records[index] : NULL;
+}
+
+void destroy_json_batch(json_batch_t *batch)
+{
+    if (batch)
+    {
+        for (size_t k = 0; k < batch->arenas_count; k++)
+            destroy_json_arena(batch->arenas[k]);
+        free(batch->arenas);
+        free(batch->records);
+        free(batch);
+    }
+}
+
+// --- streaming -------------------------------------------------------------
+
+/*
+    The callback does not wait for the whole input: it is cut into chunks of whole
+    lines that the threads take in turn, and the calling thread passes the records
+    of each finished chunk on in the input order. Only a window of chunks is
+    parsed ahead of the callback, and the arena of a chunk is reused once its
+    records are passed, so the memory depends on the window, not on the input
+*/
+#define stream_chunk_size (256 * 1024)
+
+typedef struct
+{
+    size_t offset;
+    size_t end;
+    json_arena_t *arena;
+    json_record_t *records;
+    size_t count;
+    size_t capacity;
+    size_t lines;
+    bool done;
+} stream_chunk_t;
+
+typedef struct
+{
+    const char *data;
+    size_t length;
+    json_options_t options;
+    stream_chunk_t *chunks;
+    size_t window;
+    size_t next_offset;
+    size_t taken;
+    size_t passed;
+    bool stopped;
+    monitor_t monitor;
+    json_record_callback_t callback;
+    void *context;
+    bool result;
+} stream_t;
+
+typedef struct
+{
+    stream_t *stream;
+    bool passes_records;
+} stream_worker_t;
+
+/*
+    Takes the next chunk of the input if the window allows it; the monitor is held
+*/
+static stream_chunk_t * take_stream_chunk(stream_t *stream)
+{
+    if (stream->stopped || stream->next_offset >= stream->length || stream->taken >= stream->passed + stream->window)
+        return NULL;
+    stream_chunk_t *chunk = &stream->chunks[stream->taken % stream->window];
+    size_t offset = stream->next_offset;
+    size_t end = stream->length;
+    if (end - offset > stream_chunk_size)
+    {
+        const char *next_line = memchr(stream->data + offset + stream_chunk_size, '\n',
+            stream->length - offset - stream_chunk_size);
+        if (next_line)
+            end = (size_t)(next_line - stream->data) + 1;
+    }
+    chunk->offset = offset;
+    chunk->end = end;
+    chunk->done = false;
+    stream->next_offset = end;
+    stream->taken++;
+    return chunk;
+}
+
+/*
+    Parses the lines of a chunk, their numbers are counted from the beginning
+    of the chunk and made absolute when the records are passed
+*/
+static void parse_stream_chunk(stream_t *stream, stream_chunk_t *chunk)
+{
+    if (!chunk->arena)
+        chunk->arena = create_json_arena(0);
+    json_options_t options = stream->options;
+    options.arena = chunk->arena;
+    chunk->count = 0;
+    chunk->lines = 0;
+    size_t offset = chunk->offset;
+    while (offset < chunk->end)
+    {
+        const char *end = memchr(stream->data + offset, '\n', chunk->end - offset);
+        size_t size = end ? (size_t)(end - stream->data) - offset : chunk->end - offset;
+        if (!is_blank(stream->data + offset, size))
+        {
+            if (chunk->count == chunk->capacity)
+            {
+                size_t capacity = chunk->capacity ? chunk->capacity * 2 : 256;
+                json_record_t *bigger = nnalloc(capacity * sizeof(json_record_t));
+                if (chunk->count)
+                    memcpy(bigger, chunk->records, chunk->count * sizeof(json_record_t));
+                free(chunk->records);
+                chunk->records = bigger;
+                chunk->capacity = capacity;
+            }
+            json_record_t *record = &chunk->records[chunk->count++];
+            record->line = chunk->lines;
+            record->root = parse_json_utf8_with_options(stream->data + offset, size, &record->error, &options);
+        }
+        offset += size + 1;
+        chunk->lines++;
+    }
+}
+
+static bool pass_stream_chunk(stream_t *stream, stream_chunk_t *chunk, size_t *index, size_t *line)
+{
+    bool result = true;
+    for (size_t i = 0; i < chunk->count && result; i++)
+    {
+        json_record_t *record = &chunk->records[i];
+        record->line += *line;
+        if (!record->root)
+            record->error.where.row = (int)record->line;
+        result = stream->callback(stream->context, (*index)++, record);
+    }
+    *line += chunk->lines;
+    reset_json_arena(chunk->arena);
+    return result;
+}
+
+static void run_stream_worker(void *argument)
+{
+    stream_worker_t *worker = argument;
+    stream_t *stream = worker->stream;
+    size_t index = 0;
+    size_t line = 1;
+    enter_monitor(&stream->monitor);
+    while (true)
+    {
+        if (worker->passes_records)
+        {
+            stream_chunk_t *chunk = &stream->chunks[stream->passed % stream->window];
+            if (stream->stopped || (stream->passed == stream->taken && stream->next_offset >= stream->length))
+                break;
+            if (stream->passed < stream->taken && chunk->done)
+            {
+                leave_monitor(&stream->monitor);
+                bool result = pass_stream_chunk(stream, chunk, &index, &line);
+                enter_monitor(&stream->monitor);
+                stream->passed++;
+                if (!result)
+                {
+                    stream->result = false;
+                    stream->stopped = true;
+                }
+                notify_monitor(&stream->monitor);
+                continue;
+            }
+        }
+        else if (stream->stopped || stream->next_offset >= stream->length)
+            break;
+        // the thread passing records also parses, so it never waits for a chunk nobody took
+        stream_chunk_t *chunk = take_stream_chunk(stream);
+        if (chunk)
+        {
+            leave_monitor(&stream->monitor);
+            parse_stream_chunk(stream, chunk);
+            enter_monitor(&stream->monitor);
+            chunk->done = true;
+            notify_monitor(&stream->monitor);
+        }
+        else
+            wait_in_monitor(&stream->monitor);
+    }
+    leave_monitor(&stream->monitor);
+}
+
+/*
+    The threads are started once per call and work until the input ends,
+    so their start is paid once for the whole input, not for each chunk
+*/
+bool parse_json_lines_with_callback(const char *data, size_t length, const json_options_t *options,
+    size_t threads_count, json_record_callback_t callback, void *context)
+{
+    if (threads_count == 0)
+        threads_count = get_processors_count();
+    size_t chunks_count = length / stream_chunk_size + 1;
+    if (threads_count > chunks_count)
+        threads_count = chunks_count;
+
+    stream_t stream;
+    stream.data = data;
+    stream.length = length;
+    stream.options.arena = NULL;
+    stream.options.keys = NULL;
+    stream.options.raw_numbers = options ? options->raw_numbers : false;
+    stream.options.lazy = false;
+    stream.options.max_depth = options ? options->max_depth : 0;
+    stream.options.stats = NULL;
+    stream.window = threads_count * 2;
+    stream.chunks = nnalloc(stream.window * sizeof(stream_chunk_t));
+    memset(stream.chunks, 0, stream.window * sizeof(stream_chunk_t));
+    stream.next_offset = 0;
+    stream.taken = 0;
+    stream.passed = 0;
+    stream.stopped = false;
+    stream.callback = callback;
+    stream.context = context;
+    stream.result = true;
+    init_monitor(&stream.monitor);
+
+    stream_worker_t *workers = nnalloc(threads_count * sizeof(stream_worker_t));
+    for (size_t k = 0; k < threads_count; k++)
+    {
+        workers[k].stream = &stream;
+        workers[k].passes_records = k == 0;
+    }
+    run_in_parallel(run_stream_worker, workers, sizeof(stream_worker_t), threads_count);
+    free(workers);
+
+    destroy_monitor(&stream.monitor);
+    for (size_t k = 0; k < stream.window; k++)
+    {
+        destroy_json_arena(stream.chunks[k].arena);
+        free(stream.chunks[k].records);
+    }
+    free(stream.chunks);
+    return stream.result;
+}
@@ -0,0 +1,101 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    Read-only memory mapping of files
+*/
+
+#include "mapping.h"
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+bool map_file(const char *path, file_mapping_t *mapping)
+{
+    mapping->data = NULL;
+    mapping->size = 0;
+    mapping->handle = NULL;
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size))
+    {
+        CloseHandle(file);
+        return false;
+    }
+    if (size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return true;
+    }
+    HANDLE view = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!view)
+        return false;
+    mapping->data = MapViewOfFile(view, FILE_MAP_READ, 0, 0, 0);
+    if (!mapping->data)
+    {
+        CloseHandle(view);
+        return false;
+    }
+    mapping->size = (size_t)size.QuadPart;
+    mapping->handle = view;
+    return true;
+}
+
+void unmap_file(file_mapping_t *mapping)
+{
+    if (mapping->data)
+    {
+        UnmapViewOfFile(mapping->data);
+        CloseHandle(mapping->handle);
+    }
+}
+
+#else
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+bool map_file(const char *path, file_mapping_t *mapping)
+{
+    mapping->data = NULL;
+    mapping->size = 0;
+    mapping->handle = NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    if (info.st_size == 0)
+    {
+        close(fd);
+        return true;
+    }
+    void *data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+#ifdef MADV_SEQUENTIAL
+    madvise(data, (size_t)info.st_size, MADV_SEQUENTIAL);
+#endif
+    mapping->data = data;
+    mapping->size = (size_t)info.st_size;
+    return true;
+}
+
+void unmap_file(file_mapping_t *mapping)
+{
+    if (mapping->data)
+        munmap((void*)mapping->data, mapping->size);
+}
+
+#endif
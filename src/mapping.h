@@ -0,0 +1,23 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    Read-only memory mapping of files
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct
+{
+    const char *data;
+    size_t size;
+    void *handle;
+} file_mapping_t;
+
+/*
+    An empty file is mapped as an empty block without any data
+*/
+bool map_file(const char *path, file_mapping_t *mapping);
+void unmap_file(file_mapping_t *mapping);
@@ -0,0 +1,145 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    Conversion of numeric literals already checked by the grammar
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "number.h"
+#include "allocator.h"
+
+#define max_exact_mantissa (((uint64_t)1) << 53)
+#define max_exact_power 22
+#define max_significant_digits 19
+
+static const double powers_of_ten[] =
+{
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+    1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+    1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static bool decode_by_library(const char *text, size_t length, bool negative, number_t *result)
+{
+    char buff[64];
+    char *copy = length < sizeof(buff) ? buff : nnalloc(length + 1);
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    parse_number(result, copy);
+    if (copy != buff)
+        free(copy);
+    if (!result->is_number)
+        return false;
+    if (negative)
+        negate_number(result);
+    return true;
+}
+
+bool decode_json_number(const char *text, size_t length, bool negative, number_t *result)
+{
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool is_integer = true;
+    size_t i = 0;
+
+    // leading zeros are not significant, only the integer part may have one
+    while (i < length && text[i] == '0')
+        i++;
+    for (; i < length && text[i] >= '0' && text[i] <= '9'; i++)
+    {
+        if (digits == max_significant_digits)
+            return decode_by_library(text, length, negative, result);
+        mantissa = mantissa * 10 + (text[i] - '0');
+        digits++;
+    }
+    if (i < length && text[i] == '.')
+    {
+        is_integer = false;
+        i++;
+        for (; i < length && text[i] >= '0' && text[i] <= '9'; i++)
+        {
+            if (digits == 0 && text[i] == '0')
+            {
+                exponent--;
+                continue;
+            }
+            if (digits == max_significant_digits)
+                return decode_by_library(text, length, negative, result);
+            mantissa = mantissa * 10 + (text[i] - '0');
+            digits++;
+            exponent--;
+        }
+    }
+    if (i < length && (text[i] == 'e' || text[i] == 'E'))
+    {
+        is_integer = false;
+        i++;
+        bool negative_exponent = false;
+        if (text[i] == '+' || text[i] == '-')
+            negative_exponent = text[i++] == '-';
+        int value = 0;
+        for (; i < length; i++)
+        {
+            if (value > 1000)
+                return decode_by_library(text, length, negative, result);
+            value = value * 10 + (text[i] - '0');
+        }
+        exponent += negative_exponent ? -value : value;
+    }
+
+    double value;
+    if (is_integer || mantissa == 0)
+    {
+        // the conversion of a 64-bit integer is rounded correctly by itself
+        value = (double)mantissa;
+    }
+    else if (mantissa <= max_exact_mantissa && exponent >= -max_exact_power && exponent <= max_exact_power)
+    {
+        // both operands are exact, so the only rounding is the one of the operation
+        value = exponent < 0 ? (double)mantissa / powers_of_ten[-exponent]
+            : (double)mantissa * powers_of_ten[exponent];
+    }
+    else
+        return decode_by_library(text, length, negative, result);
+
+    init_number_by_real(result, (real_t)(negative ? -value : value));
+    return true;
+}
+
+static __inline size_t skip_literal_digits(const char *text, size_t length, size_t i)
+{
+    while (i < length && text[i] >= '0' && text[i] <= '9')
+        i++;
+    return i;
+}
+
+bool is_json_number_literal(const char *text, size_t length)
+{
+    size_t i = 0;
+    if (i < length && text[i] == '-')
+        i++;
+    size_t begin = i;
+    i = skip_literal_digits(text, length, i);
+    if (i == begin)
+        return false;
+    if (i < length && text[i] == '.')
+    {
+        begin = ++i;
+        i = skip_literal_digits(text, length, i);
+        if (i == begin)
+            return false;
+    }
+    if (i < length && (text[i] == 'e' || text[i] == 'E'))
+    {
+        i++;
+        if (i < length && (text[i] == '+' || text[i] == '-'))
+            i++;
+        begin = i;
+        i = skip_literal_digits(text, length, i);
+        if (i == begin)
+            return false;
+    }
+    return i == length;
+}
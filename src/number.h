@@ -0,0 +1,23 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    Conversion of numeric literals already checked by the grammar
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include "json.h"
+
+/*
+    The text is an unsigned JSON number and does not need to be null-terminated.
+    Literals that can be converted exactly are decoded in place, the rest are
+    passed to the numbers library
+*/
+bool decode_json_number(const char *text, size_t length, bool negative, number_t *result);
+
+/*
+    Tells whether the whole text is a JSON number, including its sign,
+    for literals that come from elsewhere than the parser
+*/
+bool is_json_number_literal(const char *text, size_t length);
@@ -0,0 +1,903 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    The grammar driver: the parser reports what it reads to a handler
+    and builds nothing by itself
+*/
+
+#include <wchar.h>
+#include "parser.h"
+#include "number.h"
+#include "allocator.h"
+
+// --- source -----------------------------------------------------------------
+
+json_position_t get_source_position(const source_t *src, size_t index)
+{
+    json_position_t pos = { 1, 1 };
+    size_t i = src->wide || index < 3 || src->bytes[0] != 0xEF ? 0 : 3;
+    if (index > src->length)
+        index = src->length;
+    for (; i < index; i++)
+    {
+        unsigned int c = src->wide ? (unsigned int)src->wide[i] : src->bytes[i];
+        if (c == L'\n')
+        {
+            pos.row++;
+            pos.column = 1;
+        }
+        else if (c == L'\r')
+        {
+            pos.column = 1;
+        }
+        else if (src->wide || (c & 0xC0) != 0x80)
+        {
+            pos.column++;
+        }
+    }
+    return pos;
+}
+
+unsigned int decode_utf8_sequence(source_t *src)
+{
+    const uint8_t *b = src->bytes + src->index;
+    size_t avail = src->length - src->index;
+    unsigned int cp = 0xFFFD;
+    size_t size = 1;
+    if (b[0] >= 0xC2 && b[0] <= 0xDF && avail >= 2 && (b[1] & 0xC0) == 0x80)
+    {
+        cp = ((b[0] & 0x1Fu) << 6) | (b[1] & 0x3Fu);
+        size = 2;
+    }
+    else if (b[0] >= 0xE0 && b[0] <= 0xEF && avail >= 3 && (b[1] & 0xC0) == 0x80 && (b[2] & 0xC0) == 0x80)
+    {
+        unsigned int v = ((b[0] & 0x0Fu) << 12) | ((b[1] & 0x3Fu) << 6) | (b[2] & 0x3Fu);
+        if (v >= 0x800 && (v < 0xD800 || v > 0xDFFF))
+            cp = v;
+        size = 3;
+    }
+    else if (b[0] >= 0xF0 && b[0] <= 0xF4 && avail >= 4 && (b[1] & 0xC0) == 0x80 && (b[2] & 0xC0) == 0x80
+        && (b[3] & 0xC0) == 0x80)
+    {
+        unsigned int v = ((b[0] & 0x07u) << 18) | ((b[1] & 0x3Fu) << 12) | ((b[2] & 0x3Fu) << 6) | (b[3] & 0x3Fu);
+        if (v >= 0x10000 && v <= 0x10FFFF)
+            cp = v;
+        size = 4;
+    }
+    src->index += size;
+    return cp;
+}
+
+// --- parser -----------------------------------------------------------------
+
+#define inline_containers_count 256
+
+typedef struct
+{
+    source_t src;
+    json_error_t *err;
+    const json_handler_t *handler;
+    void *context;
+    wchar_t *chars;
+    size_t chars_capacity;
+    char *containers;
+    size_t depth;
+    size_t containers_capacity;
+    size_t max_depth;
+    char inline_containers[inline_containers_count];
+    skipped_container_callback_t on_skipped;
+    bool validate_skipped;
+    const selector_t *selector;
+    size_t key_length;
+    parser_buffer_t *buffer;
+} parser_t;
+
+static void reserve_chars(parser_t *parser, size_t length, size_t extra)
+{
+    size_t capacity = parser->chars_capacity;
+    while (capacity < length + extra)
+        capacity *= 2;
+    wchar_t *chars = nnalloc(capacity * sizeof(wchar_t));
+    memcpy(chars, parser->chars, length * sizeof(wchar_t));
+    free(parser->chars);
+    parser->chars = chars;
+    parser->chars_capacity = capacity;
+}
+
+static __inline void put_char(parser_t *parser, size_t *length, wchar_t c)
+{
+    if (!parser->chars)
+        return;
+    if (*length == parser->chars_capacity)
+        reserve_chars(parser, *length, 1);
+    parser->chars[(*length)++] = c;
+}
+
+static __inline void put_source_chars(parser_t *parser, size_t *length, size_t begin, size_t end)
+{
+    size_t count = end - begin;
+    if (!parser->chars)
+        return;
+    if (*length + count > parser->chars_capacity)
+        reserve_chars(parser, *length, count);
+    wchar_t *dst = parser->chars + *length;
+    if (parser->src.wide)
+        memcpy(dst, parser->src.wide + begin, count * sizeof(wchar_t));
+    else
+    {
+        const uint8_t *bytes = parser->src.bytes + begin;
+        for (size_t i = 0; i < count; i++)
+            dst[i] = bytes[i];
+    }
+    *length += count;
+}
+
+static __inline void put_code_point(parser_t *parser, size_t *length, unsigned int cp)
+{
+#if WCHAR_MAX <= 0xFFFF
+    if (cp >= 0x10000)
+    {
+        cp -= 0x10000;
+        put_char(parser, length, (wchar_t)(0xD800 + (cp >> 10)));
+        put_char(parser, length, (wchar_t)(0xDC00 + (cp & 0x3FF)));
+        return;
+    }
+#endif
+    put_char(parser, length, (wchar_t)cp);
+}
+
+static __inline void set_error(parser_t *parser, json_error_type_t type)
+{
+    if (parser->err)
+        parser->err->type = type;
+}
+
+static __inline void set_error_with_char(parser_t *parser, json_error_type_t type, wchar_t c)
+{
+    if (parser->err)
+    {
+        parser->err->type = type;
+        parser->err->text.data[0] = c;
+        parser->err->text.length = 1;
+    }
+}
+
+static __inline bool stopped_by_handler(parser_t *parser)
+{
+    set_error(parser, json_stopped_by_handler);
+    return false;
+}
+
+static __inline bool emit_object_begin(parser_t *parser)
+{
+    const json_handler_t *h = parser->handler;
+    return !h->on_object_begin || h->on_object_begin(parser->context) || stopped_by_handler(parser);
+}
+
+static __inline bool emit_object_end(parser_t *parser)
+{
+    const json_handler_t *h = parser->handler;
+    return !h->on_object_end || h->on_object_end(parser->context) || stopped_by_handler(parser);
+}
+
+static __inline bool emit_array_begin(parser_t *parser)
+{
+    const json_handler_t *h = parser->handler;
+    return !h->on_array_begin || h->on_array_begin(parser->context) || stopped_by_handler(parser);
+}
+
+static __inline bool emit_array_end(parser_t *parser)
+{
+    const json_handler_t *h = parser->handler;
+    return !h->on_array_end || h->on_array_end(parser->context) || stopped_by_handler(parser);
+}
+
+static __inline bool emit_key(parser_t *parser, size_t length)
+{
+    const json_handler_t *h = parser->handler;
+    wide_string_t key = { parser->chars, length };
+    return !h->on_key || h->on_key(parser->context, &key) || stopped_by_handler(parser);
+}
+
+static __inline bool emit_string(parser_t *parser, size_t length)
+{
+    const json_handler_t *h = parser->handler;
+    wide_string_t value = { parser->chars, length };
+    return !h->on_string || h->on_string(parser->context, &value) || stopped_by_handler(parser);
+}
+
+static __inline bool emit_number(parser_t *parser, const number_t *value)
+{
+    const json_handler_t *h = parser->handler;
+    return !h->on_number || h->on_number(parser->context, value) || stopped_by_handler(parser);
+}
+
+static __inline bool emit_boolean(parser_t *parser, bool value)
+{
+    const json_handler_t *h = parser->handler;
+    return !h->on_boolean || h->on_boolean(parser->context, value) || stopped_by_handler(parser);
+}
+
+static __inline bool emit_null(parser_t *parser)
+{
+    const json_handler_t *h = parser->handler;
+    return !h->on_null || h->on_null(parser->context) || stopped_by_handler(parser);
+}
+
+static bool parse_string(parser_t *parser, size_t *length);
+static bool parse_element(parser_t *parser);
+
+typedef enum
+{
+    step_failed,
+    step_item,
+    step_end
+} container_step_t;
+
+static bool open_container(parser_t *parser, bool is_object)
+{
+    if (parser->max_depth && parser->depth == parser->max_depth)
+    {
+        set_error(parser, json_maximum_depth_exceeded);
+        return false;
+    }
+    next_char(&parser->src);
+    if (!(is_object ? emit_object_begin(parser) : emit_array_begin(parser)))
+        return false;
+    if (parser->depth == parser->containers_capacity)
+    {
+        size_t capacity = parser->containers_capacity * 2;
+        char *containers = nnalloc(capacity);
+        memcpy(containers, parser->containers, parser->depth);
+        if (parser->containers != parser->inline_containers)
+            free(parser->containers);
+        parser->containers = containers;
+        parser->containers_capacity = capacity;
+    }
+    parser->containers[parser->depth++] = is_object ? 'o' : 'a';
+    return true;
+}
+
+/*
+    Moves to the next pair of the innermost object and stops at its value,
+    or closes the object
+*/
+static container_step_t next_object_member(parser_t *parser, bool first)
+{
+    source_t *src = &parser->src;
+    wchar_t c = get_char_but_not_space(src);
+
+    if (c == L'\0')
+    {
+        set_error_with_char(parser, json_missing_closing_bracket, L'}');
+        return step_failed;
+    }
+    if (c == L'}')
+    {
+        next_char(src);
+        return emit_object_end(parser) ? step_end : step_failed;
+    }
+    if (!first)
+    {
+        if (c != L',')
+        {
+            set_error(parser, json_expected_comma_separator);
+            return step_failed;
+        }
+        c = next_char_but_not_space(src);
+        if (c == 0)
+        {
+            set_error_with_char(parser, json_missing_closing_bracket, L'}');
+            return step_failed;
+        }
+        if (c == L'}')
+        {
+            next_char(src);
+            return emit_object_end(parser) ? step_end : step_failed;
+        }
+    }
+    size_t length = 0;
+    if (c == L'\"')
+    {
+        next_char(src);
+        if (!parse_string(parser, &length))
+            return step_failed;
+    }
+    else if (is_letter(c))
+    {
+        do
+        {
+            put_char(parser, &length, c);
+            c = next_char(src);
+        } while(is_letter(c) || is_digit(c));
+    }
+    else
+    {
+        set_error(parser, json_expected_name);
+        return step_failed;
+    }
+    c = get_char_but_not_space(src);
+    if (c != L':')
+    {
+        set_error(parser, json_expected_colon_separator);
+        return step_failed;
+    }
+    c = next_char_but_not_space(src);
+    if (c == 0)
+    {
+        set_error(parser, json_expected_element);
+        return step_failed;
+    }
+    parser->key_length = length;
+    return emit_key(parser, length) ? step_item : step_failed;
+}
+
+static container_step_t next_array_item(parser_t *parser, bool first)
+{
+    source_t *src = &parser->src;
+    wchar_t c = get_char_but_not_space(src);
+
+    if (c == L'\0')
+    {
+        set_error_with_char(parser, json_missing_closing_bracket, L']');
+        return step_failed;
+    }
+    if (c == L']')
+    {
+        next_char(src);
+        return emit_array_end(parser) ? step_end : step_failed;
+    }
+    if (!first)
+    {
+        if (c != L',')
+        {
+            set_error(parser, json_expected_comma_separator);
+            return step_failed;
+        }
+        c = next_char_but_not_space(src);
+        if (c == 0)
+        {
+            set_error_with_char(parser, json_missing_closing_bracket, L']');
+            return step_failed;
+        }
+        if (c == L']')
+        {
+            next_char(src);
+            return emit_array_end(parser) ? step_end : step_failed;
+        }
+    }
+    return step_item;
+}
+
+static bool parse_string(parser_t *parser, size_t *length)
+{
+    source_t *src = &parser->src;
+    wchar_t c;
+    while (true)
+    {
+        size_t begin = src->index;
+        if (src->wide)
+            src->index = src->kernels->skip_wide_string_body(src->wide, begin, src->length);
+        else
+            src->index = src->kernels->skip_string_body(src->bytes, begin, src->length);
+        if (src->index > begin)
+            put_source_chars(parser, length, begin, src->index);
+        c = get_char(src);
+        if (c == L'\"' || c == L'\0')
+            break;
+        if (c == L'\\')
+        {
+            src->escapes++;
+            c = next_char(src);
+            switch(c)
+            {
+                case L'"':
+                    put_char(parser, length, L'"');
+                    break;
+                case '\\':
+                    put_char(parser, length, L'\\');
+                    break;
+                case '/':
+                    put_char(parser, length, L'/');
+                    break;
+                case 'b':
+                    put_char(parser, length, L'\b');
+                    break;
+                case 'f':
+                    put_char(parser, length, L'\f');
+                    break;
+                case 'n':
+                    put_char(parser, length, L'\n');
+                    break;
+                case 'r':
+                    put_char(parser, length, L'\r');
+                    break;
+                case 't':
+                    put_char(parser, length, L'\t');
+                    break;
+                case 'u':
+                {
+                    int k = 0;
+                    wchar_t h[4];
+                    for (size_t i = 0; i < 4; i++)
+                    {
+                        c = next_char(src);
+                        h[i] = c;
+                        if (!is_hex_digit(c))
+                        {
+                            if (parser->err)
+                            {
+                                parser->err->type = json_incorrect_number_format;
+                                memcpy(parser->err->text.data, h, (i + 1) * sizeof(wchar_t));
+                                parser->err->text.length = i + 1;
+                            }
+                            return false;
+                        }
+                        k = (k << 4) | convert_hex_digit(c);
+                    }
+                    put_char(parser, length, (wchar_t)k);
+                    break;
+                }
+                default:
+                    set_error_with_char(parser, json_incorrect_escape_character, c);
+                    return false;
+            }
+        }
+        else if (c >= 0x80 && src->bytes)
+        {
+            put_code_point(parser, length, decode_utf8_sequence(src));
+            c = get_char(src);
+            continue;
+        }
+        else
+        {
+            put_char(parser, length, c);
+        }
+        c = next_char(src);
+    }
+    if (c == 0)
+    {
+        set_error(parser, json_missing_closing_quotation_mark_in_string);
+        return false;
+    }
+    next_char(src);
+    return true;
+}
+
+/*
+    Numeric literals are ASCII, so a wide source is narrowed into the buffer
+    (or into a heap block if the literal does not fit)
+*/
+static const char * get_number_span(source_t *src, size_t begin, char *buff, size_t size)
+{
+    size_t length = src->index - begin;
+    if (!src->wide)
+        return (const char*)src->bytes + begin;
+    char *text = length <= size ? buff : nnalloc(length);
+    for (size_t i = 0; i < length; i++)
+        text[i] = (char)src->wide[begin + i];
+    return text;
+}
+
+static bool decode_number_span(source_t *src, size_t begin, bool neg, number_t *result)
+{
+    char buff[64];
+    const char *text = get_number_span(src, begin, buff, sizeof(buff));
+    bool ok = decode_json_number(text, src->index - begin, neg, result);
+    if (src->wide && text != buff)
+        free((char*)text);
+    return ok;
+}
+
+static bool emit_number_literal(parser_t *parser, size_t begin)
+{
+    source_t *src = &parser->src;
+    char buff[64];
+    const char *text = get_number_span(src, begin, buff, sizeof(buff));
+    bool ok = parser->handler->on_number_literal(parser->context, text, src->index - begin);
+    if (src->wide && text != buff)
+        free((char*)text);
+    return ok || stopped_by_handler(parser);
+}
+
+static bool parse_number_element(parser_t *parser, bool neg)
+{
+    source_t *src = &parser->src;
+    size_t begin = src->index;
+    wchar_t c = get_char(src);
+    if (!is_digit(c))
+        goto error;
+    skip_digits(src);
+    c = get_char(src);
+    if (c == '.')
+    {
+        c = next_char(src);
+        if (!is_digit(c))
+            goto error;
+        skip_digits(src);
+        c = get_char(src);
+    }
+    if (c == L'e' || c == L'E')
+    {
+        c = next_char(src);
+        if (c == '+' || c == '-')
+            c = next_char(src);
+        if (!is_digit(c))
+            goto error;
+        skip_digits(src);
+        c = get_char(src);
+    }
+    if (parser->handler->on_number_literal)
+        return emit_number_literal(parser, neg ? begin - 1 : begin);
+    number_t result;
+    if (!decode_number_span(src, begin, neg, &result))
+        goto error;
+    return emit_number(parser, &result);
+
+error:
+    if (parser->err)
+    {
+        json_error_t *err = parser->err;
+        size_t length = src->index - begin;
+        err->type = json_incorrect_number_format;
+        err->text.length = length < json_error_text_max_length ? length + 1 : json_error_text_max_length;
+        for (size_t k = 0; k < err->text.length; k++)
+        {
+            if (k == length)
+                err->text.data[k] = c;
+            else
+                err->text.data[k] = src->wide ? src->wide[begin + k] : (wchar_t)src->bytes[begin + k];
+        }
+    }
+    return false;
+}
+
+static __inline bool is_source_word(const source_t *src, size_t begin, size_t length, const char *word)
+{
+    for (size_t k = 0; k < length; k++)
+    {
+        wchar_t c = src->wide ? src->wide[begin + k] : (wchar_t)src->bytes[begin + k];
+        if (word[k] != c)
+            return false;
+    }
+    return word[length] == '\0';
+}
+
+static bool accept_number_literal(void *context, const char *text, size_t length)
+{
+    (void)context;
+    (void)text;
+    (void)length;
+    return true;
+}
+
+static const json_handler_t validating_handler =
+{
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+static const json_handler_t validating_literal_handler =
+{
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, accept_number_literal
+};
+
+static void skip_string_chars(source_t *src)
+{
+    while (true)
+    {
+        if (src->wide)
+            src->index = src->kernels->skip_wide_string_body(src->wide, src->index, src->length);
+        else
+            src->index = src->kernels->skip_string_body(src->bytes, src->index, src->length);
+        if (src->index >= src->length)
+            return;
+        wchar_t c = get_char(src);
+        src->index++;
+        if (c == L'\"')
+            return;
+        if (c == L'\\' && src->index < src->length)
+            src->index++;
+    }
+}
+
+static void match_brackets(source_t *src)
+{
+    size_t depth = 0;
+    while (src->index < src->length)
+    {
+        wchar_t c = get_char(src);
+        src->index++;
+        if (c == L'\"')
+            skip_string_chars(src);
+        else if (c == L'{' || c == L'[')
+            depth++;
+        else if ((c == L'}' || c == L']') && --depth == 0)
+            return;
+    }
+}
+
+/*
+    Containers nested into the one being parsed are not reported to the handler
+    in the shallow mode, only their positions are. On the first pass they are still
+    checked without building anything, later the text is known to be valid
+    and the brackets are simply matched
+*/
+static bool skip_container(parser_t *parser, bool is_object)
+{
+    size_t begin = parser->src.index;
+    if (parser->validate_skipped)
+    {
+        const json_handler_t *handler = parser->handler;
+        skipped_container_callback_t on_skipped = parser->on_skipped;
+        parser->handler = handler->on_number_literal ? &validating_literal_handler : &validating_handler;
+        parser->on_skipped = NULL;
+        bool result = parse_element(parser);
+        parser->handler = handler;
+        parser->on_skipped = on_skipped;
+        if (!result)
+            return false;
+    }
+    else
+        match_brackets(&parser->src);
+    return parser->on_skipped(parser->context, is_object, begin) || stopped_by_handler(parser);
+}
+
+static bool parse_scalar(parser_t *parser, wchar_t c)
+{
+    source_t *src = &parser->src;
+
+    if (c == L'\"')
+    {
+        next_char(src);
+        size_t length = 0;
+        return parse_string(parser, &length) && emit_string(parser, length);
+    }
+    else if (is_letter(c))
+    {
+        // the word is read while it can still be a keyword, the error stops at the first letter that cannot
+        size_t begin = src->index;
+        wchar_t first = c;
+        while (continues_keyword(first, src->index - begin, c))
+            c = next_char(src);
+        size_t length = src->index - begin;
+
+        if (is_source_word(src, begin, length, "null") && !is_letter(c))
+            return emit_null(parser);
+        if (is_source_word(src, begin, length, "true") && !is_letter(c))
+            return emit_boolean(parser, true);
+        if (is_source_word(src, begin, length, "false") && !is_letter(c))
+            return emit_boolean(parser, false);
+
+        if (parser->err)
+        {
+            json_error_t *err = parser->err;
+            err->type = json_unrecognized_entity;
+            if (is_letter(c))
+                length++;
+            err->text.length = length < json_error_text_max_length ? length : json_error_text_max_length;
+            for (size_t k = 0; k < err->text.length; k++)
+                err->text.data[k] = src->wide ? src->wide[begin + k] : (wchar_t)src->bytes[begin + k];
+        }
+        return false;
+    }
+    else if (is_digit(c))
+    {
+        return parse_number_element(parser, false);
+    }
+    else if (c == '-')
+    {
+        next_char(src);
+        return parse_number_element(parser, true);
+    }
+
+    set_error_with_char(parser, json_unknown_symbol, c);
+    return false;
+}
+
+/*
+    Containers are kept on an explicit stack instead of the recursion, so the use
+    of the C stack does not depend on the nesting of the text
+*/
+static bool parse_element(parser_t *parser)
+{
+    source_t *src = &parser->src;
+    size_t base = parser->depth;
+    while (true)
+    {
+        wchar_t c = get_char_but_not_space(src);
+        bool first = false;
+        if ((c == L'{' || c == L'[') && !(parser->on_skipped && parser->depth > 0))
+        {
+            if (!open_container(parser, c == L'{'))
+                return false;
+            first = true;
+        }
+        else if (c == L'{' || c == L'[')
+        {
+            if (!skip_container(parser, c == L'{'))
+                return false;
+        }
+        else if (!parse_scalar(parser, c))
+            return false;
+        while (true)
+        {
+            if (parser->depth == base)
+                return true;
+            container_step_t step = parser->containers[parser->depth - 1] == 'o'
+                ? next_object_member(parser, first) : next_array_item(parser, first);
+            if (step == step_failed)
+                return false;
+            if (step == step_item)
+                break;
+            parser->depth--;
+            first = false;
+        }
+    }
+}
+
+/*
+    The containers on the way to the selected values are walked through with the usual
+    checks, the values are taken by the selector and all the rest is validated without
+    building anything, so an error anywhere in the text is reported.
+    The recursion is bounded by the depth of the selector, not by the text
+*/
+static bool select_element(parser_t *parser, size_t node)
+{
+    const selector_t *selector = parser->selector;
+    source_t *src = &parser->src;
+    wchar_t c = get_char_but_not_space(src);
+    if (selector->is_taken(parser->context, node))
+        return selector->take_value(parser->context, node, src, parser->err);
+    if (c != L'{' && c != L'[')
+        return parse_element(parser);
+    next_char(src);
+    bool is_object = c == L'{';
+    for (size_t index = 0; ; index++)
+    {
+        container_step_t step = is_object ? next_object_member(parser, index == 0)
+            : next_array_item(parser, index == 0);
+        if (step != step_item)
+            return step == step_end;
+        wide_string_t key = { parser->chars, parser->key_length };
+        size_t child = selector->select_member(parser->context, node, is_object ? &key : NULL, index);
+        if (!(child ? select_element(parser, child) : parse_element(parser)))
+            return false;
+    }
+}
+
+void init_json_error(json_error_t *err)
+{
+    if (err)
+    {
+        memset(err, 0, sizeof(json_error_t));
+        err->text.data = (wchar_t*)err->_buff;
+    }
+}
+
+/*
+    A parser without the buffer does not collect the characters of strings,
+    which is enough when nothing is passed to the handler
+*/
+static void init_parser(parser_t *parser, const source_t *src, const json_handler_t *handler,
+    void *context, bool collect_chars, size_t max_depth, json_error_t *err)
+{
+    parser->src = *src;
+    parser->err = err;
+    parser->handler = handler;
+    parser->context = context;
+    parser->containers = parser->inline_containers;
+    parser->depth = 0;
+    parser->containers_capacity = inline_containers_count;
+    parser->max_depth = max_depth;
+    parser->on_skipped = NULL;
+    parser->validate_skipped = false;
+    parser->selector = NULL;
+    parser->key_length = 0;
+    parser->chars_capacity = collect_chars ? 64 : 0;
+    parser->chars = collect_chars ? nnalloc(parser->chars_capacity * sizeof(wchar_t)) : NULL;
+    parser->buffer = NULL;
+}
+
+static void init_parser_with_buffer(parser_t *parser, const source_t *src, const json_handler_t *handler,
+    void *context, size_t max_depth, parser_buffer_t *buffer, json_error_t *err)
+{
+    init_parser(parser, src, handler, context, false, max_depth, err);
+    if (!buffer->chars)
+    {
+        buffer->capacity = 64;
+        buffer->chars = nnalloc(buffer->capacity * sizeof(wchar_t));
+    }
+    parser->chars = buffer->chars;
+    parser->chars_capacity = buffer->capacity;
+    parser->buffer = buffer;
+}
+
+static bool run_parser(parser_t *parser, source_t *src)
+{
+    init_json_error(parser->err);
+    bool result = parser->selector ? select_element(parser, 0) : parse_element(parser);
+    if (!result && parser->err)
+        parser->err->where = get_source_position(&parser->src, parser->src.index);
+    if (parser->buffer)
+    {
+        // the buffer may have been grown, the caller keeps the new one
+        parser->buffer->chars = parser->chars;
+        parser->buffer->capacity = parser->chars_capacity;
+    }
+    else
+        free(parser->chars);
+    if (parser->containers != parser->inline_containers)
+        free(parser->containers);
+    *src = parser->src;
+    return result;
+}
+
+bool run_json_parser(source_t *src, const json_handler_t *handler, void *context, size_t max_depth,
+    json_error_t *err)
+{
+    parser_t parser;
+    init_parser(&parser, src, handler, context, true, max_depth, err);
+    return run_parser(&parser, src);
+}
+
+bool run_json_parser_with_buffer(source_t *src, const json_handler_t *handler, void *context, size_t max_depth,
+    parser_buffer_t *buffer, json_error_t *err)
+{
+    parser_t parser;
+    init_parser_with_buffer(&parser, src, handler, context, max_depth, buffer, err);
+    return run_parser(&parser, src);
+}
+
+bool run_shallow_json_parser(source_t *src, const json_handler_t *handler, void *context, size_t max_depth,
+    skipped_container_callback_t on_skipped, bool validate_skipped, json_error_t *err)
+{
+    parser_t parser;
+    init_parser(&parser, src, handler, context, true, max_depth, err);
+    parser.on_skipped = on_skipped;
+    parser.validate_skipped = validate_skipped;
+    return run_parser(&parser, src);
+}
+
+bool parse_json_with_handler(wide_string_t *text, const json_handler_t *handler, void *context, json_error_t *err)
+{
+    source_t src;
+    init_source(&src, text);
+    return run_json_parser(&src, handler, context, 0, err);
+}
+
+bool parse_json_utf8_with_handler(const char *data, size_t length, const json_handler_t *handler,
+    void *context, json_error_t *err)
+{
+    source_t src;
+    init_utf8_source(&src, data, length);
+    return run_json_parser(&src, handler, context, 0, err);
+}
+
+bool run_selective_json_parser(source_t *src, const selector_t *selector, void *context, json_error_t *err)
+{
+    parser_t parser;
+    init_parser(&parser, src, &validating_literal_handler, context, true, 0, err);
+    parser.selector = selector;
+    return run_parser(&parser, src);
+}
+
+static bool validate_source(source_t *src, json_error_t *err)
+{
+    parser_t parser;
+    init_parser(&parser, src, &validating_literal_handler, NULL, false, 0, err);
+    return run_parser(&parser, src);
+}
+
+bool validate_json(wide_string_t *text, json_error_t *err)
+{
+    source_t src;
+    init_source(&src, text);
+    return validate_source(&src, err);
+}
+
+bool validate_json_utf8(const char *data, size_t length, json_error_t *err)
+{
+    source_t src;
+    init_utf8_source(&src, data, length);
+    return validate_source(&src, err);
+}
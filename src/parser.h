@@ -0,0 +1,202 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    The source reader and the grammar driver shared by all JSON parsers
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "json.h"
+#include "scan.h"
+
+static __inline bool is_space(wchar_t c)
+{
+    return c == L' ' || c == L'\t' || c == L'\n' || c == L'\r';
+}
+
+static __inline bool is_letter(wchar_t c)
+{
+    return (c >= L'A' && c <= L'Z') || (c >= L'a' && c <= L'z') || c == '_';
+}
+
+/*
+    The keywords differ by their first letters, so a word that is still
+    a keyword after 'length' letters goes on only with the next letter of it
+*/
+static __inline bool continues_keyword(wchar_t first, size_t length, wchar_t c)
+{
+    const char *word = first == L'n' ? "null" : first == L't' ? "true" : first == L'f' ? "false" : "";
+    for (size_t k = 0; k < length; k++)
+    {
+        if (word[k] == '\0')
+            return false;
+    }
+    return word[length] != '\0' && (wchar_t)word[length] == c;
+}
+
+static __inline bool is_digit(wchar_t c)
+{
+    return c >= L'0' && c <= L'9';
+}
+
+static __inline bool is_hex_digit(wchar_t c)
+{
+    return (c >= L'0' && c <= L'9') || (c >= L'A' && c <= L'F') || (c >= L'a' && c <= L'f');
+}
+
+static __inline int convert_hex_digit(wchar_t c)
+{
+    if (c >= L'0' && c <= L'9') return c - L'0';
+    if (c >= L'A' && c <= L'F') return c - L'A' + 10;
+    if (c >= L'a' && c <= L'f') return c - L'a' + 10;
+    return -1;
+}
+
+typedef struct
+{
+    const wchar_t *wide;
+    const uint8_t *bytes;
+    size_t length;
+    size_t index;
+    const scan_kernels_t *kernels;
+    size_t escapes;
+} source_t;
+
+static __inline void init_source(source_t *src, wide_string_t *text)
+{
+    src->wide = text->data;
+    src->bytes = NULL;
+    src->length = text->length;
+    src->index = 0;
+    src->kernels = get_scan_kernels();
+    src->escapes = 0;
+}
+
+static __inline void init_utf8_source(source_t *src, const char *data, size_t length)
+{
+    src->wide = NULL;
+    src->bytes = (const uint8_t*)data;
+    src->length = length;
+    src->index = 0;
+    src->kernels = get_scan_kernels();
+    src->escapes = 0;
+    if (length >= 3 && src->bytes[0] == 0xEF && src->bytes[1] == 0xBB && src->bytes[2] == 0xBF)
+        src->index = 3;
+}
+
+/*
+    For UTF-8 sources this returns single bytes, so everything outside string bodies
+    is matched against ASCII; multibyte sequences are decoded by parse_string()
+*/
+static __inline wchar_t get_char(source_t *src)
+{
+    if (src->index >= src->length)
+        return L'\0';
+    return src->wide ? src->wide[src->index] : (wchar_t)src->bytes[src->index];
+}
+
+static __inline wchar_t next_char(source_t *src)
+{
+    if (src->index < src->length)
+    {
+        src->index++;
+        return get_char(src);
+    }
+    return '\0';
+}
+
+static __inline wchar_t skip_spaces(source_t *src)
+{
+    if (src->wide)
+        src->index = src->kernels->skip_wide_spaces(src->wide, src->index, src->length);
+    else
+        src->index = src->kernels->skip_spaces(src->bytes, src->index, src->length);
+    return get_char(src);
+}
+
+static __inline wchar_t get_char_but_not_space(source_t *src)
+{
+    wchar_t c = get_char(src);
+    if (is_space(c))
+    {
+        // most gaps are a single space, a run is handed to the kernel
+        c = next_char(src);
+        if (is_space(c))
+            c = skip_spaces(src);
+    }
+    return c;
+}
+
+static __inline wchar_t next_char_but_not_space(source_t *src)
+{
+    next_char(src);
+    return get_char_but_not_space(src);
+}
+
+static __inline size_t skip_digits(source_t *src)
+{
+    size_t start = src->index;
+    if (src->wide)
+        src->index = src->kernels->skip_wide_digits(src->wide, src->index, src->length);
+    else
+        src->index = src->kernels->skip_digits(src->bytes, src->index, src->length);
+    return src->index - start;
+}
+
+unsigned int decode_utf8_sequence(source_t *src);
+
+/*
+    The scanner does not track rows and columns, they are worked out
+    from the index only when an error is reported
+*/
+json_position_t get_source_position(const source_t *src, size_t index);
+
+void init_json_error(json_error_t *err);
+
+/*
+    The depth of nesting is not limited if 'max_depth' is 0
+*/
+bool run_json_parser(source_t *src, const json_handler_t *handler, void *context, size_t max_depth,
+    json_error_t *err);
+
+/*
+    The characters of strings are collected in the buffer, a caller keeping it between
+    runs reuses its memory. The buffer starts empty and is released by free()
+*/
+typedef struct
+{
+    wchar_t *chars;
+    size_t capacity;
+} parser_buffer_t;
+
+bool run_json_parser_with_buffer(source_t *src, const json_handler_t *handler, void *context, size_t max_depth,
+    parser_buffer_t *buffer, json_error_t *err);
+
+/*
+    The shallow mode reports only the top container and the scalars in it,
+    nested containers are skipped and passed to the callback by their positions
+*/
+typedef bool (*skipped_container_callback_t)(void *context, bool is_object, size_t begin);
+
+bool run_shallow_json_parser(source_t *src, const json_handler_t *handler, void *context, size_t max_depth,
+    skipped_container_callback_t on_skipped, bool validate_skipped, json_error_t *err);
+
+/*
+    The selective mode walks only the members picked by the selector, by a key in objects
+    and by an index in arrays, whatever it does not pick is skipped without checks.
+    Nodes are numbers given by the selector, 0 stands for the root and means
+    nothing is picked; a taken node gets the source positioned at its value
+*/
+typedef struct
+{
+    size_t (*select_member)(void *context, size_t node, const wide_string_t *key, size_t index);
+    bool (*is_taken)(void *context, size_t node);
+    bool (*take_value)(void *context, size_t node, source_t *src, json_error_t *err);
+} selector_t;
+
+bool run_selective_json_parser(source_t *src, const selector_t *selector, void *context, json_error_t *err);
+
+json_parser_t * create_json_parser_with_owner(const json_handler_t *handler, void *context, size_t max_depth,
+    void (*reset_context)(void *context), void (*release_context)(void *context));
+void * get_json_parser_context(json_parser_t *parser);
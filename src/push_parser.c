@@ -0,0 +1,783 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    The incremental (push) parser: UTF-8 text is fed in chunks of any size,
+    the state of nested containers and of an unfinished token is kept
+    explicitly between the calls
+*/
+
+#include <wchar.h>
+#include "parser.h"
+#include "number.h"
+#include "allocator.h"
+
+typedef enum
+{
+    state_value,
+    state_array_item,
+    state_array_comma,
+    state_object_key,
+    state_object_comma,
+    state_colon,
+    state_string,
+    state_string_escape,
+    state_string_unicode,
+    state_string_utf8,
+    state_keyword,
+    state_identifier,
+    state_number,
+    state_done
+} push_state_t;
+
+typedef enum
+{
+    number_sign,
+    number_integer,
+    number_fraction_first,
+    number_fraction,
+    number_exponent_sign,
+    number_exponent_first,
+    number_exponent
+} number_stage_t;
+
+struct json_parser_t
+{
+    const json_handler_t *handler;
+    void *context;
+    void (*reset_context)(void *context);
+    void (*release_context)(void *context);
+    const scan_kernels_t *kernels;
+    push_state_t state;
+    bool failed;
+    size_t bom_matched;
+    bool bom_checked;
+    bool key_pending;
+    char *containers;
+    size_t depth;
+    size_t containers_capacity;
+    size_t max_depth;
+    wchar_t *chars;
+    size_t chars_length;
+    size_t chars_capacity;
+    bool is_key;
+    wchar_t hex[4];
+    int hex_count;
+    uint8_t utf8[4];
+    int utf8_length;
+    int utf8_needed;
+    char number[64];
+    string_builder_t *long_number;
+    size_t number_length;
+    number_stage_t number_stage;
+    bool negative;
+    json_position_t pos;
+    json_error_t err;
+};
+
+// --- buffers ----------------------------------------------------------------
+
+static void put_char(json_parser_t *parser, wchar_t c)
+{
+    if (parser->chars_length == parser->chars_capacity)
+    {
+        size_t capacity = parser->chars_capacity * 2;
+        wchar_t *chars = nnalloc(capacity * sizeof(wchar_t));
+        memcpy(chars, parser->chars, parser->chars_length * sizeof(wchar_t));
+        free(parser->chars);
+        parser->chars = chars;
+        parser->chars_capacity = capacity;
+    }
+    parser->chars[parser->chars_length++] = c;
+}
+
+static void put_code_point(json_parser_t *parser, unsigned int cp)
+{
+#if WCHAR_MAX <= 0xFFFF
+    if (cp >= 0x10000)
+    {
+        cp -= 0x10000;
+        put_char(parser, (wchar_t)(0xD800 + (cp >> 10)));
+        put_char(parser, (wchar_t)(0xDC00 + (cp & 0x3FF)));
+        return;
+    }
+#endif
+    put_char(parser, (wchar_t)cp);
+}
+
+static void put_number_char(json_parser_t *parser, char c)
+{
+    if (parser->long_number)
+        parser->long_number = append_char(parser->long_number, c);
+    else if (parser->number_length + 1 < sizeof(parser->number))
+        parser->number[parser->number_length++] = c;
+    else
+    {
+        for (size_t i = 0; i < parser->number_length; i++)
+            parser->long_number = append_char(parser->long_number, parser->number[i]);
+        parser->long_number = append_char(parser->long_number, c);
+    }
+}
+
+static const char * get_number_text(json_parser_t *parser, size_t *length)
+{
+    if (parser->long_number)
+    {
+        *length = parser->long_number->length;
+        return parser->long_number->data;
+    }
+    parser->number[parser->number_length] = '\0';
+    *length = parser->number_length;
+    return parser->number;
+}
+
+static void push_container(json_parser_t *parser, char type)
+{
+    if (parser->depth == parser->containers_capacity)
+    {
+        size_t capacity = parser->containers_capacity * 2;
+        char *containers = nnalloc(capacity);
+        memcpy(containers, parser->containers, parser->depth);
+        free(parser->containers);
+        parser->containers = containers;
+        parser->containers_capacity = capacity;
+    }
+    parser->containers[parser->depth++] = type;
+}
+
+// --- errors -----------------------------------------------------------------
+
+static void advance_position(json_position_t *pos, const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        uint8_t c = data[i];
+        if (c == '\n')
+        {
+            pos->row++;
+            pos->column = 1;
+        }
+        else if (c == '\r')
+            pos->column = 1;
+        else if ((c & 0xC0) != 0x80)
+            pos->column++;
+    }
+}
+
+static bool fail(json_parser_t *parser, json_error_type_t type, const uint8_t *data, size_t index)
+{
+    parser->failed = true;
+    parser->err.type = type;
+    parser->err.where = parser->pos;
+    if (data)
+        advance_position(&parser->err.where, data, index);
+    return false;
+}
+
+static bool fail_with_char(json_parser_t *parser, json_error_type_t type, wchar_t c, const uint8_t *data, size_t index)
+{
+    parser->err.text.data[0] = c;
+    parser->err.text.length = 1;
+    return fail(parser, type, data, index);
+}
+
+static bool fail_with_text(json_parser_t *parser, json_error_type_t type, const wchar_t *text, size_t length,
+    const uint8_t *data, size_t index)
+{
+    parser->err.text.length = length < json_error_text_max_length ? length : json_error_text_max_length;
+    memcpy(parser->err.text.data, text, parser->err.text.length * sizeof(wchar_t));
+    return fail(parser, type, data, index);
+}
+
+// --- events -----------------------------------------------------------------
+
+static __inline bool notify(json_parser_t *parser, bool (*callback)(void *context))
+{
+    return !callback || callback(parser->context);
+}
+
+static __inline bool notify_string(json_parser_t *parser, bool (*callback)(void *context, const wide_string_t *value))
+{
+    wide_string_t value = { parser->chars, parser->chars_length };
+    return !callback || callback(parser->context, &value);
+}
+
+static __inline void finish_value(json_parser_t *parser)
+{
+    if (parser->depth == 0)
+        parser->state = state_done;
+    else
+        parser->state = parser->containers[parser->depth - 1] == 'o' ? state_object_comma : state_array_comma;
+}
+
+static bool finish_keyword(json_parser_t *parser, const uint8_t *data, size_t index)
+{
+    wide_string_t ws = { parser->chars, parser->chars_length };
+    bool ok;
+    if (are_wide_strings_equal(ws, __W(L"null")))
+        ok = notify(parser, parser->handler->on_null);
+    else if (are_wide_strings_equal(ws, __W(L"true")))
+        ok = !parser->handler->on_boolean || parser->handler->on_boolean(parser->context, true);
+    else if (are_wide_strings_equal(ws, __W(L"false")))
+        ok = !parser->handler->on_boolean || parser->handler->on_boolean(parser->context, false);
+    else
+        return fail_with_text(parser, json_unrecognized_entity, ws.data, ws.length, data, index);
+    if (!ok)
+        return fail(parser, json_stopped_by_handler, data, index);
+    finish_value(parser);
+    return true;
+}
+
+static bool finish_number(json_parser_t *parser, const uint8_t *data, size_t index, wchar_t next)
+{
+    const json_handler_t *handler = parser->handler;
+    size_t literal_length;
+    const char *literal = get_number_text(parser, &literal_length);
+    // the sign is kept in the buffer only for the literal callback
+    size_t sign = parser->negative ? 1 : 0;
+    const char *text = literal + sign;
+    size_t length = literal_length - sign;
+    number_t result;
+    bool complete = parser->number_stage == number_integer || parser->number_stage == number_fraction
+        || parser->number_stage == number_exponent;
+    if (!complete || (!handler->on_number_literal && !decode_json_number(text, length, parser->negative, &result)))
+    {
+        wchar_t buff[json_error_text_max_length];
+        size_t k = 0;
+        for (; k < length && k < json_error_text_max_length; k++)
+            buff[k] = text[k];
+        // the character that stopped the number is reported too, L'\0' at the end of the text
+        if (k < json_error_text_max_length)
+            buff[k++] = next;
+        return fail_with_text(parser, json_incorrect_number_format, buff, k, data, index);
+    }
+    bool ok;
+    if (handler->on_number_literal)
+        ok = handler->on_number_literal(parser->context, literal, literal_length);
+    else
+        ok = !handler->on_number || handler->on_number(parser->context, &result);
+    free(parser->long_number);
+    parser->long_number = NULL;
+    if (!ok)
+        return fail(parser, json_stopped_by_handler, data, index);
+    finish_value(parser);
+    return true;
+}
+
+static bool finish_container(json_parser_t *parser, const uint8_t *data, size_t index)
+{
+    char type = parser->containers[--parser->depth];
+    bool ok = notify(parser, type == 'o' ? parser->handler->on_object_end : parser->handler->on_array_end);
+    if (!ok)
+        return fail(parser, json_stopped_by_handler, data, index);
+    finish_value(parser);
+    return true;
+}
+
+// --- scanner ----------------------------------------------------------------
+
+static bool begin_value(json_parser_t *parser, uint8_t c, const uint8_t *data, size_t index)
+{
+    if ((c == '{' || c == '[') && parser->max_depth && parser->depth == parser->max_depth)
+        return fail(parser, json_maximum_depth_exceeded, data, index);
+    if (c == '{')
+    {
+        if (!notify(parser, parser->handler->on_object_begin))
+            return fail(parser, json_stopped_by_handler, data, index);
+        push_container(parser, 'o');
+        parser->state = state_object_key;
+    }
+    else if (c == '[')
+    {
+        if (!notify(parser, parser->handler->on_array_begin))
+            return fail(parser, json_stopped_by_handler, data, index);
+        push_container(parser, 'a');
+        parser->state = state_array_item;
+    }
+    else if (c == '"')
+    {
+        parser->chars_length = 0;
+        parser->is_key = false;
+        parser->state = state_string;
+    }
+    else if (is_letter(c))
+    {
+        parser->chars_length = 0;
+        put_char(parser, c);
+        if (!continues_keyword(c, 0, c))
+            return fail_with_text(parser, json_unrecognized_entity, parser->chars, 1, data, index);
+        parser->state = state_keyword;
+    }
+    else if (is_digit(c) || c == '-')
+    {
+        parser->number_length = 0;
+        parser->negative = c == '-';
+        parser->number_stage = c == '-' ? number_sign : number_integer;
+        put_number_char(parser, (char)c);
+        parser->state = state_number;
+    }
+    else
+        return fail_with_char(parser, json_unknown_symbol, c, data, index);
+    return true;
+}
+
+static bool put_escape(json_parser_t *parser, uint8_t c, const uint8_t *data, size_t index)
+{
+    switch(c)
+    {
+        case '"':
+            put_char(parser, L'"');
+            break;
+        case '\\':
+            put_char(parser, L'\\');
+            break;
+        case '/':
+            put_char(parser, L'/');
+            break;
+        case 'b':
+            put_char(parser, L'\b');
+            break;
+        case 'f':
+            put_char(parser, L'\f');
+            break;
+        case 'n':
+            put_char(parser, L'\n');
+            break;
+        case 'r':
+            put_char(parser, L'\r');
+            break;
+        case 't':
+            put_char(parser, L'\t');
+            break;
+        case 'u':
+            parser->hex_count = 0;
+            parser->state = state_string_unicode;
+            return true;
+        default:
+            return fail_with_char(parser, json_incorrect_escape_character, c, data, index);
+    }
+    parser->state = state_string;
+    return true;
+}
+
+/*
+    A broken sequence gives U+FFFD for its first byte and for each byte after it,
+    as the parser of whole texts does
+*/
+static void put_pending_utf8(json_parser_t *parser)
+{
+    source_t src;
+    init_utf8_source(&src, (const char*)parser->utf8, (size_t)parser->utf8_length);
+    while (src.index < src.length)
+        put_code_point(parser, decode_utf8_sequence(&src));
+    parser->utf8_length = 0;
+}
+
+static bool scan(json_parser_t *parser, const uint8_t *data, size_t length)
+{
+    size_t i = 0;
+    while (i < length)
+    {
+        uint8_t c = data[i];
+        switch(parser->state)
+        {
+            case state_value:
+            case state_array_item:
+            case state_array_comma:
+            case state_object_key:
+            case state_object_comma:
+            case state_colon:
+                if (is_space(c))
+                {
+                    i = parser->kernels->skip_spaces(data, i, length);
+                    continue;
+                }
+                break;
+            default:
+                break;
+        }
+        switch(parser->state)
+        {
+            case state_value:
+                // the key is reported when its value begins, so that a missing value fails first
+                if (parser->key_pending)
+                {
+                    parser->key_pending = false;
+                    if (!notify_string(parser, parser->handler->on_key))
+                        return fail(parser, json_stopped_by_handler, data, i);
+                }
+                if (!begin_value(parser, c, data, i))
+                    return false;
+                i++;
+                break;
+
+            case state_array_item:
+                if (c == ']')
+                {
+                    if (!finish_container(parser, data, i))
+                        return false;
+                    i++;
+                }
+                else
+                    parser->state = state_value;
+                break;
+
+            case state_array_comma:
+                if (c == ',')
+                    parser->state = state_array_item;
+                else if (c == ']')
+                {
+                    if (!finish_container(parser, data, i))
+                        return false;
+                }
+                else
+                    return fail(parser, json_expected_comma_separator, data, i);
+                i++;
+                break;
+
+            case state_object_key:
+                if (c == '}')
+                {
+                    if (!finish_container(parser, data, i))
+                        return false;
+                }
+                else if (c == '"')
+                {
+                    parser->chars_length = 0;
+                    parser->is_key = true;
+                    parser->state = state_string;
+                }
+                else if (is_letter(c))
+                {
+                    parser->chars_length = 0;
+                    put_char(parser, c);
+                    parser->state = state_identifier;
+                }
+                else
+                    return fail(parser, json_expected_name, data, i);
+                i++;
+                break;
+
+            case state_object_comma:
+                if (c == ',')
+                    parser->state = state_object_key;
+                else if (c == '}')
+                {
+                    if (!finish_container(parser, data, i))
+                        return false;
+                }
+                else
+                    return fail(parser, json_expected_comma_separator, data, i);
+                i++;
+                break;
+
+            case state_colon:
+                if (c != ':')
+                    return fail(parser, json_expected_colon_separator, data, i);
+                parser->key_pending = true;
+                parser->state = state_value;
+                i++;
+                break;
+
+            case state_string:
+            {
+                size_t end = parser->kernels->skip_string_body(data, i, length);
+                if (end > i)
+                {
+                    for (; i < end; i++)
+                        put_char(parser, data[i]);
+                    continue;
+                }
+                if (c == '"')
+                {
+                    if (parser->is_key)
+                        parser->state = state_colon;
+                    else
+                    {
+                        if (!notify_string(parser, parser->handler->on_string))
+                            return fail(parser, json_stopped_by_handler, data, i);
+                        finish_value(parser);
+                    }
+                }
+                else if (c == '\\')
+                    parser->state = state_string_escape;
+                else if (c >= 0x80)
+                {
+                    parser->utf8[0] = c;
+                    parser->utf8_length = 1;
+                    parser->utf8_needed = c >= 0xC2 && c <= 0xDF ? 2 : c >= 0xE0 && c <= 0xEF ? 3 :
+                        c >= 0xF0 && c <= 0xF4 ? 4 : 1;
+                    if (parser->utf8_needed == 1)
+                        put_pending_utf8(parser);
+                    else
+                        parser->state = state_string_utf8;
+                }
+                else if (c == '\0')
+                    return fail(parser, json_missing_closing_quotation_mark_in_string, data, i);
+                else
+                    put_char(parser, c);
+                i++;
+                break;
+            }
+
+            case state_string_utf8:
+                if ((c & 0xC0) != 0x80)
+                {
+                    // a broken sequence, the byte is scanned again as part of the string
+                    put_pending_utf8(parser);
+                    parser->state = state_string;
+                    break;
+                }
+                parser->utf8[parser->utf8_length++] = c;
+                if (parser->utf8_length == parser->utf8_needed)
+                {
+                    put_pending_utf8(parser);
+                    parser->state = state_string;
+                }
+                i++;
+                break;
+
+            case state_string_escape:
+                if (!put_escape(parser, c, data, i))
+                    return false;
+                i++;
+                break;
+
+            case state_string_unicode:
+                parser->hex[parser->hex_count++] = c;
+                if (!is_hex_digit(c))
+                    return fail_with_text(parser, json_incorrect_number_format, parser->hex,
+                        (size_t)parser->hex_count, data, i);
+                if (parser->hex_count == 4)
+                {
+                    int k = 0;
+                    for (int j = 0; j < 4; j++)
+                        k = (k << 4) | convert_hex_digit(parser->hex[j]);
+                    put_char(parser, (wchar_t)k);
+                    parser->state = state_string;
+                }
+                i++;
+                break;
+
+            case state_keyword:
+                if (is_letter(c))
+                {
+                    // a word that cannot be a keyword any more fails at once, so it is never buffered whole
+                    bool continues = continues_keyword(parser->chars[0], parser->chars_length, c);
+                    put_char(parser, c);
+                    if (!continues)
+                        return fail_with_text(parser, json_unrecognized_entity, parser->chars,
+                            parser->chars_length, data, i);
+                    i++;
+                }
+                else if (!finish_keyword(parser, data, i))
+                    return false;
+                break;
+
+            case state_identifier:
+                if (is_letter(c) || is_digit(c))
+                {
+                    put_char(parser, c);
+                    i++;
+                }
+                else
+                    parser->state = state_colon;
+                break;
+
+            case state_number:
+            {
+                number_stage_t stage = parser->number_stage;
+                bool accepted = true;
+                if (is_digit(c))
+                {
+                    if (stage == number_sign)
+                        parser->number_stage = number_integer;
+                    else if (stage == number_fraction_first)
+                        parser->number_stage = number_fraction;
+                    else if (stage == number_exponent_sign || stage == number_exponent_first)
+                        parser->number_stage = number_exponent;
+                }
+                else if (c == '.' && stage == number_integer)
+                    parser->number_stage = number_fraction_first;
+                else if ((c == 'e' || c == 'E') && (stage == number_integer || stage == number_fraction))
+                    parser->number_stage = number_exponent_sign;
+                else if ((c == '+' || c == '-') && stage == number_exponent_sign)
+                    parser->number_stage = number_exponent_first;
+                else
+                    accepted = false;
+                if (accepted)
+                {
+                    put_number_char(parser, (char)c);
+                    i++;
+                }
+                else if (!finish_number(parser, data, i, c))
+                    return false;
+                break;
+            }
+
+            case state_done:
+                // the rest after the root element is ignored, as by parse_json_ext()
+                return true;
+        }
+    }
+    return true;
+}
+
+// --- public API -------------------------------------------------------------
+
+json_parser_t * create_json_parser_with_owner(const json_handler_t *handler, void *context, size_t max_depth,
+    void (*reset_context)(void *context), void (*release_context)(void *context))
+{
+    json_parser_t *parser = nnalloc(sizeof(json_parser_t));
+    memset(parser, 0, sizeof(json_parser_t));
+    parser->handler = handler;
+    parser->context = context;
+    parser->reset_context = reset_context;
+    parser->release_context = release_context;
+    parser->kernels = get_scan_kernels();
+    parser->max_depth = max_depth;
+    parser->containers_capacity = 16;
+    parser->containers = nnalloc(parser->containers_capacity);
+    parser->chars_capacity = 64;
+    parser->chars = nnalloc(parser->chars_capacity * sizeof(wchar_t));
+    reset_json_parser(parser);
+    return parser;
+}
+
+json_parser_t * create_json_parser(const json_handler_t *handler, void *context)
+{
+    return create_json_parser_with_owner(handler, context, 0, NULL, NULL);
+}
+
+void * get_json_parser_context(json_parser_t *parser)
+{
+    return parser->context;
+}
+
+void reset_json_parser(json_parser_t *parser)
+{
+    parser->state = state_value;
+    parser->failed = false;
+    parser->bom_matched = 0;
+    parser->bom_checked = false;
+    parser->key_pending = false;
+    parser->depth = 0;
+    parser->chars_length = 0;
+    parser->utf8_length = 0;
+    free(parser->long_number);
+    parser->long_number = NULL;
+    parser->pos.row = 1;
+    parser->pos.column = 1;
+    init_json_error(&parser->err);
+    if (parser->reset_context)
+        parser->reset_context(parser->context);
+}
+
+static const uint8_t byte_order_mark[] = { 0xEF, 0xBB, 0xBF };
+
+static bool scan_and_advance(json_parser_t *parser, const uint8_t *data, size_t length)
+{
+    if (!scan(parser, data, length))
+        return false;
+    advance_position(&parser->pos, data, length);
+    return true;
+}
+
+/*
+    The bytes of a byte order mark split between chunks are held back until it is
+    complete, or until a byte differs and they are scanned as the text
+*/
+static bool release_partial_bom(json_parser_t *parser)
+{
+    size_t matched = parser->bom_matched;
+    parser->bom_checked = true;
+    parser->bom_matched = 0;
+    return scan_and_advance(parser, byte_order_mark, matched);
+}
+
+bool json_parser_feed(json_parser_t *parser, const char *chunk, size_t length)
+{
+    if (parser->failed)
+        return false;
+    const uint8_t *data = (const uint8_t*)chunk;
+    while (!parser->bom_checked && length > 0)
+    {
+        if (data[0] != byte_order_mark[parser->bom_matched])
+        {
+            if (!release_partial_bom(parser))
+                return false;
+            break;
+        }
+        data++;
+        length--;
+        if (++parser->bom_matched == sizeof(byte_order_mark))
+        {
+            parser->bom_checked = true;
+            parser->bom_matched = 0;
+        }
+    }
+    return scan_and_advance(parser, data, length);
+}
+
+bool json_parser_finish(json_parser_t *parser)
+{
+    if (parser->failed || (parser->bom_matched && !release_partial_bom(parser)))
+        return false;
+    switch(parser->state)
+    {
+        case state_keyword:
+            if (!finish_keyword(parser, NULL, 0))
+                return false;
+            break;
+        case state_number:
+            if (!finish_number(parser, NULL, 0, L'\0'))
+                return false;
+            break;
+        case state_identifier:
+            parser->state = state_colon;
+            break;
+        default:
+            break;
+    }
+    switch(parser->state)
+    {
+        case state_done:
+            return true;
+        case state_value:
+            if (parser->depth > 0)
+                return fail(parser, json_expected_element, NULL, 0);
+            return fail_with_char(parser, json_unknown_symbol, L'\0', NULL, 0);
+        case state_array_item:
+        case state_array_comma:
+            return fail_with_char(parser, json_missing_closing_bracket, L']', NULL, 0);
+        case state_object_key:
+        case state_object_comma:
+            return fail_with_char(parser, json_missing_closing_bracket, L'}', NULL, 0);
+        case state_colon:
+            return fail(parser, json_expected_colon_separator, NULL, 0);
+        case state_string_escape:
+            return fail_with_char(parser, json_incorrect_escape_character, L'\0', NULL, 0);
+        case state_string_unicode:
+            parser->hex[parser->hex_count++] = L'\0';
+            return fail_with_text(parser, json_incorrect_number_format, parser->hex,
+                (size_t)parser->hex_count, NULL, 0);
+        default:
+            return fail(parser, json_missing_closing_quotation_mark_in_string, NULL, 0);
+    }
+}
+
+const json_error_t * get_json_parser_error(const json_parser_t *parser)
+{
+    return &parser->err;
+}
+
+void destroy_json_parser(json_parser_t *parser)
+{
+    if (!parser)
+        return;
+    if (parser->release_context)
+        parser->release_context(parser->context);
+    free(parser->containers);
+    free(parser->chars);
+    free(parser->long_number);
+    free(parser);
+}
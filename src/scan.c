@@ -0,0 +1,419 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    The implementation of the vectorized scanning kernels
+*/
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+    #define SCAN_X86
+    #include <emmintrin.h>
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+        #define TARGET_AVX2
+    #else
+        #define TARGET_AVX2 __attribute__((target("avx2")))
+    #endif
+#elif defined(__aarch64__) || defined(_M_ARM64) || (defined(__ARM_NEON) && defined(__arm__))
+    #define SCAN_NEON
+    #include <arm_neon.h>
+#endif
+
+static __inline unsigned int count_trailing_zeros(uint64_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return (unsigned int)index;
+#else
+    return (unsigned int)__builtin_ctzll(mask);
+#endif
+}
+
+// --- scalar -----------------------------------------------------------------
+
+static __inline int is_space_char(unsigned int c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static __inline int is_digit_char(unsigned int c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static size_t skip_spaces_scalar(const uint8_t *data, size_t index, size_t length)
+{
+    while (index < length && is_space_char(data[index]))
+        index++;
+    return index;
+}
+
+static size_t skip_string_body_scalar(const uint8_t *data, size_t index, size_t length)
+{
+    while (index < length && data[index] != '"' && data[index] != '\\' && data[index] >= 0x20 && data[index] < 0x80)
+        index++;
+    return index;
+}
+
+static size_t skip_digits_scalar(const uint8_t *data, size_t index, size_t length)
+{
+    while (index < length && is_digit_char(data[index]))
+        index++;
+    return index;
+}
+
+static size_t skip_wide_spaces_scalar(const wchar_t *data, size_t index, size_t length)
+{
+    while (index < length && is_space_char((unsigned int)data[index]))
+        index++;
+    return index;
+}
+
+static size_t skip_wide_string_body_scalar(const wchar_t *data, size_t index, size_t length)
+{
+    while (index < length && data[index] != L'"' && data[index] != L'\\' && (unsigned int)data[index] >= 0x20)
+        index++;
+    return index;
+}
+
+static size_t skip_wide_digits_scalar(const wchar_t *data, size_t index, size_t length)
+{
+    while (index < length && is_digit_char((unsigned int)data[index]))
+        index++;
+    return index;
+}
+
+#if !defined(SCAN_X86) && !defined(SCAN_NEON)
+
+static const scan_kernels_t scalar_kernels =
+{
+    "scalar",
+    skip_spaces_scalar,
+    skip_string_body_scalar,
+    skip_digits_scalar,
+    skip_wide_spaces_scalar,
+    skip_wide_string_body_scalar,
+    skip_wide_digits_scalar
+};
+
+#endif
+
+// --- SSE2 -------------------------------------------------------------------
+
+#ifdef SCAN_X86
+
+static __inline __m128i sse2_spaces(__m128i v)
+{
+    __m128i a = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    __m128i b = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+    return _mm_or_si128(a, b);
+}
+
+static size_t skip_spaces_sse2(const uint8_t *data, size_t index, size_t length)
+{
+    while (index + 16 <= length)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + index));
+        unsigned int mask = ~(unsigned int)_mm_movemask_epi8(sse2_spaces(v)) & 0xFFFF;
+        if (mask)
+            return index + count_trailing_zeros(mask);
+        index += 16;
+    }
+    return skip_spaces_scalar(data, index, length);
+}
+
+static size_t skip_string_body_sse2(const uint8_t *data, size_t index, size_t length)
+{
+    while (index + 16 <= length)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + index));
+        // signed comparison catches both control characters and bytes >= 0x80
+        __m128i special = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+            _mm_cmplt_epi8(v, _mm_set1_epi8(0x20)));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(special);
+        if (mask)
+            return index + count_trailing_zeros(mask);
+        index += 16;
+    }
+    return skip_string_body_scalar(data, index, length);
+}
+
+static size_t skip_digits_sse2(const uint8_t *data, size_t index, size_t length)
+{
+    while (index + 16 <= length)
+    {
+        __m128i v = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)(data + index)), _mm_set1_epi8('0'));
+        __m128i digits = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(9)), v);
+        unsigned int mask = ~(unsigned int)_mm_movemask_epi8(digits) & 0xFFFF;
+        if (mask)
+            return index + count_trailing_zeros(mask);
+        index += 16;
+    }
+    return skip_digits_scalar(data, index, length);
+}
+
+#if WCHAR_MAX > 0xFFFF
+
+#define wide_lanes 4
+#define wide_set1(c) _mm_set1_epi32(c)
+#define wide_cmpeq(a, b) _mm_cmpeq_epi32(a, b)
+#define wide_cmplt(a, b) _mm_cmplt_epi32(a, b)
+#define wide_cmpgt(a, b) _mm_cmpgt_epi32(a, b)
+#define wide_movemask(m) ((unsigned int)_mm_movemask_ps(_mm_castsi128_ps(m)))
+#define wide_mask_bits 0xF
+#define wide_bits_per_char 1
+
+#else
+
+#define wide_lanes 8
+#define wide_set1(c) _mm_set1_epi16(c)
+#define wide_cmpeq(a, b) _mm_cmpeq_epi16(a, b)
+#define wide_cmplt(a, b) _mm_cmplt_epi16(a, b)
+#define wide_cmpgt(a, b) _mm_cmpgt_epi16(a, b)
+#define wide_movemask(m) ((unsigned int)_mm_movemask_epi8(m))
+#define wide_mask_bits 0xFFFF
+#define wide_bits_per_char 2
+
+#endif
+
+static size_t skip_wide_spaces_sse2(const wchar_t *data, size_t index, size_t length)
+{
+    while (index + wide_lanes <= length)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + index));
+        __m128i a = _mm_or_si128(wide_cmpeq(v, wide_set1(' ')), wide_cmpeq(v, wide_set1('\t')));
+        __m128i b = _mm_or_si128(wide_cmpeq(v, wide_set1('\n')), wide_cmpeq(v, wide_set1('\r')));
+        unsigned int mask = ~wide_movemask(_mm_or_si128(a, b)) & wide_mask_bits;
+        if (mask)
+            return index + count_trailing_zeros(mask) / wide_bits_per_char;
+        index += wide_lanes;
+    }
+    return skip_wide_spaces_scalar(data, index, length);
+}
+
+static size_t skip_wide_string_body_sse2(const wchar_t *data, size_t index, size_t length)
+{
+    while (index + wide_lanes <= length)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + index));
+        // signed comparison may also stop at large code points, the caller handles those one by one
+        __m128i special = _mm_or_si128(
+            _mm_or_si128(wide_cmpeq(v, wide_set1('"')), wide_cmpeq(v, wide_set1('\\'))),
+            wide_cmplt(v, wide_set1(0x20)));
+        unsigned int mask = wide_movemask(special);
+        if (mask)
+            return index + count_trailing_zeros(mask) / wide_bits_per_char;
+        index += wide_lanes;
+    }
+    return skip_wide_string_body_scalar(data, index, length);
+}
+
+static size_t skip_wide_digits_sse2(const wchar_t *data, size_t index, size_t length)
+{
+    while (index + wide_lanes <= length)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + index));
+        __m128i digits = _mm_and_si128(wide_cmpgt(v, wide_set1('0' - 1)), wide_cmplt(v, wide_set1('9' + 1)));
+        unsigned int mask = ~wide_movemask(digits) & wide_mask_bits;
+        if (mask)
+            return index + count_trailing_zeros(mask) / wide_bits_per_char;
+        index += wide_lanes;
+    }
+    return skip_wide_digits_scalar(data, index, length);
+}
+
+static const scan_kernels_t sse2_kernels =
+{
+    "sse2",
+    skip_spaces_sse2,
+    skip_string_body_sse2,
+    skip_digits_sse2,
+    skip_wide_spaces_sse2,
+    skip_wide_string_body_sse2,
+    skip_wide_digits_sse2
+};
+
+// --- AVX2 -------------------------------------------------------------------
+
+TARGET_AVX2 static size_t skip_spaces_avx2(const uint8_t *data, size_t index, size_t length)
+{
+    while (index + 32 <= length)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + index));
+        __m256i a = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+        __m256i b = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+        uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_or_si256(a, b));
+        if (mask)
+            return index + count_trailing_zeros(mask);
+        index += 32;
+    }
+    return skip_spaces_sse2(data, index, length);
+}
+
+TARGET_AVX2 static size_t skip_string_body_avx2(const uint8_t *data, size_t index, size_t length)
+{
+    while (index + 32 <= length)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + index));
+        __m256i special = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(special);
+        if (mask)
+            return index + count_trailing_zeros(mask);
+        index += 32;
+    }
+    return skip_string_body_sse2(data, index, length);
+}
+
+TARGET_AVX2 static size_t skip_digits_avx2(const uint8_t *data, size_t index, size_t length)
+{
+    while (index + 32 <= length)
+    {
+        __m256i v = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*)(data + index)), _mm256_set1_epi8('0'));
+        __m256i digits = _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(9)), v);
+        uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(digits);
+        if (mask)
+            return index + count_trailing_zeros(mask);
+        index += 32;
+    }
+    return skip_digits_sse2(data, index, length);
+}
+
+static const scan_kernels_t avx2_kernels =
+{
+    "avx2",
+    skip_spaces_avx2,
+    skip_string_body_avx2,
+    skip_digits_avx2,
+    skip_wide_spaces_sse2,
+    skip_wide_string_body_sse2,
+    skip_wide_digits_sse2
+};
+
+static int is_avx2_supported(void)
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return 0;
+    __cpuid(info, 1);
+    // OSXSAVE and AVX, then the OS must have enabled the YMM state
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+        return 0;
+    if ((_xgetbv(0) & 6) != 6)
+        return 0;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+// --- NEON -------------------------------------------------------------------
+
+#ifdef SCAN_NEON
+
+/*
+    NEON has no movemask; narrowing each 8-bit lane to 4 bits gives a 64-bit mask
+    with one nibble per byte
+*/
+static __inline uint64_t neon_mask(uint8x16_t m)
+{
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+}
+
+static size_t skip_spaces_neon(const uint8_t *data, size_t index, size_t length)
+{
+    while (index + 16 <= length)
+    {
+        uint8x16_t v = vld1q_u8(data + index);
+        uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), vceqq_u8(v, vdupq_n_u8('\t'))),
+            vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')), vceqq_u8(v, vdupq_n_u8('\r'))));
+        uint64_t mask = ~neon_mask(m);
+        if (mask)
+            return index + count_trailing_zeros(mask) / 4;
+        index += 16;
+    }
+    return skip_spaces_scalar(data, index, length);
+}
+
+static size_t skip_string_body_neon(const uint8_t *data, size_t index, size_t length)
+{
+    while (index + 16 <= length)
+    {
+        uint8x16_t v = vld1q_u8(data + index);
+        uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')), vceqq_u8(v, vdupq_n_u8('\\'))),
+            vorrq_u8(vcltq_u8(v, vdupq_n_u8(0x20)), vcgeq_u8(v, vdupq_n_u8(0x80))));
+        uint64_t mask = neon_mask(m);
+        if (mask)
+            return index + count_trailing_zeros(mask) / 4;
+        index += 16;
+    }
+    return skip_string_body_scalar(data, index, length);
+}
+
+static size_t skip_digits_neon(const uint8_t *data, size_t index, size_t length)
+{
+    while (index + 16 <= length)
+    {
+        uint8x16_t v = vsubq_u8(vld1q_u8(data + index), vdupq_n_u8('0'));
+        uint64_t mask = ~neon_mask(vcleq_u8(v, vdupq_n_u8(9)));
+        if (mask)
+            return index + count_trailing_zeros(mask) / 4;
+        index += 16;
+    }
+    return skip_digits_scalar(data, index, length);
+}
+
+static const scan_kernels_t neon_kernels =
+{
+    "neon",
+    skip_spaces_neon,
+    skip_string_body_neon,
+    skip_digits_neon,
+    skip_wide_spaces_scalar,
+    skip_wide_string_body_scalar,
+    skip_wide_digits_scalar
+};
+
+#endif
+
+// --- dispatch ---------------------------------------------------------------
+
+static const scan_kernels_t * select_scan_kernels(void)
+{
+#if defined(SCAN_X86)
+    if (is_avx2_supported())
+        return &avx2_kernels;
+    return &sse2_kernels;
+#elif defined(SCAN_NEON)
+    return &neon_kernels;
+#else
+    return &scalar_kernels;
+#endif
+}
+
+const scan_kernels_t * get_scan_kernels(void)
+{
+    /*
+        All threads compute the same pointer, so a race on the first call
+        is harmless
+    */
+    static const scan_kernels_t *volatile kernels = NULL;
+    const scan_kernels_t *result = kernels;
+    if (!result)
+    {
+        result = select_scan_kernels();
+        kernels = result;
+    }
+    return result;
+}
@@ -0,0 +1,35 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    Vectorized kernels used by the JSON scanner, chosen at runtime
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+/*
+    Each kernel starts at 'index' and returns the index of the first character
+    that does not belong to the class (or 'length' if there is no such character)
+*/
+typedef size_t (*byte_scan_kernel_t)(const uint8_t *data, size_t index, size_t length);
+typedef size_t (*wide_scan_kernel_t)(const wchar_t *data, size_t index, size_t length);
+
+typedef struct
+{
+    const char *name;
+    byte_scan_kernel_t skip_spaces;
+    byte_scan_kernel_t skip_string_body;
+    byte_scan_kernel_t skip_digits;
+    wide_scan_kernel_t skip_wide_spaces;
+    wide_scan_kernel_t skip_wide_string_body;
+    wide_scan_kernel_t skip_wide_digits;
+} scan_kernels_t;
+
+/*
+    A string body ends at a quotation mark, a backslash, a control character or,
+    for UTF-8 data, at the first byte of a multibyte sequence
+*/
+const scan_kernels_t * get_scan_kernels(void);
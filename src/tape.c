@@ -0,0 +1,488 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    The read-only tape form of JSON documents
+*/
+
+#include <string.h>
+#include "json.h"
+#include "allocator.h"
+#include "tape.h"
+#include "parser.h"
+
+typedef struct
+{
+    size_t begin;
+    size_t items;
+} open_container_t;
+
+typedef struct
+{
+    uint64_t *entries;
+    size_t entries_count;
+    size_t entries_capacity;
+    uint8_t *strings;
+    size_t strings_size;
+    size_t strings_capacity;
+    open_container_t *open;
+    size_t open_count;
+    size_t open_capacity;
+} tape_builder_t;
+
+static void * grow_block(void *block, size_t used, size_t capacity)
+{
+    void *bigger = nnalloc(capacity);
+    if (used)
+        memcpy(bigger, block, used);
+    free(block);
+    return bigger;
+}
+
+static __inline size_t put_entry(tape_builder_t *builder, uint64_t entry)
+{
+    if (builder->entries_count == builder->entries_capacity)
+    {
+        builder->entries_capacity *= 2;
+        builder->entries = grow_block(builder->entries, builder->entries_count * sizeof(uint64_t),
+            builder->entries_capacity * sizeof(uint64_t));
+    }
+    builder->entries[builder->entries_count] = entry;
+    return builder->entries_count++;
+}
+
+static __inline void count_item(tape_builder_t *builder)
+{
+    if (builder->open_count)
+        builder->open[builder->open_count - 1].items++;
+}
+
+static void put_string_entry(tape_builder_t *builder, char tag, const wide_string_t *str)
+{
+    size_t size = sizeof(uint64_t) + (str->length + 1) * sizeof(wchar_t);
+    size = (size + 7) & ~(size_t)7;
+    if (builder->strings_size + size > builder->strings_capacity)
+    {
+        size_t capacity = builder->strings_capacity * 2;
+        while (capacity < builder->strings_size + size)
+            capacity *= 2;
+        builder->strings = grow_block(builder->strings, builder->strings_size, capacity);
+        builder->strings_capacity = capacity;
+    }
+    uint8_t *block = builder->strings + builder->strings_size;
+    uint64_t length = str->length;
+    memcpy(block, &length, sizeof(uint64_t));
+    wchar_t *chars = (wchar_t*)(block + sizeof(uint64_t));
+    if (str->length)
+        memcpy(chars, str->data, str->length * sizeof(wchar_t));
+    chars[str->length] = L'\0';
+    put_entry(builder, make_entry(tag, builder->strings_size));
+    builder->strings_size += size;
+}
+
+static bool open_container(tape_builder_t *builder, char tag)
+{
+    count_item(builder);
+    if (builder->open_count == builder->open_capacity)
+    {
+        builder->open_capacity *= 2;
+        builder->open = grow_block(builder->open, builder->open_count * sizeof(open_container_t),
+            builder->open_capacity * sizeof(open_container_t));
+    }
+    open_container_t *container = &builder->open[builder->open_count++];
+    container->begin = put_entry(builder, make_entry(tag, 0));
+    container->items = 0;
+    return true;
+}
+
+static bool close_container(tape_builder_t *builder, char tag)
+{
+    open_container_t *container = &builder->open[--builder->open_count];
+    size_t end = put_entry(builder, make_entry(tag, container->items));
+    uint64_t *begin = &builder->entries[container->begin];
+    *begin = make_entry(get_entry_tag(*begin), end);
+    return true;
+}
+
+static bool on_tape_object_begin(void *context)
+{
+    return open_container((tape_builder_t*)context, '{');
+}
+
+static bool on_tape_object_end(void *context)
+{
+    return close_container((tape_builder_t*)context, '}');
+}
+
+static bool on_tape_array_begin(void *context)
+{
+    return open_container((tape_builder_t*)context, '[');
+}
+
+static bool on_tape_array_end(void *context)
+{
+    return close_container((tape_builder_t*)context, ']');
+}
+
+static bool on_tape_key(void *context, const wide_string_t *key)
+{
+    put_string_entry((tape_builder_t*)context, 'k', key);
+    return true;
+}
+
+static bool on_tape_string(void *context, const wide_string_t *value)
+{
+    tape_builder_t *builder = context;
+    count_item(builder);
+    put_string_entry(builder, 's', value);
+    return true;
+}
+
+static bool on_tape_number(void *context, const number_t *value)
+{
+    tape_builder_t *builder = context;
+    double real = (double)*(const real_t*)value;
+    uint64_t bits;
+    memcpy(&bits, &real, sizeof(bits));
+    count_item(builder);
+    put_entry(builder, make_entry('d', 0));
+    put_entry(builder, bits);
+    return true;
+}
+
+static bool on_tape_boolean(void *context, bool value)
+{
+    tape_builder_t *builder = context;
+    count_item(builder);
+    put_entry(builder, make_entry(value ? 't' : 'f', 0));
+    return true;
+}
+
+static bool on_tape_null(void *context)
+{
+    tape_builder_t *builder = context;
+    count_item(builder);
+    put_entry(builder, make_entry('n', 0));
+    return true;
+}
+
+static const json_handler_t tape_handler =
+{
+    on_tape_object_begin,
+    on_tape_object_end,
+    on_tape_array_begin,
+    on_tape_array_end,
+    on_tape_key,
+    on_tape_string,
+    on_tape_number,
+    on_tape_boolean,
+    on_tape_null,
+    NULL
+};
+
+static void init_tape_builder(tape_builder_t *builder)
+{
+    builder->entries_capacity = 256;
+    builder->entries = nnalloc(builder->entries_capacity * sizeof(uint64_t));
+    builder->entries_count = 0;
+    builder->strings_capacity = 1024;
+    builder->strings = nnalloc(builder->strings_capacity);
+    builder->strings_size = 0;
+    builder->open_capacity = 16;
+    builder->open = nnalloc(builder->open_capacity * sizeof(open_container_t));
+    builder->open_count = 0;
+}
+
+/*
+    The tape and the strings are copied into one block behind the header
+*/
+static json_tape_t * finish_tape(tape_builder_t *builder, bool success)
+{
+    json_tape_t *tape = NULL;
+    if (success)
+    {
+        size_t entries_size = builder->entries_count * sizeof(uint64_t);
+        tape = nnalloc(sizeof(json_tape_t) + entries_size + builder->strings_size);
+        uint8_t *data = (uint8_t*)(tape + 1);
+        memcpy(data, builder->entries, entries_size);
+        if (builder->strings_size)
+            memcpy(data + entries_size, builder->strings, builder->strings_size);
+        tape->entries = (const uint64_t*)data;
+        tape->entries_count = builder->entries_count;
+        tape->strings = data + entries_size;
+        tape->strings_size = builder->strings_size;
+        tape->mapping.data = NULL;
+    }
+    free(builder->entries);
+    free(builder->strings);
+    free(builder->open);
+    return tape;
+}
+
+json_tape_t * parse_json_to_tape(wide_string_t *text, json_error_t *err)
+{
+    tape_builder_t builder;
+    init_tape_builder(&builder);
+    return finish_tape(&builder, parse_json_with_handler(text, &tape_handler, &builder, err));
+}
+
+json_tape_t * parse_json_utf8_to_tape(const char *data, size_t length, json_error_t *err)
+{
+    tape_builder_t builder;
+    init_tape_builder(&builder);
+    return finish_tape(&builder, parse_json_utf8_with_handler(data, length, &tape_handler, &builder, err));
+}
+
+void destroy_json_tape(json_tape_t *tape)
+{
+    if (tape)
+    {
+        file_mapping_t mapping = tape->mapping;
+        free(tape);
+        unmap_file(&mapping);
+    }
+}
+
+// --- snapshot ---------------------------------------------------------------
+
+/*
+    The file starts with a header of 8-byte fields followed by the entries and
+    the strings exactly as they are kept in memory. Entries refer to each other
+    and to the strings by offsets, so the mapped file is used as it is.
+    The marker tells the byte order and the size of wchar_t the file was written with
+*/
+#define snapshot_signature 0x5041544E4F534A00ULL
+#define snapshot_version 1
+#define snapshot_marker (0x0102030405060700ULL | (uint64_t)sizeof(wchar_t))
+
+typedef struct
+{
+    uint64_t signature;
+    uint64_t version;
+    uint64_t marker;
+    uint64_t entries_count;
+    uint64_t strings_size;
+} snapshot_header_t;
+
+bool write_json_tape_to_file(const json_tape_t *tape, const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return false;
+    snapshot_header_t header;
+    header.signature = snapshot_signature;
+    header.version = snapshot_version;
+    header.marker = snapshot_marker;
+    header.entries_count = tape->entries_count;
+    header.strings_size = tape->strings_size;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(tape->entries, sizeof(uint64_t), tape->entries_count, file) == tape->entries_count
+        && (tape->strings_size == 0 || fwrite(tape->strings, tape->strings_size, 1, file) == 1);
+    return fclose(file) == 0 && written;
+}
+
+json_tape_t * map_json_tape_file(const char *path, json_error_t *err)
+{
+    init_json_error(err);
+    file_mapping_t mapping;
+    if (!map_file(path, &mapping))
+    {
+        if (err)
+            err->type = json_cannot_read_file;
+        return NULL;
+    }
+    // only the header is checked, so mapping takes the same time whatever the size of the file
+    snapshot_header_t header;
+    bool valid = mapping.size >= sizeof(header);
+    if (valid)
+    {
+        memcpy(&header, mapping.data, sizeof(header));
+        valid = header.signature == snapshot_signature && header.version == snapshot_version
+            && header.marker == snapshot_marker && header.entries_count > 0
+            && header.entries_count <= (mapping.size - sizeof(header)) / sizeof(uint64_t)
+            && header.strings_size == mapping.size - sizeof(header) - header.entries_count * sizeof(uint64_t);
+    }
+    if (!valid)
+    {
+        if (err)
+            err->type = json_incorrect_binary_format;
+        unmap_file(&mapping);
+        return NULL;
+    }
+    json_tape_t *tape = nnalloc(sizeof(json_tape_t));
+    tape->entries = (const uint64_t*)(mapping.data + sizeof(header));
+    tape->entries_count = (size_t)header.entries_count;
+    tape->strings = (const uint8_t*)mapping.data + sizeof(header) + tape->entries_count * sizeof(uint64_t);
+    tape->strings_size = (size_t)header.strings_size;
+    tape->mapping = mapping;
+    return tape;
+}
+
+// --- accessors --------------------------------------------------------------
+
+/*
+    A mapped snapshot is only checked by its header, so every offset read from
+    the tape is checked before it is followed: a damaged file gives wrong values,
+    but nothing is read outside the tape. A value out of the tape reads as null
+*/
+static __inline uint64_t get_entry(json_tape_value_t value)
+{
+    return value.index < value.tape->entries_count ? value.tape->entries[value.index] : make_entry('n', 0);
+}
+
+/*
+    Returns the index of the closing entry of a container, or 0 if it points
+    outside the tape or backwards
+*/
+static __inline size_t get_container_end(const json_tape_t *tape, size_t index, uint64_t entry)
+{
+    uint64_t end = get_entry_payload(entry);
+    return end > index && end < tape->entries_count ? (size_t)end : 0;
+}
+
+/*
+    Returns the index of the entry that follows the value and all its content
+*/
+static __inline size_t skip_value(const json_tape_t *tape, size_t index)
+{
+    if (index >= tape->entries_count)
+        return tape->entries_count;
+    uint64_t entry = tape->entries[index];
+    switch (get_entry_tag(entry))
+    {
+        case '{':
+        case '[':
+        {
+            size_t end = get_container_end(tape, index, entry);
+            return end ? end + 1 : tape->entries_count;
+        }
+        case 'd':
+            return index + 2;
+        default:
+            return index + 1;
+    }
+}
+
+static const wchar_t * get_string_chars(const json_tape_t *tape, uint64_t entry, size_t *length)
+{
+    uint64_t offset = get_entry_payload(entry);
+    if (offset % sizeof(uint64_t) != 0 || offset > tape->strings_size
+            || tape->strings_size - offset < sizeof(uint64_t))
+        return NULL;
+    uint64_t count;
+    memcpy(&count, tape->strings + offset, sizeof(uint64_t));
+    // the characters and the terminating zero must fit into the string area
+    if (count >= (tape->strings_size - offset - sizeof(uint64_t)) / sizeof(wchar_t))
+        return NULL;
+    const wchar_t *chars = (const wchar_t*)(tape->strings + offset + sizeof(uint64_t));
+    if (chars[count] != L'\0')
+        return NULL;
+    *length = (size_t)count;
+    return chars;
+}
+
+json_tape_value_t get_json_tape_root(const json_tape_t *tape)
+{
+    json_tape_value_t root = { tape, 0 };
+    return root;
+}
+
+json_element_type_t get_json_tape_value_type(json_tape_value_t value)
+{
+    switch (get_entry_tag(get_entry(value)))
+    {
+        case '{':
+            return json_object;
+        case '[':
+            return json_array;
+        case 's':
+            return json_string;
+        case 'd':
+            return json_number;
+        case 't':
+        case 'f':
+            return json_boolean;
+        default:
+            return json_null;
+    }
+}
+
+size_t get_json_tape_value_count(json_tape_value_t value)
+{
+    uint64_t entry = get_entry(value);
+    char tag = get_entry_tag(entry);
+    if (tag != '{' && tag != '[')
+        return 0;
+    size_t end = get_container_end(value.tape, value.index, entry);
+    return end ? (size_t)get_entry_payload(value.tape->entries[end]) : 0;
+}
+
+bool get_pair_from_json_tape_object(json_tape_value_t object, const wchar_t *key, json_tape_value_t *value)
+{
+    uint64_t entry = get_entry(object);
+    if (get_entry_tag(entry) != '{')
+        return false;
+    size_t length = wcslen(key);
+    size_t end = get_container_end(object.tape, object.index, entry);
+    size_t index = object.index + 1;
+    while (index < end)
+    {
+        uint64_t key_entry = object.tape->entries[index];
+        size_t key_length;
+        const wchar_t *chars = get_string_chars(object.tape, key_entry, &key_length);
+        if (get_entry_tag(key_entry) != 'k' || !chars)
+            return false;
+        if (key_length == length && memcmp(chars, key, length * sizeof(wchar_t)) == 0)
+        {
+            value->tape = object.tape;
+            value->index = index + 1;
+            return true;
+        }
+        index = skip_value(object.tape, index + 1);
+    }
+    return false;
+}
+
+bool get_element_from_json_tape_array(json_tape_value_t array, size_t index, json_tape_value_t *item)
+{
+    uint64_t entry = get_entry(array);
+    if (get_entry_tag(entry) != '[')
+        return false;
+    size_t end = get_container_end(array.tape, array.index, entry);
+    size_t position = array.index + 1;
+    for (size_t i = 0; i < index && position < end; i++)
+        position = skip_value(array.tape, position);
+    if (position >= end)
+        return false;
+    item->tape = array.tape;
+    item->index = position;
+    return true;
+}
+
+bool get_json_tape_string(json_tape_value_t value, wide_string_t *str)
+{
+    uint64_t entry = get_entry(value);
+    if (get_entry_tag(entry) != 's')
+        return false;
+    size_t length;
+    const wchar_t *chars = get_string_chars(value.tape, entry, &length);
+    if (!chars)
+        return false;
+    str->data = (wchar_t*)chars;
+    str->length = length;
+    return true;
+}
+
+real_t get_json_tape_number(json_tape_value_t value)
+{
+    if (get_entry_tag(get_entry(value)) != 'd' || value.index + 1 >= value.tape->entries_count)
+        return 0;
+    double real;
+    uint64_t bits = value.tape->entries[value.index + 1];
+    memcpy(&real, &bits, sizeof(real));
+    return (real_t)real;
+}
+
+bool get_json_tape_boolean(json_tape_value_t value)
+{
+    return get_entry_tag(get_entry(value)) == 't';
+}
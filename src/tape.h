@@ -0,0 +1,34 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    The layout of the tape form of JSON documents
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "json.h"
+#include "mapping.h"
+
+/*
+    Each entry holds a tag in the high byte and a 56-bit payload. Containers
+    are stored as a pair of entries: the opening one points to the closing one,
+    and the closing one holds the number of items. A string entry holds the offset
+    of a block in the string area: the length followed by the characters.
+    A number entry is followed by one more entry with the bits of the value
+*/
+#define tag_shift 56
+#define payload_mask ((((uint64_t)1) << tag_shift) - 1)
+
+#define make_entry(tag, payload) (((uint64_t)(tag) << tag_shift) | ((uint64_t)(payload) & payload_mask))
+#define get_entry_tag(entry) ((char)((entry) >> tag_shift))
+#define get_entry_payload(entry) ((entry) & payload_mask)
+
+struct json_tape_t
+{
+    const uint64_t *entries;
+    size_t entries_count;
+    const uint8_t *strings;
+    size_t strings_size;
+    file_mapping_t mapping;
+};
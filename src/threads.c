@@ -0,0 +1,185 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    A minimal portable way to run tasks on worker threads
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "threads.h"
+#include "allocator.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+typedef struct
+{
+    parallel_task_t task;
+    void *argument;
+} thread_start_t;
+
+#ifdef _WIN32
+
+static DWORD WINAPI thread_routine(LPVOID param)
+{
+    thread_start_t *start = param;
+    start->task(start->argument);
+    return 0;
+}
+
+long increment_atomic_counter(volatile long *counter)
+{
+    return InterlockedIncrement(counter);
+}
+
+long decrement_atomic_counter(volatile long *counter)
+{
+    return InterlockedDecrement(counter);
+}
+
+size_t get_processors_count(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+
+void run_in_parallel(parallel_task_t task, void *arguments, size_t size, size_t count)
+{
+    HANDLE *handles = nnalloc(count * sizeof(HANDLE));
+    thread_start_t *starts = nnalloc(count * sizeof(thread_start_t));
+    for (size_t i = 1; i < count; i++)
+    {
+        starts[i].task = task;
+        starts[i].argument = (uint8_t*)arguments + i * size;
+        handles[i] = CreateThread(NULL, 0, thread_routine, &starts[i], 0, NULL);
+    }
+    task(arguments);
+    for (size_t i = 1; i < count; i++)
+    {
+        if (handles[i])
+        {
+            WaitForSingleObject(handles[i], INFINITE);
+            CloseHandle(handles[i]);
+        }
+        else
+            task(starts[i].argument);
+    }
+    free(starts);
+    free(handles);
+}
+
+void init_monitor(monitor_t *monitor)
+{
+    InitializeCriticalSection(&monitor->lock);
+    InitializeConditionVariable(&monitor->condition);
+}
+
+void destroy_monitor(monitor_t *monitor)
+{
+    DeleteCriticalSection(&monitor->lock);
+}
+
+void enter_monitor(monitor_t *monitor)
+{
+    EnterCriticalSection(&monitor->lock);
+}
+
+void leave_monitor(monitor_t *monitor)
+{
+    LeaveCriticalSection(&monitor->lock);
+}
+
+void wait_in_monitor(monitor_t *monitor)
+{
+    SleepConditionVariableCS(&monitor->condition, &monitor->lock, INFINITE);
+}
+
+void notify_monitor(monitor_t *monitor)
+{
+    WakeAllConditionVariable(&monitor->condition);
+}
+
+#else
+
+static void * thread_routine(void *param)
+{
+    thread_start_t *start = param;
+    start->task(start->argument);
+    return NULL;
+}
+
+long increment_atomic_counter(volatile long *counter)
+{
+    return __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+long decrement_atomic_counter(volatile long *counter)
+{
+    return __atomic_sub_fetch(counter, 1, __ATOMIC_ACQ_REL);
+}
+
+size_t get_processors_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (size_t)count : 1;
+}
+
+void run_in_parallel(parallel_task_t task, void *arguments, size_t size, size_t count)
+{
+    pthread_t *threads = nnalloc(count * sizeof(pthread_t));
+    bool *started = nnalloc(count * sizeof(bool));
+    thread_start_t *starts = nnalloc(count * sizeof(thread_start_t));
+    for (size_t i = 1; i < count; i++)
+    {
+        starts[i].task = task;
+        starts[i].argument = (uint8_t*)arguments + i * size;
+        started[i] = pthread_create(&threads[i], NULL, thread_routine, &starts[i]) == 0;
+    }
+    task(arguments);
+    for (size_t i = 1; i < count; i++)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            task(starts[i].argument);
+    }
+    free(starts);
+    free(started);
+    free(threads);
+}
+
+void init_monitor(monitor_t *monitor)
+{
+    pthread_mutex_init(&monitor->lock, NULL);
+    pthread_cond_init(&monitor->condition, NULL);
+}
+
+void destroy_monitor(monitor_t *monitor)
+{
+    pthread_cond_destroy(&monitor->condition);
+    pthread_mutex_destroy(&monitor->lock);
+}
+
+void enter_monitor(monitor_t *monitor)
+{
+    pthread_mutex_lock(&monitor->lock);
+}
+
+void leave_monitor(monitor_t *monitor)
+{
+    pthread_mutex_unlock(&monitor->lock);
+}
+
+void wait_in_monitor(monitor_t *monitor)
+{
+    pthread_cond_wait(&monitor->condition, &monitor->lock);
+}
+
+void notify_monitor(monitor_t *monitor)
+{
+    pthread_cond_broadcast(&monitor->condition);
+}
+
+#endif
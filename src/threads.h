@@ -0,0 +1,54 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    A minimal portable way to run tasks on worker threads
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+typedef void (*parallel_task_t)(void *argument);
+
+size_t get_processors_count(void);
+
+/*
+    Runs the task once for each of 'count' arguments placed 'size' bytes apart and
+    waits for all of them. The first argument is processed by the calling thread,
+    and if a thread cannot be started its argument is processed there as well
+*/
+void run_in_parallel(parallel_task_t task, void *arguments, size_t size, size_t count);
+
+/*
+    Counters shared between threads; both functions return the new value
+*/
+long increment_atomic_counter(volatile long *counter);
+long decrement_atomic_counter(volatile long *counter);
+
+/*
+    A lock with a condition that the threads holding it wait on, enough
+    for handing tasks and results between the threads of one call
+*/
+typedef struct
+{
+#ifdef _WIN32
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE condition;
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t condition;
+#endif
+} monitor_t;
+
+void init_monitor(monitor_t *monitor);
+void destroy_monitor(monitor_t *monitor);
+void enter_monitor(monitor_t *monitor);
+void leave_monitor(monitor_t *monitor);
+void wait_in_monitor(monitor_t *monitor);
+void notify_monitor(monitor_t *monitor);
@@ -0,0 +1,577 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    The serializer of JSON elements
+*/
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <float.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "element.h"
+#include "binding.h"
+#include "scan.h"
+#include "allocator.h"
+
+/*
+    All numbers formatted by format_real() fit in this size, the measuring pass
+    reserves it instead of formatting numbers twice
+*/
+#define max_number_length 32
+
+#define write_buffer_size 4096
+
+/*
+    The output goes either to a wide string or, encoded as UTF-8, to a fixed buffer
+    that is flushed to the callback when it is full. While the size of a wide string
+    is measured there is no output at all, and only the length grows
+*/
+typedef struct
+{
+    wchar_t *data;
+    uint8_t *bytes;
+    size_t length;
+    json_write_callback_t callback;
+    void *context;
+    unsigned int surrogate;
+    bool failed;
+    json_format_t format;
+    size_t depth;
+    const scan_kernels_t *kernels;
+} writer_t;
+
+// --- output -----------------------------------------------------------------
+
+static void flush_writer(writer_t *writer)
+{
+    if (writer->length && !writer->failed)
+        writer->failed = !writer->callback(writer->context, (const char*)writer->bytes, writer->length);
+    writer->length = 0;
+}
+
+static __inline void put_byte(writer_t *writer, uint8_t b)
+{
+    if (writer->length == write_buffer_size)
+        flush_writer(writer);
+    writer->bytes[writer->length++] = b;
+}
+
+static void put_code_point(writer_t *writer, unsigned int cp)
+{
+    if (cp < 0x80)
+        put_byte(writer, (uint8_t)cp);
+    else if (cp < 0x800)
+    {
+        put_byte(writer, (uint8_t)(0xC0 | (cp >> 6)));
+        put_byte(writer, (uint8_t)(0x80 | (cp & 0x3F)));
+    }
+    else if (cp < 0x10000)
+    {
+        put_byte(writer, (uint8_t)(0xE0 | (cp >> 12)));
+        put_byte(writer, (uint8_t)(0x80 | ((cp >> 6) & 0x3F)));
+        put_byte(writer, (uint8_t)(0x80 | (cp & 0x3F)));
+    }
+    else
+    {
+        put_byte(writer, (uint8_t)(0xF0 | (cp >> 18)));
+        put_byte(writer, (uint8_t)(0x80 | ((cp >> 12) & 0x3F)));
+        put_byte(writer, (uint8_t)(0x80 | ((cp >> 6) & 0x3F)));
+        put_byte(writer, (uint8_t)(0x80 | (cp & 0x3F)));
+    }
+}
+
+/*
+    Surrogate pairs are joined into one code point, a surrogate without a pair
+    is replaced by U+FFFD
+*/
+static void put_utf8_char(writer_t *writer, wchar_t c)
+{
+    unsigned int cp = (unsigned int)c;
+    if (writer->surrogate)
+    {
+        unsigned int high = writer->surrogate;
+        writer->surrogate = 0;
+        if (cp >= 0xDC00 && cp <= 0xDFFF)
+        {
+            put_code_point(writer, 0x10000 + ((high - 0xD800) << 10) + (cp - 0xDC00));
+            return;
+        }
+        put_code_point(writer, 0xFFFD);
+    }
+    if (cp >= 0xD800 && cp <= 0xDBFF)
+        writer->surrogate = cp;
+    else if ((cp >= 0xDC00 && cp <= 0xDFFF) || cp > 0x10FFFF)
+        put_code_point(writer, 0xFFFD);
+    else
+        put_code_point(writer, cp);
+}
+
+static __inline bool is_measuring(const writer_t *writer)
+{
+    return !writer->data && !writer->bytes;
+}
+
+static __inline void put_char(writer_t *writer, wchar_t c)
+{
+    if (writer->bytes)
+        put_utf8_char(writer, c);
+    else
+    {
+        if (writer->data)
+            writer->data[writer->length] = c;
+        writer->length++;
+    }
+}
+
+static __inline void put_chars(writer_t *writer, const wchar_t *chars, size_t count)
+{
+    if (writer->bytes)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            if ((unsigned int)chars[i] < 0x80 && !writer->surrogate)
+                put_byte(writer, (uint8_t)chars[i]);
+            else
+                put_utf8_char(writer, chars[i]);
+        }
+        return;
+    }
+    if (writer->data && count)
+        memcpy(writer->data + writer->length, chars, count * sizeof(wchar_t));
+    writer->length += count;
+}
+
+static __inline void put_ascii(writer_t *writer, const char *chars, size_t count)
+{
+    if (writer->bytes)
+    {
+        if (writer->surrogate)
+        {
+            writer->surrogate = 0;
+            put_code_point(writer, 0xFFFD);
+        }
+        for (size_t i = 0; i < count; i++)
+            put_byte(writer, (uint8_t)chars[i]);
+        return;
+    }
+    if (writer->data)
+    {
+        wchar_t *dst = writer->data + writer->length;
+        for (size_t i = 0; i < count; i++)
+            dst[i] = (wchar_t)chars[i];
+    }
+    writer->length += count;
+}
+
+static __inline void put_new_line(writer_t *writer)
+{
+    if (writer->format != json_format_pretty)
+        return;
+    put_char(writer, L'\n');
+    for (size_t i = 0; i < writer->depth; i++)
+        put_ascii(writer, "    ", 4);
+}
+
+static __inline void put_separator(writer_t *writer)
+{
+    if (writer->format == json_format_simple)
+        put_ascii(writer, ", ", 2);
+    else
+        put_char(writer, L',');
+}
+
+static __inline void put_colon(writer_t *writer)
+{
+    if (writer->format == json_format_compact)
+        put_char(writer, L':');
+    else
+        put_ascii(writer, ": ", 2);
+}
+
+// --- scalars ----------------------------------------------------------------
+
+static void put_escape(writer_t *writer, wchar_t c)
+{
+    static const char hex[] = "0123456789abcdef";
+    switch (c)
+    {
+        case L'"':  put_ascii(writer, "\\\"", 2); return;
+        case L'\\': put_ascii(writer, "\\\\", 2); return;
+        case L'\b': put_ascii(writer, "\\b", 2); return;
+        case L'\f': put_ascii(writer, "\\f", 2); return;
+        case L'\n': put_ascii(writer, "\\n", 2); return;
+        case L'\r': put_ascii(writer, "\\r", 2); return;
+        case L'\t': put_ascii(writer, "\\t", 2); return;
+    }
+    if ((unsigned int)c < 0x20)
+    {
+        char buff[6] = { '\\', 'u', '0', '0', hex[(c >> 4) & 0xF], hex[c & 0xF] };
+        put_ascii(writer, buff, 6);
+    }
+    else
+    {
+        // vector kernels may also stop at large code points, they need no escaping
+        put_char(writer, c);
+    }
+}
+
+static void put_string(writer_t *writer, const wide_string_t *str)
+{
+    put_char(writer, L'"');
+    size_t index = 0;
+    while (index < str->length)
+    {
+        size_t end = writer->kernels->skip_wide_string_body(str->data, index, str->length);
+        put_chars(writer, str->data + index, end - index);
+        if (end == str->length)
+            break;
+        put_escape(writer, str->data[end]);
+        index = end + 1;
+    }
+    put_char(writer, L'"');
+}
+
+/*
+    Integers are printed digit by digit; other values are printed with the fewest
+    significant digits that read back to the same value. A normal double lies
+    so close to any decimal of up to 15 digits that rounds to it that "%.15g"
+    gives that decimal, so only 16 and 17 digits are tried after it; subnormal
+    values have fewer bits and are tried from one digit up
+*/
+static size_t format_real(char *buff, double value)
+{
+    if (!isfinite(value))
+    {
+        memcpy(buff, "null", 4);
+        return 4;
+    }
+    if (value == floor(value) && fabs(value) < 9007199254740992.0)
+    {
+        char digits[20];
+        size_t count = 0;
+        uint64_t n = (uint64_t)fabs(value);
+        do
+        {
+            digits[count++] = (char)('0' + n % 10);
+            n /= 10;
+        } while (n);
+        size_t length = 0;
+        if (signbit(value))
+            buff[length++] = '-';
+        while (count)
+            buff[length++] = digits[--count];
+        return length;
+    }
+    int length = 0;
+    for (int precision = fabs(value) < DBL_MIN ? 1 : 15; precision <= 17; precision++)
+    {
+        length = snprintf(buff, max_number_length, "%.*g", precision, value);
+        if (strtod(buff, NULL) == value)
+            break;
+    }
+    return (size_t)length;
+}
+
+static void put_real(writer_t *writer, double value)
+{
+    if (is_measuring(writer))
+        writer->length += max_number_length;
+    else
+    {
+        char buff[max_number_length];
+        put_ascii(writer, buff, format_real(buff, value));
+    }
+}
+
+static void put_number(writer_t *writer, element_t *elem)
+{
+    private_number_data_t *num = (private_number_data_t*)elem->data.num_value;
+    if (num->literal)
+        put_ascii(writer, num->literal, num->length);
+    else
+        put_real(writer, (double)*(const real_t*)&num->value);
+}
+
+// --- elements ---------------------------------------------------------------
+
+static void put_element(writer_t *writer, element_t *elem);
+
+static void put_object(writer_t *writer, element_t *elem)
+{
+    expand_element(elem);
+    private_object_data_t *object = elem->data.object;
+    put_char(writer, L'{');
+    if (object->count)
+    {
+        writer->depth++;
+        for (size_t i = 0; i < object->count; i++)
+        {
+            if (i)
+                put_separator(writer);
+            put_new_line(writer);
+            put_string(writer, object->pairs[i].key);
+            put_colon(writer);
+            put_element(writer, object->pairs[i].value);
+        }
+        writer->depth--;
+        put_new_line(writer);
+    }
+    put_char(writer, L'}');
+}
+
+static void put_array(writer_t *writer, element_t *elem)
+{
+    expand_element(elem);
+    private_array_data_t *array = elem->data.array;
+    put_char(writer, L'[');
+    if (array->count)
+    {
+        writer->depth++;
+        for (size_t i = 0; i < array->count; i++)
+        {
+            if (i)
+                put_separator(writer);
+            put_new_line(writer);
+            put_element(writer, array->items[i]);
+        }
+        writer->depth--;
+        put_new_line(writer);
+    }
+    put_char(writer, L']');
+}
+
+static void put_element(writer_t *writer, element_t *elem)
+{
+    if (writer->failed)
+        return;
+    switch (elem->type)
+    {
+        case json_null:
+            put_ascii(writer, "null", 4);
+            break;
+        case json_object:
+            put_object(writer, elem);
+            break;
+        case json_array:
+            put_array(writer, elem);
+            break;
+        case json_string:
+            put_string(writer, elem->data.string_value);
+            break;
+        case json_number:
+            put_number(writer, elem);
+            break;
+        case json_boolean:
+            if (elem->data.bool_value)
+                put_ascii(writer, "true", 4);
+            else
+                put_ascii(writer, "false", 5);
+            break;
+    }
+}
+
+// --- structs ----------------------------------------------------------------
+
+static void put_struct(writer_t *writer, const json_binding_t *binding, const uint8_t *base);
+
+static void put_bound_value(writer_t *writer, json_element_type_t type, const json_binding_t *binding,
+    const uint8_t *value)
+{
+    switch (type)
+    {
+        case json_boolean:
+            if (*(const bool*)value)
+                put_ascii(writer, "true", 4);
+            else
+                put_ascii(writer, "false", 5);
+            break;
+        case json_number:
+            put_real(writer, (double)*(const real_t*)value);
+            break;
+        case json_string:
+            if (*(wide_string_t* const*)value)
+                put_string(writer, *(wide_string_t* const*)value);
+            else
+                put_ascii(writer, "null", 4);
+            break;
+        case json_object:
+            put_struct(writer, binding, value);
+            break;
+        default:
+            put_ascii(writer, "null", 4);
+            break;
+    }
+}
+
+static void put_bound_array(writer_t *writer, const json_field_t *field, const json_bound_array_t *array)
+{
+    size_t size = get_bound_value_size(field->item_type, field->binding);
+    put_char(writer, L'[');
+    if (array->count)
+    {
+        writer->depth++;
+        for (size_t i = 0; i < array->count; i++)
+        {
+            if (i)
+                put_separator(writer);
+            put_new_line(writer);
+            put_bound_value(writer, field->item_type, field->binding, (const uint8_t*)array->items + i * size);
+        }
+        writer->depth--;
+        put_new_line(writer);
+    }
+    put_char(writer, L']');
+}
+
+static void put_struct(writer_t *writer, const json_binding_t *binding, const uint8_t *base)
+{
+    put_char(writer, L'{');
+    if (binding->count)
+    {
+        writer->depth++;
+        for (size_t i = 0; i < binding->count; i++)
+        {
+            const bound_field_t *bound = &binding->fields[i];
+            const wide_string_t name = { (wchar_t*)bound->field.name, bound->name_length };
+            if (i)
+                put_separator(writer);
+            put_new_line(writer);
+            put_string(writer, &name);
+            put_colon(writer);
+            if (bound->field.type == json_array)
+                put_bound_array(writer, &bound->field, (const json_bound_array_t*)(base + bound->field.offset));
+            else
+                put_bound_value(writer, bound->field.type, bound->field.binding, base + bound->field.offset);
+        }
+        writer->depth--;
+        put_new_line(writer);
+    }
+    put_char(writer, L'}');
+}
+
+// --- public API -------------------------------------------------------------
+
+static void init_writer(writer_t *writer, json_format_t format)
+{
+    writer->data = NULL;
+    writer->bytes = NULL;
+    writer->length = 0;
+    writer->callback = NULL;
+    writer->context = NULL;
+    writer->surrogate = 0;
+    writer->failed = false;
+    writer->format = format;
+    writer->depth = 0;
+    writer->kernels = get_scan_kernels();
+}
+
+wide_string_t * json_element_to_string(const json_element_base_t *iface, json_format_t format)
+{
+    element_t *elem = (element_t*)iface;
+    writer_t writer;
+    init_writer(&writer, format);
+
+    // the first pass only measures the output, so the buffer is allocated once
+    put_element(&writer, elem);
+    wide_string_t *result = nnalloc(sizeof(wide_string_t) + (writer.length + 1) * sizeof(wchar_t));
+    writer.data = (wchar_t*)(result + 1);
+    writer.length = 0;
+    put_element(&writer, elem);
+    writer.data[writer.length] = L'\0';
+    result->data = writer.data;
+    result->length = writer.length;
+    return result;
+}
+
+wide_string_t * json_element_to_simple_string(const json_element_base_t *iface)
+{
+    return json_element_to_string(iface, json_format_simple);
+}
+
+bool write_json_element(const json_element_base_t *iface, json_format_t format,
+    json_write_callback_t callback, void *context)
+{
+    uint8_t buff[write_buffer_size];
+    writer_t writer;
+    init_writer(&writer, format);
+    writer.bytes = buff;
+    writer.callback = callback;
+    writer.context = context;
+    put_element(&writer, (element_t*)iface);
+    flush_writer(&writer);
+    return !writer.failed;
+}
+
+static bool write_to_file(void *context, const char *data, size_t size)
+{
+    return fwrite(data, 1, size, (FILE*)context) == size;
+}
+
+bool write_json_element_to_file(const json_element_base_t *iface, json_format_t format, FILE *file)
+{
+    return write_json_element(iface, format, write_to_file, file);
+}
+
+static bool write_to_descriptor(void *context, const char *data, size_t size)
+{
+    int fd = *(int*)context;
+    while (size)
+    {
+#ifdef _WIN32
+        int written = _write(fd, data, (unsigned int)size);
+#else
+        ssize_t written = write(fd, data, size);
+#endif
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+bool write_json_element_to_descriptor(const json_element_base_t *iface, json_format_t format, int fd)
+{
+    return write_json_element(iface, format, write_to_descriptor, &fd);
+}
+
+wide_string_t * json_struct_to_string(const json_binding_t *binding, const void *value, json_format_t format)
+{
+    writer_t writer;
+    init_writer(&writer, format);
+    put_struct(&writer, binding, value);
+    wide_string_t *result = nnalloc(sizeof(wide_string_t) + (writer.length + 1) * sizeof(wchar_t));
+    writer.data = (wchar_t*)(result + 1);
+    writer.length = 0;
+    put_struct(&writer, binding, value);
+    writer.data[writer.length] = L'\0';
+    result->data = writer.data;
+    result->length = writer.length;
+    return result;
+}
+
+bool write_json_struct(const json_binding_t *binding, const void *value, json_format_t format,
+    json_write_callback_t callback, void *context)
+{
+    uint8_t buff[write_buffer_size];
+    writer_t writer;
+    init_writer(&writer, format);
+    writer.bytes = buff;
+    writer.callback = callback;
+    writer.context = context;
+    put_struct(&writer, binding, value);
+    flush_writer(&writer);
+    return !writer.failed;
+}
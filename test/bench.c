@@ -0,0 +1,437 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    The benchmark of the parser, the serializer, the lookups and the destructor.
+    The standard corpus is generated, files given in the command line are added to it.
+    Each result is printed as one JSON object per line:
+    { "corpus", "operation", "bytes", "elements", "iterations", "seconds",
+      "mb_per_s", "ns_per_element", "allocations", "allocated_bytes", "peak_rss_kb" }
+*/
+
+#include "json.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <time.h>
+#include <sys/resource.h>
+#endif
+
+#define min_measured_seconds 0.5
+#define max_iterations 1000000
+
+// --- platform ---------------------------------------------------------------
+
+static double get_seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+#endif
+}
+
+static long get_peak_rss_kb(void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return (long)(counters.PeakWorkingSetSize / 1024);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+// --- corpus -----------------------------------------------------------------
+
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+} text_t;
+
+static void append_text(text_t *text, const char *format, ...)
+{
+    while (true)
+    {
+        va_list args;
+        va_start(args, format);
+        size_t free_space = text->capacity - text->length;
+        int written = vsnprintf(text->data + text->length, free_space, format, args);
+        va_end(args);
+        if (written >= 0 && (size_t)written < free_space)
+        {
+            text->length += (size_t)written;
+            return;
+        }
+        text->capacity = text->capacity * 2 + (written > 0 ? (size_t)written : 0);
+        text->data = realloc(text->data, text->capacity);
+        if (!text->data)
+            exit(EXIT_FAILURE);
+    }
+}
+
+static void init_text(text_t *text)
+{
+    text->capacity = 1 << 20;
+    text->data = malloc(text->capacity);
+    text->length = 0;
+    if (!text->data)
+        exit(EXIT_FAILURE);
+    text->data[0] = '\0';
+}
+
+/*
+    Statuses of a social network: many string fields with escapes and non-ASCII text,
+    nested user objects and short arrays
+*/
+static void make_statuses(text_t *text, int count)
+{
+    append_text(text, "{\"statuses\":[");
+    for (int i = 0; i < count; i++)
+    {
+        append_text(text, "%s{\"created_at\":\"Sun Aug 31 00:29:%02d +0000 2014\",\"id\":%d%06d,"
+            "\"text\":\"@user%d \\u3053\\u3093\\u306b\\u3061\\u306f \\\"quoted\\\" #tag%d http:\\/\\/t.co\\/%x\","
+            "\"source\":\"<a href=\\\"http://twitter.com\\\" rel=\\\"nofollow\\\">Web Client</a>\","
+            "\"truncated\":false,\"in_reply_to_status_id\":null,"
+            "\"user\":{\"id\":%d,\"name\":\"User %d\",\"screen_name\":\"user_%d\",\"location\":\"Tokyo\","
+            "\"followers_count\":%d,\"friends_count\":%d,\"verified\":%s,\"lang\":\"ja\"},"
+            "\"entities\":{\"hashtags\":[{\"text\":\"tag%d\",\"indices\":[%d,%d]}],\"urls\":[],"
+            "\"user_mentions\":[]},\"retweet_count\":%d,\"favorited\":false,\"lang\":\"ja\"}",
+            i ? "," : "", i % 60, 500000 + i, i, i, i % 97, i * 7919 % 100000, i, i, i,
+            i * 31 % 100000, i * 13 % 700, i % 3 ? "false" : "true", i % 50, i % 40, i % 40 + 6, i % 25);
+    }
+    append_text(text, "],\"search_metadata\":{\"completed_in\":0.087,\"max_id\":505874924095815681,"
+        "\"count\":%d}}", count);
+}
+
+/*
+    A catalog of events: wide objects with numeric keys, repeated structure
+    and arrays of integers
+*/
+static void make_catalog(text_t *text, int count)
+{
+    append_text(text, "{\"areaNames\":{");
+    for (int i = 0; i < 64; i++)
+        append_text(text, "%s\"%d\":\"Area %d\"", i ? "," : "", 205705993 + i, i);
+    append_text(text, "},\"events\":{");
+    for (int i = 0; i < count; i++)
+    {
+        append_text(text, "%s\"%d\":{\"description\":null,\"id\":%d,\"logo\":\"/images/UE0AAAAACEKo%dQAAAAVDSVRN\","
+            "\"name\":\"Concert %d\",\"subTopicIds\":[337184%d,337184283,339420802],"
+            "\"subjectCode\":null,\"subtitle\":null,\"topicIds\":[324846099,107888604,%d]}",
+            i ? "," : "", 138586341 + i, 138586341 + i, i, i, i % 10, 324846100 + i % 17);
+    }
+    append_text(text, "},\"performances\":[");
+    for (int i = 0; i < count; i++)
+    {
+        append_text(text, "%s{\"eventId\":%d,\"id\":%d,\"prices\":[{\"amount\":%d,\"audienceSubCategoryId\":337100890,"
+            "\"seatCategoryId\":338937295},{\"amount\":%d,\"audienceSubCategoryId\":337100890,"
+            "\"seatCategoryId\":338937296}],\"start\":%d000,\"venueCode\":\"PLEYEL_PLEYEL\"}",
+            i ? "," : "", 138586341 + i, 339887544 + i, 90250 + i % 40 * 1000, 66500 + i % 30 * 1000,
+            1372953600 + i * 3600);
+    }
+    append_text(text, "]}");
+}
+
+/*
+    Geometry: long arrays of coordinate pairs with many fraction digits
+*/
+static void make_coordinates(text_t *text, int count)
+{
+    append_text(text, "{\"type\":\"FeatureCollection\",\"features\":[{\"type\":\"Feature\","
+        "\"properties\":{\"name\":\"Canada\"},\"geometry\":{\"type\":\"Polygon\",\"coordinates\":[[");
+    unsigned int seed = 12345;
+    for (int i = 0; i < count; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        double lon = -141.0 + (double)(seed % 8400000) / 100000.0;
+        seed = seed * 1103515245 + 12345;
+        double lat = 41.6 + (double)(seed % 4200000) / 100000.0;
+        append_text(text, "%s[%.15g,%.15g]", i ? "," : "", lon, lat);
+    }
+    append_text(text, "]]}}]}");
+}
+
+/*
+    Containers nested to the given depth, alternating objects and arrays
+*/
+static void make_nested(text_t *text, int depth, int repeat)
+{
+    append_text(text, "[");
+    for (int k = 0; k < repeat; k++)
+    {
+        append_text(text, k ? "," : "");
+        for (int i = 0; i < depth; i++)
+            append_text(text, i % 2 ? "[" : "{\"level%d\":", i);
+        append_text(text, "%d", k);
+        for (int i = depth - 1; i >= 0; i--)
+            append_text(text, i % 2 ? "]" : "}");
+    }
+    append_text(text, "]");
+}
+
+/*
+    Newline-delimited log records
+*/
+static void make_log_lines(text_t *text, int count)
+{
+    static const char *levels[] = { "debug", "info", "warning", "error" };
+    for (int i = 0; i < count; i++)
+    {
+        append_text(text, "{\"ts\":\"2020-11-13T12:%02d:%02d.%03dZ\",\"level\":\"%s\",\"service\":\"api-%d\","
+            "\"msg\":\"request handled\",\"status\":%d,\"latency_ms\":%d.%d,\"path\":\"/v1/items/%d\","
+            "\"tags\":[\"edge\",\"%s\"]}\n",
+            i / 60 % 60, i % 60, i % 1000, levels[i % 4], i % 8, i % 7 ? 200 : 500, i % 250, i % 10,
+            i, i % 2 ? "cache-hit" : "cache-miss");
+    }
+}
+
+static bool read_file(const char *path, text_t *text)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return false;
+    init_text(text);
+    size_t read;
+    while ((read = fread(text->data + text->length, 1, text->capacity - text->length, file)) > 0)
+    {
+        text->length += read;
+        if (text->length == text->capacity)
+        {
+            text->capacity *= 2;
+            text->data = realloc(text->data, text->capacity);
+            if (!text->data)
+                exit(EXIT_FAILURE);
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+// --- measurements -----------------------------------------------------------
+
+typedef struct
+{
+    const char *corpus;
+    size_t bytes;
+    size_t elements;
+    size_t allocations;
+    size_t allocated_bytes;
+} corpus_info_t;
+
+static void report(const corpus_info_t *info, const char *operation, size_t iterations, double seconds,
+    bool with_allocations)
+{
+    double per_iteration = seconds / (double)iterations;
+    printf("{ \"corpus\": \"%s\", \"operation\": \"%s\", \"bytes\": %zu, \"elements\": %zu, "
+        "\"iterations\": %zu, \"seconds\": %.6f, \"mb_per_s\": %.2f, \"ns_per_element\": %.2f, "
+        "\"allocations\": %zu, \"allocated_bytes\": %zu, \"peak_rss_kb\": %ld }\n",
+        info->corpus, operation, info->bytes, info->elements, iterations, seconds,
+        (double)info->bytes / per_iteration / 1e6,
+        info->elements ? per_iteration * 1e9 / (double)info->elements : 0,
+        with_allocations ? info->allocations : 0, with_allocations ? info->allocated_bytes : 0,
+        get_peak_rss_kb());
+    fflush(stdout);
+}
+
+static bool count_output(void *context, const char *data, size_t size)
+{
+    (void)data;
+    *(size_t*)context += size;
+    return true;
+}
+
+/*
+    Looks every key of every object up by its name and every item of every array
+    up by its index, returns the number of lookups
+*/
+static size_t look_up_all(const json_element_t *elem)
+{
+    size_t count = 0;
+    if (elem->base.type == json_object)
+    {
+        for (size_t i = 0; i < elem->data.object->count; i++)
+        {
+            const json_pair_t *pair = get_pair_by_index_from_json_object(elem->data.object, i);
+            const json_pair_t *found = get_pair_from_json_object(elem->data.object, pair->key->data);
+            count += 1 + look_up_all(found->value);
+        }
+    }
+    else if (elem->base.type == json_array)
+    {
+        for (size_t i = 0; i < elem->data.array->count; i++)
+            count += 1 + look_up_all(get_element_from_json_array(elem->data.array, i));
+    }
+    return count;
+}
+
+static json_element_t * parse_corpus(const text_t *text, json_options_t *options)
+{
+    json_error_t err;
+    json_element_t *root = parse_json_utf8_with_options(text->data, text->length, &err, options);
+    if (!root)
+    {
+        wide_string_t *message = json_error_to_string(&err);
+        fprintf(stderr, "%ls\n", message->data);
+        free(message);
+    }
+    return root;
+}
+
+static void run_document_benchmarks(const char *name, const text_t *text)
+{
+    corpus_info_t info = { name, text->length, 0, 0, 0 };
+    json_parse_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    json_options_t options = { NULL, NULL, false, false, 0, &stats };
+    json_element_t *root = parse_corpus(text, &options);
+    if (!root)
+        return;
+    destroy_json_element(&root->base);
+    for (int type = json_null; type <= json_boolean; type++)
+        info.elements += stats.elements[type];
+    info.allocations = stats.allocations;
+    info.allocated_bytes = stats.allocated_bytes;
+
+    size_t iterations = 0;
+    double parsing = 0, destroying = 0;
+    while (parsing < min_measured_seconds && iterations < max_iterations)
+    {
+        double begin = get_seconds();
+        root = parse_corpus(text, NULL);
+        double middle = get_seconds();
+        destroy_json_element(&root->base);
+        double end = get_seconds();
+        parsing += middle - begin;
+        destroying += end - middle;
+        iterations++;
+    }
+    report(&info, "parse", iterations, parsing, true);
+    report(&info, "destroy", iterations, destroying, false);
+
+    json_arena_t *arena = create_json_arena(0);
+    json_options_t arena_options = { arena, NULL, false, false, 0, NULL };
+    double arena_parsing = 0;
+    for (size_t k = 0; k < iterations; k++)
+    {
+        double begin = get_seconds();
+        root = parse_corpus(text, &arena_options);
+        arena_parsing += get_seconds() - begin;
+        destroy_json_arena(arena);
+        arena = create_json_arena(0);
+        arena_options.arena = arena;
+    }
+    destroy_json_arena(arena);
+    report(&info, "parse_arena", iterations, arena_parsing, false);
+
+    root = parse_corpus(text, NULL);
+    double serializing = 0;
+    iterations = 0;
+    while (serializing < min_measured_seconds && iterations < max_iterations)
+    {
+        size_t size = 0;
+        double begin = get_seconds();
+        write_json_element(&root->base, json_format_compact, count_output, &size);
+        serializing += get_seconds() - begin;
+        iterations++;
+    }
+    report(&info, "serialize", iterations, serializing, false);
+
+    double looking_up = 0;
+    iterations = 0;
+    while (looking_up < min_measured_seconds && iterations < max_iterations)
+    {
+        double begin = get_seconds();
+        look_up_all(root);
+        looking_up += get_seconds() - begin;
+        iterations++;
+    }
+    report(&info, "lookup", iterations, looking_up, false);
+    destroy_json_element(&root->base);
+}
+
+static void run_lines_benchmark(const char *name, const text_t *text)
+{
+    corpus_info_t info = { name, text->length, 0, 0, 0 };
+    json_batch_t *batch = parse_json_lines(text->data, text->length, NULL, 1);
+    info.elements = get_json_batch_size(batch);
+    destroy_json_batch(batch);
+    size_t iterations = 0;
+    double sequential = 0, parallel = 0;
+    while (sequential + parallel < min_measured_seconds && iterations < max_iterations)
+    {
+        double begin = get_seconds();
+        destroy_json_batch(parse_json_lines(text->data, text->length, NULL, 1));
+        double middle = get_seconds();
+        destroy_json_batch(parse_json_lines(text->data, text->length, NULL, 0));
+        double end = get_seconds();
+        sequential += middle - begin;
+        parallel += end - middle;
+        iterations++;
+    }
+    // the elements of this corpus are the records
+    report(&info, "parse_lines", iterations, sequential, false);
+    report(&info, "parse_lines_parallel", iterations, parallel, false);
+}
+
+int main(int argc, char **argv)
+{
+    text_t text;
+
+    init_text(&text);
+    make_statuses(&text, 2000);
+    run_document_benchmarks("statuses", &text);
+    free(text.data);
+
+    init_text(&text);
+    make_catalog(&text, 3000);
+    run_document_benchmarks("catalog", &text);
+    free(text.data);
+
+    init_text(&text);
+    make_coordinates(&text, 100000);
+    run_document_benchmarks("coordinates", &text);
+    free(text.data);
+
+    init_text(&text);
+    make_nested(&text, 200, 200);
+    run_document_benchmarks("nested", &text);
+    free(text.data);
+
+    init_text(&text);
+    make_log_lines(&text, 50000);
+    run_lines_benchmark("log_lines", &text);
+    free(text.data);
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!read_file(argv[i], &text))
+        {
+            fprintf(stderr, "cannot read '%s'\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        run_document_benchmarks(argv[i], &text);
+        free(text.data);
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,25 +1,1822 @@
+/*
+    Copyright (c) 2020 Ivan Kniazkov <ivan.kniazkov.com>
+
+    The checks of the library: each test runs the same input through the ways
+    of parsing, building and writing that must agree, failed checks are printed
+    and make the exit code non-zero
+*/
+
 #include "json.h"
 #include "strings/strings.h"
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <math.h>
 
-int main(void)
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+static int checks_count;
+static int failures_count;
+
+#define check(condition) check_condition((condition), #condition, __FILE__, __LINE__)
+
+static void check_condition(bool condition, const char *text, const char *file, int line)
+{
+    checks_count++;
+    if (!condition)
+    {
+        failures_count++;
+        printf("%s:%d: failed: %s\n", file, line, text);
+    }
+}
+
+// --- helpers ----------------------------------------------------------------
+
+static json_element_t * parse_text(const char *text)
 {
-    wide_string_t src = __W(L"{ a : 1, \"b\" : true, zzz : [\"hello\", null, {}, -10.24] }");
     json_error_t err;
-    json_element_t *root = parse_json_ext(&src, &err);
-    
-    wide_string_t *result;
-    if (root)
+    return parse_json_utf8(text, strlen(text), &err);
+}
+
+/*
+    The samples are ASCII, so they are widened byte by byte
+*/
+static wide_string_t widen_text(const char *text, wchar_t *buff)
+{
+    wide_string_t result = { buff, strlen(text) };
+    for (size_t i = 0; i < result.length; i++)
+        buff[i] = (wchar_t)(unsigned char)text[i];
+    buff[result.length] = L'\0';
+    return result;
+}
+
+/*
+    Records parser events and the outcome as text, so that two ways of parsing
+    are compared by one string comparison
+*/
+typedef struct
+{
+    wchar_t data[1024];
+    size_t length;
+} event_log_t;
+
+static void log_text(event_log_t *log, const wchar_t *text)
+{
+    while (*text && log->length + 1 < sizeof(log->data) / sizeof(wchar_t))
+        log->data[log->length++] = *text++;
+    log->data[log->length] = L'\0';
+}
+
+static void log_chars(event_log_t *log, const wchar_t *chars, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
     {
-        result = json_element_to_simple_string(&root->base);
+        wchar_t buff[16];
+        if (chars[i] >= 0x20 && chars[i] < 0x7F)
+            swprintf(buff, 16, L"%lc", (wint_t)chars[i]);
+        else
+            swprintf(buff, 16, L"<%x>", (unsigned int)chars[i]);
+        log_text(log, buff);
+    }
+}
+
+static bool log_object_begin(void *context) { log_text(context, L"{ "); return true; }
+static bool log_object_end(void *context) { log_text(context, L"} "); return true; }
+static bool log_array_begin(void *context) { log_text(context, L"[ "); return true; }
+static bool log_array_end(void *context) { log_text(context, L"] "); return true; }
+
+static bool log_key(void *context, const wide_string_t *key)
+{
+    log_text(context, L"key:");
+    log_chars(context, key->data, key->length);
+    log_text(context, L" ");
+    return true;
+}
+
+static bool log_string(void *context, const wide_string_t *value)
+{
+    log_text(context, L"string:");
+    log_chars(context, value->data, value->length);
+    log_text(context, L" ");
+    return true;
+}
+
+static bool log_number(void *context, const number_t *value)
+{
+    wchar_t buff[64];
+    swprintf(buff, 64, L"number:%.17g ", (double)*(const real_t*)value);
+    log_text(context, buff);
+    return true;
+}
+
+static bool log_boolean(void *context, bool value)
+{
+    log_text(context, value ? L"true " : L"false ");
+    return true;
+}
+
+static bool log_null(void *context)
+{
+    log_text(context, L"null ");
+    return true;
+}
+
+static const json_handler_t logging_handler =
+{
+    log_object_begin, log_object_end, log_array_begin, log_array_end, log_key,
+    log_string, log_number, log_boolean, log_null, NULL
+};
+
+static void log_outcome(event_log_t *log, bool success, const json_error_t *err)
+{
+    if (success)
+    {
+        log_text(log, L"ok");
+        return;
+    }
+    wchar_t buff[32];
+    swprintf(buff, 32, L"error %d:", (int)err->type);
+    log_text(log, buff);
+    log_chars(log, err->text.data, err->text.length);
+}
+
+static const char *samples[] =
+{
+    "{\"a\":1,\"b\":true,\"c\":[\"hello\",null,{},-10.24],\"d\":{\"e\":\"\\u00e9\\n\",\"f\":[]}}",
+    "[1,2.5,-3e10,\"x\",false,[[[]]],{\"k1\":1,\"k2\":2,\"k3\":3,\"k4\":4,\"k5\":5,\"k6\":6,\"k7\":7,\"k8\":8,\"k9\":9}]",
+    "\"just a string\"",
+    "42"
+};
+
+#define samples_count (sizeof(samples) / sizeof(samples[0]))
+
+// --- arena ------------------------------------------------------------------
+
+static void test_arena_parse(void)
+{
+    for (size_t i = 0; i < samples_count; i++)
+    {
+        json_element_t *heap_root = parse_text(samples[i]);
+        json_arena_t *arena = create_json_arena(0);
+        wchar_t buff[256];
+        wide_string_t text = widen_text(samples[i], buff);
+        json_error_t err;
+        json_element_t *arena_root = parse_json_arena(&text, &err, arena);
+        check(heap_root != NULL && arena_root != NULL);
+        check(are_json_elements_equal(heap_root, arena_root));
+        destroy_json_arena(arena);
+        destroy_json_element(&heap_root->base);
+    }
+}
+
+// --- UTF-8 parser -----------------------------------------------------------
+
+static const struct
+{
+    const char *utf8;
+    const wchar_t *wide;
+} utf8_samples[] =
+{
+    { "{\"\xC3\xA9t\xC3\xA9\":\"\xD0\xBF\xD1\x80\xD0\xB8\"}", L"{\"\u00e9t\u00e9\":\"\u043f\u0440\u0438\"}" },
+    { "[\"\xE2\x82\xAC\", \"\xF0\x9F\x98\x80\"]", L"[\"\u20ac\", \"\U0001F600\"]" },
+    { "\xEF\xBB\xBF[\"\\u00e9\"]", L"[\"\\u00e9\"]" }
+};
+
+static const char *broken_samples[] =
+{
+    "[1 2]", "{\"a\" 1}", "{\"a\":1 \"b\":2}", "{1:2}", "[1", "\"abc", "\"\\q\"", "[-x]", "-", "tru", "@"
+};
+
+static void test_utf8_parse(void)
+{
+    for (size_t i = 0; i < samples_count; i++)
+    {
+        json_element_t *utf8_root = parse_text(samples[i]);
+        wchar_t buff[256];
+        wide_string_t text = widen_text(samples[i], buff);
+        json_element_t *wide_root = parse_json(&text);
+        check(utf8_root != NULL && wide_root != NULL);
+        check(are_json_elements_equal(utf8_root, wide_root));
+        destroy_json_element(&utf8_root->base);
+        destroy_json_element(&wide_root->base);
+    }
+    for (size_t i = 0; i < sizeof(utf8_samples) / sizeof(utf8_samples[0]); i++)
+    {
+        json_element_t *utf8_root = parse_text(utf8_samples[i].utf8);
+        wide_string_t text = { (wchar_t*)utf8_samples[i].wide, wcslen(utf8_samples[i].wide) };
+        json_element_t *wide_root = parse_json(&text);
+        check(utf8_root != NULL && wide_root != NULL);
+        check(are_json_elements_equal(utf8_root, wide_root));
+        destroy_json_element(&utf8_root->base);
+        destroy_json_element(&wide_root->base);
+    }
+    for (size_t i = 0; i < sizeof(broken_samples) / sizeof(broken_samples[0]); i++)
+    {
+        json_error_t utf8_err, wide_err;
+        json_element_t *utf8_root = parse_json_utf8(broken_samples[i], strlen(broken_samples[i]), &utf8_err);
+        wchar_t buff[256];
+        wide_string_t text = widen_text(broken_samples[i], buff);
+        json_element_t *wide_root = parse_json_ext(&text, &wide_err);
+        check(utf8_root == NULL && wide_root == NULL);
+        check(utf8_err.type == wide_err.type);
+        check(utf8_err.type != json_ok);
+    }
+}
+
+// --- validation -------------------------------------------------------------
+
+static void test_validate(void)
+{
+    for (size_t i = 0; i < samples_count; i++)
+    {
+        json_error_t err;
+        wchar_t buff[256];
+        wide_string_t text = widen_text(samples[i], buff);
+        check(validate_json_utf8(samples[i], strlen(samples[i]), &err));
+        check(validate_json(&text, &err));
+    }
+    for (size_t i = 0; i < sizeof(broken_samples) / sizeof(broken_samples[0]); i++)
+    {
+        const char *sample = broken_samples[i];
+        json_error_t parse_err, utf8_err, wide_err;
+        json_element_t *root = parse_json_utf8(sample, strlen(sample), &parse_err);
+        wchar_t buff[256];
+        wide_string_t text = widen_text(sample, buff);
+        check(root == NULL);
+        check(!validate_json_utf8(sample, strlen(sample), &utf8_err));
+        check(!validate_json(&text, &wide_err));
+        check(utf8_err.type == parse_err.type && wide_err.type == parse_err.type);
+        check(utf8_err.where.row == parse_err.where.row && utf8_err.where.column == parse_err.where.column);
+    }
+}
+
+// --- writer -----------------------------------------------------------------
+
+typedef struct
+{
+    char data[256];
+    size_t length;
+} byte_sink_t;
+
+static bool write_to_sink(void *context, const char *data, size_t size)
+{
+    byte_sink_t *sink = context;
+    if (sink->length + size >= sizeof(sink->data))
+        return false;
+    memcpy(sink->data + sink->length, data, size);
+    sink->length += size;
+    sink->data[sink->length] = '\0';
+    return true;
+}
+
+static void check_written_text(const json_element_t *root, const wchar_t *expected, const char *expected_utf8)
+{
+    wide_string_t *text = json_element_to_string(&root->base, json_format_compact);
+    check(wcscmp(text->data, expected) == 0);
+    free(text);
+    byte_sink_t sink = { { 0 }, 0 };
+    check(write_json_element(&root->base, json_format_compact, write_to_sink, &sink));
+    check(strcmp(sink.data, expected_utf8) == 0);
+}
+
+static void test_writer(void)
+{
+    static const real_t values[] = { 0.1, 5e-324, 1e+20, -2.5, 1.0 / 3, 123456789, 1.7976931348623157e308 };
+    json_array_t *numbers = create_json_array();
+    append_json_numbers_to_array(numbers, values, sizeof(values) / sizeof(values[0]));
+    check_written_text((json_element_t*)numbers, L"[0.1,5e-324,1e+20,-2.5,0.3333333333333333,123456789,1.7976931348623157e+308]",
+        "[0.1,5e-324,1e+20,-2.5,0.3333333333333333,123456789,1.7976931348623157e+308]");
+    wide_string_t *text = json_element_to_string(&numbers->base, json_format_compact);
+    json_element_t *reparsed = parse_json(text);
+    check(reparsed != NULL && are_json_elements_equal((json_element_t*)numbers, reparsed));
+    destroy_json_element(&reparsed->base);
+    free(text);
+    destroy_json_element(&numbers->base);
+
+    json_array_t *strings = create_json_array();
+    create_json_string_at_end_of_array(strings, L"q\"b\\n\nt\tc\x01/\u00e9\u20ac");
+    check_written_text((json_element_t*)strings, L"[\"q\\\"b\\\\n\\nt\\tc\\u0001/\u00e9\u20ac\"]",
+        "[\"q\\\"b\\\\n\\nt\\tc\\u0001/\xC3\xA9\xE2\x82\xAC\"]");
+    destroy_json_element(&strings->base);
+
+    json_element_t *root = parse_text("{\"a\":[1,true,null],\"b\":{}}");
+    wide_string_t *simple = json_element_to_simple_string(&root->base);
+    check(wcscmp(simple->data, L"{\"a\": [1, true, null], \"b\": {}}") == 0);
+    free(simple);
+    destroy_json_element(&root->base);
+}
+
+// --- binary form ------------------------------------------------------------
+
+static void check_binary_round_trip(const json_element_t *root)
+{
+    size_t size;
+    void *data = encode_json_element(&root->base, &size);
+    json_error_t err;
+    json_element_t *decoded = decode_json_element(data, size, NULL, &err);
+    check(decoded != NULL && are_json_elements_equal(root, decoded));
+    if (decoded)
+        destroy_json_element(&decoded->base);
+    // a cut encoding is reported, never read past its end
+    decoded = decode_json_element(data, size - 1, NULL, &err);
+    check(decoded == NULL && err.type == json_incorrect_binary_format);
+    free(data);
+}
+
+static void test_binary(void)
+{
+    for (size_t i = 0; i < samples_count; i++)
+    {
+        json_element_t *root = parse_text(samples[i]);
+        check_binary_round_trip(root);
+        destroy_json_element(&root->base);
+    }
+    // lone and reversed surrogates are kept as they are
+    json_element_t *root = parse_text("[\"\\ud83d\\ude00\", \"\\ud800\", \"x\\udc00y\", \"\\ude00\\ud83d\", \"\\u0000\"]");
+    check_binary_round_trip(root);
+    destroy_json_element(&root->base);
+}
+
+// --- paths ------------------------------------------------------------------
+
+static const char *pointer_document =
+    "{\"foo\":[\"bar\",\"baz\"],\"\":0,\"a/b\":1,\"c%d\":2,\"e^f\":3,\"g|h\":4,\"i\\\\j\":5,"
+    "\"k\\\"l\":6,\" \":7,\"m~n\":8,\"deep\":{\"list\":[{\"x\":[10,20,30]}]}}";
+
+static const struct
+{
+    const wchar_t *pointer;
+    const char *expected;
+} pointer_samples[] =
+{
+    { L"", NULL }, { L"/foo", "[\"bar\",\"baz\"]" }, { L"/foo/0", "\"bar\"" }, { L"/", "0" }, { L"/a~1b", "1" },
+    { L"/c%d", "2" }, { L"/e^f", "3" }, { L"/g|h", "4" }, { L"/i\\j", "5" }, { L"/k\"l", "6" }, { L"/ ", "7" },
+    { L"/m~0n", "8" }, { L"/deep/list/0/x/2", "30" }
+};
+
+static const wchar_t *missing_pointers[] = { L"/foo/2", L"/foo/-", L"/a/b", L"/deep/list/x", L"/foo/0/bar" };
+
+static const wchar_t *malformed_pointers[] = { L"foo", L"/~2", L"/a~" };
+
+static void check_pointers(const json_element_t *root, json_key_table_t *keys)
+{
+    for (size_t i = 0; i < sizeof(pointer_samples) / sizeof(pointer_samples[0]); i++)
+    {
+        json_path_t *path = compile_json_path(pointer_samples[i].pointer, keys);
+        check(path != NULL);
+        const json_element_t *found = find_json_element_by_path(root, path);
+        if (pointer_samples[i].expected)
+        {
+            json_element_t *expected = parse_text(pointer_samples[i].expected);
+            check(found != NULL && are_json_elements_equal(found, expected));
+            destroy_json_element(&expected->base);
+        }
+        else
+            check(found == root);
+        destroy_json_path(path);
+    }
+    for (size_t i = 0; i < sizeof(missing_pointers) / sizeof(missing_pointers[0]); i++)
+    {
+        json_path_t *path = compile_json_path(missing_pointers[i], keys);
+        check(path != NULL && find_json_element_by_path(root, path) == NULL);
+        destroy_json_path(path);
+    }
+    for (size_t i = 0; i < sizeof(malformed_pointers) / sizeof(malformed_pointers[0]); i++)
+        check(compile_json_path(malformed_pointers[i], keys) == NULL);
+}
+
+static void test_paths(void)
+{
+    json_element_t *root = parse_text(pointer_document);
+    check(root != NULL);
+    check_pointers(root, NULL);
+
+    json_key_table_t *keys = create_json_key_table();
+    json_options_t options = { NULL, keys, false, false, 0, NULL };
+    json_error_t err;
+    json_element_t *interned = parse_json_utf8_with_options(pointer_document, strlen(pointer_document), &err, &options);
+    check(interned != NULL);
+    check_pointers(interned, keys);
+
+    const wchar_t *pointers[] = { L"/deep/list/0/x/0", L"/deep/list/0/x/1", L"/foo/1", L"/nothing" };
+    json_path_set_t *set = compile_json_path_set(pointers, 4, keys);
+    check(get_json_path_set_size(set) == 4);
+    const json_element_t *results[4];
+    find_json_elements_by_path_set(interned, set, results);
+    check(results[0] != NULL && *results[0]->data.num_value == 10);
+    check(results[1] != NULL && *results[1]->data.num_value == 20);
+    check(results[2] != NULL && wcscmp(results[2]->data.string_value->data, L"baz") == 0);
+    check(results[3] == NULL);
+    destroy_json_path_set(set);
+
+    destroy_json_element(&interned->base);
+    destroy_json_key_table(keys);
+    destroy_json_element(&root->base);
+}
+
+// --- patches ----------------------------------------------------------------
+
+static const struct
+{
+    const char *before;
+    const char *after;
+} diff_samples[] =
+{
+    { "{\"a\":1,\"b\":[1,2,3],\"c\":{\"d\":true}}", "{\"a\":2,\"b\":[1,3],\"c\":{\"d\":true,\"e\":null},\"f\":\"x\"}" },
+    { "[1,2]", "[1,2,{\"k\":[]},4]" },
+    { "{\"k1\":1,\"k2\":2,\"k3\":3,\"k4\":4,\"k5\":5,\"k6\":6,\"k7\":7,\"k8\":8,\"k9\":9,\"k10\":10}",
+      "{\"k2\":2,\"k4\":4,\"k6\":6,\"k8\":8,\"k10\":10,\"k11\":11}" },
+    { "{\"a/b\":1,\"m~n\":2}", "{\"a/b\":3}" },
+    { "{\"a\":1}", "[\"a\",1]" }
+};
+
+static const struct
+{
+    const char *document;
+    const char *patch;
+    const char *expected;
+} patch_samples[] =
+{
+    { "{\"foo\":\"bar\"}", "[{\"op\":\"add\",\"path\":\"/baz\",\"value\":\"qux\"}]", "{\"foo\":\"bar\",\"baz\":\"qux\"}" },
+    { "{\"foo\":[\"bar\",\"baz\"]}", "[{\"op\":\"add\",\"path\":\"/foo/1\",\"value\":\"qux\"}]",
+      "{\"foo\":[\"bar\",\"qux\",\"baz\"]}" },
+    { "{\"foo\":[1]}", "[{\"op\":\"add\",\"path\":\"/foo/-\",\"value\":2}]", "{\"foo\":[1,2]}" },
+    { "{\"baz\":\"qux\",\"foo\":\"bar\"}", "[{\"op\":\"remove\",\"path\":\"/baz\"}]", "{\"foo\":\"bar\"}" },
+    { "{\"foo\":[\"bar\",\"qux\",\"baz\"]}", "[{\"op\":\"remove\",\"path\":\"/foo/1\"}]", "{\"foo\":[\"bar\",\"baz\"]}" },
+    { "{\"baz\":\"qux\",\"foo\":\"bar\"}", "[{\"op\":\"replace\",\"path\":\"/baz\",\"value\":\"boo\"}]",
+      "{\"baz\":\"boo\",\"foo\":\"bar\"}" },
+    { "{\"foo\":{\"bar\":\"baz\",\"waldo\":\"fred\"},\"qux\":{\"corge\":\"grault\"}}",
+      "[{\"op\":\"move\",\"from\":\"/foo/waldo\",\"path\":\"/qux/thud\"}]",
+      "{\"foo\":{\"bar\":\"baz\"},\"qux\":{\"corge\":\"grault\",\"thud\":\"fred\"}}" },
+    { "{\"foo\":[\"all\",\"grass\",\"cows\",\"eat\"]}", "[{\"op\":\"move\",\"from\":\"/foo/1\",\"path\":\"/foo/3\"}]",
+      "{\"foo\":[\"all\",\"cows\",\"eat\",\"grass\"]}" },
+    { "{\"a\":[\"x\",\"y\",\"z\"]}", "[{\"op\":\"move\",\"from\":\"/a/0\",\"path\":\"/a/2\"}]",
+      "{\"a\":[\"y\",\"z\",\"x\"]}" },
+    { "{\"a\":[1,{\"k\":0},{\"m\":0}]}", "[{\"op\":\"move\",\"from\":\"/a/0\",\"path\":\"/a/1/z\"}]",
+      "{\"a\":[{\"k\":0},{\"m\":0,\"z\":1}]}" },
+    { "{\"a\":{\"b\":[1]}}", "[{\"op\":\"copy\",\"from\":\"/a\",\"path\":\"/c\"},{\"op\":\"add\",\"path\":\"/c/b/-\",\"value\":2}]",
+      "{\"a\":{\"b\":[1]},\"c\":{\"b\":[1,2]}}" },
+    { "{\"baz\":\"qux\",\"foo\":[\"a\",2,\"c\"]}",
+      "[{\"op\":\"test\",\"path\":\"/baz\",\"value\":\"qux\"},{\"op\":\"test\",\"path\":\"/foo/1\",\"value\":2}]",
+      "{\"baz\":\"qux\",\"foo\":[\"a\",2,\"c\"]}" },
+    { "{\"foo\":\"bar\"}", "[{\"op\":\"replace\",\"path\":\"\",\"value\":[1]}]", "[1]" },
+    { "{\"a\\u0000b\":1,\"a\":2}", "[{\"op\":\"remove\",\"path\":\"/a\\u0000b\"}]", "{\"a\":2}" },
+    { "{\"a\":1}", "[{\"op\":\"add\",\"path\":\"/b\\u0000c\",\"value\":2},{\"op\":\"test\",\"path\":\"/b\\u0000c\",\"value\":2}]",
+      "{\"a\":1,\"b\\u0000c\":2}" },
+    { "{\"baz\":\"qux\"}", "[{\"op\":\"test\",\"path\":\"/baz\",\"value\":\"bar\"}]", NULL },
+    { "{\"foo\":\"bar\"}", "[{\"op\":\"add\",\"path\":\"/baz/bat\",\"value\":\"qux\"}]", NULL },
+    { "{\"foo\":[1]}", "[{\"op\":\"add\",\"path\":\"/foo/2\",\"value\":2}]", NULL },
+    { "{\"foo\":1}", "[{\"op\":\"remove\",\"path\":\"/bar\"}]", NULL },
+    { "{\"a\":{\"b\":1}}", "[{\"op\":\"move\",\"from\":\"/a\",\"path\":\"/a/b/c\"}]", NULL },
+    { "{\"a\":[{\"x\":1},{\"y\":2}]}", "[{\"op\":\"move\",\"from\":\"/a/0\",\"path\":\"/a/1/z\"}]", NULL },
+    { "{\"a\":[1,2,3]}", "[{\"op\":\"move\",\"from\":\"/a/0\",\"path\":\"/a/3\"}]", NULL },
+    { "{\"a\":{\"b\":1},\"c\":2}", "[{\"op\":\"move\",\"from\":\"/a/b\",\"path\":\"/c/d\"}]", NULL },
+    { "{\"foo\":1}", "[{\"op\":\"jump\",\"path\":\"/foo\"}]", NULL },
+    { "{\"foo\":1}", "[{\"path\":\"/foo\",\"value\":3}]", NULL }
+};
+
+static void test_patches(void)
+{
+    for (size_t i = 0; i < sizeof(diff_samples) / sizeof(diff_samples[0]); i++)
+    {
+        json_element_t *root = parse_text(diff_samples[i].before);
+        json_element_t *after = parse_text(diff_samples[i].after);
+        json_array_t *patch = diff_json_elements(root, after);
+        check(!are_json_elements_equal(root, after));
+        check(apply_json_patch(&root, (json_element_t*)patch));
+        check(are_json_elements_equal(root, after));
+        json_array_t *empty = diff_json_elements(root, after);
+        check(empty->array->count == 0);
+        destroy_json_element(&empty->base);
+        destroy_json_element(&patch->base);
+        destroy_json_element(&after->base);
+        destroy_json_element(&root->base);
+    }
+    for (size_t i = 0; i < sizeof(patch_samples) / sizeof(patch_samples[0]); i++)
+    {
+        json_element_t *root = parse_text(patch_samples[i].document);
+        json_element_t *patch = parse_text(patch_samples[i].patch);
+        bool applied = apply_json_patch(&root, patch);
+        if (patch_samples[i].expected)
+        {
+            json_element_t *expected = parse_text(patch_samples[i].expected);
+            check(applied && are_json_elements_equal(root, expected));
+            destroy_json_element(&expected->base);
+        }
+        else
+        {
+            // a failed operation leaves the document as it was, a moved element goes back
+            json_element_t *document = parse_text(patch_samples[i].document);
+            check(!applied && are_json_elements_equal(root, document));
+            destroy_json_element(&document->base);
+        }
+        destroy_json_element(&patch->base);
         destroy_json_element(&root->base);
     }
-    else
+
+    // pairs removed from an indexed object can still be looked up in order
+    json_object_t *object = create_json_object();
+    wchar_t key[8];
+    for (int i = 0; i < 40; i++)
+    {
+        swprintf(key, 8, L"k%d", i);
+        create_json_string_owned_by_object(object, key, key);
+    }
+    json_element_t *root = (json_element_t*)object;
+    json_element_t *patch = parse_text("[{\"op\":\"remove\",\"path\":\"/k3\"},{\"op\":\"remove\",\"path\":\"/k17\"},"
+        "{\"op\":\"remove\",\"path\":\"/k0\"},{\"op\":\"move\",\"from\":\"/k39\",\"path\":\"/k40\"}]");
+    check(apply_json_patch(&root, patch));
+    check(root->data.object->count == 37);
+    for (int i = 0; i <= 40; i++)
+    {
+        swprintf(key, 8, L"k%d", i);
+        bool removed = i == 0 || i == 3 || i == 17 || i == 39;
+        check((get_pair_from_json_object(root->data.object, key) == NULL) == removed);
+    }
+    check(wcscmp(get_pair_by_index_from_json_object(root->data.object, 0)->key->data, L"k1") == 0);
+    check(wcscmp(get_pair_by_index_from_json_object(root->data.object, 36)->key->data, L"k40") == 0);
+    destroy_json_element(&patch->base);
+    destroy_json_element(&root->base);
+
+    // the example of RFC 7386
+    root = parse_text("{\"title\":\"Goodbye!\",\"author\":{\"givenName\":\"John\",\"familyName\":\"Doe\"},"
+        "\"tags\":[\"example\",\"sample\"],\"content\":\"This will be unchanged\"}");
+    patch = parse_text("{\"title\":\"Hello!\",\"phoneNumber\":\"+01-123-456-7890\",\"author\":{\"familyName\":null},"
+        "\"tags\":[\"example\"]}");
+    json_element_t *expected = parse_text("{\"title\":\"Hello!\",\"author\":{\"givenName\":\"John\"},\"tags\":[\"example\"],"
+        "\"content\":\"This will be unchanged\",\"phoneNumber\":\"+01-123-456-7890\"}");
+    apply_json_merge_patch(&root, patch);
+    check(are_json_elements_equal(root, expected));
+    destroy_json_element(&expected->base);
+    destroy_json_element(&patch->base);
+    destroy_json_element(&root->base);
+
+    root = parse_text("{\"a\":1}");
+    patch = parse_text("[1,{\"b\":null}]");
+    apply_json_merge_patch(&root, patch);
+    check(are_json_elements_equal(root, patch));
+    destroy_json_element(&patch->base);
+    destroy_json_element(&root->base);
+
+    // copies of raw numbers keep the literals, converted or not
+    static const char *raw_document = "{\"id\":12345678901234567890123,\"n\":1.50}";
+    static const char *raw_patch = "[{\"op\":\"copy\",\"from\":\"/id\",\"path\":\"/a\"},"
+        "{\"op\":\"copy\",\"from\":\"/n\",\"path\":\"/b\"},{\"op\":\"add\",\"path\":\"/c\",\"value\":-0.0}]";
+    json_options_t options = { NULL, NULL, true, false, 0, NULL };
+    json_error_t err;
+    root = parse_json_utf8_with_options(raw_document, strlen(raw_document), &err, &options);
+    get_value_from_json_number((const json_number_t*)get_pair_from_json_object(root->data.object, L"n")->value);
+    patch = parse_json_utf8_with_options(raw_patch, strlen(raw_patch), &err, &options);
+    check(apply_json_patch(&root, patch));
+    const json_element_t *copy = get_pair_from_json_object(root->data.object, L"b")->value;
+    check(*copy->data.num_value == 1.5);
+    byte_sink_t sink = { { 0 }, 0 };
+    check(write_json_element(&root->base, json_format_compact, write_to_sink, &sink));
+    check(strcmp(sink.data, "{\"id\":12345678901234567890123,\"n\":1.50,\"a\":12345678901234567890123,"
+        "\"b\":1.50,\"c\":-0.0}") == 0);
+    destroy_json_element(&patch->base);
+    destroy_json_element(&root->base);
+}
+
+// --- struct bindings --------------------------------------------------------
+
+typedef struct
+{
+    real_t x;
+    real_t y;
+} point_t;
+
+typedef struct
+{
+    wide_string_t *name;
+    bool visible;
+    point_t origin;
+    json_bound_array_t points;
+    json_bound_array_t weights;
+    json_bound_array_t tags;
+} shape_t;
+
+static const char *shape_text =
+    "{\"extra\":{\"a\":[1,{\"b\":[]}]},\"name\":\"tri\\u00e9\",\"visible\":true,\"origin\":{\"y\":2,\"x\":1,\"z\":9},"
+    "\"points\":[{\"x\":0,\"y\":0},{\"x\":3},{\"y\":4,\"x\":5}],\"weights\":[0.5,1e+20],\"tags\":[\"a\",\"b\\\"c\"],"
+    "\"unused\":null}";
+
+static void test_struct_bindings(void)
+{
+    static const json_field_t point_fields[] =
+    {
+        { L"x", offsetof(point_t, x), json_number, json_null, NULL },
+        { L"y", offsetof(point_t, y), json_number, json_null, NULL }
+    };
+    json_binding_t *point_binding = create_json_binding(point_fields, 2, sizeof(point_t));
+    const json_field_t shape_fields[] =
+    {
+        { L"name", offsetof(shape_t, name), json_string, json_null, NULL },
+        { L"visible", offsetof(shape_t, visible), json_boolean, json_null, NULL },
+        { L"origin", offsetof(shape_t, origin), json_object, json_null, point_binding },
+        { L"points", offsetof(shape_t, points), json_array, json_object, point_binding },
+        { L"weights", offsetof(shape_t, weights), json_array, json_number, NULL },
+        { L"tags", offsetof(shape_t, tags), json_array, json_string, NULL }
+    };
+    json_binding_t *shape_binding = create_json_binding(shape_fields, 6, sizeof(shape_t));
+    check(point_binding != NULL && shape_binding != NULL);
+
+    shape_t shape;
+    json_error_t err;
+    check(decode_json_struct(shape_binding, shape_text, strlen(shape_text), &shape, &err));
+    check(wcscmp(shape.name->data, L"tri\u00e9") == 0);
+    check(shape.visible);
+    check(shape.origin.x == 1 && shape.origin.y == 2);
+    check(shape.points.count == 3);
+    const point_t *points = shape.points.items;
+    check(points[1].x == 3 && points[1].y == 0 && points[2].x == 5 && points[2].y == 4);
+    check(shape.weights.count == 2 && ((const real_t*)shape.weights.items)[1] == 1e+20);
+    check(shape.tags.count == 2 && wcscmp(((wide_string_t**)shape.tags.items)[1]->data, L"b\"c") == 0);
+
+    // the struct is written the same way as the equal tree
+    const wchar_t *expected = L"{\"name\":\"tri\u00e9\",\"visible\":true,\"origin\":{\"x\":1,\"y\":2},"
+        L"\"points\":[{\"x\":0,\"y\":0},{\"x\":3,\"y\":0},{\"x\":5,\"y\":4}],\"weights\":[0.5,1e+20],"
+        L"\"tags\":[\"a\",\"b\\\"c\"]}";
+    wide_string_t *text = json_struct_to_string(shape_binding, &shape, json_format_compact);
+    check(wcscmp(text->data, expected) == 0);
+    byte_sink_t sink = { { 0 }, 0 };
+    check(write_json_struct(shape_binding, &shape, json_format_compact, write_to_sink, &sink));
+    shape_t copy;
+    check(decode_json_struct(shape_binding, sink.data, sink.length, &copy, &err));
+    wide_string_t *copy_text = json_struct_to_string(shape_binding, &copy, json_format_compact);
+    check(wcscmp(text->data, copy_text->data) == 0);
+    free(copy_text);
+    free(text);
+    release_json_struct(shape_binding, &copy);
+    release_json_struct(shape_binding, &shape);
+
+    static const char *mismatched[] =
+    {
+        "{\"name\":1}", "{\"visible\":\"yes\"}", "{\"origin\":[1,2]}", "{\"points\":[1]}", "{\"tags\":[\"a\",false]}", "[]"
+    };
+    for (size_t i = 0; i < sizeof(mismatched) / sizeof(mismatched[0]); i++)
+    {
+        check(!decode_json_struct(shape_binding, mismatched[i], strlen(mismatched[i]), &shape, &err));
+        check(err.type == json_value_does_not_match_binding);
+    }
+    // malformed text fails as it does in the parser
+    json_error_t parse_err;
+    check(parse_json_utf8("{\"name\":\"x\",", 12, &parse_err) == NULL);
+    check(!decode_json_struct(shape_binding, "{\"name\":\"x\",", 12, &shape, &err));
+    check(err.type == parse_err.type);
+
+    destroy_json_binding(shape_binding);
+    destroy_json_binding(point_binding);
+}
+
+// --- parallel parser --------------------------------------------------------
+
+static json_element_t * parse_sequentially(const char *text, const json_options_t *options, json_error_t *err)
+{
+    return parse_json_utf8_with_options(text, strlen(text), err, options);
+}
+
+static const struct
+{
+    const char *text;
+    size_t max_depth;
+} depth_samples[] =
+{
+    { "[[1],[2],[[3]]]", 2 }, { "[[1],[2],[[3]]]", 3 }, { "[1,2,3]", 1 }, { "[1,[2],3]", 1 },
+    { "[{\"a\":[1]},{\"b\":{}}]", 2 }, { "[{\"a\":[1]},{\"b\":{}}]", 3 }
+};
+
+static void test_parallel_depth(void)
+{
+    for (size_t i = 0; i < sizeof(depth_samples) / sizeof(depth_samples[0]); i++)
+    {
+        const char *text = depth_samples[i].text;
+        json_options_t options = { NULL, NULL, false, false, depth_samples[i].max_depth, NULL };
+        json_error_t seq_err, par_err;
+        json_element_t *root = parse_sequentially(text, &options, &seq_err);
+        json_document_t *doc = parse_json_utf8_parallel(text, strlen(text), &options, 2, &par_err);
+        check((root != NULL) == (doc != NULL));
+        check(seq_err.type == par_err.type);
+        if (root && doc)
+            check(are_json_elements_equal(root, doc->root));
+        if (root)
+            destroy_json_element(&root->base);
+        destroy_json_document(doc);
+    }
+}
+
+static char * make_big_array(size_t count)
+{
+    char *text = malloc(count * 64 + 16);
+    size_t length = 0;
+    text[length++] = '[';
+    for (size_t i = 0; i < count; i++)
+        length += (size_t)sprintf(text + length, "%s\n {\"id\":%zu,\"name\":\"item\\u00e9%zu\",\"tags\":[%zu,true,null]}",
+            i ? "," : "", i, i % 7, i * 3);
+    strcpy(text + length, " ] ");
+    return text;
+}
+
+static void test_parallel_parse(void)
+{
+    char *text = make_big_array(3000);
+    json_error_t err;
+    json_element_t *root = parse_sequentially(text, NULL, &err);
+    json_document_t *doc = parse_json_utf8_parallel(text, strlen(text), NULL, 4, &err);
+    check(root != NULL && doc != NULL && are_json_elements_equal(root, doc->root));
+    destroy_json_document(doc);
+    destroy_json_element(&root->base);
+
+    // keys end up in the table of the options, statistics are the same as the sequential ones
+    json_key_table_t *seq_keys = create_json_key_table(), *par_keys = create_json_key_table();
+    json_parse_stats_t seq_stats, par_stats;
+    memset(&seq_stats, 0, sizeof(seq_stats));
+    memset(&par_stats, 0, sizeof(par_stats));
+    json_arena_t *arena = create_json_arena(0);
+    json_options_t seq_options = { arena, seq_keys, false, false, 0, &seq_stats };
+    json_options_t par_options = { NULL, par_keys, false, false, 0, &par_stats };
+    root = parse_sequentially(text, &seq_options, &err);
+    doc = parse_json_utf8_parallel(text, strlen(text), &par_options, 4, &err);
+    check(root != NULL && doc != NULL && are_json_elements_equal(root, doc->root));
+    check(get_json_key_table_size(par_keys) == get_json_key_table_size(seq_keys));
+    const json_element_t *first = get_element_from_json_array(doc->root->data.array, 0);
+    const json_element_t *last = get_element_from_json_array(doc->root->data.array, 2999);
+    check(get_pair_by_index_from_json_object(first->data.object, 1)->key
+        == get_pair_by_index_from_json_object(last->data.object, 1)->key);
+    check(get_pair_from_json_object(last->data.object, L"tags") != NULL);
+    check(par_stats.consumed == seq_stats.consumed);
+    check(memcmp(par_stats.elements, seq_stats.elements, sizeof(seq_stats.elements)) == 0);
+    check(par_stats.max_depth == seq_stats.max_depth && par_stats.keys == seq_stats.keys);
+    check(par_stats.strings == seq_stats.strings && par_stats.escapes == seq_stats.escapes);
+    // the sequential builder also counts the growth of its element stack
+    check(par_stats.allocations > 0 && par_stats.allocations <= seq_stats.allocations);
+    destroy_json_document(doc);
+    destroy_json_arena(arena);
+
+    // a lazy document is parsed by the sequential parser and expanded on access
+    json_options_t lazy_options = { NULL, NULL, false, true, 0, NULL };
+    doc = parse_json_utf8_parallel(text, strlen(text), &lazy_options, 4, &err);
+    root = parse_sequentially(text, NULL, &err);
+    check(doc != NULL && are_json_elements_equal(root, doc->root));
+    destroy_json_document(doc);
+    destroy_json_element(&root->base);
+    destroy_json_key_table(par_keys);
+    destroy_json_key_table(seq_keys);
+
+    // a broken item is reported as the sequential parser reports it
+    size_t length = strlen(text);
+    char *broken = strstr(text + length / 2, "true");
+    broken[3] = 'x';
+    json_error_t seq_err, par_err;
+    check(parse_sequentially(text, NULL, &seq_err) == NULL);
+    check(parse_json_utf8_parallel(text, length, NULL, 4, &par_err) == NULL);
+    check(seq_err.type == par_err.type && seq_err.type != json_ok);
+    check(seq_err.where.row == par_err.where.row && seq_err.where.column == par_err.where.column);
+    free(text);
+
+    static const char *fallback_samples[] =
+    {
+        "[ ]", "[]", "[1]", " [ {\"a\":[]} ] ", "{\"a\":[1,2]}", "42", "\"x\"", "[1,2", "[1,]", "[[1,2],[3]]x"
+    };
+    for (size_t i = 0; i < sizeof(fallback_samples) / sizeof(fallback_samples[0]); i++)
+    {
+        const char *sample = fallback_samples[i];
+        root = parse_sequentially(sample, NULL, &seq_err);
+        doc = parse_json_utf8_parallel(sample, strlen(sample), NULL, 4, &par_err);
+        check((root != NULL) == (doc != NULL) && seq_err.type == par_err.type);
+        if (root && doc)
+            check(are_json_elements_equal(root, doc->root));
+        if (root)
+            destroy_json_element(&root->base);
+        destroy_json_document(doc);
+    }
+}
+
+// --- newline-delimited JSON -------------------------------------------------
+
+static const char *lines_text =
+    "{\"id\":0}\n"
+    "\n"
+    "  \t \r\n"
+    "[1,2]\r\n"
+    "{\"id\":\n"
+    "\"last\"";
+
+typedef struct
+{
+    size_t calls;
+    size_t stop_after;
+    bool in_order;
+    size_t lines[8];
+    json_error_type_t errors[8];
+} record_log_t;
+
+static bool log_record(void *context, size_t index, const json_record_t *record)
+{
+    record_log_t *log = context;
+    log->in_order = log->in_order && index == log->calls;
+    if (index < 8)
     {
-        result = json_error_to_string(&err);
-    }    
-    wprintf(L"%s", result->data);
-    free(result);
+        log->lines[index] = record->line;
+        log->errors[index] = record->root ? json_ok : record->error.type;
+    }
+    log->calls++;
+    return log->calls != log->stop_after;
+}
+
+typedef struct
+{
+    const json_batch_t *batch;
+    size_t calls;
+    bool same;
+} batch_compare_t;
+
+static bool compare_with_batch(void *context, size_t index, const json_record_t *record)
+{
+    batch_compare_t *compare = context;
+    const json_record_t *expected = get_record_from_json_batch(compare->batch, index);
+    compare->same = compare->same && expected && index == compare->calls && expected->line == record->line
+        && (expected->root ? record->root && are_json_elements_equal(expected->root, record->root) : !record->root)
+        && (expected->root || (expected->error.type == record->error.type
+            && expected->error.where.row == record->error.where.row));
+    compare->calls++;
+    return true;
+}
+
+static void test_json_lines(void)
+{
+    json_batch_t *batch = parse_json_lines(lines_text, strlen(lines_text), NULL, 2);
+    check(get_json_batch_size(batch) == 4);
+    static const size_t lines[] = { 1, 4, 5, 6 };
+    for (size_t i = 0; i < 4; i++)
+    {
+        const json_record_t *record = get_record_from_json_batch(batch, i);
+        check(record->line == lines[i]);
+        check((record->root == NULL) == (i == 2));
+    }
+    const json_record_t *bad = get_record_from_json_batch(batch, 2);
+    check(bad->error.type != json_ok && bad->error.where.row == 5);
+    check(get_record_from_json_batch(batch, 3)->root->base.type == json_string);
+    check(get_record_from_json_batch(batch, 4) == NULL);
+    destroy_json_batch(batch);
+
+    record_log_t log = { 0, 0, true, { 0 }, { 0 } };
+    check(parse_json_lines_with_callback(lines_text, strlen(lines_text), NULL, 2, log_record, &log));
+    check(log.calls == 4 && log.in_order);
+    check(log.lines[0] == 1 && log.lines[1] == 4 && log.lines[2] == 5 && log.lines[3] == 6);
+    check(log.errors[0] == json_ok && log.errors[2] != json_ok && log.errors[3] == json_ok);
+
+    // a big input is passed chunk by chunk, the same as the batch has it
+    size_t count = 100000;
+    char *text = malloc(count * 64);
+    size_t length = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i % 1000 == 999)
+            length += (size_t)sprintf(text + length, "{\"id\":%zu,\"broken\":}\r\n", i);
+        else if (i % 500 == 0)
+            length += (size_t)sprintf(text + length, "\n");
+        else
+            length += (size_t)sprintf(text + length, "{\"id\":%zu,\"name\":\"n%zu\"}\n", i, i);
+    }
+    batch = parse_json_lines(text, length, NULL, 4);
+    for (size_t threads = 1; threads <= 4; threads += 3)
+    {
+        batch_compare_t compare = { batch, 0, true };
+        check(parse_json_lines_with_callback(text, length, NULL, threads, compare_with_batch, &compare));
+        check(compare.same && compare.calls == get_json_batch_size(batch));
+    }
+    destroy_json_batch(batch);
+
+    // a callback returning false is not called again
+    record_log_t stopped = { 0, 30000, true, { 0 }, { 0 } };
+    check(!parse_json_lines_with_callback(text, length, NULL, 4, log_record, &stopped));
+    check(stopped.calls == 30000 && stopped.in_order);
+    free(text);
+
+    record_log_t empty = { 0, 0, true, { 0 }, { 0 } };
+    check(parse_json_lines_with_callback("", 0, NULL, 4, log_record, &empty) && empty.calls == 0);
+    check(parse_json_lines_with_callback("\n \r\n", 4, NULL, 4, log_record, &empty) && empty.calls == 0);
+}
+
+// --- contexts ---------------------------------------------------------------
+
+static void test_contexts(void)
+{
+    json_context_t *ctx = create_json_context(NULL);
+    json_error_t err;
+    char text[256];
+    for (int round = 0; round < 50; round++)
+    {
+        // keys made of ids: without the reset of the keys they would pile up
+        sprintf(text, "{\"id%d\":{\"value\":%d},\"id%d\":[true]}", round * 2, round, round * 2 + 1);
+        json_element_t *root = parse_json_utf8_with_context(ctx, text, strlen(text), &err);
+        json_element_t *expected = parse_text(text);
+        check(root != NULL && are_json_elements_equal(root, expected));
+        wchar_t key[16];
+        swprintf(key, 16, L"id%d", round * 2);
+        check(get_pair_from_json_object(root->data.object, key) != NULL);
+        destroy_json_element(&expected->base);
+        reset_json_context(ctx);
+    }
+    for (size_t i = 0; i < samples_count; i++)
+    {
+        wchar_t buff[256];
+        wide_string_t wide = widen_text(samples[i], buff);
+        json_element_t *root = parse_json_with_context(ctx, &wide, &err);
+        json_element_t *expected = parse_text(samples[i]);
+        check(root != NULL && are_json_elements_equal(root, expected));
+        destroy_json_element(&expected->base);
+        reset_json_context(ctx);
+    }
+    check(parse_json_utf8_with_context(ctx, "{\"a\":", 5, &err) == NULL && err.type != json_ok);
+    json_element_t *root = parse_json_utf8_with_context(ctx, "{\"a\":1}", 7, &err);
+    check(root != NULL && get_pair_from_json_object(root->data.object, L"a") != NULL);
+    destroy_json_context(ctx);
+
+    // the key table of the options keeps its keys over resets
+    json_key_table_t *keys = create_json_key_table();
+    json_options_t options = { NULL, keys, false, false, 0, NULL };
+    ctx = create_json_context(&options);
+    root = parse_json_utf8_with_context(ctx, "{\"a\":1,\"b\":2}", 13, &err);
+    check(root != NULL && get_json_key_table_size(keys) == 2);
+    reset_json_context(ctx);
+    root = parse_json_utf8_with_context(ctx, "{\"c\":1}", 7, &err);
+    check(root != NULL && get_json_key_table_size(keys) == 3);
+    destroy_json_context(ctx);
+    destroy_json_key_table(keys);
+}
+
+// --- frozen documents -------------------------------------------------------
+
+static const char *frozen_text =
+    "{\"users\":[{\"name\":\"ann\",\"age\":31,\"tags\":[\"a\",\"b\"]},{\"name\":\"bob\",\"age\":42.5,\"tags\":[]}],"
+    "\"meta\":{\"count\":2,\"deep\":{\"deeper\":{\"value\":1e3}}},\"k1\":1,\"k2\":2,\"k3\":3,\"k4\":4,\"k5\":5,"
+    "\"k6\":6,\"k7\":7,\"k8\":8,\"k9\":9}";
+
+#define readers_count 8
+
+typedef struct
+{
+    json_frozen_t *frozen;
+    size_t mismatches;
+    bool destroyed;
+} frozen_reader_t;
+
+static void read_frozen(frozen_reader_t *reader)
+{
+    json_path_t *path = compile_json_path(L"/meta/deep/deeper/value", NULL);
+    for (int i = 0; i < 2000; i++)
+    {
+        const json_element_t *root = reader->frozen->root;
+        const json_element_t *users = get_pair_from_json_object(root->data.object, L"users")->value;
+        const json_element_t *bob = get_element_from_json_array(users->data.array, 1);
+        const json_element_t *age = get_pair_from_json_object(bob->data.object, L"age")->value;
+        const json_element_t *value = find_json_element_by_path(root, path);
+        const json_pair_t *k9 = get_pair_from_json_object(root->data.object, L"k9");
+        if (*age->data.num_value != 42.5 || !value || *value->data.num_value != 1000 || !k9
+                || *k9->value->data.num_value != 9)
+            reader->mismatches++;
+    }
+    destroy_json_path(path);
+    reader->destroyed = release_json_frozen(reader->frozen);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI frozen_reader_routine(LPVOID param)
+{
+    read_frozen(param);
     return 0;
 }
+#else
+static void * frozen_reader_routine(void *param)
+{
+    read_frozen(param);
+    return NULL;
+}
+#endif
+
+static void test_frozen(void)
+{
+    // references taken and released on one thread: only the last release destroys the tree
+    json_frozen_t *frozen = freeze_json_element(parse_text(frozen_text));
+    check(frozen != NULL && retain_json_frozen(frozen) == frozen);
+    check(!release_json_frozen(frozen));
+    check(release_json_frozen(frozen));
+    check(!release_json_frozen(NULL) && freeze_json_element(NULL) == NULL);
+
+    // a lazy document with raw numbers has all its deferred work done by the freezing
+    json_options_t options = { NULL, NULL, true, true, 0, NULL };
+    json_error_t err;
+    json_document_t *doc = parse_json_utf8_parallel(frozen_text, strlen(frozen_text), &options, 1, &err);
+    check(doc != NULL);
+    const json_element_t *k1 = get_pair_from_json_object(doc->root->data.object, L"k1")->value;
+    check(isnan(*k1->data.num_value));
+    frozen = freeze_json_document(doc);
+    check(*k1->data.num_value == 1);
+    // the raw numbers of nested containers are converted, so the freezing has expanded them
+    const json_element_t *meta = get_pair_from_json_object(doc->root->data.object, L"meta")->value;
+    const json_element_t *deep = get_pair_from_json_object(meta->data.object, L"deep")->value;
+    const json_element_t *deeper = get_pair_by_index_from_json_object(deep->data.object, 0)->value;
+    const json_element_t *value = get_pair_by_index_from_json_object(deeper->data.object, 0)->value;
+    check(*value->data.num_value == 1000);
+    const json_element_t *users = get_pair_by_index_from_json_object(doc->root->data.object, 0)->value;
+    const json_element_t *ann = get_element_from_json_array(users->data.array, 0);
+    check(*get_pair_from_json_object(ann->data.object, L"age")->value->data.num_value == 31);
+
+    // readers on several threads look the tree up and drop their references
+    frozen_reader_t readers[readers_count];
+    for (int i = 0; i < readers_count; i++)
+    {
+        readers[i].frozen = retain_json_frozen(frozen);
+        readers[i].mismatches = 0;
+        readers[i].destroyed = false;
+    }
+#ifdef _WIN32
+    HANDLE threads[readers_count];
+    for (int i = 0; i < readers_count; i++)
+        threads[i] = CreateThread(NULL, 0, frozen_reader_routine, &readers[i], 0, NULL);
+    int destroyed = release_json_frozen(frozen) ? 1 : 0;
+    for (int i = 0; i < readers_count; i++)
+    {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+#else
+    pthread_t threads[readers_count];
+    for (int i = 0; i < readers_count; i++)
+        pthread_create(&threads[i], NULL, frozen_reader_routine, &readers[i]);
+    int destroyed = release_json_frozen(frozen) ? 1 : 0;
+    for (int i = 0; i < readers_count; i++)
+        pthread_join(threads[i], NULL);
+#endif
+    for (int i = 0; i < readers_count; i++)
+    {
+        check(readers[i].mismatches == 0);
+        destroyed += readers[i].destroyed ? 1 : 0;
+    }
+    check(destroyed == 1);
+}
+
+// --- lazy mode --------------------------------------------------------------
+
+static const char *lazy_broken[] =
+{
+    "{\"a\":{\"b\":[1,2,}]}}", "[1,[2,{\"x\" 3}]]", "{\"a\":[\"\\q\"]}", "{\"a\":{\"b\":tru}}", "[[[[1]]]", "{\"a\":[1e]}"
+};
+
+static void test_lazy_mode(void)
+{
+    const char *texts[samples_count + 1];
+    for (size_t i = 0; i < samples_count; i++)
+        texts[i] = samples[i];
+    texts[samples_count] = frozen_text;
+    for (size_t i = 0; i <= samples_count; i++)
+    {
+        const char *text = texts[i];
+        json_element_t *eager = parse_text(text);
+        json_error_t err;
+        for (int way = 0; way < 3; way++)
+        {
+            // each way reaches the lazy containers through another reader
+            json_arena_t *arena = create_json_arena(0);
+            json_options_t options = { arena, NULL, way == 2, true, 0, NULL };
+            json_element_t *lazy = parse_json_utf8_with_options(text, strlen(text), &err, &options);
+            check(lazy != NULL);
+            if (way == 0)
+            {
+                wide_string_t *lazy_text = json_element_to_string(&lazy->base, json_format_pretty);
+                wide_string_t *eager_text = json_element_to_string(&eager->base, json_format_pretty);
+                check(wcscmp(lazy_text->data, eager_text->data) == 0);
+                free(eager_text);
+                free(lazy_text);
+            }
+            else if (way == 1)
+            {
+                size_t size;
+                void *data = encode_json_element(&lazy->base, &size);
+                json_element_t *decoded = decode_json_element(data, size, NULL, &err);
+                check(decoded != NULL && are_json_elements_equal(decoded, eager));
+                destroy_json_element(&decoded->base);
+                free(data);
+            }
+            else
+                check(are_json_elements_equal(lazy, eager));
+            destroy_json_arena(arena);
+        }
+        destroy_json_element(&eager->base);
+    }
+    for (size_t i = 0; i < sizeof(lazy_broken) / sizeof(lazy_broken[0]); i++)
+    {
+        const char *text = lazy_broken[i];
+        json_arena_t *arena = create_json_arena(0);
+        json_options_t options = { arena, NULL, false, true, 0, NULL };
+        json_error_t lazy_err, eager_err;
+        check(parse_json_utf8_with_options(text, strlen(text), &lazy_err, &options) == NULL);
+        check(parse_json_utf8(text, strlen(text), &eager_err) == NULL);
+        check(lazy_err.type == eager_err.type);
+        check(lazy_err.where.row == eager_err.where.row && lazy_err.where.column == eager_err.where.column);
+        wchar_t buff[64];
+        wide_string_t wide = widen_text(text, buff);
+        check(parse_json_with_options(&wide, &lazy_err, &options) == NULL && lazy_err.type == eager_err.type);
+        destroy_json_arena(arena);
+    }
+    // the depth limit counts the containers that are skipped
+    json_arena_t *arena = create_json_arena(0);
+    json_options_t options = { arena, NULL, false, true, 2, NULL };
+    json_error_t err;
+    check(parse_json_utf8_with_options("[[[1]]]", 7, &err, &options) == NULL);
+    check(err.type == json_maximum_depth_exceeded);
+    check(parse_json_utf8_with_options("[[1]]", 5, &err, &options) != NULL);
+    destroy_json_arena(arena);
+}
+
+// --- selective parsing ------------------------------------------------------
+
+static const char *selected_text =
+    "{\"skip\":{\"x\":[1,2,3,{\"y\":\"z\"}]},\"users\":[{\"name\":\"ann\",\"id\":1},{\"name\":\"bob\",\"id\":2,"
+    "\"tags\":[\"t1\",\"t2\"]}],\"meta\":{\"total\":2},\"tail\":[true,false,null]}";
+
+static void test_selective_parse(void)
+{
+    const wchar_t *pointers[] = { L"/users/1/name", L"/users/1/tags", L"/meta/total", L"/users/5/name",
+        L"/nothing", L"/users/1/tags/1" };
+    json_path_set_t *set = compile_json_path_set(pointers, 6, NULL);
+    const json_element_t *results[6];
+    json_parse_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    json_options_t options = { NULL, NULL, false, false, 0, &stats };
+    json_error_t err;
+    json_document_t *doc = parse_json_utf8_selected(selected_text, strlen(selected_text), set, &options, results, &err);
+    check(doc != NULL && doc->root == NULL);
+    check(results[0] != NULL && wcscmp(results[0]->data.string_value->data, L"bob") == 0);
+    check(results[1] != NULL && results[1]->base.type == json_array && results[1]->data.array->count == 2);
+    check(results[2] != NULL && *results[2]->data.num_value == 2);
+    check(results[3] == NULL && results[4] == NULL);
+    // a path going deeper than a taken value is resolved in the elements built for it
+    check(results[5] == get_element_from_json_array(results[1]->data.array, 1));
+    // the name, the array with two strings and the number are all that is built
+    check(stats.elements[json_string] == 3 && stats.elements[json_array] == 1 && stats.elements[json_number] == 1);
+    check(stats.elements[json_object] == 0 && stats.elements[json_boolean] == 0 && stats.elements[json_null] == 0);
+    destroy_json_document(doc);
+
+    wchar_t buff[256];
+    wide_string_t wide = widen_text(selected_text, buff);
+    doc = parse_json_selected(&wide, set, NULL, results, &err);
+    check(doc != NULL && results[0] != NULL && wcscmp(results[0]->data.string_value->data, L"bob") == 0);
+    destroy_json_document(doc);
+
+    // errors are found outside the selected values too, where they are found by the parser
+    static const char *broken[] =
+    {
+        "{\"skip\":[1,,2],\"meta\":{\"total\":2}}", "{\"skip\":{\"a\" 1},\"meta\":{\"total\":2}}",
+        "{\"meta\":{\"total\":2},\"tail\":[tru]}", "{\"meta\":{\"total\":2},\"tail\":\"\\q\"}",
+        "{\"meta\":{\"total\":2},\"tail\":[1}", "{\"users\":[{\"name\":\"a\"},{\"name\" \"b\"}]}",
+        "{\"meta\":{\"total\":-}}", "{\"meta\":{\"total\":2}"
+    };
+    for (size_t i = 0; i < sizeof(broken) / sizeof(broken[0]); i++)
+    {
+        json_error_t parse_err;
+        check(parse_json_utf8(broken[i], strlen(broken[i]), &parse_err) == NULL);
+        doc = parse_json_utf8_selected(broken[i], strlen(broken[i]), set, NULL, results, &err);
+        check(doc == NULL && results[0] == NULL && results[2] == NULL);
+        check(err.type == parse_err.type);
+        check(err.where.row == parse_err.where.row && err.where.column == parse_err.where.column);
+    }
+    destroy_json_path_set(set);
+}
+
+// --- tapes and snapshots ----------------------------------------------------
+
+/*
+    Walks the tape along the tree, so with a damaged tape it still stops,
+    and tells whether the tape has the same values
+*/
+static bool is_tape_equal_to_element(json_tape_value_t value, const json_element_t *elem)
+{
+    json_element_type_t type = get_json_tape_value_type(value);
+    bool equal = type == elem->base.type;
+    json_tape_value_t child;
+    wide_string_t str;
+    switch (elem->base.type)
+    {
+        case json_object:
+            equal = equal && get_json_tape_value_count(value) == elem->data.object->count;
+            for (size_t i = 0; i < elem->data.object->count; i++)
+            {
+                const json_pair_t *pair = get_pair_by_index_from_json_object(elem->data.object, i);
+                equal = get_pair_from_json_tape_object(value, pair->key->data, &child)
+                    && is_tape_equal_to_element(child, pair->value) && equal;
+            }
+            return equal;
+        case json_array:
+            equal = equal && get_json_tape_value_count(value) == elem->data.array->count;
+            for (size_t i = 0; i < elem->data.array->count; i++)
+            {
+                equal = get_element_from_json_tape_array(value, i, &child)
+                    && is_tape_equal_to_element(child, get_element_from_json_array(elem->data.array, i)) && equal;
+            }
+            return equal && !get_element_from_json_tape_array(value, elem->data.array->count, &child);
+        case json_string:
+            return get_json_tape_string(value, &str) && equal && str.length == elem->data.string_value->length
+                && memcmp(str.data, elem->data.string_value->data, str.length * sizeof(wchar_t)) == 0;
+        case json_number:
+            return get_json_tape_number(value) == *elem->data.num_value && equal;
+        case json_boolean:
+            return get_json_tape_boolean(value) == elem->data.bool_value && equal;
+        default:
+            return equal;
+    }
+}
+
+static const char *snapshot_path = "test_snapshot.tmp";
+
+static bool write_bytes_to_file(const char *path, const void *data, size_t size)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return false;
+    bool written = size == 0 || fwrite(data, size, 1, file) == 1;
+    return fclose(file) == 0 && written;
+}
+
+static void * read_file_bytes(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    *size = (size_t)ftell(file);
+    fseek(file, 0, SEEK_SET);
+    void *data = malloc(*size + 1);
+    *size = fread(data, 1, *size, file);
+    fclose(file);
+    return data;
+}
+
+static void test_tapes(void)
+{
+    const char *texts[] = { samples[0], samples[1], samples[2], samples[3], frozen_text, selected_text,
+        utf8_samples[0].utf8, utf8_samples[1].utf8, "[]", "{}", "[\"\"]", "{\"\":\"\"}" };
+    size_t texts_count = sizeof(texts) / sizeof(texts[0]);
+    json_error_t err;
+    for (size_t i = 0; i < texts_count; i++)
+    {
+        json_element_t *root = parse_text(texts[i]);
+        json_tape_t *tape = parse_json_utf8_to_tape(texts[i], strlen(texts[i]), &err);
+        check(tape != NULL && is_tape_equal_to_element(get_json_tape_root(tape), root));
+        check(write_json_tape_to_file(tape, snapshot_path));
+        json_tape_t *mapped = map_json_tape_file(snapshot_path, &err);
+        check(mapped != NULL && is_tape_equal_to_element(get_json_tape_root(mapped), root));
+        destroy_json_tape(mapped);
+        destroy_json_tape(tape);
+        destroy_json_element(&root->base);
+    }
+    wchar_t buff[256];
+    wide_string_t wide = widen_text(samples[1], buff);
+    json_element_t *root = parse_text(samples[1]);
+    json_tape_t *tape = parse_json_to_tape(&wide, &err);
+    check(tape != NULL && is_tape_equal_to_element(get_json_tape_root(tape), root));
+    json_tape_value_t missing;
+    check(!get_pair_from_json_tape_object(get_json_tape_root(tape), L"k1", &missing));
+    destroy_json_tape(tape);
+    destroy_json_element(&root->base);
+    check(parse_json_utf8_to_tape("[1,", 3, &err) == NULL && err.type == json_missing_closing_bracket);
+    check(map_json_tape_file("no/such/snapshot", &err) == NULL && err.type == json_cannot_read_file);
+
+    // a snapshot that is cut, of another version or signature is not mapped
+    tape = parse_json_utf8_to_tape(frozen_text, strlen(frozen_text), &err);
+    check(write_json_tape_to_file(tape, snapshot_path));
+    destroy_json_tape(tape);
+    size_t size;
+    uint8_t *bytes = read_file_bytes(snapshot_path, &size);
+    size_t cuts[] = { 0, 7, 39, 40, 48, size / 2, size - 8, size - 1 };
+    for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); i++)
+    {
+        check(write_bytes_to_file(snapshot_path, bytes, cuts[i]));
+        check(map_json_tape_file(snapshot_path, &err) == NULL && err.type == json_incorrect_binary_format);
+    }
+    uint8_t *longer = malloc(size + 8);
+    memcpy(longer, bytes, size);
+    memset(longer + size, 0, 8);
+    check(write_bytes_to_file(snapshot_path, longer, size + 8));
+    check(map_json_tape_file(snapshot_path, &err) == NULL && err.type == json_incorrect_binary_format);
+    free(longer);
+    for (size_t field = 0; field < 4; field++)
+    {
+        // the signature, the version, the marker and the number of entries
+        bytes[field * 8] ^= 0x10;
+        check(write_bytes_to_file(snapshot_path, bytes, size));
+        check(map_json_tape_file(snapshot_path, &err) == NULL && err.type == json_incorrect_binary_format);
+        bytes[field * 8] ^= 0x10;
+    }
+
+    // damaged offsets and lengths give wrong values, but nothing is read outside the file
+    root = parse_text(frozen_text);
+    uint64_t entries_count;
+    memcpy(&entries_count, bytes + 24, sizeof(uint64_t));
+    static const uint64_t damages[] = { 0, 1, 8, 0x7F, 0xFFFFFFFFULL, 0x00FFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL };
+    size_t mapped_count = 0, damaged_count = 0;
+    for (size_t i = 0; i < (size - 40) / 8; i++)
+    {
+        for (size_t k = 0; k < sizeof(damages) / sizeof(damages[0]); k++)
+        {
+            uint64_t saved, damage = damages[k];
+            memcpy(&saved, bytes + 40 + i * 8, sizeof(uint64_t));
+            // an entry keeps its tag and gets another payload, a string length gets another value
+            if (i < entries_count)
+                damage = (saved & ~((((uint64_t)1) << 56) - 1)) | (damage & ((((uint64_t)1) << 56) - 1));
+            memcpy(bytes + 40 + i * 8, &damage, sizeof(uint64_t));
+            check(write_bytes_to_file(snapshot_path, bytes, size));
+            json_tape_t *mapped = map_json_tape_file(snapshot_path, &err);
+            if (mapped)
+            {
+                mapped_count++;
+                if (!is_tape_equal_to_element(get_json_tape_root(mapped), root))
+                    damaged_count++;
+                destroy_json_tape(mapped);
+            }
+            memcpy(bytes + 40 + i * 8, &saved, sizeof(uint64_t));
+        }
+    }
+    check(mapped_count > 0 && damaged_count > 0);
+    free(bytes);
+    destroy_json_element(&root->base);
+    remove(snapshot_path);
+}
+
+// --- parse statistics -------------------------------------------------------
+
+static const char *counted_text = "{\"a\":[1,{\"b\":[true,null]}],\"c\":\"x\\ny\",\"d\\u0041\":2.5}";
+
+static void test_parse_stats(void)
+{
+    json_parse_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    json_options_t options = { NULL, NULL, false, false, 0, &stats };
+    json_error_t err;
+    size_t length = strlen(counted_text);
+    json_element_t *root = parse_json_utf8_with_options(counted_text, length, &err, &options);
+    check(root != NULL);
+    check(stats.consumed == length && stats.max_depth == 4);
+    check(stats.elements[json_object] == 2 && stats.elements[json_array] == 2);
+    check(stats.elements[json_number] == 2 && stats.elements[json_string] == 1);
+    check(stats.elements[json_boolean] == 1 && stats.elements[json_null] == 1);
+    check(stats.keys == 4 && stats.strings == 1 && stats.escapes == 2);
+    check(stats.allocations > 0 && stats.allocated_bytes > 0 && stats.seconds >= 0);
+    destroy_json_element(&root->base);
+
+    // the counters add up over the parses, the deepest nesting is kept
+    json_parse_stats_t first = stats;
+    wchar_t buff[256];
+    wide_string_t wide = widen_text("[[\"\\t\"]]", buff);
+    root = parse_json_with_options(&wide, &err, &options);
+    check(root != NULL);
+    check(stats.consumed == first.consumed + wide.length && stats.max_depth == 4);
+    check(stats.elements[json_array] == 4 && stats.elements[json_string] == 2 && stats.escapes == 3);
+    check(stats.allocations > first.allocations);
+    destroy_json_element(&root->base);
+
+    // a scalar has no depth, the elements taken from an arena are counted too
+    memset(&stats, 0, sizeof(stats));
+    json_arena_t *arena = create_json_arena(0);
+    options.arena = arena;
+    root = parse_json_utf8_with_options("42", 2, &err, &options);
+    check(root != NULL && stats.max_depth == 0 && stats.elements[json_number] == 1);
+    check(stats.consumed == 2 && stats.allocations > 0);
+    destroy_json_arena(arena);
+
+    // nothing is counted without the stats
+    memset(&stats, 0, sizeof(stats));
+    options.arena = NULL;
+    options.stats = NULL;
+    root = parse_json_utf8_with_options(counted_text, length, &err, &options);
+    check(root != NULL && stats.consumed == 0 && stats.allocations == 0);
+    destroy_json_element(&root->base);
+}
+
+// --- raw numbers ------------------------------------------------------------
+
+static const char *raw_text = "[12345678901234567890123,-0.10,1E+2,0]";
+
+static void check_raw_literals(const json_element_t *root)
+{
+    static const char *literals[] = { "12345678901234567890123", "-0.10", "1E+2", "0" };
+    const json_array_data_t *array = root->data.array;
+    check(array->count == 4);
+    for (size_t i = 0; i < array->count && i < 4; i++)
+    {
+        const json_number_t *num = (const json_number_t*)get_element_from_json_array(array, i);
+        size_t length;
+        const char *literal = get_literal_from_json_number(num, &length);
+        check(literal != NULL && length == strlen(literals[i]) && memcmp(literal, literals[i], length) == 0);
+    }
+}
+
+static void test_raw_numbers(void)
+{
+    json_options_t options = { NULL, NULL, true, false, 0, NULL };
+    json_error_t err;
+    json_element_t *root = parse_json_utf8_with_options(raw_text, strlen(raw_text), &err, &options);
+    check(root != NULL);
+    check_raw_literals(root);
+    // a number reads as NaN until it is converted, then it keeps the value
+    const json_element_t *second = get_element_from_json_array(root->data.array, 1);
+    check(isnan((double)*second->data.num_value));
+    check(*get_value_from_json_number((const json_number_t*)second) == -0.1 && *second->data.num_value == -0.1);
+    const json_element_t *third = get_element_from_json_array(root->data.array, 2);
+    check(isnan((double)*third->data.num_value) && *get_value_from_json_number((const json_number_t*)third) == 100);
+
+    // the writer puts the literals back, converted or not
+    wchar_t buff[64];
+    wide_string_t expected = widen_text(raw_text, buff);
+    check_written_text(root, expected.data, raw_text);
+
+    // the binary form keeps the literals, without 'raw_numbers' they are decoded to values
+    size_t size;
+    void *data = encode_json_element(&root->base, &size);
+    json_element_t *decoded = decode_json_element(data, size, &options, &err);
+    check(decoded != NULL);
+    check_raw_literals(decoded);
+    check(isnan((double)*get_element_from_json_array(decoded->data.array, 0)->data.num_value));
+    destroy_json_element(&decoded->base);
+    decoded = decode_json_element(data, size, NULL, &err);
+    check(decoded != NULL && decoded->data.array->count == 4);
+    const json_element_t *value = get_element_from_json_array(decoded->data.array, 1);
+    check(get_literal_from_json_number((const json_number_t*)value, NULL) == NULL && *value->data.num_value == -0.1);
+    check(*get_element_from_json_array(decoded->data.array, 2)->data.num_value == 100);
+    destroy_json_element(&decoded->base);
+    free(data);
+    destroy_json_element(&root->base);
+
+    // a literal must be a whole JSON number, the data of the version 1 is still read
+    static const uint8_t bad_literals[][7] =
+    {
+        { 'J', 'B', 2, 8, 2, '-', 'x' },
+        { 'J', 'B', 2, 8, 2, '1', '.' },
+        { 'J', 'B', 2, 8, 3, '1', 'e' },
+        { 'J', 'B', 2, 8, 9, '1', '2' }
+    };
+    for (size_t i = 0; i < sizeof(bad_literals) / sizeof(bad_literals[0]); i++)
+        check(decode_json_element(bad_literals[i], 7, NULL, &err) == NULL && err.type == json_incorrect_binary_format);
+    static const uint8_t old_data[] = { 'J', 'B', 1, 3, 84 };
+    decoded = decode_json_element(old_data, sizeof(old_data), NULL, &err);
+    check(decoded != NULL && *decoded->data.num_value == 42);
+    destroy_json_element(&decoded->base);
+
+    // numbers parsed without the flag have no literals
+    root = parse_text(raw_text);
+    const json_number_t *first = (const json_number_t*)get_element_from_json_array(root->data.array, 0);
+    check(get_literal_from_json_number(first, NULL) == NULL);
+    destroy_json_element(&root->base);
+}
+
+// --- number conversion ------------------------------------------------------
+
+/*
+    The values around the limits of the exact conversion: 2^53 for the mantissa,
+    10^22 for the power, the subnormals and the longest integers; the expected
+    values are rounded by the compiler
+*/
+static const struct
+{
+    const char *literal;
+    double value;
+} number_samples[] =
+{
+    { "7e22", 7e22 }, { "1e22", 1e22 }, { "1e23", 1e23 }, { "8.5e22", 8.5e22 }, { "1e-22", 1e-22 },
+    { "1e-23", 1e-23 }, { "9007199254740992", 9007199254740992.0 }, { "9007199254740993", 9007199254740993.0 },
+    { "9007199254740993.0", 9007199254740993.0 }, { "9007199254740993e0", 9007199254740993.0 },
+    { "9007199254740991.5", 9007199254740991.5 }, { "0.9007199254740993", 0.9007199254740993 },
+    { "18446744073709551615", 18446744073709551615.0 }, { "123456789012345678901", 123456789012345678901.0 },
+    { "5e-324", 5e-324 }, { "4.9406564584124654e-324", 4.9406564584124654e-324 },
+    { "2.2250738585072011e-308", 2.2250738585072011e-308 }, { "2.2250738585072014e-308", 2.2250738585072014e-308 },
+    { "1.7976931348623157e308", 1.7976931348623157e308 }, { "0.1", 0.1 }, { "3.14159", 3.14159 },
+    { "-0.0", -0.0 }, { "0e400", 0.0 }, { "0.000001", 0.000001 }, { "-2.5E+3", -2500.0 }
+};
+
+static bool is_same_double(double actual, double expected)
+{
+    return memcmp(&actual, &expected, sizeof(double)) == 0;
+}
+
+static void test_number_conversion(void)
+{
+    json_options_t options = { NULL, NULL, true, false, 0, NULL };
+    json_error_t err;
+    for (size_t i = 0; i < sizeof(number_samples) / sizeof(number_samples[0]); i++)
+    {
+        const char *literal = number_samples[i].literal;
+        double expected = number_samples[i].value;
+        json_element_t *root = parse_text(literal);
+        check(root != NULL && is_same_double((double)*root->data.num_value, expected));
+        destroy_json_element(&root->base);
+        wchar_t buff[64];
+        wide_string_t wide = widen_text(literal, buff);
+        root = parse_json(&wide);
+        check(root != NULL && is_same_double((double)*root->data.num_value, expected));
+        destroy_json_element(&root->base);
+        root = parse_json_utf8_with_options(literal, strlen(literal), &err, &options);
+        check(root != NULL && is_same_double((double)*get_value_from_json_number((json_number_t*)root), expected));
+        destroy_json_element(&root->base);
+    }
+}
+
+// --- string storage ---------------------------------------------------------
+
+static void test_string_storage(void)
+{
+    // the characters of a parsed string come in the block of its element, whatever the length
+    static const size_t lengths[] = { 1, 7, 8, 63, 64, 255, 4096 };
+    json_parse_stats_t empty_stats;
+    memset(&empty_stats, 0, sizeof(empty_stats));
+    json_options_t options = { NULL, NULL, false, false, 0, &empty_stats };
+    json_error_t err;
+    json_element_t *root = parse_json_utf8_with_options("\"\"", 2, &err, &options);
+    check(root != NULL && root->data.string_value->length == 0 && root->data.string_value->data[0] == L'\0');
+    destroy_json_element(&root->base);
+    // a number is a single block, so is a string
+    json_parse_stats_t number_stats;
+    memset(&number_stats, 0, sizeof(number_stats));
+    options.stats = &number_stats;
+    root = parse_json_utf8_with_options("0", 1, &err, &options);
+    check(root != NULL && number_stats.allocations == empty_stats.allocations);
+    destroy_json_element(&root->base);
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+    {
+        size_t length = lengths[i];
+        char *text = malloc(length + 3);
+        text[0] = '"';
+        memset(text + 1, 'a' + (int)(i % 26), length);
+        text[length + 1] = '"';
+        text[length + 2] = '\0';
+        json_parse_stats_t stats;
+        memset(&stats, 0, sizeof(stats));
+        options.stats = &stats;
+        root = parse_json_utf8_with_options(text, length + 2, &err, &options);
+        check(root != NULL && root->data.string_value->length == length);
+        check(root->data.string_value->data[0] == (wchar_t)text[1] && root->data.string_value->data[length] == L'\0');
+        check(stats.allocations == empty_stats.allocations);
+        check(stats.allocated_bytes == empty_stats.allocated_bytes + length * sizeof(wchar_t));
+        destroy_json_element(&root->base);
+        free(text);
+    }
+
+    // a string taken on the heap stays in its own block, an arena copies it
+    wide_string_t *taken = duplicate_wide_string(__W(L"taken"));
+    json_string_t *heap_string = create_json_string_taking(taken);
+    check(heap_string->value == taken && wcscmp(heap_string->value->data, L"taken") == 0);
+    json_array_t *heap_array = create_json_array();
+    taken = duplicate_wide_string(__W(L"item"));
+    check(create_json_string_taking_at_end_of_array(heap_array, taken)->value == taken);
+    create_json_string_at_end_of_array(heap_array, L"inline");
+    json_arena_t *arena = create_json_arena(0);
+    wchar_t buff[16];
+    wide_string_t text = widen_text("[]", buff);
+    json_element_t *arena_array = parse_json_arena(&text, &err, arena);
+    taken = duplicate_wide_string(__W(L"copied"));
+    json_string_t *copied = create_json_string_taking_at_end_of_array((json_array_t*)arena_array, taken);
+    check(copied->value != taken && wcscmp(copied->value->data, L"copied") == 0);
+
+    // both kinds are copied, encoded and released the same way
+    check_binary_round_trip((const json_element_t*)heap_array);
+    json_element_t *patched = parse_text("[]");
+    json_element_t *patch = parse_text("[{\"op\":\"add\",\"path\":\"/-\",\"value\":\"added\"},"
+        "{\"op\":\"copy\",\"from\":\"/0\",\"path\":\"/-\"}]");
+    check(apply_json_patch(&patched, patch));
+    check(patched->data.array->count == 2);
+    check(wcscmp(get_element_from_json_array(patched->data.array, 1)->data.string_value->data, L"added") == 0);
+    destroy_json_element(&patch->base);
+    destroy_json_element(&patched->base);
+    destroy_json_element(&heap_string->base);
+    destroy_json_element(&heap_array->base);
+    destroy_json_arena(arena);
+}
+
+// --- builders ---------------------------------------------------------------
+
+static void test_builders(void)
+{
+    // the pairs of an object created with a capacity do not move while it is filled
+    json_object_t *object = create_json_object_with_capacity(40);
+    create_json_string_owned_by_object(object, L"k0", L"v0");
+    json_pair_t *first = get_pair_by_index_from_json_object(object->object, 0);
+    wchar_t key[16], value[16];
+    for (int i = 1; i < 40; i++)
+    {
+        swprintf(key, 16, L"k%d", i);
+        swprintf(value, 16, L"v%d", i);
+        create_json_string_owned_by_object(object, key, value);
+    }
+    check(object->object->count == 40 && get_pair_by_index_from_json_object(object->object, 0) == first);
+    // past the capacity it grows, the pairs are found by key all the same
+    create_json_string_owned_by_object(object, L"k40", L"v40");
+    create_json_string_owned_by_object(object, L"k7", L"again");
+    check(object->object->count == 41);
+    for (int i = 0; i <= 40; i++)
+    {
+        swprintf(key, 16, L"k%d", i);
+        swprintf(value, 16, L"v%d", i);
+        json_pair_t *pair = get_pair_from_json_object(object->object, key);
+        check(pair != NULL && wcscmp(pair->value->data.string_value->data, i == 7 ? L"again" : value) == 0);
+    }
+    check(get_pair_from_json_object(object->object, L"k41") == NULL);
+    destroy_json_element(&object->base);
+
+    // the bulk and the single appends give the same array as the parser
+    static const real_t numbers[] = { 1, 2.5, -3 };
+    static const wchar_t *strings[] = { L"a", L"", L"\u00e9" };
+    json_element_t *expected = parse_text("[1,2.5,-3,\"a\",\"\",\"\xC3\xA9\",true,1,2.5,-3]");
+    size_t capacities[] = { 0, 1, 10, 100 };
+    for (size_t i = 0; i < sizeof(capacities) / sizeof(capacities[0]); i++)
+    {
+        json_array_t *array = create_json_array_with_capacity(capacities[i]);
+        append_json_numbers_to_array(array, numbers, 0);
+        append_json_numbers_to_array(array, numbers, 3);
+        append_json_strings_to_array(array, strings, 3);
+        create_json_boolean_at_end_of_array(array, true);
+        reserve_json_array_capacity(array, 2);
+        reserve_json_array_capacity(array, 20);
+        append_json_numbers_to_array(array, numbers, 3);
+        check(are_json_elements_equal((json_element_t*)array, expected));
+        for (size_t j = 0; j < array->array->count; j++)
+            check(get_element_from_json_array(array->array, j)->base.parent == (json_element_t*)array);
+        check_binary_round_trip((json_element_t*)array);
+        destroy_json_element(&array->base);
+    }
+
+    // containers in an arena grow inside it
+    json_arena_t *arena = create_json_arena(0);
+    json_error_t err;
+    wchar_t buff[16];
+    wide_string_t text = widen_text("[1,2.5,-3]", buff);
+    json_element_t *root = parse_json_arena(&text, &err, arena);
+    append_json_strings_to_array((json_array_t*)root, strings, 3);
+    reserve_json_array_capacity((json_array_t*)root, 64);
+    create_json_boolean_at_end_of_array((json_array_t*)root, true);
+    append_json_numbers_to_array((json_array_t*)root, numbers, 3);
+    check(are_json_elements_equal(root, expected));
+    destroy_json_arena(arena);
+    destroy_json_element(&expected->base);
+}
+
+// --- files ------------------------------------------------------------------
+
+static const char *file_path = "test_file.tmp";
+
+static void test_file_parse(void)
+{
+    json_error_t err;
+    check(parse_json_file("no/such/file.json", NULL, &err) == NULL && err.type == json_cannot_read_file);
+
+    // the elements stay valid and keep their values when the mapping is released
+    for (size_t i = 0; i < samples_count; i++)
+    {
+        check(write_bytes_to_file(file_path, samples[i], strlen(samples[i])));
+        json_document_t *doc = parse_json_file(file_path, NULL, &err);
+        check(doc != NULL);
+        remove(file_path);
+        json_element_t *expected = parse_text(samples[i]);
+        check(doc != NULL && are_json_elements_equal(doc->root, expected));
+        destroy_json_element(&expected->base);
+        destroy_json_document(doc);
+    }
+
+    // raw numbers and lazy containers read the mapped text after parsing
+    static const char *text = "{\"id\":12345678901234567890123,\"list\":[{\"name\":\"x\\ty\"},[1.50]]}";
+    check(write_bytes_to_file(file_path, text, strlen(text)));
+    json_parse_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    json_options_t options = { NULL, NULL, true, true, 0, &stats };
+    json_document_t *doc = parse_json_file(file_path, &options, &err);
+    check(doc != NULL && stats.consumed == strlen(text));
+    const json_element_t *id = get_pair_from_json_object(doc->root->data.object, L"id")->value;
+    check(strncmp(get_literal_from_json_number((const json_number_t*)id, NULL), "12345678901234567890123", 23) == 0);
+    const json_element_t *list = get_pair_from_json_object(doc->root->data.object, L"list")->value;
+    const json_element_t *first = get_element_from_json_array(list->data.array, 0);
+    check(wcscmp(get_pair_from_json_object(first->data.object, L"name")->value->data.string_value->data, L"x\ty") == 0);
+    byte_sink_t sink = { { 0 }, 0 };
+    check(write_json_element(&doc->root->base, json_format_compact, write_to_sink, &sink));
+    check(strcmp(sink.data, "{\"id\":12345678901234567890123,\"list\":[{\"name\":\"x\\ty\"},[1.50]]}") == 0);
+    destroy_json_document(doc);
+
+    // errors in a file are reported like the ones in a text, an empty file has no element
+    static const char *broken = "{\"a\":\n[1,}";
+    check(write_bytes_to_file(file_path, broken, strlen(broken)));
+    json_error_t text_err;
+    check(parse_json_utf8(broken, strlen(broken), &text_err) == NULL);
+    check(parse_json_file(file_path, NULL, &err) == NULL && err.type == text_err.type);
+    check(err.where.row == text_err.where.row && err.where.column == text_err.where.column);
+    check(write_bytes_to_file(file_path, "", 0));
+    check(parse_json_file(file_path, NULL, &err) == NULL && err.type != json_ok && err.type != json_cannot_read_file);
+    remove(file_path);
+}
+
+// --- push parser ------------------------------------------------------------
+
+static const char *push_samples[] =
+{
+    "[1]", "\xEF\xBB\xBF[1]", "\xEF\xBB", "\xEF[1]", "{\"k\":", "{\"k\":  \n", "[", "{\"a\"", "{\"a\":1,",
+    "\"abc", "\"ab\\", "\"ab\\u", "\"ab\\u12", "\"ab\\u12x\"", "\"a\xC3", "\"a\xF0\x9F\x98\"",
+    "\"a\xE2\x82x\"", "\"a\xE2\x82\xE2\x82\xAC\"", "\"\xC0\xAF\xED\xA0\x80\"", "tru", "nul", "-", "-1.",
+    "1e+", "12", "[1 2]", "{a:1}", "{a", "", " ", "[\"\\q\"]", "{\"a\":1}x", "nulllllll", "[nonsense]",
+    "truex", "[fals]", "abc", "{\"a\":nullnullnullnullnull}", "[t,f]", "[false_]",
+    "[\"\xC3\xA9\", \"\xF0\x9F\x98\x80\", -0.5e-3, true, false, null, {\"a\":{\"b\":[]}}]"
+};
+
+static void log_push_parse(event_log_t *log, const char *text, size_t length, size_t chunk)
+{
+    json_parser_t *parser = create_json_parser(&logging_handler, log);
+    bool success = true;
+    for (size_t i = 0; i < length && success; i += chunk)
+        success = json_parser_feed(parser, text + i, length - i < chunk ? length - i : chunk);
+    success = success && json_parser_finish(parser);
+    log_outcome(log, success, get_json_parser_error(parser));
+    destroy_json_parser(parser);
+}
+
+static void log_split_push_parse(event_log_t *log, const char *text, size_t length, size_t split)
+{
+    json_parser_t *parser = create_json_parser(&logging_handler, log);
+    bool success = json_parser_feed(parser, text, split) && json_parser_feed(parser, text + split, length - split)
+        && json_parser_finish(parser);
+    log_outcome(log, success, get_json_parser_error(parser));
+    destroy_json_parser(parser);
+}
+
+static void test_push_parse(void)
+{
+    for (size_t i = 0; i < sizeof(push_samples) / sizeof(push_samples[0]); i++)
+    {
+        const char *text = push_samples[i];
+        size_t length = strlen(text);
+        event_log_t expected = { { 0 }, 0 };
+        json_error_t err;
+        log_outcome(&expected, parse_json_utf8_with_handler(text, length, &logging_handler, &expected, &err), &err);
+        event_log_t whole = { { 0 }, 0 }, bytes = { { 0 }, 0 };
+        log_push_parse(&whole, text, length, length ? length : 1);
+        log_push_parse(&bytes, text, length, 1);
+        check(wcscmp(expected.data, whole.data) == 0);
+        check(wcscmp(expected.data, bytes.data) == 0);
+        for (size_t split = 1; split < length; split++)
+        {
+            event_log_t halves = { { 0 }, 0 };
+            log_split_push_parse(&halves, text, length, split);
+            check(wcscmp(expected.data, halves.data) == 0);
+        }
+    }
+
+    // a word that cannot be a keyword fails at its first wrong letter, however long it goes on
+    size_t length = 1 << 20;
+    char *letters = malloc(length);
+    memset(letters, 'l', length);
+    event_log_t log = { { 0 }, 0 };
+    json_parser_t *parser = create_json_parser(&logging_handler, &log);
+    check(json_parser_feed(parser, "[nul", 4));
+    check(!json_parser_feed(parser, letters, length) && !json_parser_feed(parser, letters, length));
+    const json_error_t *err = get_json_parser_error(parser);
+    check(err->type == json_unrecognized_entity && err->text.length == 5 && wcsncmp(err->text.data, L"nulll", 5) == 0);
+    check(err->where.row == 1 && err->where.column == 6);
+    json_error_t text_err;
+    check(!parse_json_utf8_with_handler("[nulllll", 8, &logging_handler, &log, &text_err));
+    check(text_err.type == err->type && text_err.where.row == err->where.row && text_err.where.column == err->where.column);
+    destroy_json_parser(parser);
+    free(letters);
+}
+
+// --- main -------------------------------------------------------------------
+
+int main(void)
+{
+    test_arena_parse();
+    test_utf8_parse();
+    test_validate();
+    test_writer();
+    test_binary();
+    test_paths();
+    test_patches();
+    test_struct_bindings();
+    test_parallel_depth();
+    test_parallel_parse();
+    test_json_lines();
+    test_contexts();
+    test_frozen();
+    test_lazy_mode();
+    test_selective_parse();
+    test_tapes();
+    test_parse_stats();
+    test_raw_numbers();
+    test_number_conversion();
+    test_string_storage();
+    test_builders();
+    test_file_parse();
+    test_push_parse();
+    printf("%d checks, %d failed\n", checks_count, failures_count);
+    return failures_count ? 1 : 0;
+}